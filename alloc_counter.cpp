@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include "alloc_counter.hpp"
+
+using namespace std;
+
+namespace {
+
+// The per-thread state must be trivial, as it's touched by operator new, which can be
+// called before and after static initialization.
+struct ThreadState {
+    const char* call;
+    uint64_t allocs;
+    uint64_t bytes;
+};
+
+thread_local ThreadState t_state = {nullptr, 0, 0};
+
+atomic<uint64_t> g_total_allocs(0);
+atomic<uint64_t> g_total_bytes(0);
+
+// Intentionally leaked, to avoid destruction-order problems at exit.
+mutex& ByCallMutex() {
+    static auto m = new mutex();
+    return *m;
+}
+map<string, psicash::alloc_counter::Counts>& ByCallMap() {
+    static auto m = new map<string, psicash::alloc_counter::Counts>();
+    return *m;
+}
+
+} // namespace
+
+#ifdef PSICASH_ALLOC_COUNTING
+
+// Replacements for the global allocation functions. The array, nothrow and sized
+// forms forward to these by default.
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC can't tell that these deallocation functions pair with the malloc in operator new.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    g_total_allocs.fetch_add(1, memory_order_relaxed);
+    g_total_bytes.fetch_add(size, memory_order_relaxed);
+    if (t_state.call) {
+        t_state.allocs++;
+        t_state.bytes += size;
+    }
+
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+#endif // PSICASH_ALLOC_COUNTING
+
+namespace psicash {
+namespace alloc_counter {
+
+bool Enabled() {
+#ifdef PSICASH_ALLOC_COUNTING
+    return true;
+#else
+    return false;
+#endif
+}
+
+Counts Totals() {
+    return {0, g_total_allocs.load(memory_order_relaxed), g_total_bytes.load(memory_order_relaxed)};
+}
+
+map<string, Counts> ByCall() {
+    lock_guard<mutex> lock(ByCallMutex());
+    return ByCallMap();
+}
+
+void Reset() {
+    lock_guard<mutex> lock(ByCallMutex());
+    ByCallMap().clear();
+}
+
+Scope::Scope(const char* call)
+        : outermost_(t_state.call == nullptr) {
+    if (outermost_) {
+        t_state = {call, 0, 0};
+    }
+}
+
+Scope::~Scope() {
+    if (!outermost_) {
+        return;
+    }
+
+    // Stop attributing before touching the map, which may itself allocate.
+    auto state = t_state;
+    t_state = {nullptr, 0, 0};
+
+    lock_guard<mutex> lock(ByCallMutex());
+    auto& counts = ByCallMap()[state.call];
+    counts.calls++;
+    counts.allocs += state.allocs;
+    counts.bytes += state.bytes;
+}
+
+} // namespace alloc_counter
+} // namespace psicash
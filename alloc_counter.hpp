@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_ALLOC_COUNTER_H
+#define PSICASHLIB_ALLOC_COUNTER_H
+
+#include <string>
+#include <map>
+#include <cstdint>
+
+namespace psicash {
+namespace alloc_counter {
+
+// Allocation counting is only available when the library is built with
+// PSICASH_ALLOC_COUNTING defined (the CMake option of the same name). It replaces the
+// global operator new/delete, so it is intended for benchmark and diagnostic builds.
+// Without it, all counts are zero and ALLOC_COUNT_SCOPE does nothing.
+
+struct Counts {
+    uint64_t calls;
+    uint64_t allocs;
+    uint64_t bytes;
+};
+
+/// Returns true if the library was built with allocation counting.
+bool Enabled();
+
+/// Returns the process-wide allocation totals (`calls` is unused).
+Counts Totals();
+
+/// Returns the allocations attributed to each API call so far, by call name.
+std::map<std::string, Counts> ByCall();
+
+/// Clears the per-call attributions (but not the totals).
+void Reset();
+
+/// While in scope, allocations made on the current thread are attributed to `call`.
+/// Nested scopes are attributed to the outermost one, so that (for example) the
+/// NewTracker done within a RefreshState counts towards RefreshState.
+class Scope {
+public:
+    explicit Scope(const char* call);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    bool outermost_;
+};
+
+} // namespace alloc_counter
+} // namespace psicash
+
+/// Attributes allocations in the current scope to the enclosing function.
+#ifdef PSICASH_ALLOC_COUNTING
+#define ALLOC_COUNT_SCOPE() psicash::alloc_counter::Scope alloc_count_scope(__func__)
+#else
+#define ALLOC_COUNT_SCOPE() do {} while (false)
+#endif
+
+#endif //PSICASHLIB_ALLOC_COUNTER_H
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <memory>
+
+#include "gtest/gtest.h"
+#include "alloc_counter.hpp"
+
+using namespace std;
+using namespace psicash;
+
+class TestAllocCounter : public ::testing::Test
+{
+  public:
+    TestAllocCounter() {
+        alloc_counter::Reset();
+    }
+};
+
+static void Inner() {
+    alloc_counter::Scope scope("Inner");
+    auto p = make_unique<char[]>(100);
+    (void)p;
+}
+
+TEST_F(TestAllocCounter, ByCall)
+{
+    {
+        alloc_counter::Scope scope("Outer");
+        auto p = make_unique<char[]>(1000);
+        (void)p;
+        Inner();
+    }
+
+    auto by_call = alloc_counter::ByCall();
+
+    if (!alloc_counter::Enabled()) {
+        // Scopes still work, but nothing is counted.
+        ASSERT_EQ(by_call.size(), 1);
+        ASSERT_EQ(by_call["Outer"].calls, 1);
+        ASSERT_EQ(by_call["Outer"].allocs, 0);
+        ASSERT_EQ(alloc_counter::Totals().allocs, 0);
+        return;
+    }
+
+    // The inner scope is attributed to the outer one.
+    ASSERT_EQ(by_call.size(), 1);
+    ASSERT_EQ(by_call["Outer"].calls, 1);
+    ASSERT_EQ(by_call["Outer"].allocs, 2);
+    ASSERT_EQ(by_call["Outer"].bytes, 1100);
+
+    Inner();
+    by_call = alloc_counter::ByCall();
+    ASSERT_EQ(by_call.size(), 2);
+    ASSERT_EQ(by_call["Inner"].calls, 1);
+    ASSERT_EQ(by_call["Inner"].allocs, 1);
+    ASSERT_EQ(by_call["Inner"].bytes, 100);
+
+    alloc_counter::Reset();
+    ASSERT_TRUE(alloc_counter::ByCall().empty());
+}
+
+TEST_F(TestAllocCounter, Totals)
+{
+    auto start = alloc_counter::Totals();
+    auto p = make_unique<char[]>(123);
+    (void)p;
+    auto end = alloc_counter::Totals();
+
+    if (!alloc_counter::Enabled()) {
+        ASSERT_EQ(end.allocs, 0);
+        return;
+    }
+
+    ASSERT_EQ(end.allocs - start.allocs, 1);
+    ASSERT_EQ(end.bytes - start.bytes, 123);
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <new>
+#include "arena.hpp"
+
+using namespace std;
+
+namespace psicash {
+
+// The arena is per-thread, so that ArenaAllocator can be stateless (as basic_json
+// requires) and needs no locking.
+static thread_local Arena t_arena;
+static thread_local int t_scope_depth = 0;
+
+Arena::Arena(size_t block_size)
+        : block_size_(block_size), head_(nullptr), cur_(nullptr), end_(nullptr), used_(0) {
+}
+
+Arena::~Arena() {
+    FreeBlocks();
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    auto aligned = [&]() {
+        auto addr = reinterpret_cast<uintptr_t>(cur_);
+        return reinterpret_cast<char*>((addr + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    };
+
+    char* p = cur_ ? aligned() : nullptr;
+    if (!p || p + size > end_) {
+        AddBlock(size + alignment);
+        p = aligned();
+    }
+
+    cur_ = p + size;
+    used_ += size;
+    return p;
+}
+
+bool Arena::Owns(const void* p) const {
+    auto cp = static_cast<const char*>(p);
+    for (auto b = head_; b; b = b->next) {
+        auto data = reinterpret_cast<const char*>(b + 1);
+        if (cp >= data && cp < data + b->size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Arena::Reset() {
+    if (head_ && head_->next) {
+        // Coalesce into one block big enough for everything used this time.
+        auto total = max(used_ * 2, block_size_);
+        FreeBlocks();
+        AddBlock(total);
+    } else if (head_) {
+        cur_ = reinterpret_cast<char*>(head_ + 1);
+    }
+    used_ = 0;
+}
+
+size_t Arena::BlockCount() const {
+    size_t n = 0;
+    for (auto b = head_; b; b = b->next) {
+        n++;
+    }
+    return n;
+}
+
+Arena* Arena::Current() {
+    return t_scope_depth > 0 ? &t_arena : nullptr;
+}
+
+void Arena::AddBlock(size_t min_size) {
+    // Allocate() aligns within the block, so the block itself needn't be aligned for
+    // any particular type.
+    auto size = max(min_size, block_size_);
+    auto b = static_cast<Block*>(::operator new(sizeof(Block) + size));
+    b->next = head_;
+    b->size = size;
+    head_ = b;
+    cur_ = reinterpret_cast<char*>(b + 1);
+    end_ = cur_ + size;
+}
+
+void Arena::FreeBlocks() {
+    while (head_) {
+        auto next = head_->next;
+        ::operator delete(head_);
+        head_ = next;
+    }
+    cur_ = end_ = nullptr;
+}
+
+ArenaScope::ArenaScope() {
+    t_scope_depth++;
+}
+
+ArenaScope::~ArenaScope() {
+    if (--t_scope_depth == 0) {
+        t_arena.Reset();
+    }
+}
+
+} // namespace psicash
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_ARENA_H
+#define PSICASHLIB_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "flat_json.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+namespace psicash {
+
+/// A monotonic ("bump") allocator. Memory is only released all at once, by Reset().
+/// Used for temporaries that all die at the end of a single API call, like parsed
+/// response JSON.
+class Arena {
+public:
+    explicit Arena(size_t block_size = 8192);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size, size_t alignment);
+
+    /// Returns true if `p` was allocated from this arena (and not yet Reset).
+    bool Owns(const void* p) const;
+
+    /// Releases everything allocated from the arena. If more than one block was needed
+    /// since the last reset, they are replaced with a single block big enough for all
+    /// of them, so that a repeated workload settles into one block and no mallocs.
+    void Reset();
+
+    /// The number of blocks currently held. For testing.
+    size_t BlockCount() const;
+
+    /// Returns the current thread's arena, or null if there is no ArenaScope active.
+    static Arena* Current();
+
+private:
+    struct Block {
+        Block* next;
+        size_t size;
+    };
+
+    void AddBlock(size_t min_size);
+    void FreeBlocks();
+
+    size_t block_size_;
+    Block* head_;
+    char* cur_;
+    char* end_;
+    size_t used_;
+};
+
+/// While an ArenaScope is alive, ArenaAllocator allocations on the current thread come
+/// from the thread's arena. When the outermost scope ends the arena is reset, so no
+/// arena-allocated object may outlive it. Scopes may be nested (e.g., for the
+/// NewTracker call within RefreshState).
+class ArenaScope {
+public:
+    ArenaScope();
+    ~ArenaScope();
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+/// A stateless allocator that uses the current thread's arena, if there is one, and
+/// the heap otherwise.
+template<typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    ArenaAllocator() noexcept = default;
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (auto arena = Arena::Current()) {
+            return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t) noexcept {
+        auto arena = Arena::Current();
+        if (arena && arena->Owns(p)) {
+            // Freed when the arena is reset.
+            return;
+        }
+        ::operator delete(p);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return false; }
+
+/// JSON whose objects (FlatMaps, as in flat_json) and arrays are allocated with
+/// ArenaAllocator. Use it for parsing responses within an ArenaScope. Strings still use
+/// std::string, so that values can be extracted with get<std::string>() as usual.
+using arena_json = nlohmann::basic_json<FlatMap, std::vector, std::string, bool,
+                                        std::int64_t, std::uint64_t, double,
+                                        ArenaAllocator>;
+
+} // namespace psicash
+
+#endif //PSICASHLIB_ARENA_H
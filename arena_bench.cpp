@@ -0,0 +1,82 @@
+/*
+ * Compares parsing a typical RefreshState response into heap-allocated JSON with
+ * parsing it into arena_json within an ArenaScope (as the library does). Allocation
+ * counts require a PSICASH_ALLOC_COUNTING build (see bench.sh).
+ *
+ * Usage: arena_bench [--iterations=N]
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench_helpers.hpp"
+#include "arena.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+static string RefreshStateResponse() {
+    json prices = json::array();
+    for (const auto& d : {"1hr", "2hr", "3hr", "24hr", "7day", "30day"}) {
+        prices.push_back({{"Class", "speed-boost"}, {"Distinguisher", d}, {"Price", 100}});
+    }
+    json j = {{"TokensValid", {{"earner", true}, {"spender", true}, {"indicator", true}}},
+              {"IsAccount", false},
+              {"Balance", 1000},
+              {"PurchasePrices", prices}};
+    return j.dump();
+}
+
+// Does roughly what RefreshState does with the response.
+template<typename JSON>
+static int64_t Consume(JSON& j) {
+    auto valid_token_types = j["TokensValid"].template get<map<string, bool>>();
+    int64_t sum = valid_token_types.size() + j["Balance"].template get<int64_t>();
+    for (size_t i = 0; i < j["PurchasePrices"].size(); i++) {
+        const auto& pp = j["PurchasePrices"][i];
+        sum += pp["Class"].template get<string>().size();
+        sum += pp["Distinguisher"].template get<string>().size();
+        sum += pp["Price"].template get<int64_t>();
+    }
+    return sum;
+}
+
+int main(int argc, char** argv) {
+    int iterations = 10000;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--iterations=") == 0) {
+            iterations = atoi(arg.c_str() + strlen("--iterations="));
+        }
+    }
+
+    auto body = RefreshStateResponse();
+    int64_t sink = 0;
+
+    bench::OpStats stats;
+    for (int i = 0; i < iterations; i++) {
+        sink += bench::Measure(stats, "parse (heap)", [&] {
+            auto j = json::parse(body);
+            return Consume(j);
+        });
+    }
+    for (int i = 0; i < iterations; i++) {
+        sink += bench::Measure(stats, "parse (arena)", [&] {
+            ArenaScope arena_scope;
+            auto j = arena_json::parse(body);
+            return Consume(j);
+        });
+    }
+
+    cout << "iterations: " << iterations << "; response bytes: " << body.size()
+         << "; checksum: " << sink << endl;
+    stats.Print(cout);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "arena.hpp"
+
+using namespace std;
+using namespace psicash;
+
+class TestArena : public ::testing::Test
+{
+  public:
+    TestArena() = default;
+};
+
+TEST_F(TestArena, Allocate)
+{
+    Arena arena(64);
+    ASSERT_EQ(arena.BlockCount(), 0);
+
+    auto p1 = arena.Allocate(10, 1);
+    auto p2 = arena.Allocate(8, 8);
+    ASSERT_NE(p1, p2);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(p2) % 8, 0);
+    ASSERT_TRUE(arena.Owns(p1));
+    ASSERT_TRUE(arena.Owns(p2));
+    ASSERT_EQ(arena.BlockCount(), 1);
+
+    int on_heap;
+    ASSERT_FALSE(arena.Owns(&on_heap));
+
+    // Bigger than the block size
+    auto p3 = arena.Allocate(1000, 16);
+    ASSERT_TRUE(arena.Owns(p3));
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(p3) % 16, 0);
+    ASSERT_EQ(arena.BlockCount(), 2);
+}
+
+TEST_F(TestArena, Reset)
+{
+    Arena arena(64);
+    for (int i = 0; i < 10; i++) {
+        (void)arena.Allocate(50, 8);
+    }
+    ASSERT_GT(arena.BlockCount(), 1);
+
+    // The blocks are coalesced into one, which is then big enough for the same workload.
+    arena.Reset();
+    ASSERT_EQ(arena.BlockCount(), 1);
+    for (int i = 0; i < 10; i++) {
+        (void)arena.Allocate(50, 8);
+    }
+    ASSERT_EQ(arena.BlockCount(), 1);
+
+    arena.Reset();
+    ASSERT_EQ(arena.BlockCount(), 1);
+}
+
+TEST_F(TestArena, Scope)
+{
+    ASSERT_EQ(Arena::Current(), nullptr);
+
+    {
+        ArenaScope outer;
+        auto arena = Arena::Current();
+        ASSERT_NE(arena, nullptr);
+
+        vector<int, ArenaAllocator<int>> v(100, 1);
+        ASSERT_TRUE(arena->Owns(v.data()));
+
+        {
+            ArenaScope inner;
+            ASSERT_EQ(Arena::Current(), arena);
+        }
+
+        // The inner scope didn't reset the arena
+        ASSERT_TRUE(arena->Owns(v.data()));
+        ASSERT_EQ(v[99], 1);
+    }
+
+    ASSERT_EQ(Arena::Current(), nullptr);
+
+    // Without a scope, the allocator uses the heap
+    vector<int, ArenaAllocator<int>> v(100, 2);
+    ASSERT_EQ(v[99], 2);
+}
+
+TEST_F(TestArena, HeapObjectFreedInScope)
+{
+    // Allocated on the heap, but released while a scope is active.
+    auto v = make_unique<vector<int, ArenaAllocator<int>>>(100, 3);
+    ArenaScope scope;
+    ASSERT_FALSE(Arena::Current()->Owns(v->data()));
+    v.reset();
+}
+
+TEST_F(TestArena, JSON)
+{
+    ArenaScope scope;
+
+    auto j = arena_json::parse(R"|({
+        "TokensValid": {"earner": true, "spender": false},
+        "Balance": 123,
+        "PurchasePrices": [{"Class": "speed-boost", "Distinguisher": "1hr", "Price": 100}]
+    })|");
+
+    auto tokens_valid = j["TokensValid"].get<map<string, bool>>();
+    ASSERT_EQ(tokens_valid.size(), 2);
+    ASSERT_TRUE(tokens_valid["earner"]);
+    ASSERT_EQ(j["Balance"].get<int64_t>(), 123);
+    ASSERT_EQ(j["PurchasePrices"][0]["Distinguisher"].get<string>(), "1hr");
+    ASSERT_FALSE(j["Missing"].is_string());
+
+    ASSERT_THROW(arena_json::parse("{bad json"), nlohmann::json::exception);
+}
@@ -0,0 +1,25 @@
+/*
+ * Fuzz target for authorization decoding. The input is tried both as an encoded
+ * authorization (as received in a purchase response) and as a decoded one, with each
+ * available JSON parser.
+ */
+
+#include "fuzz_helpers.hpp"
+#include "psicash.hpp"
+#include "response_parser.hpp"
+
+using namespace psicash;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz::Budget budget("authorization");
+    auto s = fuzz::AsString(data, size);
+
+    (void)DecodeAuthorization(s);
+
+    for (auto parser : {JSONParser::Nlohmann, JSONParser::Simdjson}) {
+        if (JSONParserAvailable(parser)) {
+            (void)ParseAuthorization(s, parser);
+        }
+    }
+    return 0;
+}
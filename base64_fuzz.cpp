@@ -0,0 +1,21 @@
+/*
+ * Fuzz target for base64 decoding (of untrusted encoded authorizations) and encoding.
+ */
+
+#include "fuzz_helpers.hpp"
+#include "base64.hpp"
+
+using namespace base64;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz::Budget budget("base64");
+    auto s = fuzz::AsString(data, size);
+
+    (void)B64Decode(s);
+
+    // Any bytes survive encoding and decoding.
+    auto encoded = B64Encode(data, (unsigned int)size);
+    auto decoded = B64Decode(encoded);
+    fuzz::Check(decoded == std::vector<BYTE>(data, data + size), "base64", "round-trip mismatch");
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Builds and runs all benchmark drivers (*_bench.cpp). Output is also written to
+# bench_output.txt. Arguments are passed through to each driver.
+# The benchmarks are built separately (in build-bench) with allocation counting enabled.
+# Additional CMake options can be given in BENCH_CMAKE_FLAGS, like
+# BENCH_CMAKE_FLAGS=-DPSICASH_USE_SIMDJSON=ON
+# NOTE: The build includes coverage flags by default (see CMakeLists.txt), so results
+# are only meaningful relative to each other. For absolute numbers, use
+# BENCH_CMAKE_FLAGS="-DPSICASH_COVERAGE=OFF -DCMAKE_BUILD_TYPE=Release".
+
+set -eu
+
+mkdir -p build-bench
+cd build-bench
+# Use CC/CXX if they're set; otherwise clang if it's available, or else CMake's default.
+if [[ -z "${CC:-}" && -z "${CXX:-}" ]] && command -v clang >/dev/null && command -v clang++ >/dev/null; then
+  export CC=$(command -v clang) CXX=$(command -v clang++)
+fi
+cmake -DPSICASH_ALLOC_COUNTING=ON ${BENCH_CMAKE_FLAGS:-} ..
+make
+cd -
+
+rm -f bench_output.txt
+for bench in build-bench/*_bench; do
+  echo "### $(basename ${bench})" | tee -a bench_output.txt
+  ${bench} "$@" | tee -a bench_output.txt
+done
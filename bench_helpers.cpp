@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "bench_helpers.hpp"
+#include "alloc_counter.hpp"
+
+using namespace std;
+
+namespace bench {
+
+AllocCounts CurrentAllocCounts() {
+    auto totals = psicash::alloc_counter::Totals();
+    return {totals.allocs, totals.bytes};
+}
+
+void OpStats::Add(const string& op, chrono::nanoseconds elapsed, const AllocCounts& allocs) {
+    if (samples_.count(op) == 0) {
+        order_.push_back(op);
+    }
+    auto& s = samples_[op];
+    s.elapsed.push_back(elapsed);
+    s.allocs += allocs.allocs;
+    s.bytes += allocs.bytes;
+}
+
+void OpStats::Print(ostream& os) const {
+    auto usec = [](chrono::nanoseconds ns) { return ns.count() / 1000.0; };
+
+    os << left << setw(24) << "operation" << right
+       << setw(8) << "count"
+       << setw(12) << "mean(us)"
+       << setw(12) << "p50(us)"
+       << setw(12) << "p95(us)"
+       << setw(12) << "p99(us)"
+       << setw(12) << "allocs/op"
+       << setw(12) << "bytes/op" << endl;
+
+    auto allocs_enabled = psicash::alloc_counter::Enabled();
+
+    os << fixed << setprecision(1);
+    for (const auto& op : order_) {
+        const auto& s = samples_.at(op);
+        auto n = s.elapsed.size();
+
+        chrono::nanoseconds total(0);
+        for (const auto& e : s.elapsed) {
+            total += e;
+        }
+
+        os << left << setw(24) << op << right
+           << setw(8) << n
+           << setw(12) << usec(total / n)
+           << setw(12) << usec(Percentile(s.elapsed, 50))
+           << setw(12) << usec(Percentile(s.elapsed, 95))
+           << setw(12) << usec(Percentile(s.elapsed, 99));
+        if (allocs_enabled) {
+            os << setw(12) << (double)s.allocs / n
+               << setw(12) << (double)s.bytes / n << endl;
+        } else {
+            os << setw(12) << "-" << setw(12) << "-" << endl;
+        }
+    }
+
+    if (allocs_enabled && !psicash::alloc_counter::ByCall().empty()) {
+        os << endl;
+        PrintAllocsByCall(os);
+    }
+    os.unsetf(ios::floatfield);
+}
+
+void PrintAllocsByCall(ostream& os) {
+    os << left << setw(24) << "library call" << right
+       << setw(8) << "calls"
+       << setw(12) << "allocs/call"
+       << setw(12) << "bytes/call" << endl;
+
+    os << fixed << setprecision(1);
+    for (const auto& it : psicash::alloc_counter::ByCall()) {
+        const auto& c = it.second;
+        os << left << setw(24) << it.first << right
+           << setw(8) << c.calls
+           << setw(12) << (double)c.allocs / c.calls
+           << setw(12) << (double)c.bytes / c.calls << endl;
+    }
+}
+
+chrono::nanoseconds Percentile(vector<chrono::nanoseconds> samples, double pct) {
+    if (samples.empty()) {
+        return chrono::nanoseconds(0);
+    }
+    sort(samples.begin(), samples.end());
+    auto idx = (size_t)(pct / 100.0 * (samples.size() - 1) + 0.5);
+    return samples[min(idx, samples.size() - 1)];
+}
+
+chrono::nanoseconds ThreadCPUTime() {
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+        return chrono::nanoseconds(0);
+    }
+    // FILETIMEs are in 100ns units
+    auto ticks = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+                 (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime);
+    return chrono::nanoseconds(ticks * 100);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return chrono::nanoseconds(0);
+    }
+    return chrono::seconds(ts.tv_sec) + chrono::nanoseconds(ts.tv_nsec);
+#else
+    return chrono::nanoseconds(0);
+#endif
+}
+
+string MakeTempDir() {
+    // Benchmarks may create directories from multiple threads.
+    static mutex mutex;
+    static unsigned counter = 0;
+    lock_guard<std::mutex> lock(mutex);
+
+    static bool rand_seeded = false;
+    if (!rand_seeded) {
+        srand((unsigned)time(nullptr));
+        rand_seeded = true;
+    }
+
+    const char* tmp = nullptr;
+    for (auto var : {"TMPDIR", "TMP", "TEMP", "TEMPDIR"}) {
+        if ((tmp = getenv(var))) {
+            break;
+        }
+    }
+    if (!tmp) {
+        tmp = "/tmp";
+    }
+
+    string res = string(tmp) + "/psicash-bench-" + to_string(rand()) + "-" + to_string(counter++);
+
+#ifdef _MSC_VER
+    auto rmrf = "rmdir /S /Q \"" + res + "\" > nul 2>&1";
+    auto mkdirp = "mkdir \"" + res + "\"";
+#else
+    auto rmrf = "rm -rf " + res;
+    auto mkdirp = "mkdir -p " + res;
+#endif
+    (void)system(rmrf.c_str());
+    (void)system(mkdirp.c_str());
+
+    return res;
+}
+
+} // namespace bench
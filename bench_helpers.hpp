@@ -0,0 +1,77 @@
+#ifndef PSICASHLIB_BENCH_HELPERS_H
+#define PSICASHLIB_BENCH_HELPERS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+namespace bench {
+
+/// Process-wide allocation counts. These are only maintained when the library is built
+/// with PSICASH_ALLOC_COUNTING (see alloc_counter.hpp); otherwise they are always zero.
+struct AllocCounts {
+    uint64_t allocs;
+    uint64_t bytes;
+};
+
+AllocCounts CurrentAllocCounts();
+
+/// Collects per-operation latency and allocation samples and prints a summary.
+class OpStats {
+public:
+    void Add(const std::string& op, std::chrono::nanoseconds elapsed, const AllocCounts& allocs);
+
+    /// Prints one row per operation: count, mean and p50/p95/p99 latency (in
+    /// microseconds), and mean allocations and bytes per call. When allocation counting
+    /// is enabled, this is followed by the PrintAllocsByCall table.
+    void Print(std::ostream& os) const;
+
+private:
+    struct Samples {
+        std::vector<std::chrono::nanoseconds> elapsed;
+        uint64_t allocs = 0;
+        uint64_t bytes = 0;
+    };
+    // Operations are printed in the order they were first seen.
+    std::vector<std::string> order_;
+    std::map<std::string, Samples> samples_;
+};
+
+/// Runs `f`, recording its latency and allocations in `stats` under `op`.
+template<typename F>
+auto Measure(OpStats& stats, const std::string& op, F f) -> decltype(f()) {
+    struct Recorder {
+        OpStats& stats;
+        const std::string& op;
+        AllocCounts allocs_start;
+        std::chrono::steady_clock::time_point start;
+        ~Recorder() {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            auto allocs_end = CurrentAllocCounts();
+            stats.Add(op, elapsed, {allocs_end.allocs - allocs_start.allocs,
+                                    allocs_end.bytes - allocs_start.bytes});
+        }
+    } recorder{stats, op, CurrentAllocCounts(), std::chrono::steady_clock::now()};
+    return f();
+}
+
+/// Prints the allocations the library attributed to each of its API calls (see
+/// alloc_counter::ByCall).
+void PrintAllocsByCall(std::ostream& os);
+
+/// Returns the value at the given percentile (0-100) of the samples.
+std::chrono::nanoseconds Percentile(std::vector<std::chrono::nanoseconds> samples, double pct);
+
+/// Returns the CPU time consumed so far by the calling thread. Returns zero where
+/// unsupported.
+std::chrono::nanoseconds ThreadCPUTime();
+
+/// Creates and returns a new empty temporary directory.
+std::string MakeTempDir();
+
+} // namespace bench
+
+#endif // PSICASHLIB_BENCH_HELPERS_H
@@ -0,0 +1,187 @@
+/*
+ * contention_bench: measures how UI reads of a PsiCash instance fare while other threads
+ * modify it. Reader threads call the accessors an app's UI uses (Balance, GetPurchases,
+ * HasActivePurchase, GetActiveAuthorizationBundle) in a loop, while background threads
+ * run RefreshState and purchase/expire cycles against an in-process stand-in API server
+ * (see test_fake_server.hpp). Reports read latency percentiles and how often mutations
+ * had to wait for each other.
+ *
+ * Usage: contention_bench [--readers=N] [--refreshers=N] [--buyers=N] [--seconds=N]
+ *                         [--latency-ms=N]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench_helpers.hpp"
+#include "test_fake_server.hpp"
+#include "psicash.hpp"
+#include "strand.hpp"
+
+using namespace std;
+using namespace psicash;
+
+static const char* kUserAgent = "Psiphon-PsiCash-ContentionBench";
+static const char* kTransactionClass = "speed-boost";
+// Purchases that expire almost immediately, so buyers can keep buying.
+static const char* kShortDistinguisher = "1ms";
+
+struct Config {
+    int readers = 4;
+    int refreshers = 1;
+    int buyers = 1;
+    int seconds = 3;
+    int latency_ms = 5;
+};
+
+// Exposes the strand of a PsiCash instance.
+class BenchPsiCash : public PsiCash {
+public:
+    const Strand& GetStrand() const { return *strand_; }
+};
+
+using Latencies = vector<chrono::nanoseconds>;
+
+template<typename F>
+static void Time(Latencies& latencies, F f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    latencies.push_back(chrono::steady_clock::now() - start);
+}
+
+static void PrintRow(const string& op, Latencies latencies) {
+    auto usec = [](chrono::nanoseconds ns) { return ns.count() / 1000.0; };
+    cout << left << setw(30) << op << right
+         << setw(10) << latencies.size()
+         << setw(12) << usec(bench::Percentile(latencies, 50))
+         << setw(12) << usec(bench::Percentile(latencies, 99))
+         << setw(12) << usec(bench::Percentile(latencies, 99.9))
+         << setw(12) << usec(bench::Percentile(latencies, 100)) << endl;
+}
+
+static int Run(const Config& config) {
+    FakeServer::Options options;
+    options.latency = chrono::milliseconds(config.latency_ms);
+    options.initial_balance = 1000000000;
+    FakeServer server(options);
+
+    BenchPsiCash pc;
+    auto err = pc.Init(kUserAgent, bench::MakeTempDir().c_str(), server.Requester());
+    if (err) {
+        cerr << "Init failed: " << err << endl;
+        return 1;
+    }
+    auto res = pc.RefreshState({kTransactionClass});
+    if (!res || *res != Status::Success) {
+        cerr << "initial RefreshState failed" << endl;
+        return 1;
+    }
+
+    atomic<bool> done(false);
+    vector<thread> threads;
+
+    // Mutations
+    vector<Latencies> refreshes(config.refreshers), purchases(config.buyers), expiries(config.buyers);
+    for (int i = 0; i < config.refreshers; i++) {
+        threads.emplace_back([&, i] {
+            while (!done) {
+                Time(refreshes[i], [&] { (void)pc.RefreshState({kTransactionClass}); });
+            }
+        });
+    }
+    for (int i = 0; i < config.buyers; i++) {
+        threads.emplace_back([&, i] {
+            while (!done) {
+                Time(purchases[i], [&] {
+                    (void)pc.NewExpiringPurchase(kTransactionClass, kShortDistinguisher, options.price);
+                });
+                this_thread::sleep_for(chrono::milliseconds(2));
+                Time(expiries[i], [&] { (void)pc.ExpirePurchases(); });
+            }
+        });
+    }
+
+    // UI reads
+    vector<Latencies> balances(config.readers), purchase_lists(config.readers),
+            has_actives(config.readers), bundles(config.readers);
+    for (int i = 0; i < config.readers; i++) {
+        threads.emplace_back([&, i] {
+            while (!done) {
+                Time(balances[i], [&] { (void)pc.Balance(); });
+                Time(purchase_lists[i], [&] { (void)pc.GetPurchases(); });
+                Time(has_actives[i], [&] { (void)pc.HasActivePurchase(kTransactionClass); });
+                Time(bundles[i], [&] { (void)pc.GetActiveAuthorizationBundle(); });
+            }
+        });
+    }
+
+    this_thread::sleep_for(chrono::seconds(config.seconds));
+    done = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    auto merge = [](const vector<Latencies>& per_thread) {
+        Latencies all;
+        for (const auto& l : per_thread) {
+            all.insert(all.end(), l.begin(), l.end());
+        }
+        return all;
+    };
+
+    cout << "readers: " << config.readers << "; refreshers: " << config.refreshers
+         << "; buyers: " << config.buyers << "; seconds: " << config.seconds
+         << "; latency: " << config.latency_ms << "ms" << endl;
+    cout << fixed << setprecision(1);
+    cout << left << setw(30) << "operation" << right
+         << setw(10) << "count"
+         << setw(12) << "p50(us)"
+         << setw(12) << "p99(us)"
+         << setw(12) << "p99.9(us)"
+         << setw(12) << "max(us)" << endl;
+    PrintRow("Balance", merge(balances));
+    PrintRow("GetPurchases", merge(purchase_lists));
+    PrintRow("HasActivePurchase", merge(has_actives));
+    PrintRow("GetActiveAuthorizationBundle", merge(bundles));
+    PrintRow("RefreshState", merge(refreshes));
+    PrintRow("NewExpiringPurchase", merge(purchases));
+    PrintRow("ExpirePurchases", merge(expiries));
+
+    const auto& strand = pc.GetStrand();
+    cout << "mutations: " << strand.Turns() << "; waited for another: "
+         << strand.ContendedTurns() << endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&](const char* name) -> const char* {
+            auto prefix = string("--") + name + "=";
+            return arg.compare(0, prefix.size(), prefix) == 0 ? argv[i] + prefix.size() : nullptr;
+        };
+        if (auto v = value("readers")) {
+            config.readers = atoi(v);
+        } else if (auto v = value("refreshers")) {
+            config.refreshers = atoi(v);
+        } else if (auto v = value("buyers")) {
+            config.buyers = atoi(v);
+        } else if (auto v = value("seconds")) {
+            config.seconds = atoi(v);
+        } else if (auto v = value("latency-ms")) {
+            config.latency_ms = atoi(v);
+        } else {
+            cerr << "unknown argument: " << arg << endl;
+            return 1;
+        }
+    }
+    return Run(config);
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <cstring>
+
+#include "crc32c.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32C_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#include <nmmintrin.h>
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARM 1
+#include <arm_acle.h>
+#endif
+
+namespace crc32c {
+
+static const uint32_t kPolynomial = 0x82F63B78; // reflected Castagnoli
+
+// Slicing-by-8 tables: table[0] is the usual byte table, and table[k][b] is the CRC of
+// byte b followed by k zero bytes.
+struct Tables {
+    uint32_t t[8][256];
+
+    Tables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ kPolynomial : (c >> 1);
+            }
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+static const Tables& GetTables() {
+    static const Tables tables;
+    return tables;
+}
+
+namespace detail {
+
+uint32_t ExtendPortable(uint32_t crc, const void* data, size_t len) {
+    const auto& t = GetTables().t;
+    auto p = static_cast<const uint8_t*>(data);
+    uint32_t c = ~crc;
+
+    while (len >= 8) {
+        // Assembled bytewise so that this is correct regardless of endianness.
+        uint32_t lo = uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+        uint32_t hi = uint32_t(p[4]) | uint32_t(p[5]) << 8 | uint32_t(p[6]) << 16 | uint32_t(p[7]) << 24;
+        lo ^= c;
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        c = (c >> 8) ^ t[0][(c ^ *p++) & 0xFF];
+    }
+
+    return ~c;
+}
+
+} // namespace detail
+
+#if defined(CRC32C_X86)
+
+static bool CPUHasSSE42() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+CRC32C_TARGET_SSE42
+static uint32_t ExtendHardware(uint32_t crc, const void* data, size_t len) {
+    auto p = static_cast<const uint8_t*>(data);
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t c = ~crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    auto c32 = static_cast<uint32_t>(c);
+#else
+    uint32_t c32 = ~crc;
+#endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        c32 = _mm_crc32_u32(c32, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        c32 = _mm_crc32_u8(c32, *p++);
+    }
+    return ~c32;
+}
+
+#elif defined(CRC32C_ARM)
+
+static uint32_t ExtendHardware(uint32_t crc, const void* data, size_t len) {
+    auto p = static_cast<const uint8_t*>(data);
+    uint32_t c = ~crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = __crc32cb(c, *p++);
+    }
+    return ~c;
+}
+
+#endif
+
+bool HardwareAccelerated() {
+#if defined(CRC32C_X86)
+    static const bool has = CPUHasSSE42();
+    return has;
+#elif defined(CRC32C_ARM)
+    // The compiler was told the target has the CRC extension.
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint32_t Extend(uint32_t crc, const void* data, size_t len) {
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    if (HardwareAccelerated()) {
+        return ExtendHardware(crc, data, len);
+    }
+#endif
+    return detail::ExtendPortable(crc, data, len);
+}
+
+} // namespace crc32c
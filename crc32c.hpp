@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_CRC32C_H
+#define PSICASHLIB_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace crc32c {
+
+/// Returns the CRC32C (Castagnoli) of `data`, continuing from `crc` (which should be 0
+/// for a new checksum). Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them.
+uint32_t Extend(uint32_t crc, const void* data, size_t len);
+
+inline uint32_t Value(const void* data, size_t len) {
+    return Extend(0, data, len);
+}
+
+inline uint32_t Value(const std::string& s) {
+    return Extend(0, s.data(), s.size());
+}
+
+/// True if Extend is using CPU CRC instructions rather than the table implementation.
+bool HardwareAccelerated();
+
+namespace detail {
+/// The table implementation; exposed for testing.
+uint32_t ExtendPortable(uint32_t crc, const void* data, size_t len);
+} // namespace detail
+
+} // namespace crc32c
+
+#endif //PSICASHLIB_CRC32C_H
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "crc32c.hpp"
+
+using namespace std;
+
+TEST(TestCRC32C, KnownValues)
+{
+    // Test vectors from RFC 3720, B.4
+    ASSERT_EQ(crc32c::Value("", 0), 0u);
+    ASSERT_EQ(crc32c::Value(string("123456789")), 0xE3069283u);
+
+    vector<uint8_t> buf(32, 0);
+    ASSERT_EQ(crc32c::Value(buf.data(), buf.size()), 0x8A9136AAu);
+    buf.assign(32, 0xFF);
+    ASSERT_EQ(crc32c::Value(buf.data(), buf.size()), 0x62A8AB43u);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = uint8_t(i);
+    }
+    ASSERT_EQ(crc32c::Value(buf.data(), buf.size()), 0x46DD794Eu);
+}
+
+TEST(TestCRC32C, Extend)
+{
+    string s = "The quick brown fox jumps over the lazy dog";
+    auto whole = crc32c::Value(s);
+    for (size_t split = 0; split <= s.size(); split++) {
+        auto crc = crc32c::Extend(0, s.data(), split);
+        crc = crc32c::Extend(crc, s.data() + split, s.size() - split);
+        ASSERT_EQ(crc, whole) << split;
+    }
+}
+
+TEST(TestCRC32C, PortableMatches)
+{
+    // Whichever implementation Extend uses must agree with the table implementation, for
+    // every length and alignment.
+    vector<uint8_t> buf(300);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = uint8_t(i * 131 + 7);
+    }
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t len = 0; len + offset <= buf.size(); len += 7) {
+            ASSERT_EQ(crc32c::Extend(0, buf.data() + offset, len),
+                      crc32c::detail::ExtendPortable(0, buf.data() + offset, len))
+                << offset << " " << len;
+        }
+    }
+}
@@ -19,8 +19,23 @@
 
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "datastore.hpp"
+#include "crc32c.hpp"
+#include "flight_recorder.hpp"
+#include "response_parser.hpp"
 #include "utils.hpp"
 
 #include "vendor/nlohmann/json.hpp"
@@ -32,46 +47,315 @@ using namespace psicash;
 using namespace error;
 
 
+// Flushes the file or directory at `path` to storage.
+static Error SyncPath(const string& path, bool directory) {
+#ifdef _WIN32
+    if (directory) {
+        // Windows can't open directories this way, and renames are journaled by NTFS.
+        return nullerr;
+    }
+    int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0) {
+        return MakeCriticalError(utils::Stringer("open for sync failed; errno=", errno));
+    }
+    int res = _commit(fd);
+    _close(fd);
+#else
+    int fd = open(path.c_str(), directory ? (O_RDONLY | O_DIRECTORY) : O_RDONLY);
+    if (fd < 0) {
+        return MakeCriticalError(utils::Stringer("open for sync failed; errno=", errno));
+    }
+    int res = fsync(fd);
+    close(fd);
+#endif
+    if (res != 0) {
+        return MakeCriticalError(utils::Stringer("sync failed; errno=", errno));
+    }
+    return nullerr;
+}
+
+// Atomically replaces `to` with `from`.
+static Error AtomicReplace(const string& from, const string& to) {
+#ifdef _WIN32
+    // rename doesn't replace an existing file on Windows, and removing it first would
+    // leave no datastore at all if we crashed in between. The paths are in the ANSI code
+    // page, as they are for the file streams.
+    auto widen = [](const string& s) {
+        int n = MultiByteToWideChar(CP_ACP, 0, s.c_str(), -1, nullptr, 0);
+        wstring w(n > 0 ? n : 0, L'\0');
+        if (n > 0) {
+            MultiByteToWideChar(CP_ACP, 0, s.c_str(), -1, &w[0], n);
+            w.resize(n - 1);
+        }
+        return w;
+    };
+    if (!MoveFileExW(widen(from).c_str(), widen(to).c_str(),
+                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        return MakeCriticalError(utils::Stringer("MoveFileExW failed; error=", GetLastError()));
+    }
+#else
+    if (std::rename(from.c_str(), to.c_str()) != 0) {
+        return MakeCriticalError(utils::Stringer("rename failed; errno=", errno));
+    }
+#endif
+    return nullerr;
+}
+
+// The datastore file is a header line followed by one line per record. Each record line
+// is the hex CRC32C of the record JSON, a space, and the record JSON. A record is
+// {"k":<key>,"v":<value>} or, for each element of an array value, {"k":<key>,"e":<elem>}
+// (following {"k":<key>,"v":[]}). So damage to the file only loses the records it touches.
+// Files from before this format are a single JSON object, and are still loaded.
+static const string kFileHeader = "psicashdatastore 1";
+
+static void AppendRecord(string& out, const string& key_json, const char* field, const flat_json& value) {
+    string rec;
+    rec.reserve(key_json.size() + 16);
+    rec += "{\"k\":";
+    rec += key_json;
+    rec += ",\"";
+    rec += field;
+    rec += "\":";
+    rec += value.dump();
+    rec += '}';
+
+    static const char kHex[] = "0123456789abcdef";
+    auto crc = crc32c::Value(rec);
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        out += kHex[(crc >> shift) & 0xF];
+    }
+    out += ' ';
+    out += rec;
+    out += '\n';
+}
+
+static string SerializeRecords(const flat_json& j) {
+    string out = kFileHeader + "\n";
+    for (const auto& it : j.items()) {
+        auto key_json = flat_json(it.key()).dump();
+        const auto& value = it.value();
+        if (value.is_array()) {
+            AppendRecord(out, key_json, "v", flat_json::array());
+            for (const auto& elem : value) {
+                AppendRecord(out, key_json, "e", elem);
+            }
+        } else {
+            AppendRecord(out, key_json, "v", value);
+        }
+    }
+    return out;
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Loads the records in `contents` into `j`, skipping damaged ones. Returns false if the
+// contents don't look like a records file at all.
+static bool ParseRecords(const string& contents, flat_json& j, uint64_t& dropped) {
+    j = flat_json::object();
+    dropped = 0;
+    bool recognized = false;
+
+    size_t pos = 0;
+    while (pos < contents.size()) {
+        auto end = contents.find('\n', pos);
+        if (end == string::npos) {
+            end = contents.size();
+        }
+        auto line_start = pos, line_len = end - pos;
+        pos = end + 1;
+
+        if (line_len == 0) {
+            continue;
+        }
+        if (contents.compare(line_start, line_len, kFileHeader) == 0) {
+            recognized = true;
+            continue;
+        }
+
+        // Checksum
+        if (line_len < 10 || contents[line_start + 8] != ' ') {
+            dropped++;
+            continue;
+        }
+        uint32_t want = 0;
+        bool hex_ok = true;
+        for (size_t i = 0; i < 8; i++) {
+            auto v = HexValue(contents[line_start + i]);
+            if (v < 0) {
+                hex_ok = false;
+                break;
+            }
+            want = (want << 4) | uint32_t(v);
+        }
+        auto rec_start = line_start + 9, rec_len = line_len - 9;
+        if (!hex_ok || crc32c::Value(contents.data() + rec_start, rec_len) != want) {
+            dropped++;
+            continue;
+        }
+
+        auto rec = ParseJSONDocument(contents.substr(rec_start, rec_len));
+        if (!rec || !rec->is_object()) {
+            dropped++;
+            continue;
+        }
+        auto k = rec->find("k"), v = rec->find("v"), e = rec->find("e");
+        if (k == rec->end() || !k->is_string() || (v == rec->end() && e == rec->end())) {
+            dropped++;
+            continue;
+        }
+        recognized = true;
+
+        auto& dest = j[k->get<string>()];
+        if (v != rec->end()) {
+            dest = std::move(*v);
+        } else {
+            if (!dest.is_array()) {
+                // The array's own record was lost; keep the elements we have.
+                dest = flat_json::array();
+            }
+            dest.push_back(std::move(*e));
+        }
+    }
+
+    return recognized;
+}
+
 Datastore::Datastore()
-        : json_(json::object()) {
+        : json_(flat_json::object()), pause_count_(0), dirty_(false),
+          pending_durability_(kLazy), change_gen_(0), written_gen_(0), durable_gen_(0),
+          bytes_written_(0), dropped_records_(0) {
+}
+
+Datastore::~Datastore() {
+    (void)Flush();
 }
 
 Error Datastore::Init(const char* file_root) {
-    SYNCHRONIZE(mutex_);
-    file_path_ = string(file_root) + "/psicashdatastore";
-    return PassError(FileLoad());
+    Durability rewrite = kLazy;
+    uint64_t gen = 0;
+    SYNCHRONIZE_BLOCK(mutex_) {
+        file_root_ = file_root;
+        file_path_ = file_root_ + "/psicashdatastore";
+        if (auto err = FileLoad(rewrite)) {
+            return PassError(err);
+        }
+        if (rewrite != kLazy) {
+            gen = Changed(rewrite);
+        }
+    }
+    if (rewrite == kLazy) {
+        return nullerr;
+    }
+    return WrapError(WriteChanges(gen, rewrite), "FileStore after load failed");
 }
 
 void Datastore::Clear() {
-    SYNCHRONIZE(mutex_);
-    json_ = json::object();
-    FileStore();
+    uint64_t gen = 0;
+    Durability durability = kLazy;
+    SYNCHRONIZE_BLOCK(mutex_) {
+        json_ = flat_json::object();
+        gen = Changed(kNormal);
+        durability = WriteDurability();
+    }
+    if (durability != kLazy) {
+        (void)WriteChanges(gen, durability);
+    }
 }
 
 void Datastore::PauseWrites() {
     SYNCHRONIZE(mutex_);
-    paused_ = true;
+    pause_count_++;
 }
 
 error::Error Datastore::UnpauseWrites() {
-    SYNCHRONIZE(mutex_);
-    if (!paused_) {
+    auto lock = Lock();
+    return UnpauseWrites(lock);
+}
+
+error::Error Datastore::UnpauseWrites(utils::SynchronizeLock& lock) {
+    uint64_t gen = 0;
+    Durability durability = kLazy;
+    SYNCHRONIZE_BLOCK(mutex_) {
+        if (pause_count_ == 0) {
+            break;
+        }
+        pause_count_--;
+        if (dirty_) {
+            gen = change_gen_;
+            durability = WriteDurability();
+        }
+    }
+    lock.unlock();
+
+    if (durability == kLazy) {
         return nullerr;
     }
-    paused_ = false;
-    return FileStore();
+    return WriteChanges(gen, durability);
 }
 
-Error Datastore::Set(const json& in) {
-    SYNCHRONIZE(mutex_);
-    json_.update(in);
-    return PassError(FileStore());
+Error Datastore::Flush() {
+    uint64_t gen = 0;
+    SYNCHRONIZE_BLOCK(mutex_) {
+        if (!dirty_ || pause_count_ > 0 || file_path_.empty()) {
+            return nullerr;
+        }
+        gen = change_gen_;
+    }
+    return PassError(WriteChanges(gen, kNormal));
 }
 
-Error Datastore::FileLoad() {
-    SYNCHRONIZE(mutex_);
+utils::SynchronizeLock Datastore::Lock() const {
+    return SYNCHRONIZE_LOCK(mutex_);
+}
+
+Error Datastore::Set(const flat_json& in, Durability durability) {
+    if (!in.is_object()) {
+        return MakeCriticalError("Set requires an object");
+    }
+
+    uint64_t gen = 0;
+    SYNCHRONIZE_BLOCK(mutex_) {
+        for (auto it = in.begin(); it != in.end(); ++it) {
+            json_[it.key()] = it.value();
+        }
+        gen = Changed(durability);
+        durability = WriteDurability();
+    }
+
+    if (durability == kLazy) {
+        return nullerr;
+    }
+    return PassError(WriteChanges(gen, durability));
+}
 
-    json_ = json::object();
+uint64_t Datastore::Changed(Durability durability) {
+    dirty_ = true;
+    pending_durability_ = max(pending_durability_, durability);
+    return ++change_gen_;
+}
+
+Datastore::Durability Datastore::WriteDurability() const {
+    if (pause_count_ > 0 || pending_durability_ == kLazy) {
+        return kLazy;
+    }
+    return pending_durability_;
+}
+
+uint64_t Datastore::BytesWritten() const {
+    return bytes_written_;
+}
+
+uint64_t Datastore::DroppedRecords() const {
+    return dropped_records_;
+}
+
+Error Datastore::FileLoad(Durability& rewrite) {
+    rewrite = kLazy;
+    json_ = flat_json::object();
 
     ifstream f;
     f.open(file_path_, ios::binary);
@@ -82,40 +366,122 @@ Error Datastore::FileLoad() {
     // For details see: https://en.cppreference.com/w/cpp/io/ios_base/iostate
     if (f.fail()) {
         // File probably doesn't exist. Check that we can write here.
-        return WrapError(FileStore(), "f.fail and FileStore failed");
+        rewrite = kNormal;
+        return nullerr;
     } else if (!f.good()) {
         return MakeCriticalError(utils::Stringer("not f.good; errno=", errno));
     }
 
-    try {
-        f >> json_;
+    string contents((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+
+    auto first = contents.find_first_not_of(" \t\r\n");
+    if (first != string::npos && contents[first] == '{') {
+        // Old single-document format; converted by the next write.
+        auto j = ParseJSONDocument(contents);
+        if (!j) {
+            return WrapError(j.error(), "json load failed");
+        }
+        json_ = std::move(*j);
+        return nullerr;
     }
-    catch (json::exception& e) {
-        return MakeCriticalError(utils::Stringer("json load failed: ", e.what(), "; id:", e.id));
+
+    uint64_t dropped = 0;
+    if (!ParseRecords(contents, json_, dropped)) {
+        json_ = flat_json::object();
+        return MakeCriticalError("datastore file not recognized");
+    }
+    dropped_records_ = dropped;
+
+    if (dropped > 0) {
+        // Replace the damaged file with the intact records.
+        rewrite = kDurable;
     }
 
     return nullerr;
 }
 
-Error Datastore::FileStore() {
-    SYNCHRONIZE(mutex_);
-
-    if (paused_) {
+Error Datastore::WriteChanges(uint64_t gen, Durability durability) {
+    // Writes are made one at a time, each of the latest state, so a write that waited
+    // here may find that its change was already written by another.
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    if (written_gen_ >= gen && (durability != kDurable || durable_gen_ >= gen)) {
         return nullerr;
     }
 
-    ofstream f;
-    f.open(file_path_, ios::trunc | ios::binary);
-    if (!f.is_open()) {
-        return MakeCriticalError(utils::Stringer("not f.is_open; errno=", errno));
+    FlightRecorder::PhaseTimer persist_timer(FlightRecorder::Phase::kPersist);
+
+    // Only taking the snapshot holds up readers; the file operations don't.
+    string out, file_path, file_root;
+    uint64_t snapshot_gen = 0;
+    SYNCHRONIZE_BLOCK(mutex_) {
+        if (file_path_.empty()) {
+            return MakeCriticalError("datastore not initialized");
+        }
+        try {
+            out = SerializeRecords(json_);
+        }
+        catch (json::exception& e) {
+            return MakeCriticalError(utils::Stringer("json dump failed: ", e.what(), "; id:", e.id));
+        }
+        snapshot_gen = change_gen_;
+        durability = max(durability, pending_durability_);
+        dirty_ = false;
+        pending_durability_ = kLazy;
+        file_path = file_path_;
+        file_root = file_root_;
     }
 
-    try {
-        f << json_;
+    auto err = WriteFile(out, file_path, file_root, durability == kDurable);
+    if (err) {
+        // Leave the changes pending, for the next write.
+        SYNCHRONIZE(mutex_);
+        dirty_ = true;
+        pending_durability_ = max(pending_durability_, durability);
+        return err;
     }
-    catch (json::exception& e) {
-        return MakeCriticalError(utils::Stringer("json dump failed: ", e.what(), "; id:", e.id));
+
+    written_gen_ = snapshot_gen;
+    if (durability == kDurable) {
+        durable_gen_ = snapshot_gen;
     }
+    return nullerr;
+}
+
+Error Datastore::WriteFile(const string& contents, const string& file_path,
+                           const string& file_root, bool durable) {
+    // Every write goes to a temporary file that then replaces the datastore file, so that
+    // a crash can't leave a partial one (and lose records that were written durably
+    // before). A durable write is also flushed to storage before and after the rename.
+    auto write_path = file_path + ".tmp";
+
+    {
+        ofstream f;
+        f.open(write_path, ios::trunc | ios::binary);
+        if (!f.is_open()) {
+            return MakeCriticalError(utils::Stringer("not f.is_open; errno=", errno));
+        }
+
+        f.write(contents.data(), contents.size());
+        bytes_written_ += contents.size();
 
+        f.close();
+        if (f.fail()) {
+            return MakeCriticalError(utils::Stringer("f.close failed; errno=", errno));
+        }
+    }
+
+    if (durable) {
+        if (auto err = SyncPath(write_path, false)) {
+            return WrapError(err, "file sync failed");
+        }
+    }
+    if (auto err = AtomicReplace(write_path, file_path)) {
+        return WrapError(err, "file replace failed");
+    }
+    if (durable) {
+        if (auto err = SyncPath(file_root, true)) {
+            return WrapError(err, "directory sync failed");
+        }
+    }
     return nullerr;
 }
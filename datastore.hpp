@@ -22,13 +22,19 @@
 
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
 #include "error.hpp"
+#include "utils.hpp"
+#include "flat_json.hpp"
 #include "vendor/nonstd/expected.hpp"
 #include "vendor/nlohmann/json.hpp"
 
 namespace psicash {
 
 /// Extremely simplistic key-value store.
+/// The values are kept, and set, as flat_json (nlohmann::json converts to it, with a
+/// deep copy); they can be retrieved as nlohmann::json or anything that converts from it.
 /// Datastore operations are threadsafe.
 class Datastore {
     using json = nlohmann::json;
@@ -39,8 +45,23 @@ public:
         kTypeMismatch
     };
 
+    /// How hard Set tries to persist a change before returning.
+    enum Durability {
+        /// Only kept in memory; written with the next non-lazy write (or when the
+        /// Datastore is destroyed). May be lost on crash.
+        kLazy = 0,
+        /// Written to a temporary file, which is renamed over the datastore file. A crash
+        /// leaves the old or new file intact, but a power loss may lose the write.
+        kNormal,
+        /// As kNormal, but the temporary file is flushed to storage (fsync) before the
+        /// rename, and the directory after it.
+        kDurable
+    };
+
 public:
     Datastore();
+    /// Writes any lazy changes (unless writes are paused).
+    ~Datastore();
 
     /// Must be called exactly once.
     /// The fileRoot directory must already exist.
@@ -51,20 +72,38 @@ public:
     /// Primarily intended for debugging purposes.
     void Clear();
 
-    /// Stops writing of updates to disk until UnpauseWrites is called.
+    /// Stops writing of updates to disk until UnpauseWrites is called. Pauses nest: writing
+    /// resumes when each PauseWrites has been matched by an UnpauseWrites.
     void PauseWrites();
-    /// Unpauses writing and causes an immediate write.
+    /// Unpauses writing and, if there are changes, causes an immediate write with the
+    /// greatest durability requested while paused (but at least kNormal).
     error::Error UnpauseWrites();
+    /// As UnpauseWrites, for a caller holding `lock` (from Lock). The lock is released
+    /// once the state to write has been taken, before the file is written.
+    error::Error UnpauseWrites(utils::SynchronizeLock& lock);
+
+    /// Writes any lazy changes.
+    error::Error Flush();
+
+    /// Locks the datastore. While the lock is held, other threads' Gets and Sets wait,
+    /// so a series of Sets made under it is seen by them all at once. The holder must
+    /// not go on to take locks that are ordered before the datastore's (like UserData's
+    /// purchases lock), or do anything slow.
+    /// File writes are made without the lock held, so they don't hold up other threads'
+    /// Gets. Writes requested while the lock is held must be deferred with PauseWrites.
+    utils::SynchronizeLock Lock() const;
 
     /// Returns the value, or an error indicating the failure reason.
     template<typename T>
     nonstd::expected<T, DatastoreGetError> Get(const char* key) const {
+        SYNCHRONIZE(mutex_);
         try {
-            if (json_.find(key) == json_.end()) {
+            auto it = json_.find(key);
+            if (it == json_.end()) {
                 return nonstd::make_unexpected(kNotFound);
             }
 
-            return json_[key].get<T>();
+            return it->template get<T>();
         }
         catch (json::type_error& e) {
             return nonstd::make_unexpected(kTypeMismatch);
@@ -81,17 +120,51 @@ public:
     /// NOTE: Set is not atomic. If the file operation fails, the intermediate object will still be
     /// updated. We may want this to be otherwise in the future, but for now I think that it's preferable.
     /// Returns false if the file operation failed.
-    error::Error Set(const json& in);
+    error::Error Set(const flat_json& in, Durability durability = kNormal);
+
+    /// Returns the total number of bytes written to the datastore file since Init.
+    uint64_t BytesWritten() const;
+
+    /// Returns the number of damaged records that were dropped when the datastore file
+    /// was loaded. Each key (or array element) is checksummed separately, so damage only
+    /// loses the records it touches.
+    uint64_t DroppedRecords() const;
 
 protected:
-    error::Error FileLoad();
-    error::Error FileStore();
+    /// Loads the file. Sets `rewrite` to the durability with which the file should be
+    /// rewritten, if it should be. Must be called with the mutex held.
+    error::Error FileLoad(Durability& rewrite);
+
+    /// Records a change to json_ that requires a write with `durability`, returning its
+    /// generation. Must be called with the mutex held.
+    uint64_t Changed(Durability durability);
+    /// The durability of the write needed now, or kLazy if none is (because no write is
+    /// pending, or writes are paused). Must be called with the mutex held.
+    Durability WriteDurability() const;
+    /// Writes the current state to the file, unless change `gen` has already been written
+    /// with `durability`. Must be called without the mutex held.
+    error::Error WriteChanges(uint64_t gen, Durability durability);
+    error::Error WriteFile(const std::string& contents, const std::string& file_path,
+                           const std::string& file_root, bool durable);
 
 private:
-    std::recursive_mutex mutex_;
+    mutable std::recursive_mutex mutex_;
+    std::string file_root_;
     std::string file_path_;
-    json json_;
-    bool paused_;
+    flat_json json_;
+    int pause_count_;
+    // True if json_ has changes that haven't been written, and the greatest durability
+    // requested for them.
+    bool dirty_;
+    Durability pending_durability_;
+    // Generations of changes to json_: the latest, and the latest written (durably).
+    // The written ones are guarded by write_mutex_, which is taken before mutex_.
+    uint64_t change_gen_;
+    uint64_t written_gen_;
+    uint64_t durable_gen_;
+    std::mutex write_mutex_;
+    std::atomic<uint64_t> bytes_written_;
+    uint64_t dropped_records_;
 };
 
 } // namespace psicash
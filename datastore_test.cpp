@@ -19,6 +19,9 @@
 
 #include <cstdlib>
 #include <ctime>
+#include <fstream>
+#include <iterator>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "test_helpers.hpp"
@@ -377,3 +380,243 @@ TEST_F(TestDatastore, clear)
     ASSERT_FALSE(got);
     ASSERT_EQ(got.error(), psicash::Datastore::kNotFound);
 }
+
+TEST_F(TestDatastore, BytesWritten)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir().c_str());
+    ASSERT_FALSE(err);
+
+    auto start = ds.BytesWritten();
+
+    err = ds.Set({{"k", "v"}});
+    ASSERT_FALSE(err);
+    auto after_one = ds.BytesWritten();
+    ASSERT_GT(after_one, start);
+
+    ds.PauseWrites();
+    err = ds.Set({{"k2", "v2"}});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds.BytesWritten(), after_one);
+    err = ds.UnpauseWrites();
+    ASSERT_FALSE(err);
+    ASSERT_GT(ds.BytesWritten(), after_one);
+}
+
+TEST_F(TestDatastore, WritePauseNested)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir().c_str());
+    ASSERT_FALSE(err);
+
+    auto start = ds.BytesWritten();
+    ds.PauseWrites();
+    ds.PauseWrites();
+    err = ds.Set({{"k", "v"}});
+    ASSERT_FALSE(err);
+
+    // Still paused by the outer pause
+    err = ds.UnpauseWrites();
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds.BytesWritten(), start);
+
+    err = ds.UnpauseWrites();
+    ASSERT_FALSE(err);
+    auto after = ds.BytesWritten();
+    ASSERT_GT(after, start);
+
+    // Nothing changed, so unpausing again doesn't write
+    ds.PauseWrites();
+    err = ds.UnpauseWrites();
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds.BytesWritten(), after);
+}
+
+TEST_F(TestDatastore, DurabilityLazy)
+{
+    auto temp_dir = GetTempDir();
+
+    auto ds = new Datastore();
+    auto err = ds->Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+
+    // A lazy set doesn't write...
+    auto start = ds->BytesWritten();
+    err = ds->Set({{"lazy1", "v1"}}, Datastore::kLazy);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds->BytesWritten(), start);
+
+    // ...but is written with the next non-lazy set.
+    err = ds->Set({{"normal", "v"}}, Datastore::kNormal);
+    ASSERT_FALSE(err);
+    ASSERT_GT(ds->BytesWritten(), start);
+
+    // Normal writes also replace the file rather than rewriting it in place.
+    ifstream tmp(temp_dir + "/psicashdatastore.tmp");
+    ASSERT_FALSE(tmp.is_open());
+
+    Datastore ds2;
+    err = ds2.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    auto got = ds2.Get<string>("lazy1");
+    ASSERT_TRUE(got);
+    ASSERT_EQ(*got, "v1");
+
+    // Nothing is pending, so flushing doesn't write.
+    auto after_normal = ds->BytesWritten();
+    err = ds->Flush();
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds->BytesWritten(), after_normal);
+
+    // Pending lazy changes are written on destruction.
+    err = ds->Set({{"lazy2", "v2"}}, Datastore::kLazy);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds->BytesWritten(), after_normal);
+    delete ds;
+
+    ds = new Datastore();
+    err = ds->Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    got = ds->Get<string>("lazy2");
+    ASSERT_TRUE(got);
+    ASSERT_EQ(*got, "v2");
+    delete ds;
+}
+
+TEST_F(TestDatastore, DurabilityDurable)
+{
+    auto temp_dir = GetTempDir();
+
+    auto ds = new Datastore();
+    auto err = ds->Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+
+    err = ds->Set({{"k", "v"}}, Datastore::kDurable);
+    ASSERT_FALSE(err);
+
+    // The temporary file was renamed over the datastore file
+    ifstream tmp(temp_dir + "/psicashdatastore.tmp");
+    ASSERT_FALSE(tmp.is_open());
+
+    // A durable set while paused makes the unpause write durable
+    ds->PauseWrites();
+    err = ds->Set({{"k2", "v2"}}, Datastore::kDurable);
+    ASSERT_FALSE(err);
+    err = ds->Set({{"k3", "v3"}}, Datastore::kLazy);
+    ASSERT_FALSE(err);
+    err = ds->UnpauseWrites();
+    ASSERT_FALSE(err);
+
+    // Simulate a crash by abandoning the datastore without destroying it; nothing is pending.
+    Datastore ds2;
+    err = ds2.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    for (auto k : {"k", "k2", "k3"}) {
+        ASSERT_TRUE(ds2.Get<string>(k)) << k;
+    }
+
+    delete ds;
+}
+
+static string ReadFile(const string& path) {
+    ifstream f(path, ios::binary);
+    return string((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+}
+
+static void WriteFile(const string& path, const string& contents) {
+    ofstream f(path, ios::trunc | ios::binary);
+    f << contents;
+}
+
+TEST_F(TestDatastore, RecoverDamagedRecords)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_file = temp_dir + "/psicashdatastore";
+
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir.c_str());
+        ASSERT_FALSE(err);
+        err = ds.Set({{"k1", "v1"},
+                      {"k2", "v2"},
+                      {"arr", {"e1", "e2", "e3"}}});
+        ASSERT_FALSE(err);
+    }
+
+    // Damage the value of k1 and the second array element.
+    auto contents = ReadFile(ds_file);
+    auto pos = contents.find("\"v1\"");
+    ASSERT_NE(pos, string::npos);
+    contents[pos + 1] = 'X';
+    pos = contents.find("\"e2\"");
+    ASSERT_NE(pos, string::npos);
+    contents[pos + 1] = 'X';
+    WriteFile(ds_file, contents);
+
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir.c_str());
+        ASSERT_FALSE(err);
+        ASSERT_EQ(ds.DroppedRecords(), 2);
+
+        ASSERT_FALSE(ds.Get<string>("k1"));
+        auto got = ds.Get<string>("k2");
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "v2");
+        auto arr = ds.Get<vector<string>>("arr");
+        ASSERT_TRUE(arr);
+        ASSERT_EQ(*arr, (vector<string>{"e1", "e3"}));
+    }
+
+    // The damaged file was replaced with the intact records.
+    Datastore ds;
+    auto err = ds.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds.DroppedRecords(), 0);
+    ASSERT_TRUE(ds.Get<string>("k2"));
+}
+
+TEST_F(TestDatastore, RecoverTruncated)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_file = temp_dir + "/psicashdatastore";
+
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir.c_str());
+        ASSERT_FALSE(err);
+        err = ds.Set({{"a", 1}, {"b", 2}, {"c", 3}});
+        ASSERT_FALSE(err);
+    }
+
+    // Cut off the middle of the last record, as an interrupted write might.
+    auto contents = ReadFile(ds_file);
+    WriteFile(ds_file, contents.substr(0, contents.size() - 4));
+
+    Datastore ds;
+    auto err = ds.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds.DroppedRecords(), 1);
+    ASSERT_EQ(*ds.Get<int>("a"), 1);
+    ASSERT_EQ(*ds.Get<int>("b"), 2);
+    ASSERT_FALSE(ds.Get<int>("c"));
+}
+
+TEST_F(TestDatastore, LoadOldFormat)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_file = temp_dir + "/psicashdatastore";
+    WriteFile(ds_file, R"({"k":"v","arr":[1,2]})");
+
+    Datastore ds;
+    auto err = ds.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get<string>("k"), "v");
+    ASSERT_EQ(*ds.Get<vector<int>>("arr"), (vector<int>{1, 2}));
+
+    // Garbage is still an error
+    WriteFile(ds_file, "nonsense");
+    Datastore ds2;
+    err = ds2.Init(temp_dir.c_str());
+    ASSERT_TRUE(err);
+}
@@ -23,6 +23,8 @@
 #include <iomanip>
 #include <chrono>
 #include <locale>
+#include <atomic>
+#include <thread>
 #include "datetime.hpp"
 #include "vendor/date/date.h"
 #include "vendor/nlohmann/json.hpp"
@@ -86,7 +88,24 @@ DateTime DateTime::Zero() {
     return DateTime(kTimePointZero);
 }
 
+static atomic<TimeSource*> g_time_source{nullptr};
+
+void SetTimeSource(TimeSource* time_source) {
+    g_time_source = time_source;
+}
+
+void SleepFor(const Duration& d) {
+    if (auto time_source = g_time_source.load()) {
+        time_source->SleepFor(d);
+        return;
+    }
+    this_thread::sleep_for(d);
+}
+
 DateTime DateTime::Now() {
+    if (auto time_source = g_time_source.load()) {
+        return time_source->Now();
+    }
     return DateTime(NormalizeTimePoint(Clock::now()));
 }
 
@@ -56,7 +56,7 @@ public:
     DateTime Add(const Duration& d) const;
     DateTime Sub(const Duration& d) const;
 
-    // Mostly for testing
+    // Used for the datastore encoding and for testing.
     int64_t MillisSinceEpoch() const;
 
     bool operator<(const DateTime& rhs) const;
@@ -76,6 +76,24 @@ private:
 int64_t DurationToInt64(const Duration& d);
 Duration DurationFromInt64(int64_t d);
 
+/// The library's source of the current time and of waiting. The default uses the system
+/// clock and really sleeps. A simulation (or test) can install a virtual one, so that
+/// expiry and retry delays play out without real waiting.
+class TimeSource {
+public:
+    virtual ~TimeSource() = default;
+    virtual DateTime Now() = 0;
+    virtual void SleepFor(const Duration& d) = 0;
+};
+
+/// Replaces the time source used by DateTime::Now and SleepFor, process-wide. nullptr
+/// restores the system clock. The time source must outlive its installation.
+void SetTimeSource(TimeSource* time_source);
+
+/// Waits for `d`, according to the current time source. Library code waits with this
+/// rather than std::this_thread::sleep_for.
+void SleepFor(const Duration& d);
+
 } // namespace datetime
 } // namespace psicash
 
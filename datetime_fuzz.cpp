@@ -0,0 +1,26 @@
+/*
+ * Fuzz target for DateTime parsing: RFC 7231 comes from server Date headers, and
+ * ISO 8601 from API responses and authorizations.
+ */
+
+#include "fuzz_helpers.hpp"
+#include "datetime.hpp"
+
+using namespace psicash::datetime;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz::Budget budget("datetime");
+    auto s = fuzz::AsString(data, size);
+
+    DateTime rfc;
+    (void)rfc.FromRFC7231(s);
+
+    DateTime iso;
+    if (iso.FromISO8601(s)) {
+        // The formatted form (with millisecond precision) parses back to the same time.
+        DateTime reparsed;
+        fuzz::Check(reparsed.FromISO8601(iso.ToISO8601()), "datetime", "ToISO8601 result doesn't parse");
+        fuzz::Check(reparsed == iso, "datetime", "ISO 8601 doesn't round-trip");
+    }
+    return 0;
+}
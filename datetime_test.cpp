@@ -260,4 +260,8 @@ TEST(TestDatetime, JSON)
   j = json::parse(js);
   res = j.get<DateTime>();
   ASSERT_EQ(dt, res);
+
+  // Only the datastore uses the numeric form.
+  j = DateTime::Now().MillisSinceEpoch();
+  ASSERT_THROW(j.get<DateTime>(), json::type_error);
 }
@@ -22,6 +22,7 @@
 
 #include <string>
 #include <vector>
+#include <utility>
 #include <iosfwd>
 #include "vendor/nonstd/expected.hpp"
 
@@ -108,6 +109,8 @@ public:
 
     Result(const T& val) : nonstd::expected<T, Error>(val) {}
 
+    Result(T&& val) : nonstd::expected<T, Error>(std::move(val)) {}
+
     Result(const Error& err) : nonstd::expected<T, Error>(
             (nonstd::unexpected_type<Error>)err) {}
 };
@@ -0,0 +1,256 @@
+#include <atomic>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "test_helpers.hpp"
+#include "test_fake_server.hpp"
+#include "psicash.hpp"
+
+using namespace std;
+using namespace psicash;
+using namespace testing;
+
+// Exercises the client state machine against the in-process stand-in server, which
+// doesn't require network access (unlike TestPsiCash).
+class TestFakeServer : public ::testing::Test, public TempDir
+{
+  public:
+    TestFakeServer() : user_agent_("Psiphon-PsiCash-iOS") {}
+
+    const char* user_agent_;
+};
+
+TEST_F(TestFakeServer, RefreshState)
+{
+    FakeServer::Options options;
+    options.initial_balance = 12345;
+    FakeServer server(options);
+
+    PsiCash pc;
+    auto err = pc.Init(user_agent_, GetTempDir().c_str(), server.Requester());
+    ASSERT_FALSE(err);
+
+    auto res = pc.RefreshState({"speed-boost"});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::Success);
+    ASSERT_EQ(pc.ValidTokenTypes().size(), 3);
+    ASSERT_FALSE(pc.IsAccount());
+    ASSERT_EQ(pc.Balance(), 12345);
+    ASSERT_GT(pc.GetPurchasePrices().size(), 0);
+    ASSERT_EQ(server.RequestCount(), 2); // tracker and refresh-state
+}
+
+TEST_F(TestFakeServer, RefreshStateHedged)
+{
+    FakeServer server;
+    auto requester = server.Requester();
+
+    // The first refresh-state request is very slow.
+    auto slow_started = make_shared<atomic<bool>>(false);
+    auto slow_finished = make_shared<atomic<bool>>(false);
+    auto slow_requester = [requester, slow_started, slow_finished](const HTTPParams& params) {
+        if (params.path.find("/refresh-state") != string::npos && !slow_started->exchange(true)) {
+            this_thread::sleep_for(chrono::seconds(2));
+            auto res = requester(params);
+            *slow_finished = true;
+            return res;
+        }
+        return requester(params);
+    };
+
+    PsiCash pc;
+    auto err = pc.Init(user_agent_, GetTempDir().c_str(), slow_requester);
+    ASSERT_FALSE(err);
+
+    HedgingConfig config;
+    config.initial_delay = chrono::milliseconds(100);
+    pc.SetRequestHedging(&config);
+
+    auto start = chrono::steady_clock::now();
+    auto res = pc.RefreshState({"speed-boost"});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::Success);
+    ASSERT_LT(chrono::steady_clock::now() - start, chrono::seconds(1));
+
+    auto hedging = pc.GetDiagnosticInfo()["hedging"];
+    ASSERT_EQ(hedging["requests"], 1); // the tracker request is a POST
+    ASSERT_EQ(hedging["hedged"], 1);
+    ASSERT_EQ(hedging["hedgeWins"], 1);
+
+    pc.SetRequestHedging(nullptr);
+    ASSERT_EQ(pc.GetDiagnosticInfo().count("hedging"), 0);
+
+    // The losing request still uses the server.
+    while (!*slow_finished) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+TEST_F(TestFakeServer, RefreshScheduler)
+{
+    FakeServer::Options options;
+    options.initial_balance = 12345;
+    FakeServer server(options);
+
+    RefreshSchedulerConfig config;
+    config.purchase_classes = {"speed-boost"};
+    config.min_interval = chrono::milliseconds(20);
+    config.max_interval = chrono::milliseconds(20);
+
+    PsiCash pc;
+    // Not before Init.
+    pc.StartRefreshScheduler(config);
+    this_thread::sleep_for(chrono::milliseconds(50));
+    ASSERT_EQ(server.RequestCount(), 0);
+
+    auto err = pc.Init(user_agent_, GetTempDir().c_str(), server.Requester());
+    ASSERT_FALSE(err);
+    pc.StartRefreshScheduler(config);
+
+    this_thread::sleep_for(chrono::milliseconds(200));
+    ASSERT_EQ(pc.Balance(), 12345);
+    ASSERT_GT(pc.GetPurchasePrices().size(), 0);
+    ASSERT_GT(server.RequestCount(), 2);
+
+    // Without a requester, refreshing pauses.
+    pc.SetHTTPRequestFn(nullptr);
+    this_thread::sleep_for(chrono::milliseconds(50));
+    auto request_count = server.RequestCount();
+    this_thread::sleep_for(chrono::milliseconds(100));
+    ASSERT_EQ(server.RequestCount(), request_count);
+
+    pc.SetHTTPRequestFn(server.Requester());
+    this_thread::sleep_for(chrono::milliseconds(100));
+    ASSERT_GT(server.RequestCount(), request_count);
+
+    pc.StopRefreshScheduler();
+    request_count = server.RequestCount();
+    this_thread::sleep_for(chrono::milliseconds(100));
+    ASSERT_EQ(server.RequestCount(), request_count);
+}
+
+TEST_F(TestFakeServer, NewExpiringPurchase)
+{
+    FakeServer::Options options;
+    options.initial_balance = 250;
+    options.price = 100;
+    FakeServer server(options);
+
+    PsiCash pc;
+    auto err = pc.Init(user_agent_, GetTempDir().c_str(), server.Requester());
+    ASSERT_FALSE(err);
+    auto res = pc.RefreshState({"speed-boost"});
+    ASSERT_TRUE(res);
+
+    auto purchase_result = pc.NewExpiringPurchase("speed-boost", "1hr", 100);
+    ASSERT_TRUE(purchase_result) << purchase_result.error();
+    ASSERT_EQ(purchase_result->status, Status::Success);
+    ASSERT_TRUE(purchase_result->purchase->authorization);
+    ASSERT_EQ(purchase_result->purchase->authorization->access_type, "speed-boost");
+    ASSERT_EQ(pc.Balance(), 150);
+    ASSERT_EQ(pc.ActivePurchases().size(), 1);
+
+    purchase_result = pc.NewExpiringPurchase("speed-boost", "1hr", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::ExistingTransaction);
+
+    purchase_result = pc.NewExpiringPurchase("other-class", "1hr", 99);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::TransactionAmountMismatch);
+
+    purchase_result = pc.NewExpiringPurchase("other-class", "not-a-duration", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::TransactionTypeNotFound);
+
+    purchase_result = pc.NewExpiringPurchase("other-class", "1ms", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::Success);
+    ASSERT_EQ(pc.Balance(), 50);
+
+    purchase_result = pc.NewExpiringPurchase("third-class", "1hr", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::InsufficientBalance);
+
+    ASSERT_EQ(pc.GetPurchases().size(), 2);
+}
+
+TEST_F(TestFakeServer, NewExpiringPurchasePreflight)
+{
+    FakeServer::Options options;
+    options.initial_balance = 250;
+    options.price = 100;
+    FakeServer server(options);
+
+    PsiCash pc;
+    auto err = pc.Init(user_agent_, GetTempDir().c_str(), server.Requester());
+    ASSERT_FALSE(err);
+    pc.SetPurchasePreflight(true);
+
+    // Nothing is known before RefreshState, so the server is asked.
+    auto purchase_result = pc.NewExpiringPurchase("speed-boost", "not-a-duration", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::InvalidTokens);
+
+    auto res = pc.RefreshState({"speed-boost"});
+    ASSERT_TRUE(res);
+    auto request_count = server.RequestCount();
+
+    // Decided locally.
+    purchase_result = pc.NewExpiringPurchase("speed-boost", "not-a-duration", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::TransactionTypeNotFound);
+    purchase_result = pc.NewExpiringPurchase("speed-boost", "1hr", 99);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::TransactionAmountMismatch);
+    ASSERT_EQ(server.RequestCount(), request_count);
+
+    // There are no stored prices for other-class, so the server is asked.
+    purchase_result = pc.NewExpiringPurchase("other-class", "not-a-duration", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::TransactionTypeNotFound);
+    ASSERT_EQ(server.RequestCount(), ++request_count);
+
+    purchase_result = pc.NewExpiringPurchase("speed-boost", "1hr", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::Success);
+    ASSERT_EQ(server.RequestCount(), ++request_count);
+
+    purchase_result = pc.NewExpiringPurchase("speed-boost", "1hr", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::ExistingTransaction);
+    ASSERT_FALSE(purchase_result->purchase);
+    ASSERT_EQ(server.RequestCount(), request_count);
+
+    purchase_result = pc.NewExpiringPurchase("other-class", "1hr", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::Success);
+    ASSERT_EQ(pc.Balance(), 50);
+    ASSERT_EQ(server.RequestCount(), ++request_count);
+
+    purchase_result = pc.NewExpiringPurchase("third-class", "1hr", 100);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::InsufficientBalance);
+    ASSERT_EQ(server.RequestCount(), request_count);
+
+    // Skipping the checks still gets the server's answer.
+    purchase_result = pc.NewExpiringPurchase("third-class", "1hr", 100, true);
+    ASSERT_TRUE(purchase_result);
+    ASSERT_EQ(purchase_result->status, Status::InsufficientBalance);
+    ASSERT_EQ(server.RequestCount(), ++request_count);
+}
+
+TEST_F(TestFakeServer, ServerError)
+{
+    FakeServer::Options options;
+    options.server_error_rate = 1;
+    FakeServer server(options);
+
+    PsiCash pc;
+    auto err = pc.Init(user_agent_, GetTempDir().c_str(), server.Requester());
+    ASSERT_FALSE(err);
+
+    auto res = pc.RefreshState({});
+    ASSERT_TRUE(res);
+    ASSERT_EQ(*res, Status::ServerError);
+    ASSERT_EQ(server.RequestCount(), 3); // retried
+}
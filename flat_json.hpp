@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_FLAT_JSON_H
+#define PSICASHLIB_FLAT_JSON_H
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vendor/nlohmann/json.hpp"
+
+namespace psicash {
+
+/// A map stored as a vector of key-value pairs sorted by key, with the interface that
+/// nlohmann::basic_json needs of its object type. The library's JSON objects are small
+/// (a handful of keys), so a binary search over one contiguous allocation beats
+/// std::map's node per key; iteration order is the same (sorted), so dumps match.
+/// Unlike std::map, inserting or erasing invalidates iterators and references to other
+/// elements, and elements are pair<Key, T> rather than pair<const Key, T> (so they
+/// can be moved within the vector); keys must not be modified through iterators.
+template<class Key, class T, class Compare = std::less<Key>,
+         class Allocator = std::allocator<std::pair<const Key, T>>>
+class FlatMap {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<Key, T>;
+    using key_compare = Compare;
+    using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<value_type>;
+    using container_type = std::vector<value_type, allocator_type>;
+    using size_type = typename container_type::size_type;
+    using difference_type = typename container_type::difference_type;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using iterator = typename container_type::iterator;
+    using const_iterator = typename container_type::const_iterator;
+
+    FlatMap() = default;
+
+    template<class InputIt>
+    FlatMap(InputIt first, InputIt last) {
+        insert(first, last);
+    }
+
+    FlatMap(std::initializer_list<value_type> init) {
+        insert(init.begin(), init.end());
+    }
+
+    iterator begin() noexcept { return items_.begin(); }
+    const_iterator begin() const noexcept { return items_.begin(); }
+    const_iterator cbegin() const noexcept { return items_.cbegin(); }
+    iterator end() noexcept { return items_.end(); }
+    const_iterator end() const noexcept { return items_.end(); }
+    const_iterator cend() const noexcept { return items_.cend(); }
+
+    bool empty() const noexcept { return items_.empty(); }
+    size_type size() const noexcept { return items_.size(); }
+    size_type max_size() const noexcept { return items_.max_size(); }
+    void clear() noexcept { items_.clear(); }
+    void reserve(size_type n) { items_.reserve(n); }
+
+    iterator lower_bound(const Key& key) {
+        return std::lower_bound(items_.begin(), items_.end(), key, KeyLess());
+    }
+
+    const_iterator lower_bound(const Key& key) const {
+        return std::lower_bound(items_.begin(), items_.end(), key, KeyLess());
+    }
+
+    iterator find(const Key& key) {
+        auto it = lower_bound(key);
+        return (it != items_.end() && !Compare()(key, it->first)) ? it : items_.end();
+    }
+
+    const_iterator find(const Key& key) const {
+        auto it = lower_bound(key);
+        return (it != items_.end() && !Compare()(key, it->first)) ? it : items_.end();
+    }
+
+    size_type count(const Key& key) const {
+        return find(key) == end() ? 0 : 1;
+    }
+
+    T& at(const Key& key) {
+        auto it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("FlatMap::at: key not found");
+        }
+        return it->second;
+    }
+
+    const T& at(const Key& key) const {
+        auto it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("FlatMap::at: key not found");
+        }
+        return it->second;
+    }
+
+    T& operator[](const Key& key) {
+        return TryEmplace(Key(key)).first->second;
+    }
+
+    T& operator[](Key&& key) {
+        return TryEmplace(std::move(key)).first->second;
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value) {
+        return emplace(value);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+        return emplace(std::move(value));
+    }
+
+    /// Like std::map, a key that's already present (or repeated in the range) keeps its
+    /// first value.
+    template<class InputIt>
+    void insert(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            emplace(*first);
+        }
+    }
+
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        value_type value(std::forward<Args>(args)...);
+        auto it = lower_bound(value.first);
+        if (it != items_.end() && !Compare()(value.first, it->first)) {
+            return {it, false};
+        }
+        it = ReserveFirst(it);
+        return {items_.insert(it, std::move(value)), true};
+    }
+
+    iterator erase(const_iterator pos) {
+        return items_.erase(pos);
+    }
+
+    iterator erase(const_iterator first, const_iterator last) {
+        return items_.erase(first, last);
+    }
+
+    size_type erase(const Key& key) {
+        auto it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        items_.erase(it);
+        return 1;
+    }
+
+    void swap(FlatMap& other) noexcept {
+        items_.swap(other.items_);
+    }
+
+    friend bool operator==(const FlatMap& lhs, const FlatMap& rhs) {
+        return lhs.items_ == rhs.items_;
+    }
+
+    friend bool operator!=(const FlatMap& lhs, const FlatMap& rhs) {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator<(const FlatMap& lhs, const FlatMap& rhs) {
+        return lhs.items_ < rhs.items_;
+    }
+
+private:
+    struct KeyLess {
+        bool operator()(const value_type& item, const Key& key) const {
+            return Compare()(item.first, key);
+        }
+    };
+
+    std::pair<iterator, bool> TryEmplace(Key&& key) {
+        auto it = lower_bound(key);
+        if (it != items_.end() && !Compare()(key, it->first)) {
+            return {it, false};
+        }
+        it = ReserveFirst(it);
+        return {items_.emplace(it, std::move(key), T()), true};
+    }
+
+    // Objects are rarely smaller than this, so the first insert reserves room for them
+    // all, rather than the vector growing 1, 2, 4. Returns `it`, still valid.
+    static constexpr size_type kInitialCapacity = 4;
+    iterator ReserveFirst(iterator it) {
+        if (items_.capacity() == 0) {
+            items_.reserve(kInitialCapacity);
+            return items_.begin();
+        }
+        return it;
+    }
+
+    container_type items_;
+};
+
+/// JSON whose objects are FlatMaps. Used for the library's internal documents (the
+/// datastore and parsed responses); the public API still uses nlohmann::json, which
+/// converts to and from this implicitly (with a deep copy).
+using flat_json = nlohmann::basic_json<FlatMap>;
+
+} // namespace psicash
+
+#endif //PSICASHLIB_FLAT_JSON_H
@@ -0,0 +1,138 @@
+/*
+ * Compares nlohmann's default json (std::map objects) with flat_json (sorted-vector
+ * objects; see flat_json.hpp) on the small objects the library works with: building
+ * them, looking up their keys, copying them, and parsing a response and a datastore
+ * record. Allocation counts require a PSICASH_ALLOC_COUNTING build (see bench.sh).
+ *
+ * Usage: flat_json_bench [--iterations=N]
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench_helpers.hpp"
+#include "flat_json.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+// Lookups per sample, so that samples are long enough to time.
+static const int kLookups = 100;
+
+static vector<string> Keys(size_t n) {
+    static const char* kKeys[] = {"v", "serverTimeDiff", "authTokens", "balance", "IsAccount",
+                                  "purchasePrices", "purchases", "lastTransactionID",
+                                  "requestMetadata", "slowOperations"};
+    return vector<string>(kKeys, kKeys + min(n, sizeof(kKeys) / sizeof(kKeys[0])));
+}
+
+template<typename JSON>
+static JSON Build(const vector<string>& keys) {
+    JSON j = JSON::object();
+    int64_t i = 0;
+    for (const auto& k : keys) {
+        j[k] = i++;
+    }
+    return j;
+}
+
+template<typename JSON>
+static int64_t Lookup(const JSON& j, const vector<string>& keys) {
+    int64_t sum = 0;
+    for (int n = 0; n < kLookups; n++) {
+        auto it = j.find(keys[n % keys.size()]);
+        if (it != j.end()) {
+            sum += it->template get<int64_t>();
+        }
+    }
+    return sum;
+}
+
+static string RefreshStateResponse() {
+    json prices = json::array();
+    for (const auto& d : {"1hr", "2hr", "3hr", "24hr", "7day", "30day"}) {
+        prices.push_back({{"Class", "speed-boost"}, {"Distinguisher", d}, {"Price", 100}});
+    }
+    json j = {{"TokensValid", {{"earner", true}, {"spender", true}, {"indicator", true}}},
+              {"IsAccount", false},
+              {"Balance", 1000},
+              {"PurchasePrices", prices}};
+    return j.dump();
+}
+
+static string DatastoreRecord() {
+    json purchase = {{"id", "2019-01-01T00:00:00.000Z"},
+                     {"class", "speed-boost"},
+                     {"distinguisher", "1hr"},
+                     {"serverTimeExpiry", 1546304400000},
+                     {"authorization", {{"ID", "0123456789abcdef"},
+                                        {"Expires", 1546304400000},
+                                        {"Encoded", string(300, 'x')}}}};
+    return json{{"k", "purchases"}, {"e", purchase}}.dump();
+}
+
+template<typename JSON>
+static void Run(bench::OpStats& stats, const string& name, int iterations, int64_t& sink) {
+    for (size_t size : {3, 6, 10}) {
+        auto keys = Keys(size);
+        auto suffix = " " + to_string(size) + " (" + name + ")";
+        for (int i = 0; i < iterations; i++) {
+            sink += bench::Measure(stats, "build" + suffix, [&] {
+                return (int64_t)Build<JSON>(keys).size();
+            });
+        }
+        auto j = Build<JSON>(keys);
+        for (int i = 0; i < iterations; i++) {
+            sink += bench::Measure(stats, "find x100" + suffix, [&] {
+                return Lookup(j, keys);
+            });
+        }
+        for (int i = 0; i < iterations; i++) {
+            sink += bench::Measure(stats, "copy" + suffix, [&] {
+                JSON copy = j;
+                return (int64_t)copy.size();
+            });
+        }
+    }
+
+    auto response = RefreshStateResponse();
+    auto record = DatastoreRecord();
+    for (int i = 0; i < iterations; i++) {
+        sink += bench::Measure(stats, "parse resp (" + name + ")", [&] {
+            auto j = JSON::parse(response);
+            return j["Balance"].template get<int64_t>() + (int64_t)j["PurchasePrices"].size();
+        });
+    }
+    for (int i = 0; i < iterations; i++) {
+        sink += bench::Measure(stats, "parse rec (" + name + ")", [&] {
+            auto j = JSON::parse(record);
+            return (int64_t)j["e"]["authorization"]["Encoded"].template get_ref<const string&>().size();
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    int iterations = 10000;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--iterations=") == 0) {
+            iterations = atoi(arg.c_str() + strlen("--iterations="));
+        }
+    }
+
+    int64_t sink = 0;
+    bench::OpStats stats;
+    Run<json>(stats, "map", iterations, sink);
+    Run<flat_json>(stats, "flat", iterations, sink);
+
+    cout << "iterations: " << iterations << "; checksum: " << sink << endl;
+    stats.Print(cout);
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "flat_json.hpp"
+#include "arena.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+class TestFlatJSON : public ::testing::Test
+{
+  public:
+    TestFlatJSON() = default;
+};
+
+TEST_F(TestFlatJSON, FlatMap)
+{
+    FlatMap<string, int> m;
+    ASSERT_TRUE(m.empty());
+    m["b"] = 2;
+    m["a"] = 1;
+    m["c"] = 3;
+    ASSERT_EQ(m.size(), 3);
+
+    // Sorted by key, whatever the insertion order.
+    vector<string> keys;
+    for (const auto& it : m) {
+        keys.push_back(it.first);
+    }
+    ASSERT_EQ(keys, vector<string>({"a", "b", "c"}));
+
+    ASSERT_EQ(m.at("b"), 2);
+    ASSERT_THROW(m.at("x"), out_of_range);
+    ASSERT_EQ(m.count("c"), 1);
+    ASSERT_EQ(m.count("x"), 0);
+    ASSERT_EQ(m.find("x"), m.end());
+
+    // An existing key keeps its value.
+    auto res = m.emplace("a", 10);
+    ASSERT_FALSE(res.second);
+    ASSERT_EQ(res.first->second, 1);
+    res = m.insert({"d", 4});
+    ASSERT_TRUE(res.second);
+    ASSERT_EQ(m.size(), 4);
+
+    ASSERT_EQ(m.erase("b"), 1);
+    ASSERT_EQ(m.erase("b"), 0);
+    auto next = m.erase(m.find("a"));
+    ASSERT_EQ(next->first, "c");
+    ASSERT_EQ(m.size(), 2);
+
+    map<string, int> from = {{"z", 26}, {"y", 25}};
+    FlatMap<string, int> copy(from.begin(), from.end());
+    ASSERT_EQ(copy.begin()->first, "y");
+    ASSERT_TRUE(copy == (FlatMap<string, int>{{"z", 26}, {"y", 25}}));
+    ASSERT_TRUE(copy != m);
+}
+
+TEST_F(TestFlatJSON, MatchesJSON)
+{
+    auto doc = R"|({
+        "v": 1,
+        "balance": -12,
+        "nested": {"b": [1, "two", null, true, {"d": [], "c": {}}], "a": 1.5},
+        "purchasePrices": [{"Class": "speed-boost", "Distinguisher": "1hr", "Price": 100}],
+        "dup": 1,
+        "dup": 2
+    })|";
+
+    auto f = flat_json::parse(doc);
+    auto j = json::parse(doc);
+    ASSERT_EQ(f.dump(), j.dump());
+    ASSERT_EQ(f["dup"], 2);
+    ASSERT_EQ(f["nested"]["b"][4].size(), 2);
+
+    // Conversions both ways are deep and lossless.
+    json to_json = f;
+    ASSERT_EQ(to_json, j);
+    flat_json from_json = j;
+    ASSERT_EQ(from_json, f);
+
+    ASSERT_EQ(f.at("v").get<int>(), 1);
+    ASSERT_THROW(f.at("missing"), json::out_of_range);
+    ASSERT_EQ(f.count("balance"), 1);
+    ASSERT_EQ(f.erase("balance"), 1);
+    ASSERT_EQ(f.count("balance"), 0);
+
+    auto tokens = flat_json::parse(R"|({"spender": true, "earner": false})|");
+    auto m = tokens.get<map<string, bool>>();
+    ASSERT_EQ(m, (map<string, bool>{{"earner", false}, {"spender", true}}));
+    flat_json back = m;
+    ASSERT_EQ(back, tokens);
+
+    ASSERT_TRUE(flat_json::parse(R"({"a":1})") < flat_json::parse(R"({"a":2})"));
+}
+
+TEST_F(TestFlatJSON, Arena)
+{
+    ArenaScope scope;
+    auto j = arena_json::parse(R"|({"b": {"y": 1, "x": 2}, "a": [1, 2]})|");
+    ASSERT_EQ(j.dump(), R"|({"a":[1,2],"b":{"x":2,"y":1}})|");
+    ASSERT_TRUE(Arena::Current()->Owns(&*j.get_ptr<arena_json::object_t*>()->begin()));
+}
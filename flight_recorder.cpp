@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include "flight_recorder.hpp"
+#include "datetime.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace std::chrono;
+
+namespace psicash {
+
+static_assert(is_trivially_copyable<FlightRecorder::Entry>::value,
+              "FlightRecorder::Entry is copied through the ring as words");
+
+constexpr int FlightRecorder::kStatusError;
+constexpr size_t FlightRecorder::Entry::kMaxAttempts;
+constexpr size_t FlightRecorder::Entry::kMaxOpName;
+
+// The outermost Op on this thread, if any.
+static thread_local FlightRecorder::Op* t_op = nullptr;
+
+static uint32_t ClampMillis(steady_clock::duration d) {
+    auto ms = duration_cast<milliseconds>(d).count();
+    return (uint32_t)max<int64_t>(0, min<int64_t>(ms, numeric_limits<uint32_t>::max()));
+}
+
+FlightRecorder::FlightRecorder(size_t capacity, milliseconds threshold)
+        : capacity_(max<size_t>(capacity, 1)), slots_(new Slot[capacity_]),
+          next_ticket_(0), threshold_ms_(threshold.count()) {
+    for (size_t i = 0; i < capacity_; i++) {
+        slots_[i].seq.store(0, memory_order_relaxed);
+        for (auto& w : slots_[i].words) {
+            w.store(0, memory_order_relaxed);
+        }
+    }
+}
+
+void FlightRecorder::SetThreshold(milliseconds threshold) {
+    threshold_ms_.store(threshold.count(), memory_order_relaxed);
+}
+
+milliseconds FlightRecorder::Threshold() const {
+    return milliseconds(threshold_ms_.load(memory_order_relaxed));
+}
+
+void FlightRecorder::Record(const Entry& entry) {
+    uint64_t words[kEntryWords] = {};
+    memcpy(words, &entry, sizeof(entry));
+
+    auto ticket = next_ticket_.fetch_add(1, memory_order_relaxed);
+    auto& slot = slots_[ticket % capacity_];
+
+    // Claim the slot, unless another writer has it or it already holds a newer entry
+    // (this writer having been delayed by a whole lap of the ring).
+    auto seq = slot.seq.load(memory_order_relaxed);
+    if ((seq & 1) || (seq != 0 && seq / 2 - 1 > ticket) ||
+        !slot.seq.compare_exchange_strong(seq, 2 * ticket + 1, memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = 0; i < kEntryWords; i++) {
+        slot.words[i].store(words[i], memory_order_relaxed);
+    }
+    slot.seq.store(2 * ticket + 2, memory_order_release);
+}
+
+vector<FlightRecorder::Entry> FlightRecorder::Entries() const {
+    vector<pair<uint64_t, Entry>> found;
+    found.reserve(capacity_);
+
+    for (size_t s = 0; s < capacity_; s++) {
+        const auto& slot = slots_[s];
+        // A slot being rewritten is retried a few times, then skipped.
+        for (int attempt = 0; attempt < 3; attempt++) {
+            auto seq = slot.seq.load(memory_order_acquire);
+            if (seq == 0) {
+                break;
+            }
+            if (seq & 1) {
+                continue;
+            }
+            uint64_t words[kEntryWords];
+            for (size_t i = 0; i < kEntryWords; i++) {
+                words[i] = slot.words[i].load(memory_order_relaxed);
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (slot.seq.load(memory_order_relaxed) != seq) {
+                continue;
+            }
+            Entry entry;
+            memcpy(&entry, words, sizeof(entry));
+            found.emplace_back(seq / 2 - 1, entry);
+            break;
+        }
+    }
+
+    sort(found.begin(), found.end(), [](const pair<uint64_t, Entry>& a, const pair<uint64_t, Entry>& b) {
+        return a.first < b.first;
+    });
+    vector<Entry> entries;
+    entries.reserve(found.size());
+    for (const auto& f : found) {
+        entries.push_back(f.second);
+    }
+    return entries;
+}
+
+static const char* kPhaseNames[] = {"build", "parse", "persist", "wait"};
+static_assert(sizeof(kPhaseNames) / sizeof(kPhaseNames[0]) == (size_t)FlightRecorder::Phase::kCount,
+              "a name for every phase");
+
+json FlightRecorder::ToJSON() const {
+    json j = json::array();
+    for (const auto& e : Entries()) {
+        json http = json::array();
+        for (size_t i = 0; i < min<size_t>(e.attempts, Entry::kMaxAttempts); i++) {
+            http.push_back({e.attempt_ms[i], e.attempt_code[i]});
+        }
+        json je = {{"op",    e.op},
+                   {"t",     e.started_millis / 1000},
+                   {"ms",    e.total_ms},
+                   {"req",   e.requests},
+                   {"tries", e.attempts},
+                   {"s",     e.status},
+                   {"http",  http}};
+        for (size_t p = 0; p < (size_t)Phase::kCount; p++) {
+            je[kPhaseNames[p]] = e.phase_ms[p];
+        }
+        j.push_back(je);
+    }
+    return j;
+}
+
+void FlightRecorder::Load(const json& j) {
+    if (!j.is_array()) {
+        return;
+    }
+    for (const auto& je : j) {
+        if (!je.is_object()) {
+            continue;
+        }
+        auto op = je.find("op"), ms = je.find("ms");
+        if (op == je.end() || !op->is_string() || ms == je.end() || !ms->is_number_integer()) {
+            continue;
+        }
+        auto num = [&je](const char* key) -> int64_t {
+            auto it = je.find(key);
+            return (it != je.end() && it->is_number_integer()) ? it->get<int64_t>() : 0;
+        };
+
+        Entry e;
+        memset(&e, 0, sizeof(e));
+        strncpy(e.op, op->get_ref<const string&>().c_str(), Entry::kMaxOpName);
+        e.started_millis = num("t") * 1000;
+        e.total_ms = (uint32_t)num("ms");
+        e.requests = (uint16_t)num("req");
+        e.attempts = (uint16_t)num("tries");
+        e.status = (int16_t)num("s");
+        for (size_t p = 0; p < (size_t)Phase::kCount; p++) {
+            e.phase_ms[p] = (uint32_t)num(kPhaseNames[p]);
+        }
+        auto http = je.find("http");
+        if (http != je.end() && http->is_array()) {
+            size_t i = 0;
+            for (const auto& a : *http) {
+                if (i >= Entry::kMaxAttempts) {
+                    break;
+                }
+                if (a.is_array() && a.size() == 2 && a[0].is_number_integer() && a[1].is_number_integer()) {
+                    e.attempt_ms[i] = a[0].get<uint32_t>();
+                    e.attempt_code[i] = a[1].get<int16_t>();
+                    i++;
+                }
+            }
+        }
+        Record(e);
+    }
+}
+
+//
+// Op
+//
+
+FlightRecorder::Op::Op(FlightRecorder& recorder, const char* name)
+        : recorder_(nullptr) {
+    if (t_op) {
+        return;
+    }
+    t_op = this;
+    recorder_ = &recorder;
+    memset(&entry_, 0, sizeof(entry_));
+    strncpy(entry_.op, name, Entry::kMaxOpName);
+    entry_.started_millis = datetime::DateTime::Now().MillisSinceEpoch();
+    start_ = steady_clock::now();
+}
+
+FlightRecorder::Op::~Op() {
+    (void)Finish(kStatusError);
+}
+
+bool FlightRecorder::Op::Finish(int status) {
+    if (!recorder_) {
+        return false;
+    }
+    auto recorder = recorder_;
+    recorder_ = nullptr;
+    t_op = nullptr;
+
+    entry_.total_ms = ClampMillis(steady_clock::now() - start_);
+    entry_.status = (int16_t)status;
+    if (entry_.total_ms < recorder->Threshold().count()) {
+        return false;
+    }
+    recorder->Record(entry_);
+    return true;
+}
+
+//
+// PhaseTimer
+//
+
+FlightRecorder::PhaseTimer::PhaseTimer(Phase phase)
+        : phase_(phase), running_(true), start_(steady_clock::now()) {
+}
+
+FlightRecorder::PhaseTimer::~PhaseTimer() {
+    Stop();
+}
+
+void FlightRecorder::PhaseTimer::Start() {
+    running_ = true;
+    start_ = steady_clock::now();
+}
+
+void FlightRecorder::PhaseTimer::Stop() {
+    if (!running_) {
+        return;
+    }
+    running_ = false;
+    if (t_op) {
+        t_op->entry_.phase_ms[(size_t)phase_] += ClampMillis(steady_clock::now() - start_);
+    }
+}
+
+void FlightRecorder::AddRequest() {
+    if (t_op) {
+        t_op->entry_.requests++;
+    }
+}
+
+void FlightRecorder::AddAttempt(steady_clock::duration elapsed, int code) {
+    if (!t_op) {
+        return;
+    }
+    auto& e = t_op->entry_;
+    if (e.attempts < Entry::kMaxAttempts) {
+        e.attempt_ms[e.attempts] = ClampMillis(elapsed);
+        e.attempt_code[e.attempts] = (int16_t)code;
+    }
+    e.attempts++;
+}
+
+} // namespace psicash
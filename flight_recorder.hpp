@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_FLIGHT_RECORDER_H
+#define PSICASHLIB_FLIGHT_RECORDER_H
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include "vendor/nlohmann/json.hpp"
+
+namespace psicash {
+
+/// Keeps the last few API operations that took longer than a threshold, with where
+/// their time went, for diagnostic packages. Recording is lock-free: the entries live in
+/// a fixed-size ring of seqlocked slots, so a slow operation never waits on a reader (or
+/// another writer). If two writers land on the same slot at once, one entry is dropped.
+///
+/// An operation is timed by an Op in scope on its thread. Phases (see Phase) and HTTP
+/// attempts within it -- on that thread, in whatever code they happen -- are attributed
+/// to it with PhaseTimer and AddAttempt.
+class FlightRecorder {
+public:
+    enum class Phase {
+        kBuild = 0,   // building HTTP requests
+        kParse,       // parsing responses
+        kPersist,     // writing the datastore
+        kWait,        // waiting for other operations to finish (see Strand)
+        kCount
+    };
+
+    /// The status of an operation that returned an error, rather than a Status.
+    static constexpr int kStatusError = -2;
+
+    /// A recorded operation. Fixed-size and trivially copyable, so it can live in the
+    /// ring. Contains nothing that identifies the user.
+    struct Entry {
+        static constexpr size_t kMaxAttempts = 6;
+        static constexpr size_t kMaxOpName = 23;
+
+        char op[kMaxOpName + 1];
+        // When the operation started (wall clock).
+        int64_t started_millis;
+        uint32_t total_ms;
+        uint32_t phase_ms[(size_t)Phase::kCount];
+        // The number of HTTP requests the operation made, and of attempts at them;
+        // attempts beyond the requests are retries.
+        uint16_t requests;
+        uint16_t attempts;
+        // A Status, or kStatusError.
+        int16_t status;
+        // The first kMaxAttempts attempts: how long each took, and its HTTP status (or
+        // HTTPResult error code).
+        int16_t attempt_code[kMaxAttempts];
+        uint32_t attempt_ms[kMaxAttempts];
+    };
+
+    explicit FlightRecorder(size_t capacity = 16,
+                            std::chrono::milliseconds threshold = std::chrono::milliseconds(1000));
+
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+    /// Operations that take at least `threshold` are recorded.
+    void SetThreshold(std::chrono::milliseconds threshold);
+    std::chrono::milliseconds Threshold() const;
+
+    /// Adds an entry, replacing the oldest if the ring is full.
+    void Record(const Entry& entry);
+
+    /// Returns the recorded entries, oldest first.
+    std::vector<Entry> Entries() const;
+
+    /// The entries in a compact form, for diagnostics and for persisting. Like:
+    /// [{"op":"RefreshState","t":<start epoch seconds>,"ms":3120,"build":1,"parse":2,
+    ///   "persist":15,"wait":0,"req":2,"tries":4,"s":0,"http":[[1500,503],[1010,200],...]},...]
+    nlohmann::json ToJSON() const;
+
+    /// Records the entries of a ToJSON value (as after a restart). Malformed entries
+    /// are skipped.
+    void Load(const nlohmann::json& j);
+
+    /// Times an operation, and records it if it's slow. Scopes nest: only the outermost
+    /// Op on a thread is timed (so an operation that calls another is recorded once).
+    class Op {
+    public:
+        /// `name` is truncated to Entry::kMaxOpName characters.
+        Op(FlightRecorder& recorder, const char* name);
+        ~Op();
+
+        Op(const Op&) = delete;
+        Op& operator=(const Op&) = delete;
+
+        /// Ends the operation with the given status, recording it if it was slow.
+        /// Returns true if it was recorded. Without a call to Finish, the operation
+        /// ends when the Op is destroyed, with kStatusError.
+        bool Finish(int status);
+
+    private:
+        friend class FlightRecorder;
+        FlightRecorder* recorder_; // null if not outermost or finished
+        Entry entry_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    /// Attributes the time it's running to a phase of the current thread's operation.
+    /// It starts running when constructed, and stops when destroyed (or by Stop).
+    class PhaseTimer {
+    public:
+        explicit PhaseTimer(Phase phase);
+        ~PhaseTimer();
+
+        PhaseTimer(const PhaseTimer&) = delete;
+        PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+        void Start();
+        void Stop();
+
+    private:
+        Phase phase_;
+        bool running_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    /// Count an HTTP request, and an attempt at one, against the current thread's
+    /// operation (if any).
+    static void AddRequest();
+    static void AddAttempt(std::chrono::steady_clock::duration elapsed, int code);
+
+private:
+    static constexpr size_t kEntryWords = (sizeof(Entry) + 7) / 8;
+
+    // seq is 0 while the slot is empty, odd while it's being written, and otherwise
+    // 2*(ticket+1) for the entry's ticket (its position in the record order).
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        std::array<std::atomic<uint64_t>, kEntryWords> words;
+    };
+
+    size_t capacity_;
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<uint64_t> next_ticket_;
+    std::atomic<int64_t> threshold_ms_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_FLIGHT_RECORDER_H
@@ -0,0 +1,229 @@
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include "gtest/gtest.h"
+#include "test_helpers.hpp"
+#include "test_fake_server.hpp"
+#include "test_simulation.hpp"
+#include "flight_recorder.hpp"
+#include "psicash.hpp"
+#include "http_status_codes.h"
+
+using namespace std;
+using namespace psicash;
+using namespace testing;
+
+class TestFlightRecorder : public ::testing::Test, public TempDir
+{
+  public:
+    static FlightRecorder::Entry MakeEntry(uint32_t n) {
+        FlightRecorder::Entry e;
+        memset(&e, 0, sizeof(e));
+        strncpy(e.op, ("op" + to_string(n)).c_str(), FlightRecorder::Entry::kMaxOpName);
+        e.total_ms = n;
+        for (auto& p : e.phase_ms) {
+            p = n;
+        }
+        e.started_millis = int64_t(n) * 1000;
+        return e;
+    }
+};
+
+TEST_F(TestFlightRecorder, Threshold)
+{
+    FlightRecorder recorder(4, chrono::milliseconds(20));
+    {
+        FlightRecorder::Op op(recorder, "Fast");
+        ASSERT_FALSE(op.Finish(0));
+    }
+    {
+        FlightRecorder::Op op(recorder, "Slow");
+        this_thread::sleep_for(chrono::milliseconds(25));
+        ASSERT_TRUE(op.Finish(3));
+    }
+    {
+        // Destroyed without Finish: an error
+        FlightRecorder::Op op(recorder, "SlowError");
+        this_thread::sleep_for(chrono::milliseconds(25));
+    }
+
+    auto entries = recorder.Entries();
+    ASSERT_EQ(entries.size(), 2);
+    ASSERT_STREQ(entries[0].op, "Slow");
+    ASSERT_GE(entries[0].total_ms, 20);
+    ASSERT_EQ(entries[0].status, 3);
+    ASSERT_STREQ(entries[1].op, "SlowError");
+    ASSERT_EQ(entries[1].status, FlightRecorder::kStatusError);
+}
+
+TEST_F(TestFlightRecorder, RingKeepsNewest)
+{
+    FlightRecorder recorder(4);
+    for (uint32_t i = 0; i < 10; i++) {
+        recorder.Record(MakeEntry(i));
+    }
+    auto entries = recorder.Entries();
+    ASSERT_EQ(entries.size(), 4);
+    for (uint32_t i = 0; i < 4; i++) {
+        ASSERT_EQ(entries[i].total_ms, 6 + i);
+    }
+}
+
+TEST_F(TestFlightRecorder, PhasesAndAttempts)
+{
+    FlightRecorder recorder(4, chrono::milliseconds(0));
+
+    // Not attributed to anything.
+    FlightRecorder::AddRequest();
+    { FlightRecorder::PhaseTimer t(FlightRecorder::Phase::kParse); }
+
+    {
+        FlightRecorder::Op op(recorder, "Outer");
+        {
+            // Nested ops are attributed to the outermost.
+            FlightRecorder::Op inner(recorder, "Inner");
+            FlightRecorder::AddRequest();
+            for (int i = 0; i < 8; i++) {
+                FlightRecorder::AddAttempt(chrono::milliseconds(100 + i), i < 7 ? 500 : 200);
+            }
+            ASSERT_FALSE(inner.Finish(0));
+        }
+        {
+            FlightRecorder::PhaseTimer t(FlightRecorder::Phase::kPersist);
+            this_thread::sleep_for(chrono::milliseconds(15));
+            t.Stop();
+            this_thread::sleep_for(chrono::milliseconds(15));
+        }
+        ASSERT_TRUE(op.Finish(0));
+    }
+
+    auto entries = recorder.Entries();
+    ASSERT_EQ(entries.size(), 1);
+    const auto& e = entries[0];
+    ASSERT_STREQ(e.op, "Outer");
+    ASSERT_EQ(e.requests, 1);
+    ASSERT_EQ(e.attempts, 8);
+    ASSERT_EQ(e.attempt_ms[0], 100);
+    ASSERT_EQ(e.attempt_code[0], 500);
+    ASSERT_EQ(e.attempt_ms[5], 105);
+    ASSERT_GE(e.phase_ms[(size_t)FlightRecorder::Phase::kPersist], 15);
+    ASSERT_LT(e.phase_ms[(size_t)FlightRecorder::Phase::kPersist], 30);
+    ASSERT_EQ(e.phase_ms[(size_t)FlightRecorder::Phase::kParse], 0);
+}
+
+TEST_F(TestFlightRecorder, JSONRoundTrip)
+{
+    FlightRecorder recorder(4);
+    auto e = MakeEntry(1234);
+    e.requests = 2;
+    e.attempts = 3;
+    e.status = 6;
+    e.attempt_ms[0] = 1000;
+    e.attempt_code[0] = 503;
+    e.attempt_ms[1] = 10;
+    e.attempt_code[1] = HTTPResult::RECOVERABLE_ERROR;
+    e.attempt_ms[2] = 20;
+    e.attempt_code[2] = 200;
+    recorder.Record(e);
+
+    auto j = recorder.ToJSON();
+    ASSERT_EQ(j, R"|([{"op":"op1234","t":1234,"ms":1234,"build":1234,"parse":1234,"persist":1234,"wait":1234,
+                       "req":2,"tries":3,"s":6,"http":[[1000,503],[10,-1],[20,200]]}])|"_json);
+
+    FlightRecorder loaded(4);
+    loaded.Load(R"|([{"op":"bad"}, 7, {"ms":1}])|"_json);
+    ASSERT_EQ(loaded.Entries().size(), 0);
+    loaded.Load(j);
+    ASSERT_EQ(loaded.ToJSON(), j);
+}
+
+TEST_F(TestFlightRecorder, ConcurrentWritersAndReaders)
+{
+    FlightRecorder recorder(8);
+    atomic<bool> done(false);
+    atomic<int> torn(0);
+
+    vector<thread> readers;
+    for (int r = 0; r < 2; r++) {
+        readers.emplace_back([&] {
+            while (!done) {
+                for (const auto& e : recorder.Entries()) {
+                    // Every field of an entry was written from the same n.
+                    if (e.phase_ms[0] != e.total_ms || e.phase_ms[2] != e.total_ms ||
+                        e.started_millis != int64_t(e.total_ms) * 1000 ||
+                        string(e.op) != "op" + to_string(e.total_ms)) {
+                        torn++;
+                    }
+                }
+            }
+        });
+    }
+
+    vector<thread> writers;
+    for (uint32_t w = 0; w < 4; w++) {
+        writers.emplace_back([&recorder, w] {
+            for (uint32_t i = 0; i < 20000; i++) {
+                recorder.Record(MakeEntry(w * 100000 + i));
+            }
+        });
+    }
+    for (auto& t : writers) {
+        t.join();
+    }
+    done = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+
+    ASSERT_EQ(torn, 0);
+    ASSERT_GT(recorder.Entries().size(), 0);
+}
+
+TEST_F(TestFlightRecorder, PsiCashDiagnostics)
+{
+    datetime::DateTime start;
+    start.FromISO8601("2019-01-01T00:00:00.000Z");
+    VirtualClock clock(start);
+    clock.Install();
+
+    FakeServer server;
+    ScriptedTransport transport(server, 1);
+    // The first refresh-state attempt fails; the retry (after a virtual wait) succeeds.
+    transport.AddStorm(start, start.Add(chrono::milliseconds(500)), 503, 1.0);
+    auto dir = GetTempDir();
+
+    {
+        PsiCash pc;
+        ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Test", dir.c_str(), transport.Requester()));
+        pc.SetSlowOperationThreshold(chrono::milliseconds(0));
+
+        auto res = pc.RefreshState({"speed-boost"});
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_EQ(*res, Status::Success);
+
+        auto slow = pc.GetDiagnosticInfo()["slowOperations"];
+        ASSERT_EQ(slow.size(), 1);
+        ASSERT_EQ(slow[0]["op"], "RefreshState");
+        ASSERT_EQ(slow[0]["s"], (int)Status::Success);
+        ASSERT_EQ(slow[0]["req"], 2); // tracker and refresh-state
+        ASSERT_EQ(slow[0]["tries"], 3);
+        ASSERT_EQ(slow[0]["http"][0][1], 503);
+        ASSERT_EQ(slow[0]["http"][1][1], 200);
+        ASSERT_EQ(slow[0]["http"][2][1], 200);
+        // Nothing that identifies the user.
+        auto dump = slow.dump();
+        ASSERT_EQ(dump.find("speed-boost"), string::npos);
+        ASSERT_EQ(dump.find("tracker"), string::npos);
+    }
+
+    // The entries survive a restart.
+    PsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Test", dir.c_str(), transport.Requester()));
+    auto slow = pc.GetDiagnosticInfo()["slowOperations"];
+    ASSERT_EQ(slow.size(), 1);
+    ASSERT_EQ(slow[0]["op"], "RefreshState");
+    ASSERT_EQ(slow[0]["tries"], 3);
+}
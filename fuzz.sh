@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Builds the fuzz targets (*_fuzz.cpp) with libFuzzer, ASan and UBSan (in build-fuzz),
+# and runs each for FUZZ_SECONDS (default 60), starting from its seed corpus in
+# fuzz_corpus/<target>. New corpus entries are kept in build-fuzz/corpus, and crashing
+# or too-slow inputs are written to build-fuzz/artifacts.
+# Besides libFuzzer's limits, each input has a time and peak-RSS budget (see
+# fuzz_helpers.hpp), so pathological-complexity inputs are reported as crashes too.
+# Arguments are passed through to each fuzzer, like -max_len=100000.
+# With REPLAY_ONLY=1, just runs the seed corpus through each target (which also works
+# without Clang).
+
+set -eu
+
+FUZZ_SECONDS=${FUZZ_SECONDS:-60}
+
+mkdir -p build-fuzz
+cd build-fuzz
+if [ -z "${REPLAY_ONLY:-}" ]; then
+  export CC=$(which clang) CXX=$(which clang++)
+fi
+cmake -DPSICASH_FUZZ=ON ${FUZZ_CMAKE_FLAGS:-} ..
+make $(cd .. && ls *_fuzz.cpp | sed 's/\.cpp$//')
+cd -
+
+for source in *_fuzz.cpp; do
+  fuzzer=$(basename ${source} .cpp)
+  target=${fuzzer%_fuzz}
+  echo "### ${fuzzer}"
+  if [ -n "${REPLAY_ONLY:-}" ]; then
+    build-fuzz/${fuzzer} fuzz_corpus/${target}
+    continue
+  fi
+  mkdir -p build-fuzz/corpus/${target} build-fuzz/artifacts/${target}
+  build-fuzz/${fuzzer} \
+    -max_total_time=${FUZZ_SECONDS} \
+    -timeout=5 \
+    -rss_limit_mb=1024 \
+    -malloc_limit_mb=256 \
+    -max_len=65536 \
+    -artifact_prefix=build-fuzz/artifacts/${target}/ \
+    "$@" \
+    build-fuzz/corpus/${target} fuzz_corpus/${target}
+done
@@ -0,0 +1,67 @@
+#include <cstdlib>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "fuzz_helpers.hpp"
+
+using namespace std;
+
+namespace fuzz {
+
+static int64_t EnvInt(const char* name, int64_t def) {
+    auto v = getenv(name);
+    return v ? atoll(v) : def;
+}
+
+// Instrumented builds are several times slower than normal ones, and inputs can be
+// up to libFuzzer's -max_len; a linear-time parser is far within this.
+static const chrono::milliseconds kTimeBudget(EnvInt("PSICASH_FUZZ_BUDGET_MS", 250));
+static const int64_t kRSSBudgetMB = EnvInt("PSICASH_FUZZ_RSS_MB", 512);
+
+static int64_t PeakRSSMB() {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024 * 1024); // bytes
+#else
+    return usage.ru_maxrss / 1024; // kilobytes
+#endif
+#endif
+}
+
+Budget::Budget(const char* target)
+        : target_(target), start_(chrono::steady_clock::now()), start_peak_rss_mb_(PeakRSSMB()) {
+}
+
+Budget::~Budget() {
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_);
+    if (elapsed > kTimeBudget) {
+        fprintf(stderr, "%s: input took %lldms; budget is %lldms\n", target_,
+                (long long)elapsed.count(), (long long)kTimeBudget.count());
+        abort();
+    }
+
+    auto growth = PeakRSSMB() - start_peak_rss_mb_;
+    if (growth > kRSSBudgetMB) {
+        fprintf(stderr, "%s: input grew peak RSS by %lldMB; budget is %lldMB\n", target_,
+                (long long)growth, (long long)kRSSBudgetMB);
+        abort();
+    }
+}
+
+void Check(bool cond, const char* target, const char* message) {
+    if (!cond) {
+        fprintf(stderr, "%s: check failed: %s\n", target, message);
+        abort();
+    }
+}
+
+} // namespace fuzz
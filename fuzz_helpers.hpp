@@ -0,0 +1,53 @@
+#ifndef PSICASHLIB_FUZZ_HELPERS_H
+#define PSICASHLIB_FUZZ_HELPERS_H
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// Support for the libFuzzer targets (*_fuzz.cpp). Each target defines
+// LLVMFuzzerTestOneInput. With the PSICASH_FUZZ CMake option, Clang builds link them
+// with libFuzzer (and ASan/UBSan); other compilers link fuzz_replay.cpp, which runs
+// the inputs (such as the seed corpus in fuzz_corpus/) once each. See fuzz.sh.
+
+namespace fuzz {
+
+/// Per-input resource limits. While in scope, if the input takes longer than the time
+/// budget, or the process's peak RSS grows by more than the memory budget, the process
+/// aborts, so the fuzzer records the input as a crash. This catches pathological
+/// complexity (such as regex backtracking), not just memory errors. libFuzzer's own
+/// -timeout is in whole seconds; these budgets are much tighter.
+/// Only the growth during the input counts, so an input isn't blamed for the peak an
+/// earlier one (or libFuzzer itself) reached; but nor is one that stays under that
+/// peak. fuzz.sh's -malloc_limit_mb catches any single huge allocation regardless.
+/// The defaults can be changed with the PSICASH_FUZZ_BUDGET_MS and PSICASH_FUZZ_RSS_MB
+/// environment variables.
+class Budget {
+public:
+    explicit Budget(const char* target);
+    ~Budget();
+
+    Budget(const Budget&) = delete;
+    Budget& operator=(const Budget&) = delete;
+
+private:
+    const char* target_;
+    std::chrono::steady_clock::time_point start_;
+    int64_t start_peak_rss_mb_;
+};
+
+/// The input as a string.
+inline std::string AsString(const uint8_t* data, size_t size) {
+    return std::string(reinterpret_cast<const char*>(data), size);
+}
+
+/// Aborts with the message if `cond` is false. For checking invariants (like
+/// round-tripping) that should hold for every input.
+void Check(bool cond, const char* target, const char* message);
+
+} // namespace fuzz
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+#endif //PSICASHLIB_FUZZ_HELPERS_H
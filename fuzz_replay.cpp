@@ -0,0 +1,68 @@
+/*
+ * Runs each input file (or each file in an input directory) through the fuzz target's
+ * LLVMFuzzerTestOneInput, once. Linked into the *_fuzz targets when the compiler doesn't
+ * have libFuzzer, so the harnesses and the seed corpus can still be checked.
+ * Arguments starting with '-' (libFuzzer flags) are ignored.
+ *
+ * Usage: <target>_fuzz <file or directory>...
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <dirent.h>
+
+#include "fuzz_helpers.hpp"
+
+using namespace std;
+
+static bool RunFile(const string& path) {
+    ifstream f(path, ios::binary);
+    if (!f) {
+        return false;
+    }
+    string contents((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(contents.data()), contents.size());
+    return true;
+}
+
+int main(int argc, char** argv) {
+    size_t inputs = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.empty() || arg[0] == '-') {
+            continue;
+        }
+
+        auto dir = opendir(arg.c_str());
+        if (!dir) {
+            if (!RunFile(arg)) {
+                cerr << "failed to read " << arg << endl;
+                return 1;
+            }
+            inputs++;
+            continue;
+        }
+
+        vector<string> names;
+        while (auto entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') {
+                names.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+
+        for (const auto& name : names) {
+            if (!RunFile(arg + "/" + name)) {
+                cerr << "failed to read " << arg << "/" << name << endl;
+                return 1;
+            }
+            inputs++;
+        }
+    }
+
+    cout << argv[0] << ": ran " << inputs << " inputs" << endl;
+    return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <fstream>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include "http_recorder.hpp"
+#include "utils.hpp"
+
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+using namespace error;
+
+namespace psicash {
+
+static constexpr const char* kAuthHeader = "X-PsiCash-Auth";
+static constexpr const char* kTrackerPathSuffix = "/tracker";
+
+//
+// HTTPRecorder
+//
+
+HTTPRecorder::HTTPRecorder(MakeHTTPRequestFn requester)
+        : requester_(requester) {
+}
+
+MakeHTTPRequestFn HTTPRecorder::Requester() {
+    return [this](const HTTPParams& params) { return Record(params); };
+}
+
+HTTPExchanges HTTPRecorder::Exchanges() const {
+    lock_guard<mutex> lock(mutex_);
+    return exchanges_;
+}
+
+Error HTTPRecorder::Save(const string& file_path) const {
+    auto exchanges = Exchanges();
+
+    ofstream f;
+    f.open(file_path, ios::trunc | ios::binary);
+    if (!f.is_open()) {
+        return MakeCriticalError(utils::Stringer("not f.is_open; errno=", errno));
+    }
+
+    try {
+        for (const auto& e : exchanges) {
+            f << json(e) << '\n';
+        }
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(utils::Stringer("json dump failed: ", e.what(), "; id:", e.id));
+    }
+
+    return nullerr;
+}
+
+HTTPResult HTTPRecorder::Record(const HTTPParams& params) {
+    auto start = chrono::steady_clock::now();
+    auto result = requester_(params);
+    auto elapsed = chrono::duration_cast<datetime::Duration>(chrono::steady_clock::now() - start);
+
+    // The recorded exchange must not include the auth tokens, so learn what they are
+    // before scrubbing.
+    auto auth_header = params.headers.find(kAuthHeader);
+    bool is_tracker = params.path.size() >= strlen(kTrackerPathSuffix) &&
+                      params.path.compare(params.path.size() - strlen(kTrackerPathSuffix),
+                                          string::npos, kTrackerPathSuffix) == 0;
+
+    lock_guard<mutex> lock(mutex_);
+
+    LearnTokens(auth_header != params.headers.end() ? auth_header->second : "",
+                is_tracker ? result.body : "");
+
+    HTTPExchange exchange{params, result, elapsed};
+    for (auto& h : exchange.params.headers) {
+        h.second = Scrub(h.second);
+    }
+    for (auto& q : exchange.params.query) {
+        q.second = Scrub(q.second);
+    }
+    exchange.result.body = Scrub(exchange.result.body);
+
+    exchanges_.push_back(exchange);
+
+    return result;
+}
+
+void HTTPRecorder::LearnTokens(const string& auth_header, const string& tracker_body) {
+    vector<string> tokens;
+
+    // The auth header is a comma-separated list of tokens.
+    size_t start = 0;
+    while (start < auth_header.size()) {
+        auto end = auth_header.find(',', start);
+        if (end == string::npos) {
+            end = auth_header.size();
+        }
+        if (end > start) {
+            tokens.push_back(auth_header.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+
+    // A tracker response is an object of token-type to token.
+    if (!tracker_body.empty()) {
+        try {
+            auto j = json::parse(tracker_body);
+            if (j.is_object()) {
+                for (const auto& it : j) {
+                    if (it.is_string()) {
+                        tokens.push_back(it.get<string>());
+                    }
+                }
+            }
+        }
+        catch (json::exception&) {
+            // Not our problem; the library will deal with the bad response
+        }
+    }
+
+    for (const auto& t : tokens) {
+        if (tokens_.count(t) == 0) {
+            tokens_[t] = utils::Stringer("scrubbed-token-", tokens_.size() + 1);
+        }
+    }
+}
+
+string HTTPRecorder::Scrub(const string& s) const {
+    string res = s;
+    for (const auto& t : tokens_) {
+        size_t pos = 0;
+        while ((pos = res.find(t.first, pos)) != string::npos) {
+            res.replace(pos, t.first.size(), t.second);
+            pos += t.second.size();
+        }
+    }
+    return res;
+}
+
+//
+// HTTPReplayer
+//
+
+HTTPReplayer::HTTPReplayer(const HTTPExchanges& exchanges, double time_scale)
+        : exchanges_(exchanges), time_scale_(time_scale), next_(0) {
+}
+
+Result<HTTPExchanges> HTTPReplayer::Load(const string& file_path) {
+    ifstream f;
+    f.open(file_path, ios::binary);
+    if (!f.is_open()) {
+        return MakeCriticalError(utils::Stringer("not f.is_open; errno=", errno));
+    }
+
+    HTTPExchanges exchanges;
+    string line;
+    try {
+        while (getline(f, line)) {
+            if (line.empty()) {
+                continue;
+            }
+            exchanges.push_back(json::parse(line).get<HTTPExchange>());
+        }
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(utils::Stringer("json load failed: ", e.what(), "; id:", e.id));
+    }
+
+    return exchanges;
+}
+
+MakeHTTPRequestFn HTTPReplayer::Requester() {
+    return [this](const HTTPParams& params) { return Replay(params.method, params.path); };
+}
+
+MakeHTTPRequestRefFn HTTPReplayer::RequesterRef() {
+    return [this](const HTTPRequestRef& req) { return Replay(req.method, req.path); };
+}
+
+void HTTPReplayer::Rewind() {
+    lock_guard<mutex> lock(mutex_);
+    next_ = 0;
+}
+
+size_t HTTPReplayer::Remaining() const {
+    lock_guard<mutex> lock(mutex_);
+    return exchanges_.size() - next_;
+}
+
+HTTPResult HTTPReplayer::Replay(const StringRef& method, const StringRef& path) {
+    HTTPExchange exchange;
+    {
+        lock_guard<mutex> lock(mutex_);
+
+        if (next_ >= exchanges_.size()) {
+            HTTPResult result;
+            result.error = "replay exhausted; request: " + method.str() + " " + path.str();
+            return result;
+        }
+
+        const auto& want = exchanges_[next_].params;
+        if (StringRef(want.method) != method || StringRef(want.path) != path) {
+            HTTPResult result;
+            result.error = "replay mismatch; want: " + want.method + " " + want.path +
+                           "; got: " + method.str() + " " + path.str();
+            return result;
+        }
+
+        exchange = exchanges_[next_++];
+    }
+
+    if (time_scale_ > 0) {
+        this_thread::sleep_for(chrono::duration_cast<chrono::microseconds>(
+                chrono::duration<double, milli>(exchange.elapsed.count() * time_scale_)));
+    }
+
+    return exchange.result;
+}
+
+//
+// JSON de/serializing of HTTPExchange
+//
+
+void to_json(json& j, const HTTPExchange& v) {
+    j = json{
+            {"params", {
+                    {"scheme",   v.params.scheme},
+                    {"hostname", v.params.hostname},
+                    {"port",     v.params.port},
+                    {"method",   v.params.method},
+                    {"path",     v.params.path},
+                    {"headers",  v.params.headers},
+                    {"query",    v.params.query}}},
+            {"result", {
+                    {"code",  v.result.code},
+                    {"body",  v.result.body},
+                    {"date",  v.result.date},
+                    {"error", v.result.error}}},
+            {"elapsed", datetime::DurationToInt64(v.elapsed)}};
+}
+
+void from_json(const json& j, HTTPExchange& v) {
+    const auto& params = j.at("params");
+    v.params.scheme = params.at("scheme").get<string>();
+    v.params.hostname = params.at("hostname").get<string>();
+    v.params.port = params.at("port").get<int>();
+    v.params.method = params.at("method").get<string>();
+    v.params.path = params.at("path").get<string>();
+    v.params.headers = params.at("headers").get<map<string, string>>();
+    v.params.query = params.at("query").get<vector<pair<string, string>>>();
+
+    const auto& result = j.at("result");
+    v.result.code = result.at("code").get<int>();
+    v.result.body = result.at("body").get<string>();
+    v.result.date = result.at("date").get<string>();
+    v.result.error = result.at("error").get<string>();
+
+    v.elapsed = datetime::DurationFromInt64(j.at("elapsed").get<int64_t>());
+}
+
+} // namespace psicash
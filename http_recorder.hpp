@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_HTTP_RECORDER_H
+#define PSICASHLIB_HTTP_RECORDER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include "psicash.hpp"
+#include "datetime.hpp"
+#include "error.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+namespace psicash {
+
+/// A single request-response exchange made through a MakeHTTPRequestFn.
+struct HTTPExchange {
+    HTTPParams params;
+    HTTPResult result;
+    // How long the requester took to produce the result.
+    datetime::Duration elapsed;
+
+    friend void to_json(nlohmann::json& j, const HTTPExchange& v);
+    friend void from_json(const nlohmann::json& j, HTTPExchange& v);
+};
+
+using HTTPExchanges = std::vector<HTTPExchange>;
+
+/// Wraps a MakeHTTPRequestFn and captures every exchange made through it, so that a
+/// session can later be served back by HTTPReplayer.
+/// Auth tokens are scrubbed from the captured exchanges: each token seen (in the auth
+/// header or in a tracker response) is replaced everywhere with a stable placeholder.
+/// For a recording to be replayable, it should start from an empty datastore.
+/// HTTPRecorder operations are threadsafe.
+class HTTPRecorder {
+public:
+    explicit HTTPRecorder(MakeHTTPRequestFn requester);
+
+    /// Returns a requester suitable for PsiCash::Init or SetHTTPRequestFn. The
+    /// HTTPRecorder must outlive any use of it.
+    MakeHTTPRequestFn Requester();
+
+    /// Returns the (scrubbed) exchanges captured so far.
+    HTTPExchanges Exchanges() const;
+
+    /// Writes the captured exchanges to file_path, one JSON object per line.
+    error::Error Save(const std::string& file_path) const;
+
+protected:
+    HTTPResult Record(const HTTPParams& params);
+    void LearnTokens(const std::string& auth_header, const std::string& tracker_body);
+    std::string Scrub(const std::string& s) const;
+
+private:
+    mutable std::mutex mutex_;
+    MakeHTTPRequestFn requester_;
+    // Maps real token values to their placeholders.
+    std::map<std::string, std::string> tokens_;
+    HTTPExchanges exchanges_;
+};
+
+/// Serves back recorded exchanges, in order, as a MakeHTTPRequestFn.
+/// Each request must match the method and path of the next recorded exchange; if it
+/// doesn't (or the recording is exhausted) a CRITICAL_ERROR result is returned.
+/// HTTPReplayer operations are threadsafe.
+class HTTPReplayer {
+public:
+    /// `time_scale` is applied to the recorded elapsed time of each exchange before its
+    /// result is returned: 1.0 reproduces the original timings, 0 returns immediately.
+    explicit HTTPReplayer(const HTTPExchanges& exchanges, double time_scale = 0);
+
+    /// Reads exchanges previously written by HTTPRecorder::Save.
+    static error::Result<HTTPExchanges> Load(const std::string& file_path);
+
+    /// Returns a requester suitable for PsiCash::Init or SetHTTPRequestFn. The
+    /// HTTPReplayer must outlive any use of it.
+    MakeHTTPRequestFn Requester();
+
+    /// Like Requester, but for PsiCash::SetHTTPRequestRefFn.
+    MakeHTTPRequestRefFn RequesterRef();
+
+    /// Restarts serving from the first exchange.
+    void Rewind();
+
+    /// The number of exchanges not yet served.
+    size_t Remaining() const;
+
+protected:
+    HTTPResult Replay(const StringRef& method, const StringRef& path);
+
+private:
+    mutable std::mutex mutex_;
+    HTTPExchanges exchanges_;
+    double time_scale_;
+    size_t next_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_HTTP_RECORDER_H
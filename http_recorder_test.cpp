@@ -0,0 +1,124 @@
+#include <fstream>
+
+#include "gtest/gtest.h"
+#include "test_helpers.hpp"
+#include "http_recorder.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+class TestHTTPRecorder : public ::testing::Test, public TempDir
+{
+  public:
+    TestHTTPRecorder() {}
+
+    static HTTPParams MakeParams(const string& path, const string& auth) {
+        HTTPParams params;
+        params.scheme = "https";
+        params.hostname = "api.psi.cash";
+        params.port = 443;
+        params.method = "GET";
+        params.path = path;
+        params.headers["User-Agent"] = "test";
+        if (!auth.empty()) {
+            params.headers["X-PsiCash-Auth"] = auth;
+        }
+        params.query = {{"class", "speed-boost"}};
+        return params;
+    }
+
+    // Responds to /tracker with new tokens and to everything else by echoing the auth header.
+    static HTTPResult FakeServer(const HTTPParams& params) {
+        HTTPResult result;
+        result.code = 200;
+        result.date = "Mon, 14 Jan 2019 17:22:23 GMT";
+        if (params.path == "/v1/tracker") {
+            result.body = R"({"earner":"realearner","spender":"realspender"})";
+        } else {
+            result.body = "tokens:" + params.headers.at("X-PsiCash-Auth");
+        }
+        return result;
+    }
+};
+
+TEST_F(TestHTTPRecorder, ScrubsTokens)
+{
+    HTTPRecorder recorder(FakeServer);
+    auto requester = recorder.Requester();
+
+    auto result = requester(MakeParams("/v1/tracker", ""));
+    // The caller gets the real, unscrubbed result
+    ASSERT_EQ(result.body, R"({"earner":"realearner","spender":"realspender"})");
+
+    result = requester(MakeParams("/v1/refresh-state", "realearner,realspender"));
+    ASSERT_EQ(result.body, "tokens:realearner,realspender");
+
+    auto exchanges = recorder.Exchanges();
+    ASSERT_EQ(exchanges.size(), 2);
+    for (const auto& e : exchanges) {
+        ASSERT_EQ(json(e).dump().find("real"), string::npos) << json(e).dump();
+    }
+
+    // Placeholders are stable across exchanges
+    ASSERT_EQ(exchanges[0].result.body, R"({"earner":"scrubbed-token-1","spender":"scrubbed-token-2"})");
+    ASSERT_EQ(exchanges[1].params.headers.at("X-PsiCash-Auth"), "scrubbed-token-1,scrubbed-token-2");
+    ASSERT_EQ(exchanges[1].result.body, "tokens:scrubbed-token-1,scrubbed-token-2");
+    ASSERT_EQ(exchanges[1].result.date, "Mon, 14 Jan 2019 17:22:23 GMT");
+}
+
+TEST_F(TestHTTPRecorder, SaveLoadReplay)
+{
+    HTTPRecorder recorder(FakeServer);
+    auto requester = recorder.Requester();
+    (void)requester(MakeParams("/v1/tracker", ""));
+    (void)requester(MakeParams("/v1/refresh-state", "realearner,realspender"));
+
+    auto file_path = GetTempDir() + "/recording.jsonl";
+    auto err = recorder.Save(file_path);
+    ASSERT_FALSE(err) << err;
+
+    auto loaded = HTTPReplayer::Load(file_path);
+    ASSERT_TRUE(loaded) << loaded.error();
+    ASSERT_EQ(loaded->size(), 2);
+    ASSERT_EQ(json(*loaded), json(recorder.Exchanges()));
+
+    HTTPReplayer replayer(*loaded);
+    auto replay = replayer.Requester();
+    ASSERT_EQ(replayer.Remaining(), 2);
+
+    auto result = replay(MakeParams("/v1/tracker", ""));
+    ASSERT_EQ(result.code, 200);
+    ASSERT_EQ(result.body, (*loaded)[0].result.body);
+
+    result = replay(MakeParams("/v1/refresh-state", "whatever"));
+    ASSERT_EQ(result.code, 200);
+    ASSERT_EQ(result.body, (*loaded)[1].result.body);
+    ASSERT_EQ(replayer.Remaining(), 0);
+
+    // Exhausted
+    result = replay(MakeParams("/v1/refresh-state", ""));
+    ASSERT_EQ(result.code, HTTPResult::CRITICAL_ERROR);
+    ASSERT_FALSE(result.error.empty());
+
+    // Mismatch
+    replayer.Rewind();
+    result = replay(MakeParams("/v1/refresh-state", ""));
+    ASSERT_EQ(result.code, HTTPResult::CRITICAL_ERROR);
+    ASSERT_NE(result.error.find("mismatch"), string::npos);
+}
+
+TEST_F(TestHTTPRecorder, LoadFail)
+{
+    auto loaded = HTTPReplayer::Load(GetTempDir() + "/nonexistent");
+    ASSERT_FALSE(loaded);
+
+    auto file_path = GetTempDir() + "/bad.jsonl";
+    ofstream f(file_path);
+    f << "nonsense" << endl;
+    f.close();
+    loaded = HTTPReplayer::Load(file_path);
+    ASSERT_FALSE(loaded);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include "lock_profiler.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Intentionally leaked, to avoid destruction-order problems at exit.
+mutex& BySiteMutex() {
+    static auto m = new mutex();
+    return *m;
+}
+map<string, psicash::lock_profiler::SiteStats>& BySiteMap() {
+    static auto m = new map<string, psicash::lock_profiler::SiteStats>();
+    return *m;
+}
+
+} // namespace
+
+namespace psicash {
+namespace lock_profiler {
+
+constexpr size_t Histogram::kBuckets;
+
+void Histogram::Add(microseconds d) {
+    uint64_t us = d.count() > 0 ? d.count() : 0;
+
+    size_t bucket = 0;
+    for (auto v = us; v > 0 && bucket < kBuckets - 1; v >>= 1) {
+        bucket++;
+    }
+
+    count++;
+    total_us += us;
+    max_us = max(max_us, us);
+    buckets[bucket]++;
+}
+
+bool Enabled() {
+#ifdef PSICASH_LOCK_PROFILING
+    return true;
+#else
+    return false;
+#endif
+}
+
+map<string, SiteStats> BySite() {
+    lock_guard<mutex> lock(BySiteMutex());
+    return BySiteMap();
+}
+
+void Reset() {
+    lock_guard<mutex> lock(BySiteMutex());
+    BySiteMap().clear();
+}
+
+Lock::Lock(recursive_mutex& m, const char* site)
+        : site_(site), lock_(m, defer_lock) {
+    for (auto p = site; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            site_ = p + 1;
+        }
+    }
+
+    auto start = steady_clock::now();
+    lock_.lock();
+    acquired_ = steady_clock::now();
+    wait_ = duration_cast<microseconds>(acquired_ - start);
+}
+
+Lock::Lock(Lock&& other)
+        : site_(other.site_), lock_(std::move(other.lock_)), wait_(other.wait_),
+          acquired_(other.acquired_) {
+}
+
+Lock::~Lock() {
+    unlock();
+}
+
+void Lock::unlock() {
+    if (!lock_.owns_lock()) {
+        return;
+    }
+
+    auto hold = duration_cast<microseconds>(steady_clock::now() - acquired_);
+    lock_.unlock();
+
+    // Recorded after unlocking, so the bookkeeping isn't counted as hold time.
+    lock_guard<mutex> lock(BySiteMutex());
+    auto& stats = BySiteMap()[site_];
+    stats.wait.Add(wait_);
+    stats.hold.Add(hold);
+}
+
+} // namespace lock_profiler
+} // namespace psicash
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_LOCK_PROFILER_H
+#define PSICASHLIB_LOCK_PROFILER_H
+
+#include <string>
+#include <map>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <cstdint>
+
+namespace psicash {
+namespace lock_profiler {
+
+// Lock profiling is only used by the SYNCHRONIZE macros (see utils.hpp) when
+// the library is built with PSICASH_LOCK_PROFILING defined (the CMake option of the
+// same name). Lock itself always records, so it can be used and tested directly.
+
+/// A histogram of durations. Bucket 0 counts durations under 1us; bucket i (for i > 0)
+/// counts durations in [2^(i-1), 2^i) us. The last bucket also counts everything longer.
+struct Histogram {
+    static constexpr size_t kBuckets = 26; // the last bucket starts at ~16s
+
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    std::array<uint64_t, kBuckets> buckets;
+
+    void Add(std::chrono::microseconds d);
+};
+
+struct SiteStats {
+    /// Time spent waiting to acquire the lock.
+    Histogram wait;
+    /// Time the lock was held, including time spent in nested (recursive) acquisitions.
+    Histogram hold;
+};
+
+/// Returns true if the library was built with lock profiling.
+bool Enabled();
+
+/// Returns the stats for each call site so far, by call site name.
+std::map<std::string, SiteStats> BySite();
+
+/// Clears all stats.
+void Reset();
+
+/// A unique_lock on a recursive_mutex that records its wait and hold times against
+/// `site`, which must be a string literal (or otherwise outlive the process). A leading
+/// path, as in a `__FILE__`, is dropped from the site.
+class Lock {
+public:
+    Lock(std::recursive_mutex& m, const char* site);
+    Lock(Lock&& other);
+    ~Lock();
+
+    Lock(const Lock&) = delete;
+    Lock& operator=(const Lock&) = delete;
+
+    explicit operator bool() const { return lock_.owns_lock(); }
+    void unlock();
+
+private:
+    const char* site_;
+    std::unique_lock<std::recursive_mutex> lock_;
+    std::chrono::microseconds wait_;
+    std::chrono::steady_clock::time_point acquired_;
+};
+
+} // namespace lock_profiler
+} // namespace psicash
+
+#endif //PSICASHLIB_LOCK_PROFILER_H
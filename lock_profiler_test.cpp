@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <thread>
+#include <atomic>
+
+#include "gtest/gtest.h"
+#include "lock_profiler.hpp"
+#include "utils.hpp"
+
+using namespace std;
+using namespace psicash;
+
+class TestLockProfiler : public ::testing::Test
+{
+  public:
+    TestLockProfiler() {
+        lock_profiler::Reset();
+    }
+};
+
+TEST_F(TestLockProfiler, Histogram)
+{
+    lock_profiler::Histogram h = {};
+    h.Add(chrono::microseconds(0));
+    h.Add(chrono::microseconds(1));
+    h.Add(chrono::microseconds(3));
+    h.Add(chrono::microseconds(1000));
+    h.Add(chrono::hours(1));
+
+    ASSERT_EQ(h.count, 5);
+    ASSERT_EQ(h.max_us, 3600000000ULL);
+    ASSERT_EQ(h.buckets[0], 1);
+    ASSERT_EQ(h.buckets[1], 1);
+    ASSERT_EQ(h.buckets[2], 1);
+    ASSERT_EQ(h.buckets[10], 1); // [512, 1024)
+    ASSERT_EQ(h.buckets[lock_profiler::Histogram::kBuckets - 1], 1);
+}
+
+TEST_F(TestLockProfiler, Contention)
+{
+    recursive_mutex m;
+    atomic<bool> holding(false);
+
+    thread holder([&] {
+        lock_profiler::Lock lock(m, "holder");
+        holding = true;
+        this_thread::sleep_for(chrono::milliseconds(50));
+    });
+
+    while (!holding) {
+        this_thread::yield();
+    }
+    {
+        lock_profiler::Lock lock(m, "waiter");
+        ASSERT_TRUE(lock);
+
+        // Recursive acquisitions are recorded separately.
+        lock_profiler::Lock inner(m, "inner");
+        inner.unlock();
+        ASSERT_FALSE(inner);
+    }
+    holder.join();
+
+    auto by_site = lock_profiler::BySite();
+    ASSERT_EQ(by_site.size(), 3);
+    ASSERT_EQ(by_site["holder"].hold.count, 1);
+    ASSERT_GE(by_site["holder"].hold.max_us, 40000);
+    ASSERT_EQ(by_site["waiter"].wait.count, 1);
+    ASSERT_GE(by_site["waiter"].wait.max_us, 20000);
+    ASSERT_EQ(by_site["inner"].hold.count, 1);
+}
+
+TEST_F(TestLockProfiler, Synchronize)
+{
+    recursive_mutex m;
+    const int line = __LINE__;
+    for (int i = 0; i < 2; i++) {
+        SYNCHRONIZE(m);
+    }
+    SYNCHRONIZE_BLOCK(m) {
+    }
+    {
+        auto lock = SYNCHRONIZE_LOCK(m);
+        ASSERT_TRUE(lock);
+    }
+
+    auto by_site = lock_profiler::BySite();
+    if (!lock_profiler::Enabled()) {
+        ASSERT_EQ(by_site.size(), 0);
+        return;
+    }
+
+    // Each site is its own, named by file (without the directory) and line.
+    ASSERT_EQ(by_site.size(), 3);
+    ASSERT_EQ(by_site[utils::Stringer("lock_profiler_test.cpp:", line + 2)].hold.count, 2);
+    ASSERT_EQ(by_site[utils::Stringer("lock_profiler_test.cpp:", line + 4)].hold.count, 1);
+    ASSERT_EQ(by_site[utils::Stringer("lock_profiler_test.cpp:", line + 7)].hold.count, 1);
+}
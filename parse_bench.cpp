@@ -0,0 +1,106 @@
+/*
+ * Compares the JSON parsers available to response_parser.hpp on typical API responses
+ * and a datastore-sized document. simdjson is only included if the library was built
+ * with PSICASH_USE_SIMDJSON.
+ *
+ * Usage: parse_bench [--iterations=N]
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench_helpers.hpp"
+#include "response_parser.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+static string RefreshStateBody() {
+    json prices = json::array();
+    for (const auto& d : {"1hr", "2hr", "3hr", "24hr", "7day", "30day"}) {
+        prices.push_back({{"Class", "speed-boost"}, {"Distinguisher", d}, {"Price", 100}});
+    }
+    return json({{"TokensValid", {{"earner", true}, {"spender", true}, {"indicator", true}}},
+                 {"IsAccount", false},
+                 {"Balance", 1000},
+                 {"PurchasePrices", prices}}).dump();
+}
+
+static string TransactionBody() {
+    return json({{"TransactionID", "01234567890123456789"},
+                 {"TransactionAmount", -100},
+                 {"Balance", 900},
+                 {"Authorization", string(400, 'A')},
+                 {"TransactionResponse", {{"Type", "expiring-purchase"},
+                                          {"Values", {{"Expires", "2019-01-14T17:22:23.168764129Z"}}}}}}).dump();
+}
+
+// Roughly the shape of a datastore with many purchases.
+static string DatastoreDocument() {
+    json purchases = json::array();
+    for (int i = 0; i < 500; i++) {
+        purchases.push_back({{"id", "transaction-" + to_string(i)},
+                             {"class", "speed-boost"},
+                             {"distinguisher", "1hr"},
+                             {"serverTimeExpiry", "2019-01-14T17:22:23.168Z"},
+                             {"localTimeExpiry", "2019-01-14T17:22:23.168Z"}});
+    }
+    return json({{"v", 1},
+                 {"authTokens", {{"earner", string(44, 'e')}, {"spender", string(44, 's')}}},
+                 {"balance", 123456},
+                 {"purchases", purchases}}).dump();
+}
+
+int main(int argc, char** argv) {
+    int iterations = 10000;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--iterations=") == 0) {
+            iterations = atoi(arg.c_str() + strlen("--iterations="));
+        }
+    }
+
+    vector<pair<string, JSONParser>> parsers = {{"nlohmann", JSONParser::Nlohmann}};
+    if (JSONParserAvailable(JSONParser::Simdjson)) {
+        parsers.push_back({"simdjson", JSONParser::Simdjson});
+    }
+
+    auto refresh_body = RefreshStateBody();
+    auto transaction_body = TransactionBody();
+    auto datastore_doc = DatastoreDocument();
+    size_t failures = 0;
+
+    bench::OpStats stats;
+    for (const auto& p : parsers) {
+        for (int i = 0; i < iterations; i++) {
+            failures += !bench::Measure(stats, "refresh-state/" + p.first, [&] {
+                return ParseRefreshStateResponse(refresh_body, p.second);
+            });
+            failures += !bench::Measure(stats, "transaction/" + p.first, [&] {
+                return ParseTransactionResponse(transaction_body, p.second);
+            });
+        }
+        // The datastore document is much bigger, so fewer iterations.
+        for (int i = 0; i < iterations / 100 + 1; i++) {
+            failures += !bench::Measure(stats, "datastore/" + p.first, [&] {
+                return ParseJSONDocument(datastore_doc, p.second);
+            });
+        }
+    }
+
+    if (failures) {
+        cerr << failures << " parse failures" << endl;
+        return 1;
+    }
+
+    cout << "iterations: " << iterations << "; datastore bytes: " << datastore_doc.size() << endl;
+    stats.Print(cout);
+
+    return 0;
+}
@@ -21,7 +21,6 @@
 #include <iostream>
 #include <sstream>
 #include <chrono>
-#include <thread>
 #include <algorithm>
 #include "psicash.hpp"
 #include "userdata.hpp"
@@ -30,6 +29,14 @@
 #include "url.hpp"
 #include "base64.hpp"
 #include "utils.hpp"
+#include "alloc_counter.hpp"
+#include "lock_profiler.hpp"
+#include "request_hedger.hpp"
+#include "refresh_scheduler.hpp"
+#include "response_parser.hpp"
+#include "flight_recorder.hpp"
+#include "strand.hpp"
+#include "revalidator.hpp"
 #include "http_status_codes.h"
 
 #include "vendor/nlohmann/json.hpp"
@@ -70,6 +77,9 @@ static constexpr const char* kAPIServerVersion = "v1";
 static const string kLandingPageParamKey = "psicash";
 static constexpr const char* kMethodGET = "GET";
 static constexpr const char* kMethodPOST = "POST";
+static constexpr const char* kUserAgentHeader = "User-Agent";
+static constexpr const char* kAuthHeader = "X-PsiCash-Auth";
+static constexpr const char* kMetadataHeader = "X-PsiCash-Metadata";
 
 //
 // PsiCash class implementation
@@ -79,15 +89,58 @@ static constexpr const char* kMethodPOST = "POST";
 constexpr int HTTPResult::CRITICAL_ERROR;
 constexpr int HTTPResult::RECOVERABLE_ERROR;
 
+static const vector<pair<string, string>> kNoQueryParams;
+
+HTTPRequestRef::HTTPRequestRef()
+        : port(0), headers(nullptr), header_count(0), query_params(&kNoQueryParams) {
+}
+
+HTTPParams HTTPRequestRef::ToHTTPParams() const {
+    HTTPParams params;
+    params.scheme = scheme.str();
+    params.hostname = hostname.str();
+    params.port = port;
+    params.method = method.str();
+    params.path = path.str();
+    for (size_t i = 0; i < header_count; i++) {
+        params.headers[headers[i].name.str()] = headers[i].value.str();
+    }
+    if (query_params) {
+        params.query = *query_params;
+    }
+    return params;
+}
+
+// Wraps an HTTPParams requester so that it can be used where an HTTPRequestRef one is.
+static MakeHTTPRequestRefFn AdaptHTTPRequestFn(MakeHTTPRequestFn make_http_request_fn) {
+    if (!make_http_request_fn) {
+        return nullptr;
+    }
+    return [make_http_request_fn](const HTTPRequestRef& req) {
+        return make_http_request_fn(req.ToHTTPParams());
+    };
+}
+
 PsiCash::PsiCash()
-        : server_port_(0), make_http_request_fn_(nullptr) {
+        : server_port_(0), make_http_request_fn_(nullptr), has_requester_(false),
+          purchase_preflight_(false),
+          tracker_provisioning_(false),
+          flight_recorder_(std::make_unique<FlightRecorder>()),
+          strand_(std::make_unique<Strand>()),
+          revalidator_(std::make_unique<Revalidator>()),
+          tracker_provisioner_(std::make_unique<Revalidator>()) {
 }
 
 PsiCash::~PsiCash() {
+    // Stop background refreshes before anything they use is destroyed.
+    refresh_scheduler_.reset();
+    revalidator_.reset();
+    tracker_provisioner_.reset();
 }
 
 Error PsiCash::Init(const char* user_agent, const char* file_store_root,
               MakeHTTPRequestFn make_http_request_fn, bool test) {
+    ALLOC_COUNT_SCOPE();
     if (test) {
         server_scheme_ = dev::kAPIServerScheme;
         server_hostname_ = dev::kAPIServerHostname;
@@ -107,7 +160,8 @@ Error PsiCash::Init(const char* user_agent, const char* file_store_root,
     }
 
     // May still be null.
-    make_http_request_fn_ = make_http_request_fn;
+    make_http_request_fn_ = AdaptHTTPRequestFn(make_http_request_fn);
+    has_requester_ = !!make_http_request_fn_;
 
     user_data_ = std::make_unique<UserData>();
     auto err = user_data_->Init(file_store_root);
@@ -120,14 +174,171 @@ Error PsiCash::Init(const char* user_agent, const char* file_store_root,
         }
     }
 
+    flight_recorder_->Load(user_data_->GetSlowOperations());
+
     return nullerr;
 }
 
 void PsiCash::SetHTTPRequestFn(MakeHTTPRequestFn make_http_request_fn) {
-    make_http_request_fn_ = make_http_request_fn;
+    SetHTTPRequestRefFn(AdaptHTTPRequestFn(make_http_request_fn));
+}
+
+void PsiCash::SetHTTPRequestRefFn(MakeHTTPRequestRefFn make_http_request_fn) {
+    // Don't change the requester under an operation that may be using it (such as a
+    // background tracker provisioning).
+    auto set = [&] {
+        Strand::Turn turn(*strand_);
+        make_http_request_fn_ = make_http_request_fn;
+        has_requester_ = !!make_http_request_fn_;
+    };
+
+    SYNCHRONIZE(refresh_scheduler_mutex_);
+    if (!refresh_scheduler_) {
+        set();
+        MaybeProvisionTracker();
+        return;
+    }
+
+    // Don't change the requester under a background refresh, and resume refreshing
+    // if it was paused for lack of a requester. (The scheduler's lock is taken before
+    // the strand, as a background refresh does.)
+    refresh_scheduler_->Exclusive(set);
+    MaybeProvisionTracker();
+    if (has_requester_) {
+        refresh_scheduler_->Nudge();
+    }
+}
+
+void PsiCash::StartRefreshScheduler(const RefreshSchedulerConfig& config) {
+    SYNCHRONIZE(refresh_scheduler_mutex_);
+    refresh_scheduler_.reset();
+
+    // The callbacks use the user data.
+    if (!user_data_) {
+        return;
+    }
+
+    // Just the state that RefreshState retrieves, to tell whether a refresh changed it.
+    struct Snapshot {
+        TokenTypes valid_token_types;
+        bool is_account;
+        int64_t balance;
+        PurchasePrices purchase_prices;
+
+        bool operator==(const Snapshot& other) const {
+            return valid_token_types == other.valid_token_types &&
+                   is_account == other.is_account &&
+                   balance == other.balance &&
+                   purchase_prices == other.purchase_prices;
+        }
+    };
+    auto snapshot = [this] {
+        return Snapshot{ValidTokenTypes(), IsAccount(), Balance(), GetPurchasePrices()};
+    };
+
+    RefreshScheduler::Callbacks callbacks;
+    callbacks.refresh = [this, snapshot, config] {
+        auto before = snapshot();
+        auto res = RefreshState(config.purchase_classes);
+        if (!res || *res == Status::ServerError) {
+            return RefreshScheduler::Outcome::kFailed;
+        }
+        return snapshot() == before ? RefreshScheduler::Outcome::kUnchanged
+                                    : RefreshScheduler::Outcome::kChanged;
+    };
+    callbacks.available = [this] {
+        return has_requester_.load();
+    };
+    callbacks.time_until_next_expiry = [this]() -> optional<chrono::milliseconds> {
+        auto next = user_data_->GetNextExpiringPurchase();
+        if (!next || !next->local_time_expiry) {
+            return nullopt;
+        }
+        return next->local_time_expiry->Diff(datetime::DateTime::Now());
+    };
+
+    refresh_scheduler_ = std::make_unique<RefreshScheduler>(config, callbacks);
+}
+
+void PsiCash::StopRefreshScheduler() {
+    SYNCHRONIZE(refresh_scheduler_mutex_);
+    refresh_scheduler_.reset();
+}
+
+void PsiCash::NudgeRefreshScheduler() const {
+    SYNCHRONIZE(refresh_scheduler_mutex_);
+    if (refresh_scheduler_) {
+        refresh_scheduler_->Nudge();
+    }
+}
+
+void PsiCash::SetPurchasePreflight(bool enabled) {
+    purchase_preflight_ = enabled;
+}
+
+void PsiCash::SetTrackerProvisioning(bool enabled) {
+    tracker_provisioning_ = enabled;
+    MaybeProvisionTracker();
+}
+
+void PsiCash::MaybeProvisionTracker() {
+    if (!tracker_provisioning_ || !has_requester_ || !user_data_ ||
+        !user_data_->GetAuthTokens().empty() || user_data_->GetIsAccount()) {
+        return;
+    }
+
+    tracker_provisioner_->Revalidate([this]() -> Result<Status> {
+        FlightRecorder::Op op(*flight_recorder_, "ProvisionTracker");
+        // A RefreshState that got its turn first may have gotten the tokens already.
+        Strand::Turn turn(*strand_);
+        if (!user_data_->GetAuthTokens().empty() || user_data_->GetIsAccount()) {
+            (void)op.Finish((int)Status::Success);
+            return Status::Success;
+        }
+        auto result = NewTracker();
+        if (op.Finish(result ? (int)*result : FlightRecorder::kStatusError)) {
+            StoreSlowOperations();
+        }
+        return result;
+    }, nullptr);
+}
+
+void PsiCash::SetSlowOperationThreshold(std::chrono::milliseconds threshold) {
+    flight_recorder_->SetThreshold(threshold);
+}
+
+// Called after an operation is recorded, so the recorder's entries survive a restart.
+// They aren't worth a write of their own, so they go out with the next one.
+void PsiCash::StoreSlowOperations() {
+    (void)user_data_->SetSlowOperations(flight_recorder_->ToJSON());
+}
+
+void PsiCash::SetRequestHedging(const HedgingConfig* config) {
+    std::unique_ptr<RequestHedger> hedger;
+    if (config) {
+        hedger = std::make_unique<RequestHedger>(*config);
+    }
+
+    // As with the requester, don't swap the hedger under a request that may be using it.
+    auto swap = [&] {
+        Strand::Turn turn(*strand_);
+        request_hedger_.swap(hedger);
+    };
+    SYNCHRONIZE_BLOCK(refresh_scheduler_mutex_) {
+        if (refresh_scheduler_) {
+            refresh_scheduler_->Exclusive(swap);
+        } else {
+            swap();
+        }
+    }
+
+    // The old hedger (now in `hedger`) waits for any losing requests when destroyed,
+    // which needn't hold up other calls.
 }
 
 Error PsiCash::SetRequestMetadataItem(const string& key, const string& value) {
+    ALLOC_COUNT_SCOPE();
+    Strand::Turn turn(*strand_);
     return PassError(user_data_->SetRequestMetadataItem(key, value));
 }
 
@@ -136,6 +347,7 @@ Error PsiCash::SetRequestMetadataItem(const string& key, const string& value) {
 //
 
 TokenTypes PsiCash::ValidTokenTypes() const {
+    ALLOC_COUNT_SCOPE();
     TokenTypes tt;
 
     auto auth_tokens = user_data_->GetAuthTokens();
@@ -158,92 +370,171 @@ PurchasePrices PsiCash::GetPurchasePrices() const {
     return user_data_->GetPurchasePrices();
 }
 
+optional<datetime::Duration> PsiCash::StoredStateAge() const {
+    auto last_refresh = user_data_->GetLastRefresh();
+    if (!last_refresh) {
+        return nullopt;
+    }
+    return datetime::DateTime::Now().Diff(*last_refresh);
+}
+
+bool PsiCash::RevalidateIfStale(const optional<datetime::Duration>& age,
+                                chrono::milliseconds max_age,
+                                const vector<string>& purchase_classes,
+                                const Revalidator::DoneFn& done) {
+    // A negative age means the clock has moved back since the refresh.
+    if (age && *age <= max_age && *age >= datetime::Duration::zero()) {
+        return false;
+    }
+    if (!has_requester_) {
+        return false;
+    }
+
+    revalidator_->Revalidate([this, purchase_classes] { return RefreshState(purchase_classes); },
+                             done);
+    return true;
+}
+
+StoredValue<int64_t> PsiCash::BalanceWithRevalidation(
+        chrono::milliseconds max_age, RevalidatedFn<int64_t> on_revalidated) {
+    ALLOC_COUNT_SCOPE();
+    StoredValue<int64_t> stored;
+    stored.value = Balance();
+    stored.age = StoredStateAge();
+
+    // Ask for the prices that are already stored, so that they aren't cleared.
+    vector<string> purchase_classes;
+    for (const auto& pp : GetPurchasePrices()) {
+        if (std::find(purchase_classes.begin(), purchase_classes.end(), pp.transaction_class) == purchase_classes.end()) {
+            purchase_classes.push_back(pp.transaction_class);
+        }
+    }
+
+    Revalidator::DoneFn done;
+    if (on_revalidated) {
+        done = [this, on_revalidated](const Result<Status>& result) {
+            on_revalidated(result, Balance());
+        };
+    }
+    stored.revalidating = RevalidateIfStale(stored.age, max_age, purchase_classes, done);
+    return stored;
+}
+
+StoredValue<PurchasePrices> PsiCash::GetPurchasePricesWithRevalidation(
+        const vector<string>& purchase_classes,
+        chrono::milliseconds max_age, RevalidatedFn<PurchasePrices> on_revalidated) {
+    ALLOC_COUNT_SCOPE();
+    StoredValue<PurchasePrices> stored;
+    stored.value = GetPurchasePrices();
+    stored.age = StoredStateAge();
+
+    Revalidator::DoneFn done;
+    if (on_revalidated) {
+        done = [this, on_revalidated](const Result<Status>& result) {
+            on_revalidated(result, GetPurchasePrices());
+        };
+    }
+    stored.revalidating = RevalidateIfStale(stored.age, max_age, purchase_classes, done);
+    return stored;
+}
+
 Purchases PsiCash::GetPurchases() const {
+    ALLOC_COUNT_SCOPE();
     return user_data_->GetPurchases();
 }
 
-static bool IsExpired(const Purchase& p) {
+Purchases PsiCash::ActivePurchases() const {
+    ALLOC_COUNT_SCOPE();
     // Note that "expired" is decided using local time.
+    return user_data_->GetPurchases(PurchaseExpiry::kActive, datetime::DateTime::Now());
+}
+
+Authorizations PsiCash::GetAuthorizations(bool activeOnly/*=false*/) const {
+    ALLOC_COUNT_SCOPE();
+    auto expiry = activeOnly ? PurchaseExpiry::kActive : PurchaseExpiry::kAny;
     auto local_now = datetime::DateTime::Now();
-    return (p.local_time_expiry && *p.local_time_expiry < local_now);
+    Authorizations res;
+    res.reserve(user_data_->CountPurchases(expiry, local_now, true));
+    user_data_->ForEachPurchase(expiry, local_now, true, [&res](const Purchase& p) {
+        res.push_back(*p.authorization);
+        return true;
+    });
+    return res;
 }
 
-Purchases PsiCash::ActivePurchases() const {
+AuthorizationBundle PsiCash::GetActiveAuthorizationBundle() const {
+    ALLOC_COUNT_SCOPE();
+    return user_data_->GetActiveAuthorizationBundle(datetime::DateTime::Now());
+}
+
+Purchases PsiCash::GetPurchasesByAuthorizationID(std::vector<std::string> authorization_ids) const {
+    ALLOC_COUNT_SCOPE();
     Purchases res;
-    for (const auto& p : user_data_->GetPurchases()) {
-        if (!IsExpired(p)) {
+    user_data_->ForEachPurchase(PurchaseExpiry::kAny, datetime::DateTime::Now(), true,
+            [&res, &authorization_ids](const Purchase& p) {
+        if (std::find(authorization_ids.begin(), authorization_ids.end(), p.authorization->id) != authorization_ids.end()) {
             res.push_back(p);
         }
-    }
+        return true;
+    });
     return res;
 }
 
-Authorizations PsiCash::GetAuthorizations(bool activeOnly/*=false*/) const {
-    Authorizations res;
-    for (const auto& p : user_data_->GetPurchases()) {
-        if (p.authorization && (!activeOnly || !IsExpired(p))) {
-            res.push_back(*p.authorization);
-        }
-    }
-    return res;
+void PsiCash::ForEachPurchase(PurchaseExpiry expiry, PurchaseVisitor visit) const {
+    ALLOC_COUNT_SCOPE();
+    user_data_->ForEachPurchase(expiry, datetime::DateTime::Now(), false, visit);
 }
 
-Purchases PsiCash::GetPurchasesByAuthorizationID(std::vector<std::string> authorization_ids) const {
-    auto purchases = user_data_->GetPurchases();
+size_t PsiCash::CountPurchases(PurchaseExpiry expiry) const {
+    ALLOC_COUNT_SCOPE();
+    return user_data_->CountPurchases(expiry, datetime::DateTime::Now());
+}
 
-    auto new_end = std::remove_if(purchases.begin(), purchases.end(), [&authorization_ids](const Purchase& p){
-        return !p.authorization
-            || std::find(authorization_ids.begin(), authorization_ids.end(), p.authorization->id) == authorization_ids.end();
+bool PsiCash::HasActivePurchase(const string& transaction_class,
+                                const string& distinguisher/*=""*/) const {
+    ALLOC_COUNT_SCOPE();
+    bool found = false;
+    user_data_->ForEachPurchase(PurchaseExpiry::kActive, datetime::DateTime::Now(), false,
+            [&](const Purchase& p) {
+        found = p.transaction_class == transaction_class &&
+                (distinguisher.empty() || p.distinguisher == distinguisher);
+        return !found;
     });
-
-    purchases.erase(new_end, purchases.end());
-
-    return purchases;
+    return found;
 }
 
 optional<Purchase> PsiCash::NextExpiringPurchase() const {
-    optional<Purchase> next;
-    for (const auto& p : user_data_->GetPurchases()) {
-        // We're using server time, since we're not comparing to local now (because we're
-        // not checking to see if the purchase is expired -- just which expires next).
-        if (!p.server_time_expiry) {
-            continue;
-        }
-
-        if (!next) {
-            // We haven't yet set a next.
-            next = p;
-            continue;
-        }
-
-        if (p.server_time_expiry < next->server_time_expiry) {
-            next = p;
-        }
-    }
-
-    return next;
+    ALLOC_COUNT_SCOPE();
+    // This uses server time, since we're not comparing to local now (because we're
+    // not checking to see if the purchase is expired -- just which expires next).
+    return user_data_->GetNextExpiringPurchase();
 }
 
 Result<Purchases> PsiCash::ExpirePurchases() {
-    auto all_purchases = GetPurchases();
-    Purchases expired_purchases, valid_purchases;
-    for (const auto& p : all_purchases) {
-        if (IsExpired(p)) {
-            expired_purchases.push_back(p);
-        } else {
-            valid_purchases.push_back(p);
+    ALLOC_COUNT_SCOPE();
+    FlightRecorder::Op op(*flight_recorder_, "ExpirePurchases");
+    Strand::Turn turn(*strand_);
+    // Both sets must be decided against the same "now".
+    auto local_now = datetime::DateTime::Now();
+    auto expired_purchases = user_data_->GetPurchases(PurchaseExpiry::kExpired, local_now);
+    if (!expired_purchases.empty()) {
+        auto valid_purchases = user_data_->GetPurchases(PurchaseExpiry::kActive, local_now);
+        auto err = user_data_->SetPurchases(valid_purchases);
+        if (err) {
+            return WrapError(err, "SetPurchases failed");
         }
     }
 
-    auto err = user_data_->SetPurchases(valid_purchases);
-    if (err) {
-        return WrapError(err, "SetPurchases failed");
+    if (op.Finish((int)Status::Success)) {
+        StoreSlowOperations();
     }
-
     return expired_purchases;
 }
 
 error::Result<Purchases> PsiCash::RemovePurchases(const vector<TransactionID>& ids) {
+    ALLOC_COUNT_SCOPE();
+    FlightRecorder::Op op(*flight_recorder_, "RemovePurchases");
+    Strand::Turn turn(*strand_);
     auto all_purchases = GetPurchases();
     Purchases remaining_purchases, removed_purchases;
     for (const auto& p : all_purchases) {
@@ -268,10 +559,14 @@ error::Result<Purchases> PsiCash::RemovePurchases(const vector<TransactionID>& i
         return WrapError(err, "SetPurchases failed");
     }
 
+    if (op.Finish((int)Status::Success)) {
+        StoreSlowOperations();
+    }
     return removed_purchases;
 }
 
 Result<string> PsiCash::ModifyLandingPage(const string& url_string) const {
+    ALLOC_COUNT_SCOPE();
     URL url;
     auto err = url.Parse(url_string);
     if (err) {
@@ -320,6 +615,7 @@ Result<string> PsiCash::ModifyLandingPage(const string& url_string) const {
 }
 
 Result<string> PsiCash::GetRewardedActivityData() const {
+    ALLOC_COUNT_SCOPE();
     /*
      The data is base64-encoded JSON-serialized with this structure:
      {
@@ -360,10 +656,14 @@ Result<string> PsiCash::GetRewardedActivityData() const {
 
     json_data = base64::B64Encode(json_data);
 
+    // The rewarded activity will probably change the balance.
+    NudgeRefreshScheduler();
+
     return json_data;
 }
 
 json PsiCash::GetDiagnosticInfo() const {
+    ALLOC_COUNT_SCOPE();
     // NOTE: Do not put personal identifiers in this package.
     // TODO: This is still enough info to uniquely identify the user (combined with the
     // PsiCash DB). So maybe avoiding direct PII does not achieve anything, and we should
@@ -377,6 +677,8 @@ json PsiCash::GetDiagnosticInfo() const {
     j["balance"] = Balance();
     j["serverTimeDiff"] = user_data_->GetServerTimeDiff().count(); // in milliseconds
     j["purchasePrices"] = GetPurchasePrices();
+    j["datastoreDroppedRecords"] = user_data_->DatastoreDroppedRecords();
+    j["slowOperations"] = flight_recorder_->ToJSON();
 
     // Include a sanitized version of the purchases
     j["purchases"] = json::array();
@@ -385,6 +687,40 @@ json PsiCash::GetDiagnosticInfo() const {
                                   {"distinguisher", p.distinguisher}});
     }
 
+    if (alloc_counter::Enabled()) {
+        // Per-call allocation counts, if this is an instrumented build.
+        j["allocations"] = json::object();
+        for (const auto& it : alloc_counter::ByCall()) {
+            j["allocations"][it.first] = {{"calls",  it.second.calls},
+                                          {"allocs", it.second.allocs},
+                                          {"bytes",  it.second.bytes}};
+        }
+    }
+
+    if (request_hedger_) {
+        auto stats = request_hedger_->Stats();
+        j["hedging"] = {{"requests",        stats.requests},
+                        {"hedged",          stats.hedged},
+                        {"hedgeWins",       stats.hedge_wins},
+                        {"budgetExhausted", stats.budget_exhausted},
+                        {"delayMs",         request_hedger_->HedgeDelay().count()}};
+    }
+
+    if (lock_profiler::Enabled()) {
+        // Per-call-site lock wait and hold times, if this is an instrumented build.
+        auto histogram_json = [](const lock_profiler::Histogram& h) {
+            return json{{"count",   h.count},
+                        {"totalUs", h.total_us},
+                        {"maxUs",   h.max_us},
+                        {"buckets", h.buckets}};
+        };
+        j["locks"] = json::object();
+        for (const auto& it : lock_profiler::BySite()) {
+            j["locks"][it.first] = {{"wait", histogram_json(it.second.wait)},
+                                    {"hold", histogram_json(it.second.hold)}};
+        }
+    }
+
     return j;
 }
 
@@ -397,6 +733,18 @@ inline bool IsServerError(int code) {
     return code >= 500 && code <= 599;
 }
 
+// Formats name-value pairs as a URL-encoded query string (without a leading "?").
+static string FormatQuery(const vector<pair<string, string>>& query_params) {
+    string query;
+    for (const auto& qp : query_params) {
+        if (!query.empty()) {
+            query += "&";
+        }
+        query += URL::Encode(qp.first, false) + "=" + URL::Encode(qp.second, false);
+    }
+    return query;
+}
+
 // Makes an HTTP request (with possible retries).
 // HTTPResult.error will always be empty on a non-error return.
 Result<HTTPResult> PsiCash::MakeHTTPRequestWithRetry(
@@ -407,23 +755,87 @@ Result<HTTPResult> PsiCash::MakeHTTPRequestWithRetry(
         throw std::runtime_error("make_http_request_fn_ must be set before requests are attempted");
     }
 
+    FlightRecorder::AddRequest();
+    FlightRecorder::PhaseTimer build_timer(FlightRecorder::Phase::kBuild);
+
+    // Everything but the metadata header (which includes the attempt number) is the
+    // same for every attempt, so is only built once. `req` borrows from these.
+    auto full_path = "/"s + kAPIServerVersion + path;
+    auto query = FormatQuery(query_params);
+
+    string auth_header;
+    if (include_auth_tokens) {
+        for (const auto& at : user_data_->GetAuthTokens()) {
+            if (!auth_header.empty()) {
+                auth_header += ",";
+            }
+            auth_header += at.second;
+        }
+    }
+
+    // The library's headers take precedence over any additional ones. The metadata
+    // header is last, so that it can be updated for each attempt.
+    auto additional_headers = AdditionalRequestHeaders();
+    additional_headers.erase(kUserAgentHeader);
+    additional_headers.erase(kAuthHeader);
+    additional_headers.erase(kMetadataHeader);
+
+    vector<HTTPHeaderRef> headers;
+    headers.reserve(additional_headers.size() + 3);
+    for (const auto& h : additional_headers) {
+        headers.push_back({h.first, h.second});
+    }
+    headers.push_back({kUserAgentHeader, user_agent_});
+    if (include_auth_tokens) {
+        headers.push_back({kAuthHeader, auth_header});
+    }
+    headers.push_back({kMetadataHeader, StringRef()});
+
+    auto metadata = user_data_->GetRequestMetadata();
+    string metadata_header;
+
+    HTTPRequestRef req;
+    req.scheme = server_scheme_;
+    req.hostname = server_hostname_;
+    req.port = server_port_;
+    req.method = method;
+    req.path = full_path;
+    req.query = query;
+    req.query_params = &query_params;
+    req.headers = headers.data();
+    req.header_count = headers.size();
+
     const int max_attempts = 3;
     HTTPResult http_result;
 
     for (int i = 0; i < max_attempts; i++) {
         if (i > 0) {
             // Not the first attempt; wait before retrying
-            this_thread::sleep_for(chrono::seconds(i));
+            datetime::SleepFor(chrono::seconds(i));
+            build_timer.Start();
         }
 
-        auto req_params = BuildRequestParams(
-            method, path, include_auth_tokens, query_params, i + 1, {});
-        if (!req_params) {
-            return WrapError(req_params.error(), "BuildRequestParams failed");
+        metadata["attempt"] = i + 1;
+        try {
+            metadata_header = metadata.dump(-1, ' ', true);
+        }
+        catch (json::exception& e) {
+            return MakeCriticalError(
+                    utils::Stringer("metadata json dump failed: ", e.what(), "; id:", e.id).c_str());
         }
 
+        headers.back().value = metadata_header;
 
-        http_result = make_http_request_fn_(*req_params);
+        build_timer.Stop();
+
+        // GETs are idempotent, so may be hedged.
+        auto attempt_start = chrono::steady_clock::now();
+        if (request_hedger_ && method == kMethodGET) {
+            http_result = request_hedger_->Request(make_http_request_fn_, req);
+        } else {
+            http_result = make_http_request_fn_(req);
+        }
+        FlightRecorder::AddAttempt(chrono::steady_clock::now() - attempt_start, http_result.code);
 
         // Error state sanity check
         if (http_result.code < 0 && http_result.error.empty()) {
@@ -461,51 +873,15 @@ Result<HTTPResult> PsiCash::MakeHTTPRequestWithRetry(
     return http_result;
 }
 
-// Build the request paramters JSON appropriate for passing to make_http_request_fn_.
-Result<HTTPParams> PsiCash::BuildRequestParams(
-        const std::string& method, const std::string& path, bool include_auth_tokens,
-        const std::vector<std::pair<std::string, std::string>>& query_params, int attempt,
-        const std::map<std::string, std::string>& additional_headers) const {
-
-    HTTPParams params;
-
-    params.scheme = server_scheme_;
-    params.hostname = server_hostname_;
-    params.port = server_port_;
-    params.method = method;
-    params.path = "/"s + kAPIServerVersion + path;
-    params.query = query_params;
-
-    params.headers = additional_headers;
-    params.headers["User-Agent"] = user_agent_;
-
-    if (include_auth_tokens) {
-        string s;
-        for (const auto& at : user_data_->GetAuthTokens()) {
-            if (!s.empty()) {
-                s += ",";
-            }
-            s += at.second;
-        }
-        params.headers["X-PsiCash-Auth"] = s;
-    }
-
-    auto metadata = user_data_->GetRequestMetadata();
-    metadata["attempt"] = attempt;
-
-    try {
-        params.headers["X-PsiCash-Metadata"] = metadata.dump(-1, ' ', true);
-    }
-    catch (json::exception& e) {
-        return MakeCriticalError(
-                utils::Stringer("metadata json dump failed: ", e.what(), "; id:", e.id).c_str());
-    }
-
-    return params;
+// Extra headers to include with each request attempt. None by default; overridden
+// for testing.
+map<string, string> PsiCash::AdditionalRequestHeaders() const {
+    return {};
 }
 
 // Get new tracker tokens from the server. This effectively gives us a new identity.
 Result<Status> PsiCash::NewTracker() {
+    ALLOC_COUNT_SCOPE();
     auto result = MakeHTTPRequestWithRetry(
             kMethodPOST,
             "/tracker",
@@ -522,26 +898,20 @@ Result<Status> PsiCash::NewTracker() {
                     utils::Stringer("result has no body; code: ", result->code).c_str());
         }
 
-        AuthTokens auth_tokens;
-        try {
-            auto j = json::parse(result->body);
-
-            auth_tokens = j.get<AuthTokens>();
-        }
-        catch (json::exception& e) {
-            return MakeCriticalError(
-                    utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+        auto auth_tokens = ParseNewTrackerResponse(result->body);
+        if (!auth_tokens) {
+            return WrapError(auth_tokens.error(), "ParseNewTrackerResponse failed");
         }
 
         // Sanity check
-        if (auth_tokens.size() < 3) {
+        if (auth_tokens->size() < 3) {
             return MakeCriticalError(
-                    utils::Stringer("bad number of tokens received: ", auth_tokens.size()).c_str());
+                    utils::Stringer("bad number of tokens received: ", auth_tokens->size()).c_str());
         }
 
         // Set our new data in a single write.
         UserData::WritePauser pauser(*user_data_);
-        (void)user_data_->SetAuthTokens(auth_tokens, false);
+        (void)user_data_->SetAuthTokens(*auth_tokens, false);
         (void)user_data_->SetBalance(0);
         if (auto err = pauser.Unpause()) {
             return WrapError(err, "SetAuthTokens failed");
@@ -557,7 +927,14 @@ Result<Status> PsiCash::NewTracker() {
 }
 
 Result<Status> PsiCash::RefreshState(const std::vector<std::string>& purchase_classes) {
-    return RefreshState(purchase_classes, true);
+    ALLOC_COUNT_SCOPE();
+    FlightRecorder::Op op(*flight_recorder_, "RefreshState");
+    Strand::Turn turn(*strand_);
+    auto result = RefreshState(purchase_classes, true);
+    if (op.Finish(result ? (int)*result : FlightRecorder::kStatusError)) {
+        StoreSlowOperations();
+    }
+    return result;
 }
 
 // RefreshState helper that makes recursive calls (to allow for NewTracker and then
@@ -633,60 +1010,43 @@ Result<Status> PsiCash::RefreshState(
                     utils::Stringer("result has no body; code: ", result->code).c_str());
         }
 
-        try {
-            // We're going to be setting a bunch of UserData values, so let's wait until we're done
-            // to write them all to disk.
-            UserData::WritePauser pauser(*user_data_);
-
-            auto j = json::parse(result->body);
+        auto response = ParseRefreshStateResponse(result->body);
+        if (!response) {
+            return WrapError(response.error(), "ParseRefreshStateResponse failed");
+        }
 
-            auto valid_token_types = j["TokensValid"].get<map<string, bool>>();
-            user_data_->CullAuthTokens(valid_token_types);
+        // We're going to be setting a bunch of UserData values, so let's wait until we're done
+        // to write them all to disk.
+        UserData::WritePauser pauser(*user_data_);
 
-            // If any of our tokens were valid, then the IsAccount value from the
-            // server is authoritative. Otherwise we'll respect our existing value.
-            if (!valid_token_types.empty() && j["IsAccount"].is_boolean()) {
-                // If we have moved from being an account to not being an account,
-                // something is very wrong.
-                auto prev_is_account = IsAccount();
-                auto is_account = j["IsAccount"].get<bool>();
-                if (prev_is_account && !is_account) {
-                    return MakeCriticalError("invalid is-account state");
-                }
+        user_data_->CullAuthTokens(response->tokens_valid);
 
-                user_data_->SetIsAccount(is_account);
+        // If any of our tokens were valid, then the IsAccount value from the
+        // server is authoritative. Otherwise we'll respect our existing value.
+        if (!response->tokens_valid.empty() && response->is_account) {
+            // If we have moved from being an account to not being an account,
+            // something is very wrong.
+            auto prev_is_account = IsAccount();
+            if (prev_is_account && !*response->is_account) {
+                return MakeCriticalError("invalid is-account state");
             }
 
-            if (j["Balance"].is_number_integer()) {
-                user_data_->SetBalance(j["Balance"].get<int64_t>());
-            }
+            user_data_->SetIsAccount(*response->is_account);
+        }
 
-            // We only try to use the PurchasePrices if we supplied purchase classes to the request
-            if (!purchase_classes.empty() && j["PurchasePrices"].is_array()) {
-                PurchasePrices purchase_prices;
-
-                // The from_json for the PurchasePrice struct is for our internal (datastore and library API)
-                // representation of PurchasePrice. We won't assume that the representation used by the
-                // server is the same (nor that it won't change independent of our representation).
-                for (size_t i = 0; i < j["PurchasePrices"].size(); i++) {
-                    const auto& pp = j["PurchasePrices"][i];
-                    purchase_prices.push_back(PurchasePrice{
-                            pp["Class"].get<string>(),
-                            pp["Distinguisher"].get<string>(),
-                            pp["Price"].get<int64_t>()
-                    });
-                }
-
-                user_data_->SetPurchasePrices(purchase_prices);
-            }
+        if (response->balance) {
+            user_data_->SetBalance(*response->balance);
+        }
 
-            if (auto err = pauser.Unpause()) {
-                return WrapError(err, "UserData write failed");
-            }
+        // We only try to use the PurchasePrices if we supplied purchase classes to the request
+        if (!purchase_classes.empty() && response->purchase_prices) {
+            user_data_->SetPurchasePrices(*response->purchase_prices);
         }
-        catch (json::exception& e) {
-            return MakeCriticalError(
-                    utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+
+        user_data_->SetLastRefresh(datetime::DateTime::Now());
+
+        if (auto err = pauser.Unpause()) {
+            return WrapError(err, "UserData write failed");
         }
 
         if (IsAccount()) {
@@ -719,10 +1079,85 @@ Result<Status> PsiCash::RefreshState(
         "request returned unexpected result code: ", result->code).c_str());
 }
 
+// Returns the status that the stored state shows a NewExpiringPurchase request would
+// get, if it shows that it would fail. The checks are those the server makes, in the
+// same order.
+optional<Status> PsiCash::PreflightNewExpiringPurchase(
+        const string& transaction_class,
+        const string& distinguisher,
+        const int64_t expected_price) const {
+    // Without an indicator token, the balance and prices were never retrieved.
+    auto valid_token_types = ValidTokenTypes();
+    if (std::find(valid_token_types.begin(), valid_token_types.end(), kIndicatorTokenType) == valid_token_types.end()) {
+        return nullopt;
+    }
+
+    // Prices are only stored for the classes RefreshState asked for, so only a class
+    // with stored prices says anything about its distinguishers.
+    bool class_found = false;
+    optional<int64_t> price;
+    for (const auto& pp : GetPurchasePrices()) {
+        if (pp.transaction_class == transaction_class) {
+            class_found = true;
+            if (pp.distinguisher == distinguisher) {
+                price = pp.price;
+            }
+        }
+    }
+    if (class_found && !price) {
+        return Status::TransactionTypeNotFound;
+    }
+    if (price && *price != expected_price) {
+        return Status::TransactionAmountMismatch;
+    }
+
+    if (HasActivePurchase(transaction_class)) {
+        return Status::ExistingTransaction;
+    }
+
+    if (Balance() < expected_price) {
+        return Status::InsufficientBalance;
+    }
+
+    return nullopt;
+}
+
 Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
         const string& transaction_class,
         const string& distinguisher,
-        const int64_t expected_price) {
+        const int64_t expected_price,
+        bool skip_preflight/*=false*/) {
+    ALLOC_COUNT_SCOPE();
+    FlightRecorder::Op op(*flight_recorder_, "NewExpiringPurchase");
+    auto result = [&] {
+        Strand::Turn turn(*strand_);
+        auto res = NewExpiringPurchaseRequest(transaction_class, distinguisher, expected_price, skip_preflight);
+        if (op.Finish(res ? (int)res->status : FlightRecorder::kStatusError)) {
+            StoreSlowOperations();
+        }
+        return res;
+    }();
+
+    // The scheduler's lock can't be taken on the strand.
+    if (result && result->status == Status::Success) {
+        NudgeRefreshScheduler();
+    }
+    return result;
+}
+
+// NewExpiringPurchase, without the recording.
+Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchaseRequest(
+        const string& transaction_class,
+        const string& distinguisher,
+        const int64_t expected_price,
+        bool skip_preflight) {
+    if (purchase_preflight_ && !skip_preflight) {
+        auto status = PreflightNewExpiringPurchase(transaction_class, distinguisher, expected_price);
+        if (status) {
+            return PsiCash::NewExpiringPurchaseResponse{*status};
+        }
+    }
+
     auto result = MakeHTTPRequestWithRetry(
             kMethodPOST,
             "/transaction",
@@ -741,6 +1176,9 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
     string transaction_id, authorization_encoded, transaction_type;
     datetime::DateTime server_expiry;
 
+    // The new balance and purchase are written, and become visible, together.
+    UserData::WritePauser pauser(*user_data_);
+
     // These statuses require the response body to be parsed
     if (result->code == kHTTPStatusOK ||
         result->code == kHTTPStatusTooManyRequests ||
@@ -751,44 +1189,29 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
                     utils::Stringer("result has no body; code: ", result->code).c_str());
         }
 
-        try {
-            auto j = json::parse(result->body);
-
-            // Many response fields are optional (depending on the presence of the indicator token)
-
-            if (j["Balance"].is_number_integer()) {
-                // We don't care about the return value of this right now
-                (void)user_data_->SetBalance(j["Balance"].get<int64_t>());
-            }
-
-            if (j["TransactionID"].is_string()) {
-                transaction_id = j["TransactionID"].get<string>();
-            }
+        auto response = ParseTransactionResponse(result->body);
+        if (!response) {
+            return WrapError(response.error(), "ParseTransactionResponse failed");
+        }
 
-            if (j["Authorization"].is_string()) {
-                authorization_encoded = j["Authorization"].get<string>();
-            }
+        if (response->balance) {
+            // We don't care about the return value of this right now
+            (void)user_data_->SetBalance(*response->balance);
+        }
 
-            if (j["TransactionResponse"]["Type"].is_string()) {
-                transaction_type = j["TransactionResponse"]["Type"].get<string>();
-            }
+        transaction_id = response->transaction_id;
+        authorization_encoded = response->authorization;
+        transaction_type = response->type;
 
-            if (j["TransactionResponse"]["Values"]["Expires"].is_string()) {
-                string expiry_string = j["TransactionResponse"]["Values"]["Expires"].get<string>();
-                if (!server_expiry.FromISO8601(expiry_string)) {
-                    return MakeCriticalError(
-                            ("failed to parse TransactionResponse.Values.Expires; got "s +
-                             expiry_string).c_str());
-                }
+        if (!response->expires.empty()) {
+            if (!server_expiry.FromISO8601(response->expires)) {
+                return MakeCriticalError(
+                        ("failed to parse TransactionResponse.Values.Expires; got "s +
+                         response->expires).c_str());
             }
-
-            // Unused fields
-            //auto transaction_amount = j.at("TransactionAmount").get<int64_t>();
-        }
-        catch (json::exception& e) {
-            return MakeCriticalError(
-                    utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
         }
+
+        // Unused fields: TransactionAmount
     }
 
     if (result->code == kHTTPStatusOK) {
@@ -831,7 +1254,8 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
 
         user_data_->UpdatePurchaseLocalTimeExpiry(purchase);
 
-        if (auto err = user_data_->AddPurchase(purchase)) {
+        (void)user_data_->AddPurchase(purchase); // doesn't write while paused
+        if (auto err = pauser.Unpause()) {
             return WrapError(err, "AddPurchase failed");
         }
 
@@ -943,10 +1367,12 @@ void from_json(const json& j, Purchase& p) {
         p.server_time_expiry = j.at("serverTimeExpiry").get<datetime::DateTime>();
     }
 
-    if (j.at("localTimeExpiry").is_null()) {
+    // The datastore doesn't store the derived localTimeExpiry.
+    auto local_time_expiry = j.find("localTimeExpiry");
+    if (local_time_expiry == j.end() || local_time_expiry->is_null()) {
         p.local_time_expiry = nullopt;
     } else {
-        p.local_time_expiry = j.at("localTimeExpiry").get<datetime::DateTime>();
+        p.local_time_expiry = local_time_expiry->get<datetime::DateTime>();
     }
 }
 
@@ -976,17 +1402,13 @@ void from_json(const json& j, Authorization& v) {
 }
 
 Result<Authorization> DecodeAuthorization(const string& encoded) {
-    try {
-        auto decoded = base64::B64Decode(encoded);
-        auto json = json::parse(decoded);
-        auto auth = json.at("Authorization").get<Authorization>();
-        auth.encoded = encoded;
-        return auth;
-    }
-    catch (json::exception& e) {
-        return MakeCriticalError(
-                utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+    auto decoded = base64::B64Decode(encoded);
+    auto auth = ParseAuthorization(string(decoded.begin(), decoded.end()));
+    if (!auth) {
+        return WrapError(auth.error(), "ParseAuthorization failed");
     }
+    auth->encoded = encoded;
+    return auth;
 }
 
 } // namespace psicash
@@ -20,10 +20,16 @@
 #ifndef PSICASHLIB_PSICASH_H
 #define PSICASHLIB_PSICASH_H
 
+#include <atomic>
 #include <string>
+#include <cstring>
 #include <functional>
+#include <map>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <chrono>
+#include <type_traits>
 #include "vendor/nonstd/optional.hpp"
 #include "vendor/nlohmann/json.hpp"
 #include "datetime.hpp"
@@ -34,6 +40,11 @@ namespace psicash {
 
 // Forward declarations
 class UserData;
+class RequestHedger;
+class RefreshScheduler;
+class FlightRecorder;
+class Strand;
+class Revalidator;
 
 
 //
@@ -88,6 +99,105 @@ struct HTTPResult {
 // This is the signature for the HTTP Requester callback provided by the native consumer.
 using MakeHTTPRequestFn = std::function<HTTPResult(const HTTPParams&)>;
 
+// A borrowed (non-owning) string. A stand-in for std::string_view, which requires C++17.
+struct StringRef {
+    const char* data;
+    size_t size;
+
+    StringRef() : data(""), size(0) {}
+    StringRef(const char* s) : data(s), size(std::strlen(s)) {}
+    StringRef(const char* d, size_t n) : data(d), size(n) {}
+    StringRef(const std::string& s) : data(s.data()), size(s.size()) {}
+
+    std::string str() const { return std::string(data, size); }
+
+    friend bool operator==(const StringRef& lhs, const StringRef& rhs) {
+        return lhs.size == rhs.size && std::memcmp(lhs.data, rhs.data, lhs.size) == 0;
+    }
+    friend bool operator!=(const StringRef& lhs, const StringRef& rhs) { return !(lhs == rhs); }
+};
+
+struct HTTPHeaderRef {
+    StringRef name;
+    StringRef value;
+};
+
+// The parameters provided to MakeHTTPRequestRefFn. This is a compact alternative to
+// HTTPParams that the library can provide without copying: all strings are borrowed
+// and are only valid for the duration of the requester call.
+struct HTTPRequestRef {
+    StringRef scheme;
+    StringRef hostname;
+    int port;
+    StringRef method;
+    StringRef path;
+
+    // Flat array of `header_count` headers. Names are unique.
+    const HTTPHeaderRef* headers;
+    size_t header_count;
+
+    // The URL-encoded query string, without a leading "?". Like
+    // "class=speed-boost&expectedAmount=-10000". May be empty.
+    StringRef query;
+
+    // The unencoded name-value pairs that `query` was formatted from. Never null.
+    const std::vector<std::pair<std::string, std::string>>* query_params;
+
+    HTTPRequestRef();
+
+    // Copies the request into the HTTPParams form, for requesters that use that.
+    HTTPParams ToHTTPParams() const;
+};
+
+// An alternative HTTP Requester signature. The result (including the body) is moved
+// into the library.
+using MakeHTTPRequestRefFn = std::function<HTTPResult(const HTTPRequestRef&)>;
+
+// Configuration for hedging idempotent (GET) requests. If a request hasn't completed
+// after the hedge delay, an identical request is made and the first response to arrive
+// is used. See PsiCash::SetRequestHedging.
+struct HedgingConfig {
+    // The hedge delay is this percentile of recent request latencies...
+    double delay_percentile;
+    // ...bounded by these. Until enough latencies have been seen, initial_delay is used.
+    std::chrono::milliseconds min_delay;
+    std::chrono::milliseconds max_delay;
+    std::chrono::milliseconds initial_delay;
+
+    // Limits the extra load: over time, at most this fraction of requests are hedged,
+    // with up to `budget_burst` hedges allowed at once.
+    double budget_ratio;
+    double budget_burst;
+
+    HedgingConfig()
+            : delay_percentile(95),
+              min_delay(200), max_delay(10000), initial_delay(2000),
+              budget_ratio(0.1), budget_burst(3) {}
+};
+
+// Configuration for the background refresh scheduler. See PsiCash::StartRefreshScheduler.
+struct RefreshSchedulerConfig {
+    // The purchase classes to retrieve prices for; as for RefreshState.
+    std::vector<std::string> purchase_classes;
+
+    // The interval between refreshes starts at min_interval and is multiplied by
+    // backoff_factor (up to max_interval) after each refresh that changes nothing or
+    // fails. It returns to min_interval when something changes.
+    std::chrono::milliseconds min_interval;
+    std::chrono::milliseconds max_interval;
+    double backoff_factor;
+    // Intervals are randomly adjusted by up to this fraction, so that clients don't
+    // synchronize.
+    double jitter;
+
+    // How soon to refresh after a purchase, rewarded activity, or purchase expiry.
+    std::chrono::milliseconds nudge_delay;
+
+    RefreshSchedulerConfig()
+            : min_interval(std::chrono::minutes(1)), max_interval(std::chrono::hours(1)),
+              backoff_factor(2), jitter(0.1), nudge_delay(std::chrono::seconds(5)) {}
+};
+
 // These are the possible token types.
 extern const char* const kEarnerTokenType;
 extern const char* const kSpenderTokenType;
@@ -121,6 +231,14 @@ struct Authorization {
 
 using Authorizations = std::vector<Authorization>;
 
+/// The encoded authorizations of the active purchases, as passed to the tunnel core.
+/// version changes whenever the set of authorizations does, so a caller can skip
+/// resending a bundle it has already sent.
+struct AuthorizationBundle {
+    uint64_t version = 0;
+    std::shared_ptr<const std::vector<std::string>> encoded;
+};
+
 // May be used for for decoding non-PsiCash authorizations.
 error::Result<Authorization> DecodeAuthorization(const std::string& encoded);
 
@@ -142,6 +260,35 @@ struct Purchase {
 
 using Purchases = std::vector<Purchase>;
 
+/// Selects purchases by whether they're expired, according to the local clock.
+/// Purchases without an expiry are never expired.
+enum class PurchaseExpiry {
+    kAny,
+    kActive,
+    kExpired
+};
+
+/// A non-owning reference to a callable taking `const Purchase&` and returning true to
+/// continue visiting or false to stop. Unlike std::function it never allocates; the
+/// callable must outlive the visit it's passed to.
+class PurchaseVisitor {
+public:
+    template<typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, PurchaseVisitor>::value>::type>
+    PurchaseVisitor(F&& f)
+        : callable_((void*)std::addressof(f)),
+          call_([](void* callable, const Purchase& p) -> bool {
+              return (*static_cast<typename std::remove_reference<F>::type*>(callable))(p);
+          }) {
+    }
+
+    bool operator()(const Purchase& p) const { return call_(callable_, p); }
+
+private:
+    void* callable_;
+    bool (*call_)(void*, const Purchase&);
+};
+
 // Possible API method result statuses. Which are possible and what they mean will
 // be described for each method.
 enum class Status {
@@ -155,6 +302,28 @@ enum class Status {
     ServerError
 };
 
+/// A stored value, as returned by the stale-while-revalidate accessors (like
+/// PsiCash::BalanceWithRevalidation).
+template<typename T>
+struct StoredValue {
+    T value;
+    /// The time since the value was last refreshed from the server (by a successful
+    /// RefreshState). Null if it never has been.
+    nonstd::optional<datetime::Duration> age;
+    /// True if a revalidation is in flight, whose result will be passed to the callback.
+    bool revalidating = false;
+};
+
+/// Receives the result of a revalidation's RefreshState, and the value as stored after it
+/// (which is unchanged if the refresh failed).
+template<typename T>
+using RevalidatedFn = std::function<void(const error::Result<Status>& refresh_result, const T& value)>;
+
+/// The methods of a PsiCash instance may be called from multiple threads (after Init).
+/// Those that modify the state -- RefreshState, NewExpiringPurchase, ExpirePurchases,
+/// RemovePurchases and SetRequestMetadataItem -- are serialized: each runs once the ones
+/// called before it have finished. Accessors don't wait for them; they see the state as
+/// of the last completed change (a RefreshState's updates become visible together).
 class PsiCash {
 public:
     PsiCash();
@@ -175,6 +344,56 @@ public:
     /// Can be used for updating the HTTP requester function pointer.
     void SetHTTPRequestFn(MakeHTTPRequestFn make_http_request_fn);
 
+    /// Sets an HTTP requester that uses the HTTPRequestRef form, which avoids building
+    /// an HTTPParams for every request. Replaces any requester set by Init or
+    /// SetHTTPRequestFn (and vice versa).
+    void SetHTTPRequestRefFn(MakeHTTPRequestRefFn make_http_request_fn);
+
+    /// Enables hedging of GET requests (i.e., RefreshState) with the given
+    /// configuration, or disables it if `config` is null. Disabled by default.
+    /// When enabled, the HTTP requester is called from other threads, and may be called
+    /// concurrently. A request that loses the race is not cancelled, so the requester
+    /// may still be running after the library call that started it returns; it is
+    /// waited for when hedging is disabled or this object is destroyed.
+    /// Waits for any in-progress request to finish before taking effect.
+    void SetRequestHedging(const HedgingConfig* config);
+
+    /// Enables or disables local pre-flight checks in NewExpiringPurchase. Disabled by
+    /// default. When enabled, a purchase that the stored state shows will fail -- an
+    /// insufficient balance, an unexpired purchase of the same class, or a price or
+    /// distinguisher that doesn't match the stored prices for the class -- gets that
+    /// status without a server request. The stored state may be stale (e.g., if a reward
+    /// was just given), so NewExpiringPurchase can skip the checks per call.
+    void SetPurchasePreflight(bool enabled);
+
+    /// Enables or disables provisioning tracker tokens in the background. Disabled by
+    /// default; call after Init. When enabled and the user has no tokens (i.e., on first
+    /// run), the tracker request is made on a background thread as soon as there's an
+    /// HTTP requester -- now, or when one is set -- so that the first RefreshState
+    /// doesn't have to make it first. A RefreshState called while it's in progress waits
+    /// for it rather than requesting a tracker of its own. The HTTP requester is then
+    /// called from another thread.
+    void SetTrackerProvisioning(bool enabled);
+
+    /// Sets how long an operation (RefreshState, NewExpiringPurchase, ExpirePurchases,
+    /// RemovePurchases or a background tracker provisioning) must take to be kept by the
+    /// slow-operation recorder, whose last
+    /// entries -- with where their time went -- are included in GetDiagnosticInfo and
+    /// survive restarts. The default is 1 second.
+    void SetSlowOperationThreshold(std::chrono::milliseconds threshold);
+
+    /// Starts refreshing the state (with RefreshState) on a background thread, on an
+    /// adaptive interval: sooner after purchases, rewarded activity (i.e., a call to
+    /// GetRewardedActivityData) and purchase expiries, and backing off while nothing
+    /// changes. Refreshing pauses while there's no HTTP requester. Replaces any
+    /// scheduler already running. Library calls may then run concurrently with a
+    /// background refresh. Does nothing before Init.
+    void StartRefreshScheduler(const RefreshSchedulerConfig& config);
+
+    /// Stops the background refresh scheduler, if it's running. Waits for any refresh
+    /// in progress.
+    void StopRefreshScheduler();
+
     /// Set values that will be included in the request metadata. This includes
     /// client_version, client_region, sponsor_id, and propagation_channel_id.
     error::Error SetRequestMetadataItem(const std::string& key, const std::string& value);
@@ -197,6 +416,20 @@ public:
     /// Will be empty if no purchase prices are available.
     PurchasePrices GetPurchasePrices() const;
 
+    /// Stale-while-revalidate versions of Balance and GetPurchasePrices, so a UI can
+    /// render the stored value immediately. If the value is older than `max_age` (or
+    /// was never retrieved) and there's an HTTP requester, a revalidation -- a
+    /// RefreshState -- is done on a background thread, and `on_revalidated` (if not
+    /// null) is called on that thread when it finishes. At most one revalidation is in
+    /// flight at a time: a call made during one joins it (even if it asked for other
+    /// purchase classes). The balance revalidation asks for the classes of the stored
+    /// prices, so they're kept. Callbacks must not destroy the PsiCash instance.
+    StoredValue<int64_t> BalanceWithRevalidation(
+            std::chrono::milliseconds max_age, RevalidatedFn<int64_t> on_revalidated);
+    StoredValue<PurchasePrices> GetPurchasePricesWithRevalidation(
+            const std::vector<std::string>& purchase_classes,
+            std::chrono::milliseconds max_age, RevalidatedFn<PurchasePrices> on_revalidated);
+
     /// Returns the set of active purchases, if any.
     Purchases GetPurchases() const;
 
@@ -207,9 +440,28 @@ public:
     /// for non-expired purchases will be returned.
     Authorizations GetAuthorizations(bool activeOnly=false) const;
 
+    /// Returns the encoded authorizations of the active purchases (in stored order). The
+    /// bundle is maintained as purchases are added, removed and expire, so this is cheap
+    /// to call before every tunnel connection.
+    AuthorizationBundle GetActiveAuthorizationBundle() const;
+
     /// Returns all purchases that match the given set of Authorization IDs.
     Purchases GetPurchasesByAuthorizationID(std::vector<std::string> authorization_ids) const;
 
+    /// Calls `visit` with each stored purchase (with local_time_expiry populated) that
+    /// matches `expiry`, until it returns false. Nothing is copied, so this is cheaper
+    /// than GetPurchases or ActivePurchases when the caller only needs to look. Purchases
+    /// are locked during the visit, so `visit` must not call methods that modify them.
+    void ForEachPurchase(PurchaseExpiry expiry, PurchaseVisitor visit) const;
+
+    /// Returns the number of purchases that match `expiry`, without copying any.
+    size_t CountPurchases(PurchaseExpiry expiry) const;
+
+    /// Returns true if there is an active (non-expired) purchase of the given class.
+    /// If distinguisher is non-empty, the purchase must also match it.
+    bool HasActivePurchase(const std::string& transaction_class,
+                           const std::string& distinguisher="") const;
+
     /// Get the next expiring purchase (with local_time_expiry populated).
     /// The returned optional will false if there is no outstanding expiring purchase (or
     /// no outstanding purchases at all). The returned purchase may already be expired.
@@ -307,6 +559,10 @@ public:
     • expected_price: The expected price of the purchase (previously obtained by RefreshState).
       The transaction will fail if the expected_price does not match the actual price.
 
+    • skip_preflight: If true, the request is made even if pre-flight checks are enabled
+      (see SetPurchasePreflight) and the stored state indicates it will fail. Use this
+      if the stored state is known to be stale.
+
     Result fields:
 
     • error: If set, the request failed utterly and no other params are valid.
@@ -348,7 +604,8 @@ public:
     error::Result<NewExpiringPurchaseResponse> NewExpiringPurchase(
             const std::string& transaction_class,
             const std::string& distinguisher,
-            const int64_t expected_price);
+            const int64_t expected_price,
+            bool skip_preflight = false);
 
 protected:
     // See implementation for descriptions of non-public methods.
@@ -357,16 +614,45 @@ protected:
             const std::string& method, const std::string& path, bool include_auth_tokens,
             const std::vector<std::pair<std::string, std::string>>& query_params);
 
-    virtual error::Result<HTTPParams> BuildRequestParams(
-            const std::string& method, const std::string& path, bool include_auth_tokens,
-            const std::vector<std::pair<std::string, std::string>>& query_params, int attempt,
-            const std::map<std::string, std::string>& additional_headers) const;
+    virtual std::map<std::string, std::string> AdditionalRequestHeaders() const;
 
     error::Result<Status> NewTracker();
 
     error::Result<Status>
     RefreshState(const std::vector<std::string>& purchase_classes, bool allow_recursion);
 
+    nonstd::optional<Status> PreflightNewExpiringPurchase(
+            const std::string& transaction_class,
+            const std::string& distinguisher,
+            const int64_t expected_price) const;
+
+    error::Result<NewExpiringPurchaseResponse> NewExpiringPurchaseRequest(
+            const std::string& transaction_class,
+            const std::string& distinguisher,
+            const int64_t expected_price,
+            bool skip_preflight);
+
+    void StoreSlowOperations();
+
+    /// Starts provisioning tracker tokens in the background if it's enabled, there's a
+    /// requester and the user has no tokens (and isn't an account).
+    void MaybeProvisionTracker();
+
+    /// Brings the background refresh forward, if the scheduler is running. Must not be
+    /// called on the strand.
+    void NudgeRefreshScheduler() const;
+
+    /// The time since the last successful refresh-state request, if there has been one.
+    nonstd::optional<datetime::Duration> StoredStateAge() const;
+
+    /// Starts (or joins) a revalidation with the given purchase classes, calling `done`
+    /// with its result, if `age` is older than `max_age` and there's a requester. Returns
+    /// true if it did.
+    bool RevalidateIfStale(const nonstd::optional<datetime::Duration>& age,
+                           std::chrono::milliseconds max_age,
+                           const std::vector<std::string>& purchase_classes,
+                           const std::function<void(const error::Result<Status>&)>& done);
+
 protected:
     std::string user_agent_;
     std::string server_scheme_;
@@ -374,7 +660,27 @@ protected:
     int server_port_;
     // This is a pointer rather than an instance to avoid including userdata.h (TODO: worthwhile?)
     std::unique_ptr<UserData> user_data_;
-    MakeHTTPRequestFn make_http_request_fn_;
+    MakeHTTPRequestRefFn make_http_request_fn_;
+    // Whether make_http_request_fn_ is set. Set along with it, but can be read from any
+    // thread without taking the strand.
+    std::atomic<bool> has_requester_;
+    // Null unless hedging is enabled.
+    std::unique_ptr<RequestHedger> request_hedger_;
+    bool purchase_preflight_;
+    // Set and read on different threads.
+    std::atomic<bool> tracker_provisioning_;
+    std::unique_ptr<FlightRecorder> flight_recorder_;
+    // Operations that modify the state run on this, one at a time.
+    std::unique_ptr<Strand> strand_;
+    // Runs the stale-while-revalidate accessors' revalidations.
+    std::unique_ptr<Revalidator> revalidator_;
+    // Runs background tracker provisioning, one at a time.
+    std::unique_ptr<Revalidator> tracker_provisioner_;
+    // Guards refresh_scheduler_. Taken before the scheduler's locks and the strand, so
+    // never on the strand.
+    mutable std::recursive_mutex refresh_scheduler_mutex_;
+    // Null unless started. Last, so that it's stopped before anything it uses is destroyed.
+    std::unique_ptr<RefreshScheduler> refresh_scheduler_;
 };
 
 } // namespace psicash
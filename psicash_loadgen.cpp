@@ -0,0 +1,256 @@
+/*
+ * psicash_loadgen: runs N simulated clients concurrently, each with its own PsiCash
+ * instance and datastore, against an in-process stand-in API server (see
+ * test_fake_server.hpp), and reports throughput, latency percentiles, datastore bytes
+ * written and CPU time per operation.
+ *
+ * Usage: psicash_loadgen [--clients=N] [--ops=N] [--workload=W] [--latency-ms=N]
+ *                        [--error-rate=X]
+ *
+ * Workloads (each client performs --ops operations):
+ *   refresh   RefreshState storm
+ *   purchase  NewExpiringPurchase bursts (short-lived purchases, so most succeed)
+ *   expiry    NewExpiringPurchase followed by ExpirePurchases
+ *   mixed     all of the above, interleaved
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench_helpers.hpp"
+#include "test_fake_server.hpp"
+#include "psicash.hpp"
+#include "userdata.hpp"
+#include "alloc_counter.hpp"
+
+using namespace std;
+using namespace psicash;
+
+static const char* kUserAgent = "Psiphon-PsiCash-Loadgen";
+static const char* kTransactionClass = "speed-boost";
+// Purchases that expire almost immediately, so the same client can keep buying.
+static const char* kShortDistinguisher = "1ms";
+
+struct Config {
+    int clients = 8;
+    int ops = 200;
+    string workload = "mixed";
+    int latency_ms = 0;
+    double error_rate = 0;
+};
+
+// Per-operation samples, accumulated per client and merged at the end.
+struct OpSamples {
+    vector<chrono::nanoseconds> latency;
+    chrono::nanoseconds cpu{0};
+    uint64_t bytes_written = 0;
+    uint64_t failures = 0; // errors and non-success statuses
+
+    void Merge(const OpSamples& other) {
+        latency.insert(latency.end(), other.latency.begin(), other.latency.end());
+        cpu += other.cpu;
+        bytes_written += other.bytes_written;
+        failures += other.failures;
+    }
+};
+
+using Samples = map<string, OpSamples>;
+
+// Exposes the datastore write count of a PsiCash instance.
+class LoadgenPsiCash : public PsiCash {
+public:
+    uint64_t DatastoreBytesWritten() const { return user_data_->DatastoreBytesWritten(); }
+};
+
+class Client {
+public:
+    Client(const Config& config, FakeServer& server)
+            : config_(config), server_(server) {
+    }
+
+    bool Run(Samples& samples) {
+        auto err = pc_.Init(kUserAgent, bench::MakeTempDir().c_str(), server_.Requester());
+        if (err) {
+            cerr << "Init failed: " << err << endl;
+            return false;
+        }
+
+        // Get tracker tokens before the workload proper. Simulated server errors may
+        // require a few tries.
+        for (int i = 0; pc_.ValidTokenTypes().empty(); i++) {
+            auto res = pc_.RefreshState({kTransactionClass});
+            if (!res || i >= 10) {
+                cerr << "initial RefreshState failed" << endl;
+                return false;
+            }
+        }
+
+        for (int i = 0; i < config_.ops; i++) {
+            auto workload = config_.workload;
+            if (workload == "mixed") {
+                static const char* kMix[] = {"refresh", "purchase", "expiry"};
+                workload = kMix[i % 3];
+            }
+
+            if (workload == "refresh") {
+                Measure(samples, "RefreshState", [&] {
+                    auto r = pc_.RefreshState({kTransactionClass});
+                    return r && *r == Status::Success;
+                });
+            } else if (workload == "purchase") {
+                Purchase(samples);
+            } else if (workload == "expiry") {
+                Purchase(samples);
+                Measure(samples, "ExpirePurchases", [&] { return (bool)pc_.ExpirePurchases(); });
+            } else {
+                cerr << "unknown workload: " << workload << endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    void Purchase(Samples& samples) {
+        Measure(samples, "NewExpiringPurchase", [&] {
+            auto r = pc_.NewExpiringPurchase(kTransactionClass, kShortDistinguisher, 100);
+            return r && r->status == Status::Success;
+        });
+    }
+
+    template<typename F>
+    void Measure(Samples& samples, const string& op, F f) {
+        auto& s = samples[op];
+        auto bytes_start = pc_.DatastoreBytesWritten();
+        auto cpu_start = bench::ThreadCPUTime();
+        auto start = chrono::steady_clock::now();
+
+        bool ok = f();
+
+        s.latency.push_back(chrono::steady_clock::now() - start);
+        s.cpu += bench::ThreadCPUTime() - cpu_start;
+        s.bytes_written += pc_.DatastoreBytesWritten() - bytes_start;
+        if (!ok) {
+            s.failures++;
+        }
+    }
+
+    const Config& config_;
+    FakeServer& server_;
+    LoadgenPsiCash pc_;
+};
+
+static void Report(const Config& config, const Samples& samples, chrono::nanoseconds wall) {
+    auto usec = [](chrono::nanoseconds ns) { return ns.count() / 1000.0; };
+
+    size_t total_ops = 0;
+    for (const auto& s : samples) {
+        total_ops += s.second.latency.size();
+    }
+    auto wall_secs = chrono::duration<double>(wall).count();
+
+    cout << "clients: " << config.clients << "; ops/client: " << config.ops
+         << "; workload: " << config.workload << "; latency: " << config.latency_ms << "ms"
+         << "; error rate: " << config.error_rate << endl;
+    cout << fixed << setprecision(1);
+    cout << "total ops: " << total_ops << "; wall: " << wall_secs << "s"
+         << "; throughput: " << total_ops / wall_secs << " ops/s" << endl;
+
+    cout << left << setw(22) << "operation" << right
+         << setw(8) << "count"
+         << setw(10) << "failed"
+         << setw(12) << "p50(us)"
+         << setw(12) << "p95(us)"
+         << setw(12) << "p99(us)"
+         << setw(12) << "cpu/op(us)"
+         << setw(14) << "written/op(B)" << endl;
+    for (const auto& it : samples) {
+        const auto& s = it.second;
+        auto n = s.latency.size();
+        cout << left << setw(22) << it.first << right
+             << setw(8) << n
+             << setw(10) << s.failures
+             << setw(12) << usec(bench::Percentile(s.latency, 50))
+             << setw(12) << usec(bench::Percentile(s.latency, 95))
+             << setw(12) << usec(bench::Percentile(s.latency, 99))
+             << setw(12) << usec(s.cpu / n)
+             << setw(14) << (double)s.bytes_written / n << endl;
+    }
+
+    if (alloc_counter::Enabled()) {
+        cout << endl;
+        bench::PrintAllocsByCall(cout);
+    }
+}
+
+int main(int argc, char** argv) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&](const char* name) -> const char* {
+            auto prefix = string("--") + name + "=";
+            return arg.find(prefix) == 0 ? arg.c_str() + prefix.size() : nullptr;
+        };
+
+        if (auto v = value("clients")) {
+            config.clients = atoi(v);
+        } else if (auto v = value("ops")) {
+            config.ops = atoi(v);
+        } else if (auto v = value("workload")) {
+            config.workload = v;
+        } else if (auto v = value("latency-ms")) {
+            config.latency_ms = atoi(v);
+        } else if (auto v = value("error-rate")) {
+            config.error_rate = atof(v);
+        } else {
+            cerr << "unknown argument: " << arg << endl;
+            return 1;
+        }
+    }
+
+    FakeServer::Options options;
+    options.latency = datetime::Duration(config.latency_ms);
+    options.server_error_rate = config.error_rate;
+    // Enough that purchases never fail for lack of funds.
+    options.initial_balance = options.price * config.ops * 2;
+    FakeServer server(options);
+
+    vector<Samples> client_samples(config.clients);
+    vector<char> client_ok(config.clients, false);
+    vector<thread> threads;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < config.clients; i++) {
+        threads.emplace_back([&, i] {
+            Client client(config, server);
+            client_ok[i] = client.Run(client_samples[i]);
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto wall = chrono::steady_clock::now() - start;
+
+    Samples samples;
+    for (int i = 0; i < config.clients; i++) {
+        if (!client_ok[i]) {
+            return 1;
+        }
+        for (const auto& s : client_samples[i]) {
+            samples[s.first].Merge(s.second);
+        }
+    }
+
+    Report(config, samples, wall);
+
+    return 0;
+}
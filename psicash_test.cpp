@@ -799,6 +799,8 @@ TEST_F(TestPsiCash, GetDiagnosticInfo) {
 
     auto want = R"|({
     "balance":0,
+    "datastoreDroppedRecords":0,
+    "slowOperations":[],
     "isAccount":false,
     "purchasePrices":[],
     "purchases":[],
@@ -806,6 +808,8 @@ TEST_F(TestPsiCash, GetDiagnosticInfo) {
     "validTokenTypes":[]
     })|"_json;
     auto j = pc.GetDiagnosticInfo();
+    j.erase("allocations"); // only present in PSICASH_ALLOC_COUNTING builds
+    j.erase("locks"); // only present in PSICASH_LOCK_PROFILING builds
     ASSERT_EQ(j, want);
 
     pc.user_data().SetBalance(12345);
@@ -816,6 +820,8 @@ TEST_F(TestPsiCash, GetDiagnosticInfo) {
     // pc.user_data().SetServerTimeDiff() // too hard to do reliably
     want = R"|({
     "balance":12345,
+    "datastoreDroppedRecords":0,
+    "slowOperations":[],
     "isAccount":true,
     "purchasePrices":[{"distinguisher":"d1","price":123,"class":"tc1"},{"distinguisher":"d2","price":321,"class":"tc2"}],
     "purchases":[{"class":"tc2","distinguisher":"d2"}],
@@ -823,6 +829,8 @@ TEST_F(TestPsiCash, GetDiagnosticInfo) {
     "validTokenTypes":["a","b","c"]
     })|"_json;
     j = pc.GetDiagnosticInfo();
+    j.erase("allocations");
+    j.erase("locks");
     ASSERT_EQ(j, want);
 }
 
@@ -1429,3 +1437,55 @@ TEST_F(TestPsiCash, HTTPRequestBadResult) {
     ASSERT_FALSE(refresh_result);
     ASSERT_NE(refresh_result.error().ToString().find(want_error_message), string::npos);
 }
+
+TEST_F(TestPsiCash, HTTPRequestRef) {
+    PsiCashTester pc;
+    auto err = pc.Init(user_agent_, GetTempDir().c_str(), nullptr, true);
+    ASSERT_FALSE(err);
+
+    err = pc.user_data().SetAuthTokens({{"earner", "e"}, {"spender", "s"}, {"indicator", "i"}}, false);
+    ASSERT_FALSE(err);
+
+    HTTPResult unauthorized;
+    unauthorized.code = 401;
+
+    string query;
+    HTTPParams ref_params;
+    pc.SetHTTPRequestRefFn([&](const HTTPRequestRef& req) {
+        query = req.query.str();
+        ref_params = req.ToHTTPParams();
+        return unauthorized;
+    });
+
+    auto refresh_result = pc.RefreshState({"speed-boost", "a b&c"});
+    ASSERT_TRUE(refresh_result);
+    ASSERT_EQ(*refresh_result, Status::InvalidTokens);
+
+    ASSERT_EQ(query, "class=speed-boost&class=a%20b%26c");
+    ASSERT_EQ(ref_params.method, "GET");
+    ASSERT_EQ(ref_params.path, "/v1/refresh-state");
+    ASSERT_EQ(ref_params.query.size(), 2);
+    ASSERT_EQ(ref_params.query[1].second, "a b&c");
+    ASSERT_EQ(ref_params.headers["User-Agent"], user_agent_);
+    ASSERT_EQ(ref_params.headers["X-PsiCash-Auth"].size(), 5); // three tokens, comma-separated
+    ASSERT_EQ(json::parse(ref_params.headers["X-PsiCash-Metadata"])["attempt"], 1);
+
+    // The legacy requester form gets the same params
+    err = pc.user_data().SetAuthTokens({{"earner", "e"}, {"spender", "s"}, {"indicator", "i"}}, false);
+    ASSERT_FALSE(err);
+
+    HTTPParams legacy_params;
+    pc.SetHTTPRequestFn([&](const HTTPParams& params) {
+        legacy_params = params;
+        return unauthorized;
+    });
+
+    refresh_result = pc.RefreshState({"speed-boost", "a b&c"});
+    ASSERT_TRUE(refresh_result);
+    ASSERT_EQ(legacy_params.scheme, ref_params.scheme);
+    ASSERT_EQ(legacy_params.hostname, ref_params.hostname);
+    ASSERT_EQ(legacy_params.port, ref_params.port);
+    ASSERT_EQ(legacy_params.path, ref_params.path);
+    ASSERT_EQ(legacy_params.query, ref_params.query);
+    ASSERT_EQ(legacy_params.headers, ref_params.headers);
+}
@@ -20,7 +20,6 @@
 #ifndef NDEBUG
 
 #include <string>
-#include <thread>
 #include "psicash_tester.hpp"
 #include "utils.hpp"
 #include "http_status_codes.h"
@@ -55,7 +54,7 @@ error::Error PsiCashTester::MakeRewardRequests(const std::string& transaction_cl
     for (int i = 0; i < repeat; ++i) {
         if (i != 0) {
             // Sleep a bit to avoid server DB transaction conflicts
-            this_thread::sleep_for(chrono::milliseconds(100));
+            datetime::SleepFor(chrono::milliseconds(100));
         }
 
         auto result = MakeHTTPRequestWithRetry(
@@ -72,23 +71,16 @@ error::Error PsiCashTester::MakeRewardRequests(const std::string& transaction_cl
     return error::nullerr;
 }
 
-error::Result<HTTPParams>
-PsiCashTester::BuildRequestParams(const std::string& method, const std::string& path,
-                                  bool include_auth_tokens,
-                                  const std::vector<std::pair<std::string, std::string>>& query_params,
-                                  int attempt,
-                                  const std::map<std::string, std::string>& additional_headers) const {
-    auto bonus_headers = additional_headers;
+std::map<std::string, std::string> PsiCashTester::AdditionalRequestHeaders() const {
+    auto headers = PsiCash::AdditionalRequestHeaders();
     if (!g_request_mutators.empty()) {
         auto mutator = g_request_mutators.back();
         if (!mutator.empty()) {
-            bonus_headers[TEST_HEADER] = mutator;
+            headers[TEST_HEADER] = mutator;
         }
         g_request_mutators.pop_back();
     }
-
-    return PsiCash::BuildRequestParams(
-        method, path, include_auth_tokens, query_params, attempt, bonus_headers);
+    return headers;
 }
 
 bool PsiCashTester::MutatorsEnabled() {
@@ -41,11 +41,7 @@ class PsiCashTester : public psicash::PsiCash {
                                              const std::string& distinguisher,
                                              int repeat=1);
 
-    virtual psicash::error::Result<psicash::HTTPParams>
-    BuildRequestParams(const std::string& method, const std::string& path, bool include_auth_tokens,
-                       const std::vector<std::pair<std::string, std::string>>& query_params,
-                       int attempt,
-                       const std::map<std::string, std::string>& additional_headers) const;
+    virtual std::map<std::string, std::string> AdditionalRequestHeaders() const;
 
     bool MutatorsEnabled();
 
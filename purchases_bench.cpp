@@ -0,0 +1,170 @@
+/*
+ * Measures loading a large set of purchases from the datastore, in the version 1
+ * (ISO8601 dates, stored localTimeExpiry, decoded authorization fields) and current
+ * (epoch milliseconds, encoded-only authorizations) formats, and scanning a (larger) set
+ * of purchases by expiry. Loading the current format defers decoding authorizations, so
+ * load/current+read adds reading every purchase.
+ *
+ * Usage: purchases_bench [--purchases=N] [--scan-purchases=N] [--iterations=N]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+
+#include "base64.hpp"
+#include "bench_helpers.hpp"
+#include "psicash.hpp"
+#include "userdata.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+static const char* kExpiry = "2019-01-14T17:22:23.168Z";
+
+// An encoded authorization, in the form the server produces.
+static string EncodedAuthorization(const string& id) {
+    return base64::B64Encode(json({
+        {"Authorization", {{"ID", id}, {"AccessType", "speed-boost"}, {"Expires", kExpiry}}},
+        {"Signature", string(88, 'S')},
+        {"SigningKeyID", string(44, 'K')}}).dump());
+}
+
+// A datastore in the version 1 format.
+static string V1Datastore(int purchase_count) {
+    json purchases = json::array();
+    for (int i = 0; i < purchase_count; i++) {
+        purchases.push_back({{"id", "transaction-" + to_string(i)},
+                             {"class", "speed-boost"},
+                             {"distinguisher", "1hr"},
+                             {"serverTimeExpiry", kExpiry},
+                             {"localTimeExpiry", kExpiry},
+                             {"authorization", {{"ID", "authorization-" + to_string(i)},
+                                                {"AccessType", "speed-boost"},
+                                                {"Expires", kExpiry},
+                                                {"Encoded", EncodedAuthorization("authorization-" + to_string(i))}}}});
+    }
+    return json({{"v", 1}, {"purchases", purchases}}).dump();
+}
+
+// Half of the purchases are expired. One in three has an authorization.
+static Purchases ScanPurchases(int purchase_count) {
+    auto now = datetime::DateTime::Now();
+    Purchases purchases;
+    for (int i = 0; i < purchase_count; i++) {
+        auto expiry = now.Add(datetime::Duration((i % 2 ? 1 : -1) * (60*60*1000 + i)));
+        nonstd::optional<Authorization> auth;
+        if (i % 3 == 0) {
+            auth = Authorization{"authorization-" + to_string(i), "speed-boost", expiry, string(300, 'A')};
+        }
+        purchases.push_back({"transaction-" + to_string(i), "speed-boost", "1hr", expiry, nonstd::nullopt, auth});
+    }
+    return purchases;
+}
+
+static bool WriteFile(const string& path, const string& contents) {
+    ofstream f(path, ios::trunc | ios::binary);
+    f << contents;
+    return f.good();
+}
+
+static bool Load(const string& dir, size_t want_count, bool read_all) {
+    UserData ud;
+    if (ud.Init(dir.c_str())) {
+        return false;
+    }
+    if (read_all) {
+        return ud.GetPurchases().size() == want_count;
+    }
+    return ud.CountPurchases(UserData::PurchaseExpiry::kAny, datetime::DateTime::Now()) == want_count;
+}
+
+int main(int argc, char** argv) {
+    int purchase_count = 1000;
+    int scan_purchase_count = 10000;
+    int iterations = 50;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--purchases=") == 0) {
+            purchase_count = atoi(arg.c_str() + strlen("--purchases="));
+        } else if (arg.find("--scan-purchases=") == 0) {
+            scan_purchase_count = atoi(arg.c_str() + strlen("--scan-purchases="));
+        } else if (arg.find("--iterations=") == 0) {
+            iterations = atoi(arg.c_str() + strlen("--iterations="));
+        }
+    }
+
+    auto v1_doc = V1Datastore(purchase_count);
+    auto v1_dir = bench::MakeTempDir();
+    auto current_dir = bench::MakeTempDir();
+    size_t failures = 0;
+
+    // Produce the current format by migrating a copy of the version 1 datastore.
+    if (!WriteFile(current_dir + "/psicashdatastore", v1_doc) || !Load(current_dir, purchase_count, false)) {
+        cerr << "failed to create datastore" << endl;
+        return 1;
+    }
+
+    bench::OpStats stats;
+    for (int i = 0; i < iterations; i++) {
+        // Loading a version 1 datastore includes migrating (and writing) it.
+        failures += !WriteFile(v1_dir + "/psicashdatastore", v1_doc);
+        failures += !bench::Measure(stats, "load/v1", [&] { return Load(v1_dir, purchase_count, false); });
+        failures += !bench::Measure(stats, "load/current", [&] { return Load(current_dir, purchase_count, false); });
+        failures += !bench::Measure(stats, "load/current+read", [&] { return Load(current_dir, purchase_count, true); });
+    }
+
+    UserData scan_ud;
+    if (scan_ud.Init(bench::MakeTempDir().c_str()) || scan_ud.SetPurchases(ScanPurchases(scan_purchase_count))) {
+        cerr << "failed to create scan datastore" << endl;
+        return 1;
+    }
+    size_t active_count = scan_purchase_count / 2;
+    for (int i = 0; i < iterations; i++) {
+        auto now = datetime::DateTime::Now();
+        failures += !bench::Measure(stats, "scan/all", [&] {
+            return scan_ud.GetPurchases().size() == (size_t)scan_purchase_count;
+        });
+        failures += !bench::Measure(stats, "scan/active", [&] {
+            return scan_ud.GetPurchases(UserData::PurchaseExpiry::kActive, now).size() == active_count;
+        });
+        failures += !bench::Measure(stats, "scan/active-authorized", [&] {
+            return !scan_ud.GetPurchases(UserData::PurchaseExpiry::kActive, now, true).empty();
+        });
+        failures += !bench::Measure(stats, "scan/next-expiring", [&] {
+            return scan_ud.GetNextExpiringPurchase().has_value();
+        });
+        failures += !bench::Measure(stats, "bundle/get", [&] {
+            return !scan_ud.GetActiveAuthorizationBundle(now).encoded->empty();
+        });
+        failures += !bench::Measure(stats, "visit/count-active", [&] {
+            return scan_ud.CountPurchases(UserData::PurchaseExpiry::kActive, now) == active_count;
+        });
+        failures += !bench::Measure(stats, "visit/find-last-active", [&] {
+            // Worst case for a find: the match is the last active purchase.
+            auto want_id = "transaction-" + to_string(scan_purchase_count - 1 - (scan_purchase_count % 2 ? 1 : 0));
+            bool found = false;
+            scan_ud.ForEachPurchase(UserData::PurchaseExpiry::kActive, now, false, [&](const Purchase& p) {
+                found = (p.id == want_id);
+                return !found;
+            });
+            return found;
+        });
+    }
+
+    if (failures) {
+        cerr << failures << " failures" << endl;
+        return 1;
+    }
+
+    cout << "purchases: " << purchase_count << "; scan purchases: " << scan_purchase_count
+         << "; iterations: " << iterations << endl;
+    stats.Print(cout);
+
+    return 0;
+}
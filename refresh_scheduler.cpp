@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include "refresh_scheduler.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace psicash {
+
+RefreshScheduler::RefreshScheduler(const RefreshSchedulerConfig& config, const Callbacks& callbacks)
+        : config_(config), callbacks_(callbacks), stop_(false), waiting_for_available_(false), nudges_(0),
+          interval_(config.min_interval), rand_(random_device()()) {
+    due_ = Clock::now() + Jittered(interval_);
+    thread_ = thread(&RefreshScheduler::Run, this);
+}
+
+RefreshScheduler::~RefreshScheduler() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+}
+
+void RefreshScheduler::Nudge() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        interval_ = config_.min_interval;
+        due_ = min(due_, Clock::now() + config_.nudge_delay);
+        waiting_for_available_ = false;
+        nudges_++;
+    }
+    wake_.notify_all();
+}
+
+void RefreshScheduler::Exclusive(const function<void()>& f) {
+    lock_guard<mutex> lock(refresh_mutex_);
+    f();
+}
+
+milliseconds RefreshScheduler::Interval() const {
+    lock_guard<mutex> lock(mutex_);
+    return interval_;
+}
+
+RefreshScheduler::Clock::duration RefreshScheduler::Jittered(milliseconds d) {
+    uniform_real_distribution<double> dist(1 - config_.jitter, 1 + config_.jitter);
+    return duration_cast<Clock::duration>(d * dist(rand_));
+}
+
+void RefreshScheduler::Run() {
+    unique_lock<mutex> lock(mutex_);
+    while (!stop_) {
+        // Wake at the due time, or just after the next purchase expiry if that's sooner
+        // (as the state changes then). That isn't jittered, as expiries are already
+        // spread out.
+        auto wake_at = due_;
+        if (!waiting_for_available_) {
+            lock.unlock();
+            auto until_expiry = callbacks_.time_until_next_expiry();
+            lock.lock();
+            if (until_expiry && *until_expiry > milliseconds::zero()) {
+                wake_at = min(wake_at, Clock::now() + *until_expiry + config_.nudge_delay);
+            }
+        }
+
+        if (waiting_for_available_) {
+            wake_.wait(lock, [this] { return stop_ || !waiting_for_available_; });
+            continue;
+        }
+
+        auto due_before = due_;
+        if (wake_.wait_until(lock, wake_at, [this, due_before] { return stop_ || due_ != due_before; })) {
+            // Stopped or nudged.
+            continue;
+        }
+
+        auto nudges_before = nudges_;
+        lock.unlock();
+        bool available;
+        Outcome outcome = Outcome::kFailed;
+        {
+            lock_guard<mutex> refresh_lock(refresh_mutex_);
+            available = callbacks_.available();
+            if (available) {
+                outcome = callbacks_.refresh();
+            }
+        }
+        lock.lock();
+
+        if (!available) {
+            // Unless a Nudge (e.g., for a new requester) came in the meantime.
+            waiting_for_available_ = (nudges_ == nudges_before);
+            continue;
+        }
+
+        // Back off while nothing changes (or refreshes fail).
+        if (outcome == Outcome::kChanged) {
+            interval_ = config_.min_interval;
+        } else {
+            interval_ = min(config_.max_interval,
+                            duration_cast<milliseconds>(interval_ * config_.backoff_factor));
+        }
+        due_ = Clock::now() + Jittered(interval_);
+    }
+}
+
+} // namespace psicash
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_REFRESH_SCHEDULER_H
+#define PSICASHLIB_REFRESH_SCHEDULER_H
+
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include "psicash.hpp"
+#include "vendor/nonstd/optional.hpp"
+
+namespace psicash {
+
+/// Runs refreshes on a single background thread, on an adaptive interval. See
+/// RefreshSchedulerConfig for the policy.
+/// RefreshScheduler operations are threadsafe.
+class RefreshScheduler {
+public:
+    enum class Outcome {
+        // The refresh succeeded and the state changed.
+        kChanged,
+        // The refresh succeeded but nothing changed.
+        kUnchanged,
+        // The refresh failed.
+        kFailed
+    };
+
+    struct Callbacks {
+        /// Does the refresh.
+        std::function<Outcome()> refresh;
+        /// Returns false if a refresh can't currently be done (e.g., there's no
+        /// requester), in which case the scheduler waits for Nudge.
+        std::function<bool()> available;
+        /// Returns the time until the next purchase expiry, if any.
+        std::function<nonstd::optional<std::chrono::milliseconds>()> time_until_next_expiry;
+    };
+
+    /// Starts the scheduler thread. The first refresh is after config.min_interval.
+    RefreshScheduler(const RefreshSchedulerConfig& config, const Callbacks& callbacks);
+    /// Stops the scheduler thread, waiting for any refresh in progress.
+    ~RefreshScheduler();
+
+    RefreshScheduler(const RefreshScheduler&) = delete;
+    RefreshScheduler& operator=(const RefreshScheduler&) = delete;
+
+    /// Indicates that the state has probably changed, so there should be a refresh
+    /// soon (after config.nudge_delay), and resets the interval. Also resumes a
+    /// scheduler that's waiting for a refresh to be available.
+    void Nudge();
+
+    /// Calls `f` while no refresh is in progress (or can start).
+    void Exclusive(const std::function<void()>& f);
+
+    /// The current interval (before jitter).
+    std::chrono::milliseconds Interval() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void Run();
+    // Must be called with mutex_ held.
+    Clock::duration Jittered(std::chrono::milliseconds d);
+
+    const RefreshSchedulerConfig config_;
+    const Callbacks callbacks_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    // Held while refreshing.
+    std::mutex refresh_mutex_;
+    bool stop_;
+    bool waiting_for_available_;
+    uint64_t nudges_;
+    Clock::time_point due_;
+    std::chrono::milliseconds interval_;
+    std::mt19937 rand_;
+    std::thread thread_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_REFRESH_SCHEDULER_H
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <atomic>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "refresh_scheduler.hpp"
+
+using namespace std;
+using namespace psicash;
+
+class TestRefreshScheduler : public ::testing::Test
+{
+  public:
+    TestRefreshScheduler()
+        : refreshes(0), available(true), outcome(RefreshScheduler::Outcome::kUnchanged),
+          has_expiry(false) {
+        config.min_interval = chrono::milliseconds(20);
+        config.max_interval = chrono::milliseconds(80);
+        config.backoff_factor = 2;
+        config.jitter = 0;
+        config.nudge_delay = chrono::milliseconds(0);
+    }
+
+    RefreshScheduler::Callbacks Callbacks() {
+        RefreshScheduler::Callbacks callbacks;
+        callbacks.refresh = [this] { refreshes++; return outcome.load(); };
+        callbacks.available = [this] { return available.load(); };
+        callbacks.time_until_next_expiry = [this]() -> nonstd::optional<chrono::milliseconds> {
+            if (!has_expiry) {
+                return nonstd::nullopt;
+            }
+            return chrono::duration_cast<chrono::milliseconds>(expiry - chrono::steady_clock::now());
+        };
+        return callbacks;
+    }
+
+    RefreshSchedulerConfig config;
+    atomic<int> refreshes;
+    atomic<bool> available;
+    atomic<RefreshScheduler::Outcome> outcome;
+    atomic<bool> has_expiry;
+    chrono::steady_clock::time_point expiry;
+};
+
+TEST_F(TestRefreshScheduler, Backoff)
+{
+    RefreshScheduler scheduler(config, Callbacks());
+    ASSERT_EQ(scheduler.Interval(), chrono::milliseconds(20));
+
+    // Refreshes at 20, 60 (+40), 140 (+80), 220 (+80)...
+    this_thread::sleep_for(chrono::milliseconds(250));
+    ASSERT_GE(refreshes, 3);
+    ASSERT_LE(refreshes, 5);
+    ASSERT_EQ(scheduler.Interval(), chrono::milliseconds(80));
+}
+
+TEST_F(TestRefreshScheduler, ChangedResetsInterval)
+{
+    outcome = RefreshScheduler::Outcome::kChanged;
+    RefreshScheduler scheduler(config, Callbacks());
+    this_thread::sleep_for(chrono::milliseconds(250));
+    ASSERT_GE(refreshes, 8);
+    ASSERT_EQ(scheduler.Interval(), chrono::milliseconds(20));
+}
+
+TEST_F(TestRefreshScheduler, Nudge)
+{
+    config.min_interval = chrono::seconds(10);
+    config.max_interval = chrono::seconds(10);
+    config.nudge_delay = chrono::milliseconds(10);
+    RefreshScheduler scheduler(config, Callbacks());
+
+    this_thread::sleep_for(chrono::milliseconds(50));
+    ASSERT_EQ(refreshes, 0);
+
+    scheduler.Nudge();
+    this_thread::sleep_for(chrono::milliseconds(100));
+    ASSERT_EQ(refreshes, 1);
+}
+
+TEST_F(TestRefreshScheduler, NextExpiry)
+{
+    config.min_interval = chrono::seconds(10);
+    config.max_interval = chrono::seconds(10);
+    expiry = chrono::steady_clock::now() + chrono::milliseconds(30);
+    has_expiry = true;
+    RefreshScheduler scheduler(config, Callbacks());
+
+    this_thread::sleep_for(chrono::milliseconds(20));
+    ASSERT_EQ(refreshes, 0);
+
+    // Once it has passed, the expiry doesn't cause more refreshes.
+    this_thread::sleep_for(chrono::milliseconds(130));
+    ASSERT_EQ(refreshes, 1);
+}
+
+TEST_F(TestRefreshScheduler, Unavailable)
+{
+    available = false;
+    RefreshScheduler scheduler(config, Callbacks());
+
+    this_thread::sleep_for(chrono::milliseconds(100));
+    ASSERT_EQ(refreshes, 0);
+
+    available = true;
+    this_thread::sleep_for(chrono::milliseconds(100));
+    // Still waiting for a Nudge.
+    ASSERT_EQ(refreshes, 0);
+
+    scheduler.Nudge();
+    this_thread::sleep_for(chrono::milliseconds(50));
+    ASSERT_GE(refreshes, 1);
+}
+
+TEST_F(TestRefreshScheduler, Exclusive)
+{
+    config.min_interval = chrono::milliseconds(1);
+    atomic<bool> in_exclusive(false);
+    atomic<bool> overlapped(false);
+    auto callbacks = Callbacks();
+    callbacks.refresh = [&] {
+        if (in_exclusive) {
+            overlapped = true;
+        }
+        refreshes++;
+        return RefreshScheduler::Outcome::kChanged;
+    };
+    RefreshScheduler scheduler(config, callbacks);
+
+    for (int i = 0; i < 10; i++) {
+        scheduler.Exclusive([&] {
+            in_exclusive = true;
+            this_thread::sleep_for(chrono::milliseconds(5));
+            in_exclusive = false;
+        });
+    }
+    ASSERT_FALSE(overlapped);
+    ASSERT_GT(refreshes, 0);
+}
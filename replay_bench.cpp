@@ -0,0 +1,215 @@
+/*
+ * Replays recorded HTTP sessions through the full PsiCash state machine and reports
+ * per-operation latency and allocations.
+ *
+ * Usage: replay_bench [--iterations=N] [--time-scale=X] [recording.jsonl ...]
+ *
+ * Recordings are made with HTTPRecorder (starting from an empty datastore). The API
+ * calls to replay are derived from the recorded requests: each first attempt of
+ * /refresh-state becomes a RefreshState and each first attempt of /transaction becomes a
+ * NewExpiringPurchase. Every session is followed by ExpirePurchases. If no recordings are
+ * given, a built-in synthetic session (startup, refresh, purchase, expiry) is used.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench_helpers.hpp"
+#include "http_recorder.hpp"
+#include "psicash.hpp"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+static const char* kUserAgent = "Psiphon-PsiCash-Bench";
+
+// Server date and purchase expiry are the same, so the purchase is expired by the time
+// ExpirePurchases is called.
+static const char* kServerDate = "Mon, 14 Jan 2019 17:22:23 GMT";
+static const char* kAuthorizationEncoded = "eyJBdXRob3JpemF0aW9uIjp7IklEIjoiMFYzRXhUdmlBdFNxTGZOd2FpQXlHNHpaRUJJOGpIYnp5bFdNeU5FZ1JEZz0iLCJBY2Nlc3NUeXBlIjoic3BlZWQtYm9vc3QtdGVzdCIsIkV4cGlyZXMiOiIyMDE5LTAxLTE0VDE3OjIyOjIzLjE2ODc2NDEyOVoifSwiU2lnbmluZ0tleUlEIjoiUUNZTzV2clIvZGhjRDZ6M2FMQlVNeWRuZlJyZFNRL1RWYW1IUFhYeTd0TT0iLCJTaWduYXR1cmUiOiJQL2NrenloVUJoSk5RQ24zMnluM1VTdGpLencxU04xNW9MclVhTU9XaW9scXBOTTBzNVFSNURHVEVDT1FzQk13ODdQdTc1TGE1OGtJTHRIcW1BVzhDQT09In0=";
+
+static HTTPExchange MakeExchange(const string& method, const string& path,
+                                 const vector<pair<string, string>>& query,
+                                 const json& body) {
+    HTTPExchange e;
+    e.params.scheme = "https";
+    e.params.hostname = "api.psi.cash";
+    e.params.port = 443;
+    e.params.method = method;
+    e.params.path = path;
+    e.params.headers["X-PsiCash-Metadata"] = R"({"attempt":1})";
+    e.params.query = query;
+    e.result.code = 200;
+    e.result.body = body.dump();
+    e.result.date = kServerDate;
+    e.elapsed = datetime::Duration(80);
+    return e;
+}
+
+static HTTPExchanges SyntheticSession() {
+    json tokens_valid = {{"scrubbed-token-1", true},
+                         {"scrubbed-token-2", true},
+                         {"scrubbed-token-3", true}};
+    json prices = json::array();
+    for (const auto& d : {"1hr", "2hr", "3hr", "24hr", "7day", "30day"}) {
+        prices.push_back({{"Class", "speed-boost"}, {"Distinguisher", d}, {"Price", 100}});
+    }
+
+    return {
+        MakeExchange("POST", "/v1/tracker", {},
+                     {{"earner", "scrubbed-token-1"},
+                      {"spender", "scrubbed-token-2"},
+                      {"indicator", "scrubbed-token-3"}}),
+        MakeExchange("GET", "/v1/refresh-state", {{"class", "speed-boost"}},
+                     {{"TokensValid", tokens_valid}, {"IsAccount", false},
+                      {"Balance", 1000}, {"PurchasePrices", prices}}),
+        MakeExchange("POST", "/v1/transaction",
+                     {{"class", "speed-boost"}, {"distinguisher", "1hr"},
+                      {"expectedAmount", "-100"}},
+                     {{"TransactionID", "tx1"}, {"Balance", 900},
+                      {"Authorization", kAuthorizationEncoded},
+                      {"TransactionResponse", {{"Type", "expiring-purchase"},
+                                               {"Values", {{"Expires", "2019-01-14T17:22:23Z"}}}}}}),
+        MakeExchange("GET", "/v1/refresh-state", {{"class", "speed-boost"}},
+                     {{"TokensValid", tokens_valid}, {"IsAccount", false},
+                      {"Balance", 900}, {"PurchasePrices", prices}}),
+    };
+}
+
+// Returns true if this exchange is a retry of a previous request.
+static bool IsRetry(const HTTPExchange& e) {
+    auto metadata = e.params.headers.find("X-PsiCash-Metadata");
+    if (metadata == e.params.headers.end()) {
+        return false;
+    }
+    try {
+        return json::parse(metadata->second).value("attempt", 1) > 1;
+    }
+    catch (json::exception&) {
+        return false;
+    }
+}
+
+static string QueryValue(const HTTPExchange& e, const string& name) {
+    for (const auto& q : e.params.query) {
+        if (q.first == name) {
+            return q.second;
+        }
+    }
+    return "";
+}
+
+static bool PathEndsWith(const HTTPExchange& e, const string& suffix) {
+    const auto& p = e.params.path;
+    return p.size() >= suffix.size() && p.compare(p.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool ReplaySession(const HTTPExchanges& exchanges, double time_scale, bench::OpStats& stats) {
+    HTTPReplayer replayer(exchanges, time_scale);
+    PsiCash pc;
+    auto file_store_root = bench::MakeTempDir();
+
+    auto err = bench::Measure(stats, "startup", [&] {
+        auto err = pc.Init(kUserAgent, file_store_root.c_str(), nullptr);
+        pc.SetHTTPRequestRefFn(replayer.RequesterRef());
+        return err;
+    });
+    if (err) {
+        cerr << "Init failed: " << err << endl;
+        return false;
+    }
+
+    for (const auto& e : exchanges) {
+        if (IsRetry(e)) {
+            continue;
+        }
+
+        if (PathEndsWith(e, "/refresh-state")) {
+            vector<string> classes;
+            for (const auto& q : e.params.query) {
+                if (q.first == "class") {
+                    classes.push_back(q.second);
+                }
+            }
+            auto res = bench::Measure(stats, "refresh", [&] { return pc.RefreshState(classes); });
+            if (!res) {
+                cerr << "RefreshState failed: " << res.error() << endl;
+                return false;
+            }
+        } else if (PathEndsWith(e, "/transaction")) {
+            auto res = bench::Measure(stats, "purchase", [&] {
+                return pc.NewExpiringPurchase(QueryValue(e, "class"), QueryValue(e, "distinguisher"),
+                                              -strtoll(QueryValue(e, "expectedAmount").c_str(), nullptr, 10));
+            });
+            if (!res) {
+                cerr << "NewExpiringPurchase failed: " << res.error() << endl;
+                return false;
+            }
+        }
+    }
+
+    auto res = bench::Measure(stats, "expiry", [&] { return pc.ExpirePurchases(); });
+    if (!res) {
+        cerr << "ExpirePurchases failed: " << res.error() << endl;
+        return false;
+    }
+
+    if (replayer.Remaining() != 0) {
+        cerr << "session ended with " << replayer.Remaining() << " exchanges unreplayed" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int iterations = 100;
+    double time_scale = 0;
+    vector<string> files;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--iterations=") == 0) {
+            iterations = atoi(arg.c_str() + strlen("--iterations="));
+        } else if (arg.find("--time-scale=") == 0) {
+            time_scale = atof(arg.c_str() + strlen("--time-scale="));
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    vector<pair<string, HTTPExchanges>> sessions;
+    if (files.empty()) {
+        sessions.push_back({"synthetic", SyntheticSession()});
+    }
+    for (const auto& f : files) {
+        auto exchanges = HTTPReplayer::Load(f);
+        if (!exchanges) {
+            cerr << "failed to load " << f << ": " << exchanges.error() << endl;
+            return 1;
+        }
+        sessions.push_back({f, *exchanges});
+    }
+
+    for (const auto& session : sessions) {
+        bench::OpStats stats;
+        for (int i = 0; i < iterations; i++) {
+            if (!ReplaySession(session.second, time_scale, stats)) {
+                return 1;
+            }
+        }
+
+        cout << "session: " << session.first << "; iterations: " << iterations
+             << "; time scale: " << time_scale << endl;
+        stats.Print(cout);
+        cout << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "request_hedger.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace psicash {
+
+// The number of recent request latencies that the hedge delay is computed from, and
+// how many are needed before they're used.
+static constexpr size_t kLatencySamples = 100;
+static constexpr size_t kMinLatencySamples = 10;
+
+struct RequestHedger::State {
+    HedgingConfig config;
+
+    mutable std::mutex mtx;
+    vector<milliseconds> latencies; // ring buffer of the most recent kLatencySamples
+    size_t next_latency;
+    double budget;
+    HedgingStats stats;
+
+    // The attempt threads. They're reused, so a new one is only started when all are
+    // busy -- in practice, for a hedge. Guarded by worker_mtx.
+    std::mutex worker_mtx;
+    condition_variable work_available;
+    deque<function<void()>> work;
+    vector<thread> workers;
+    size_t idle_workers;
+    bool stopping;
+
+    explicit State(const HedgingConfig& c)
+            : config(c), next_latency(0), budget(c.budget_burst), stats({0, 0, 0, 0}),
+              idle_workers(0), stopping(false) {
+    }
+
+    void AddLatency(milliseconds latency) {
+        lock_guard<std::mutex> lock(mtx);
+        if (latencies.size() < kLatencySamples) {
+            latencies.push_back(latency);
+        } else {
+            latencies[next_latency] = latency;
+        }
+        next_latency = (next_latency + 1) % kLatencySamples;
+    }
+
+    // Must be called with the mutex held.
+    milliseconds HedgeDelay() const {
+        if (latencies.size() < kMinLatencySamples) {
+            return config.initial_delay;
+        }
+
+        auto sorted = latencies;
+        sort(sorted.begin(), sorted.end());
+        auto index = static_cast<size_t>(config.delay_percentile / 100 * (sorted.size() - 1));
+        auto delay = sorted[min(index, sorted.size() - 1)];
+        return max(config.min_delay, min(config.max_delay, delay));
+    }
+
+    void Run(function<void()> fn) {
+        lock_guard<std::mutex> lock(worker_mtx);
+        work.push_back(std::move(fn));
+        if (idle_workers < work.size()) {
+            workers.emplace_back([this] { WorkerLoop(); });
+        } else {
+            work_available.notify_one();
+        }
+    }
+
+    void WorkerLoop() {
+        unique_lock<std::mutex> lock(worker_mtx);
+        for (;;) {
+            idle_workers++;
+            work_available.wait(lock, [this] { return stopping || !work.empty(); });
+            idle_workers--;
+            if (work.empty()) {
+                return; // stopping
+            }
+            auto fn = std::move(work.front());
+            work.pop_front();
+            lock.unlock();
+            fn();
+            lock.lock();
+        }
+    }
+
+    // Waits for all attempts to complete, including those still queued.
+    void StopWorkers() {
+        {
+            lock_guard<std::mutex> lock(worker_mtx);
+            stopping = true;
+        }
+        work_available.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+};
+
+namespace {
+
+// An owned copy of an HTTPRequestRef, for requests that may outlive the original.
+class OwnedRequest {
+public:
+    explicit OwnedRequest(const HTTPRequestRef& req)
+            : scheme_(req.scheme.str()), hostname_(req.hostname.str()),
+              method_(req.method.str()), path_(req.path.str()), query_(req.query.str()),
+              query_params_(req.query_params ? *req.query_params : decltype(query_params_)()) {
+        for (size_t i = 0; i < req.header_count; i++) {
+            headers_.emplace_back(req.headers[i].name.str(), req.headers[i].value.str());
+        }
+        for (const auto& h : headers_) {
+            header_refs_.push_back({h.first, h.second});
+        }
+
+        ref_.scheme = scheme_;
+        ref_.hostname = hostname_;
+        ref_.port = req.port;
+        ref_.method = method_;
+        ref_.path = path_;
+        ref_.headers = header_refs_.data();
+        ref_.header_count = header_refs_.size();
+        ref_.query = query_;
+        ref_.query_params = &query_params_;
+    }
+
+    // ref_ points into this object.
+    OwnedRequest(const OwnedRequest&) = delete;
+    OwnedRequest& operator=(const OwnedRequest&) = delete;
+
+    const HTTPRequestRef& Ref() const { return ref_; }
+
+private:
+    string scheme_, hostname_, method_, path_, query_;
+    vector<pair<string, string>> query_params_;
+    vector<pair<string, string>> headers_;
+    vector<HTTPHeaderRef> header_refs_;
+    HTTPRequestRef ref_;
+};
+
+// The race between the original and hedge requests. Shared with the attempt threads.
+// The first attempt to get a response from the server wins; if all of the attempts
+// that were started fail, the race finishes with the last failure.
+struct Race {
+    OwnedRequest req;
+    MakeHTTPRequestRefFn make_http_request_fn;
+
+    std::mutex mtx;
+    condition_variable done;
+    int started;
+    int failed;
+    bool finished;
+    int winner;
+    HTTPResult result;
+
+    Race(const HTTPRequestRef& r, const MakeHTTPRequestRefFn& fn)
+            : req(r), make_http_request_fn(fn), started(0), failed(0), finished(false),
+              winner(-1) {}
+};
+
+// Like the retry logic in PsiCash: anything under 500 is a response worth keeping.
+bool IsSuccess(const HTTPResult& result) {
+    return result.code >= 0 && result.code < 500;
+}
+
+} // namespace
+
+// Runs attempt `index` of the race. Must be counted in race->started before it's
+// queued. The latency of the original request (index 0) is passed to `record_latency`,
+// whether or not it wins.
+static void RunAttempt(const shared_ptr<Race>& race, int index,
+                       const function<void(milliseconds)>& record_latency) {
+    {
+        lock_guard<mutex> lock(race->mtx);
+        if (race->finished) {
+            // Won by another attempt before this one got a thread.
+            race->failed++;
+            return;
+        }
+    }
+
+    auto start = steady_clock::now();
+    HTTPResult result;
+    try {
+        result = race->make_http_request_fn(race->req.Ref());
+    }
+    catch (const std::exception& e) {
+        result.code = HTTPResult::RECOVERABLE_ERROR;
+        result.error = "requester threw: "s + e.what();
+    }
+    catch (...) {
+        result.code = HTTPResult::RECOVERABLE_ERROR;
+        result.error = "requester threw";
+    }
+    if (index == 0) {
+        record_latency(duration_cast<milliseconds>(steady_clock::now() - start));
+    }
+
+    lock_guard<mutex> lock(race->mtx);
+    if (race->finished) {
+        return;
+    }
+    if (IsSuccess(result)) {
+        race->finished = true;
+        race->winner = index;
+        race->result = std::move(result);
+        race->done.notify_all();
+        return;
+    }
+    race->failed++;
+    race->result = std::move(result);
+    if (race->failed == race->started) {
+        race->finished = true;
+        race->winner = index;
+        race->done.notify_all();
+    }
+}
+
+RequestHedger::RequestHedger(const HedgingConfig& config)
+        : state_(make_unique<State>(config)) {
+}
+
+RequestHedger::~RequestHedger() {
+    state_->StopWorkers();
+}
+
+HTTPResult RequestHedger::Request(const MakeHTTPRequestRefFn& make_http_request_fn,
+                                  const HTTPRequestRef& req) {
+    milliseconds delay;
+    {
+        lock_guard<mutex> lock(state_->mtx);
+        state_->stats.requests++;
+        state_->budget = min(state_->config.budget_burst,
+                             state_->budget + state_->config.budget_ratio);
+        delay = state_->HedgeDelay();
+    }
+
+    auto race = make_shared<Race>(req, make_http_request_fn);
+    auto state = state_.get();
+    race->started = 1;
+    state->Run([state, race] {
+        RunAttempt(race, 0, [state](milliseconds latency) { state->AddLatency(latency); });
+    });
+
+    unique_lock<mutex> race_lock(race->mtx);
+    if (!race->done.wait_for(race_lock, delay, [&race] { return race->finished; })) {
+        bool hedge;
+        {
+            lock_guard<mutex> lock(state_->mtx);
+            hedge = state_->budget >= 1;
+            if (hedge) {
+                state_->budget -= 1;
+                state_->stats.hedged++;
+            } else {
+                state_->stats.budget_exhausted++;
+            }
+        }
+
+        if (hedge) {
+            race->started++;
+            state->Run([race] { RunAttempt(race, 1, nullptr); });
+        }
+        race->done.wait(race_lock, [&race] { return race->finished; });
+    }
+
+    if (race->winner == 1 && IsSuccess(race->result)) {
+        lock_guard<mutex> lock(state_->mtx);
+        state_->stats.hedge_wins++;
+    }
+
+    return std::move(race->result);
+}
+
+milliseconds RequestHedger::HedgeDelay() const {
+    lock_guard<mutex> lock(state_->mtx);
+    return state_->HedgeDelay();
+}
+
+HedgingStats RequestHedger::Stats() const {
+    lock_guard<mutex> lock(state_->mtx);
+    return state_->stats;
+}
+
+} // namespace psicash
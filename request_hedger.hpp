@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_REQUEST_HEDGER_H
+#define PSICASHLIB_REQUEST_HEDGER_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include "psicash.hpp"
+
+namespace psicash {
+
+struct HedgingStats {
+    uint64_t requests;
+    // Requests for which a hedge request was made.
+    uint64_t hedged;
+    // Hedged requests for which the hedge result was used.
+    uint64_t hedge_wins;
+    // Requests that would have been hedged, but the budget was exhausted.
+    uint64_t budget_exhausted;
+};
+
+/// Makes HTTP requests, hedging those that are slow. See HedgingConfig.
+/// RequestHedger operations are threadsafe.
+class RequestHedger {
+public:
+    explicit RequestHedger(const HedgingConfig& config);
+
+    /// Waits for any losing requests that are still running.
+    ~RequestHedger();
+
+    /// Makes the request with `make_http_request_fn`, which is called on other threads
+    /// and may be called concurrently. `req` is copied for each call, so it need only be
+    /// valid for the duration of this call, but a losing call is not cancelled and may
+    /// still be running after this returns -- until this object is destroyed.
+    /// The first response with a status under 500 is returned; failures are only
+    /// returned once every request that was made has failed. A requester exception is
+    /// treated as a RECOVERABLE_ERROR result.
+    HTTPResult Request(const MakeHTTPRequestRefFn& make_http_request_fn, const HTTPRequestRef& req);
+
+    /// The current hedge delay.
+    std::chrono::milliseconds HedgeDelay() const;
+
+    HedgingStats Stats() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_REQUEST_HEDGER_H
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "request_hedger.hpp"
+
+using namespace std;
+using namespace psicash;
+
+// Returns a requester whose first call takes `first_delay` and later calls are
+// immediate. The body is the call number.
+static MakeHTTPRequestRefFn SlowFirstRequester(chrono::milliseconds first_delay,
+                                               shared_ptr<atomic<int>> calls) {
+    return [first_delay, calls](const HTTPRequestRef& req) {
+        auto call = (*calls)++;
+        if (call == 0) {
+            this_thread::sleep_for(first_delay);
+        }
+        HTTPResult res;
+        res.code = 200;
+        res.body = to_string(call) + ":" + req.path.str();
+        return res;
+    };
+}
+
+static HTTPRequestRef Request(const string& path) {
+    HTTPRequestRef req;
+    req.scheme = "https";
+    req.hostname = "example.com";
+    req.port = 443;
+    req.method = "GET";
+    req.path = path;
+    return req;
+}
+
+static HedgingConfig TestConfig() {
+    HedgingConfig config;
+    config.initial_delay = chrono::milliseconds(50);
+    config.min_delay = chrono::milliseconds(10);
+    return config;
+}
+
+TEST(TestRequestHedger, NoHedge)
+{
+    RequestHedger hedger(TestConfig());
+    auto calls = make_shared<atomic<int>>(0);
+    auto requester = SlowFirstRequester(chrono::milliseconds(0), calls);
+
+    for (int i = 0; i < 5; i++) {
+        string path = "/path";
+        auto res = hedger.Request(requester, Request(path));
+        ASSERT_EQ(res.code, 200);
+        ASSERT_EQ(res.body, to_string(i) + ":/path");
+    }
+
+    auto stats = hedger.Stats();
+    ASSERT_EQ(stats.requests, 5);
+    ASSERT_EQ(stats.hedged, 0);
+    ASSERT_EQ(stats.hedge_wins, 0);
+    ASSERT_EQ(*calls, 5);
+}
+
+TEST(TestRequestHedger, HedgeWins)
+{
+    RequestHedger hedger(TestConfig());
+    auto calls = make_shared<atomic<int>>(0);
+    auto requester = SlowFirstRequester(chrono::milliseconds(1000), calls);
+
+    auto start = chrono::steady_clock::now();
+    HTTPResult res;
+    {
+        // The request must be copied, as the original call outlives this.
+        string path = "/path";
+        res = hedger.Request(requester, Request(path));
+    }
+    auto elapsed = chrono::steady_clock::now() - start;
+
+    ASSERT_EQ(res.body, "1:/path");
+    ASSERT_LT(elapsed, chrono::milliseconds(500));
+    auto stats = hedger.Stats();
+    ASSERT_EQ(stats.requests, 1);
+    ASSERT_EQ(stats.hedged, 1);
+    ASSERT_EQ(stats.hedge_wins, 1);
+}
+
+TEST(TestRequestHedger, BudgetExhausted)
+{
+    auto config = TestConfig();
+    config.budget_ratio = 0;
+    config.budget_burst = 0;
+    RequestHedger hedger(config);
+    auto calls = make_shared<atomic<int>>(0);
+    auto requester = SlowFirstRequester(chrono::milliseconds(200), calls);
+
+    auto res = hedger.Request(requester, Request("/path"));
+    ASSERT_EQ(res.body, "0:/path");
+    auto stats = hedger.Stats();
+    ASSERT_EQ(stats.hedged, 0);
+    ASSERT_EQ(stats.budget_exhausted, 1);
+    ASSERT_EQ(*calls, 1);
+}
+
+TEST(TestRequestHedger, HedgeDelay)
+{
+    auto config = TestConfig();
+    config.initial_delay = chrono::milliseconds(5000);
+    config.min_delay = chrono::milliseconds(20);
+    RequestHedger hedger(config);
+    ASSERT_EQ(hedger.HedgeDelay(), chrono::milliseconds(5000));
+
+    // Fast requests bring the delay down to the minimum.
+    auto calls = make_shared<atomic<int>>(0);
+    auto requester = SlowFirstRequester(chrono::milliseconds(0), calls);
+    for (int i = 0; i < 20; i++) {
+        (void)hedger.Request(requester, Request("/path"));
+    }
+    // The latency of the last request may be recorded just after it returns.
+    this_thread::sleep_for(chrono::milliseconds(50));
+    ASSERT_EQ(hedger.HedgeDelay(), chrono::milliseconds(20));
+}
+
+TEST(TestRequestHedger, FastFailureDoesNotWin)
+{
+    RequestHedger hedger(TestConfig());
+    auto calls = make_shared<atomic<int>>(0);
+    // The original is slow but succeeds; the hedge fails immediately.
+    MakeHTTPRequestRefFn requester = [calls](const HTTPRequestRef&) {
+        HTTPResult res;
+        if ((*calls)++ == 0) {
+            this_thread::sleep_for(chrono::milliseconds(200));
+            res.code = 200;
+            res.body = "original";
+        } else {
+            res.code = HTTPResult::RECOVERABLE_ERROR;
+            res.error = "bad tunnel";
+        }
+        return res;
+    };
+
+    auto res = hedger.Request(requester, Request("/path"));
+    ASSERT_EQ(res.code, 200);
+    ASSERT_EQ(res.body, "original");
+    auto stats = hedger.Stats();
+    ASSERT_EQ(stats.hedged, 1);
+    ASSERT_EQ(stats.hedge_wins, 0);
+}
+
+TEST(TestRequestHedger, AllFail)
+{
+    RequestHedger hedger(TestConfig());
+    auto calls = make_shared<atomic<int>>(0);
+    MakeHTTPRequestRefFn requester = [calls](const HTTPRequestRef&) {
+        HTTPResult res;
+        if ((*calls)++ == 0) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        res.code = 503;
+        return res;
+    };
+
+    auto res = hedger.Request(requester, Request("/path"));
+    ASSERT_EQ(res.code, 503);
+    ASSERT_EQ(*calls, 2);
+}
+
+TEST(TestRequestHedger, RequesterThrows)
+{
+    RequestHedger hedger(TestConfig());
+    MakeHTTPRequestRefFn requester = [](const HTTPRequestRef&) -> HTTPResult {
+        throw std::runtime_error("oops");
+    };
+
+    auto res = hedger.Request(requester, Request("/path"));
+    ASSERT_EQ(res.code, HTTPResult::RECOVERABLE_ERROR);
+    ASSERT_FALSE(res.error.empty());
+}
+
+TEST(TestRequestHedger, DestructorWaitsForLoser)
+{
+    auto running = make_shared<atomic<bool>>(false);
+    {
+        RequestHedger hedger(TestConfig());
+        auto calls = make_shared<atomic<int>>(0);
+        MakeHTTPRequestRefFn requester = [calls, running](const HTTPRequestRef&) {
+            HTTPResult res;
+            res.code = 200;
+            if ((*calls)++ == 0) {
+                *running = true;
+                this_thread::sleep_for(chrono::milliseconds(200));
+                *running = false;
+            }
+            return res;
+        };
+        (void)hedger.Request(requester, Request("/path"));
+        ASSERT_TRUE(*running);
+    }
+    ASSERT_FALSE(*running);
+}
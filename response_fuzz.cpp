@@ -0,0 +1,26 @@
+/*
+ * Fuzz target for the API response parsers used by RefreshState, NewTracker and
+ * NewExpiringPurchase, and for the generic document parser used by the datastore,
+ * with each available JSON parser.
+ */
+
+#include "fuzz_helpers.hpp"
+#include "response_parser.hpp"
+
+using namespace psicash;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz::Budget budget("response");
+    auto s = fuzz::AsString(data, size);
+
+    for (auto parser : {JSONParser::Nlohmann, JSONParser::Simdjson}) {
+        if (!JSONParserAvailable(parser)) {
+            continue;
+        }
+        (void)ParseRefreshStateResponse(s, parser);
+        (void)ParseNewTrackerResponse(s, parser);
+        (void)ParseTransactionResponse(s, parser);
+        (void)ParseJSONDocument(s, parser);
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "response_parser.hpp"
+#include "arena.hpp"
+#include "flight_recorder.hpp"
+#include "utils.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace nonstd;
+using namespace psicash;
+using namespace error;
+
+namespace psicash {
+
+JSONParser DefaultJSONParser() {
+#ifdef PSICASH_USE_SIMDJSON
+    return JSONParser::Simdjson;
+#else
+    return JSONParser::Nlohmann;
+#endif
+}
+
+bool JSONParserAvailable(JSONParser parser) {
+#ifdef PSICASH_USE_SIMDJSON
+    (void)parser;
+    return true;
+#else
+    return parser == JSONParser::Nlohmann;
+#endif
+}
+
+// Selects the simdjson implementation of a parse function, if requested.
+#ifdef PSICASH_USE_SIMDJSON
+#define DISPATCH_TO_SIMDJSON(parser, fn, arg) \
+    if ((parser) == JSONParser::Simdjson) { return simdjson_parser::fn(arg); }
+#else
+static Error ParserUnavailableError() {
+    return MakeCriticalError("simdjson parser not available; build with PSICASH_USE_SIMDJSON");
+}
+
+#define DISPATCH_TO_SIMDJSON(parser, fn, arg) \
+    if ((parser) == JSONParser::Simdjson) { return ParserUnavailableError(); }
+#endif
+
+//
+// nlohmann implementations. Responses are parsed into arena_json, as the parsed
+// document doesn't outlive the call.
+//
+
+Result<RefreshStateResponse> ParseRefreshStateResponse(const string& body, JSONParser parser) {
+    FlightRecorder::PhaseTimer parse_timer(FlightRecorder::Phase::kParse);
+    DISPATCH_TO_SIMDJSON(parser, ParseRefreshStateResponse, body);
+
+    try {
+        ArenaScope arena_scope;
+        auto j = arena_json::parse(body);
+
+        RefreshStateResponse res;
+        res.tokens_valid = j["TokensValid"].get<map<string, bool>>();
+
+        if (j["IsAccount"].is_boolean()) {
+            res.is_account = j["IsAccount"].get<bool>();
+        }
+
+        if (j["Balance"].is_number_integer()) {
+            res.balance = j["Balance"].get<int64_t>();
+        }
+
+        // The from_json for the PurchasePrice struct is for our internal (datastore and library API)
+        // representation of PurchasePrice. We won't assume that the representation used by the
+        // server is the same (nor that it won't change independent of our representation).
+        if (j["PurchasePrices"].is_array()) {
+            PurchasePrices purchase_prices;
+            for (const auto& pp : j["PurchasePrices"]) {
+                purchase_prices.push_back(PurchasePrice{
+                        pp.at("Class").get<string>(),
+                        pp.at("Distinguisher").get<string>(),
+                        pp.at("Price").get<int64_t>()
+                });
+            }
+            res.purchase_prices = std::move(purchase_prices);
+        }
+
+        return res;
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+    }
+}
+
+Result<AuthTokens> ParseNewTrackerResponse(const string& body, JSONParser parser) {
+    FlightRecorder::PhaseTimer parse_timer(FlightRecorder::Phase::kParse);
+    DISPATCH_TO_SIMDJSON(parser, ParseNewTrackerResponse, body);
+
+    try {
+        ArenaScope arena_scope;
+        auto j = arena_json::parse(body);
+        return j.get<AuthTokens>();
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+    }
+}
+
+Result<TransactionResponse> ParseTransactionResponse(const string& body, JSONParser parser) {
+    FlightRecorder::PhaseTimer parse_timer(FlightRecorder::Phase::kParse);
+    DISPATCH_TO_SIMDJSON(parser, ParseTransactionResponse, body);
+
+    try {
+        ArenaScope arena_scope;
+        auto j = arena_json::parse(body);
+
+        // Many response fields are optional (depending on the presence of the indicator token)
+        TransactionResponse res;
+
+        if (j["Balance"].is_number_integer()) {
+            res.balance = j["Balance"].get<int64_t>();
+        }
+
+        if (j["TransactionID"].is_string()) {
+            res.transaction_id = j["TransactionID"].get<string>();
+        }
+
+        if (j["Authorization"].is_string()) {
+            res.authorization = j["Authorization"].get<string>();
+        }
+
+        if (j["TransactionResponse"]["Type"].is_string()) {
+            res.type = j["TransactionResponse"]["Type"].get<string>();
+        }
+
+        if (j["TransactionResponse"]["Values"]["Expires"].is_string()) {
+            res.expires = j["TransactionResponse"]["Values"]["Expires"].get<string>();
+        }
+
+        return res;
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+    }
+}
+
+Result<Authorization> ParseAuthorization(const string& decoded, JSONParser parser) {
+    FlightRecorder::PhaseTimer parse_timer(FlightRecorder::Phase::kParse);
+    DISPATCH_TO_SIMDJSON(parser, ParseAuthorization, decoded);
+
+    try {
+        auto j = json::parse(decoded);
+        return j.at("Authorization").get<Authorization>();
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+    }
+}
+
+Result<flat_json> ParseJSONDocument(const string& s, JSONParser parser) {
+    DISPATCH_TO_SIMDJSON(parser, ParseJSONDocument, s);
+
+    try {
+        return flat_json::parse(s);
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("json parse failed: ", e.what(), "; id:", e.id).c_str());
+    }
+}
+
+} // namespace psicash
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_RESPONSE_PARSER_H
+#define PSICASHLIB_RESPONSE_PARSER_H
+
+#include <string>
+#include <map>
+#include <cstdint>
+#include "vendor/nonstd/optional.hpp"
+#include "vendor/nlohmann/json.hpp"
+#include "psicash.hpp"
+#include "userdata.hpp"
+#include "error.hpp"
+#include "flat_json.hpp"
+
+namespace psicash {
+
+// Typed parsing of API server responses (and other JSON the library reads), with a
+// choice of parser. nlohmann is always available; simdjson (using its On Demand API)
+// is available if the library is built with PSICASH_USE_SIMDJSON (the CMake option of
+// the same name). Both produce the same results for well-formed JSON. Note that On
+// Demand only validates the parts of a document that are read, so simdjson may accept
+// a response that is malformed somewhere the library doesn't look.
+
+enum class JSONParser {
+    Nlohmann,
+    Simdjson
+};
+
+/// Simdjson if it's available, otherwise Nlohmann.
+JSONParser DefaultJSONParser();
+
+/// Returns true if the given parser was built into the library.
+bool JSONParserAvailable(JSONParser parser);
+
+/// The fields of a /refresh-state response body. Optional fields are unset if missing
+/// or of the wrong type.
+struct RefreshStateResponse {
+    std::map<std::string, bool> tokens_valid;
+    nonstd::optional<bool> is_account;
+    nonstd::optional<int64_t> balance;
+    // Unset if the response had no PurchasePrices array.
+    nonstd::optional<PurchasePrices> purchase_prices;
+};
+
+/// The fields of a /transaction response body. String fields are empty if missing or
+/// of the wrong type.
+struct TransactionResponse {
+    nonstd::optional<int64_t> balance;
+    std::string transaction_id;
+    // Still encoded; see DecodeAuthorization.
+    std::string authorization;
+    // TransactionResponse.Type
+    std::string type;
+    // TransactionResponse.Values.Expires, unparsed.
+    std::string expires;
+};
+
+/// `TokensValid` is required; `PurchasePrices` entries must be complete.
+error::Result<RefreshStateResponse> ParseRefreshStateResponse(
+        const std::string& body, JSONParser parser = DefaultJSONParser());
+
+/// Parses the tokens returned by /tracker.
+error::Result<AuthTokens> ParseNewTrackerResponse(
+        const std::string& body, JSONParser parser = DefaultJSONParser());
+
+error::Result<TransactionResponse> ParseTransactionResponse(
+        const std::string& body, JSONParser parser = DefaultJSONParser());
+
+/// Parses a decoded authorization, like `{"Authorization":{...},"Signature":...}`.
+/// The `encoded` field of the result is not set.
+error::Result<Authorization> ParseAuthorization(
+        const std::string& decoded, JSONParser parser = DefaultJSONParser());
+
+/// Parses an arbitrary document into a flat_json value. Used for loading the datastore.
+error::Result<flat_json> ParseJSONDocument(
+        const std::string& s, JSONParser parser = DefaultJSONParser());
+
+#ifdef PSICASH_USE_SIMDJSON
+namespace simdjson_parser {
+// The simdjson implementations of the above. See response_parser_simdjson.cpp.
+error::Result<RefreshStateResponse> ParseRefreshStateResponse(const std::string& body);
+error::Result<AuthTokens> ParseNewTrackerResponse(const std::string& body);
+error::Result<TransactionResponse> ParseTransactionResponse(const std::string& body);
+error::Result<Authorization> ParseAuthorization(const std::string& decoded);
+error::Result<flat_json> ParseJSONDocument(const std::string& s);
+} // namespace simdjson_parser
+#endif
+
+} // namespace psicash
+
+#endif //PSICASHLIB_RESPONSE_PARSER_H
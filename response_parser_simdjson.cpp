@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// The simdjson (On Demand) implementations of the response_parser.hpp functions. This
+// file is empty unless the library is built with PSICASH_USE_SIMDJSON.
+
+#ifdef PSICASH_USE_SIMDJSON
+
+#include "simdjson.h"
+#include "response_parser.hpp"
+#include "utils.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+using namespace error;
+
+namespace psicash {
+namespace simdjson_parser {
+
+namespace ondemand = simdjson::ondemand;
+using simdjson::error_code;
+using simdjson::simdjson_result;
+using simdjson::padded_string;
+using simdjson::SUCCESS;
+using simdjson::NO_SUCH_FIELD;
+using simdjson::INCORRECT_TYPE;
+using simdjson::NUMBER_OUT_OF_RANGE;
+using simdjson::TRAILING_CONTENT;
+
+// A parser reuses its internal buffers between documents, so we keep one per thread.
+static ondemand::parser& Parser() {
+    static thread_local ondemand::parser parser;
+    return parser;
+}
+
+static Error ParseError(error_code err, const char* what) {
+    return MakeCriticalError(
+            utils::Stringer("json parse failed: ", what, ": ", simdjson::error_message(err)).c_str());
+}
+
+// Returns true if the error just means that an optional value is missing or of the wrong
+// type, rather than that the document is malformed.
+static bool IsAbsent(error_code err) {
+    return err == NO_SUCH_FIELD || err == INCORRECT_TYPE || err == NUMBER_OUT_OF_RANGE;
+}
+
+// Reads an optional value into `out`. Only returns an error if the document is malformed.
+template<typename T>
+static error_code GetOptional(simdjson_result<ondemand::value> value, nonstd::optional<T>& out) {
+    T v;
+    auto err = value.get(v);
+    if (!err) {
+        out = v;
+    } else if (!IsAbsent(err)) {
+        return err;
+    }
+    return SUCCESS;
+}
+
+// Like GetOptional, for strings. `out` is left empty if the value is absent.
+static error_code GetOptionalString(simdjson_result<ondemand::value> value, string& out) {
+    std::string_view sv;
+    auto err = value.get_string().get(sv);
+    if (!err) {
+        out.assign(sv.data(), sv.size());
+    } else if (!IsAbsent(err)) {
+        return err;
+    }
+    return SUCCESS;
+}
+
+static error_code GetString(simdjson_result<ondemand::value> value, string& out) {
+    std::string_view sv;
+    auto err = value.get_string().get(sv);
+    if (!err) {
+        out.assign(sv.data(), sv.size());
+    }
+    return err;
+}
+
+// nlohmann converts any number to an integer on request, so we do too.
+static error_code GetInteger(simdjson_result<ondemand::value> value, int64_t& out) {
+    ondemand::value v;
+    auto err = value.get(v);
+    if (err) {
+        return err;
+    }
+    if (!v.get_int64().get(out)) {
+        return SUCCESS;
+    }
+    double d;
+    if ((err = v.get_double().get(d))) {
+        return err;
+    }
+    out = static_cast<int64_t>(d);
+    return SUCCESS;
+}
+
+Result<RefreshStateResponse> ParseRefreshStateResponse(const string& body) {
+    padded_string padded(body);
+    ondemand::document doc;
+    ondemand::object root;
+    auto err = Parser().iterate(padded).get(doc);
+    if (!err) {
+        err = doc.get_object().get(root);
+    }
+    if (err) {
+        return ParseError(err, "document");
+    }
+
+    RefreshStateResponse res;
+
+    ondemand::object tokens_valid;
+    if ((err = root["TokensValid"].get_object().get(tokens_valid))) {
+        return ParseError(err, "TokensValid");
+    }
+    for (auto field_result : tokens_valid) {
+        ondemand::field field;
+        std::string_view key;
+        bool valid;
+        if ((err = std::move(field_result).get(field)) ||
+            (err = field.unescaped_key().get(key)) ||
+            (err = field.value().get_bool().get(valid))) {
+            return ParseError(err, "TokensValid");
+        }
+        res.tokens_valid[string(key)] = valid;
+    }
+
+    if ((err = GetOptional(root["IsAccount"], res.is_account))) {
+        return ParseError(err, "IsAccount");
+    }
+
+    if ((err = GetOptional(root["Balance"], res.balance))) {
+        return ParseError(err, "Balance");
+    }
+
+    ondemand::array prices;
+    err = root["PurchasePrices"].get_array().get(prices);
+    if (!err) {
+        PurchasePrices purchase_prices;
+        for (auto pp_result : prices) {
+            ondemand::object pp;
+            PurchasePrice purchase_price;
+            if ((err = pp_result.get_object().get(pp)) ||
+                (err = GetString(pp["Class"], purchase_price.transaction_class)) ||
+                (err = GetString(pp["Distinguisher"], purchase_price.distinguisher)) ||
+                (err = GetInteger(pp["Price"], purchase_price.price))) {
+                return ParseError(err, "PurchasePrices");
+            }
+            purchase_prices.push_back(std::move(purchase_price));
+        }
+        res.purchase_prices = std::move(purchase_prices);
+    } else if (!IsAbsent(err)) {
+        return ParseError(err, "PurchasePrices");
+    }
+
+    return std::move(res);
+}
+
+Result<AuthTokens> ParseNewTrackerResponse(const string& body) {
+    padded_string padded(body);
+    ondemand::document doc;
+    ondemand::object root;
+    auto err = Parser().iterate(padded).get(doc);
+    if (!err) {
+        err = doc.get_object().get(root);
+    }
+    if (err) {
+        return ParseError(err, "document");
+    }
+
+    AuthTokens auth_tokens;
+    for (auto field_result : root) {
+        ondemand::field field;
+        std::string_view key;
+        string value;
+        if ((err = std::move(field_result).get(field)) ||
+            (err = field.unescaped_key().get(key)) ||
+            (err = GetString(std::move(field).value(), value))) {
+            return ParseError(err, "tokens");
+        }
+        auth_tokens[string(key)] = std::move(value);
+    }
+
+    return std::move(auth_tokens);
+}
+
+Result<TransactionResponse> ParseTransactionResponse(const string& body) {
+    padded_string padded(body);
+    ondemand::document doc;
+    ondemand::object root;
+    auto err = Parser().iterate(padded).get(doc);
+    if (!err) {
+        err = doc.get_object().get(root);
+    }
+    if (err) {
+        return ParseError(err, "document");
+    }
+
+    // Many response fields are optional (depending on the presence of the indicator token)
+    TransactionResponse res;
+
+    if ((err = GetOptional(root["Balance"], res.balance)) ||
+        (err = GetOptionalString(root["TransactionID"], res.transaction_id)) ||
+        (err = GetOptionalString(root["Authorization"], res.authorization))) {
+        return ParseError(err, "fields");
+    }
+
+    ondemand::object transaction_response;
+    err = root["TransactionResponse"].get_object().get(transaction_response);
+    if (!err) {
+        if ((err = GetOptionalString(transaction_response["Type"], res.type))) {
+            return ParseError(err, "TransactionResponse.Type");
+        }
+
+        ondemand::object values;
+        err = transaction_response["Values"].get_object().get(values);
+        if (!err) {
+            err = GetOptionalString(values["Expires"], res.expires);
+        }
+        if (err && !IsAbsent(err)) {
+            return ParseError(err, "TransactionResponse.Values");
+        }
+    } else if (!IsAbsent(err)) {
+        return ParseError(err, "TransactionResponse");
+    }
+
+    return std::move(res);
+}
+
+Result<Authorization> ParseAuthorization(const string& decoded) {
+    padded_string padded(decoded);
+    ondemand::document doc;
+    ondemand::object auth_obj;
+    auto err = Parser().iterate(padded).get(doc);
+    if (!err) {
+        err = doc["Authorization"].get_object().get(auth_obj);
+    }
+    if (err) {
+        return ParseError(err, "Authorization");
+    }
+
+    Authorization auth;
+    string expires;
+    if ((err = GetString(auth_obj["ID"], auth.id)) ||
+        (err = GetString(auth_obj["AccessType"], auth.access_type)) ||
+        (err = GetString(auth_obj["Expires"], expires)) ||
+        (err = GetOptionalString(auth_obj["Encoded"], auth.encoded))) {
+        return ParseError(err, "Authorization fields");
+    }
+    // As with the nlohmann from_json, a bad timestamp leaves the DateTime zero.
+    (void)auth.expires.FromISO8601(expires);
+
+    return std::move(auth);
+}
+
+// Converts a value (and all its children) to flat_json, matching nlohmann's own parsing.
+static error_code ToJSON(ondemand::value value, flat_json& out) {
+    ondemand::json_type type;
+    auto err = value.type().get(type);
+    if (err) {
+        return err;
+    }
+
+    switch (type) {
+        case ondemand::json_type::object: {
+            ondemand::object obj;
+            if ((err = value.get_object().get(obj))) {
+                return err;
+            }
+            out = flat_json::object();
+            for (auto field_result : obj) {
+                ondemand::field field;
+                std::string_view key;
+                if ((err = std::move(field_result).get(field)) ||
+                    (err = field.unescaped_key().get(key)) ||
+                    (err = ToJSON(field.value(), out[string(key)]))) {
+                    return err;
+                }
+            }
+            return SUCCESS;
+        }
+        case ondemand::json_type::array: {
+            ondemand::array arr;
+            if ((err = value.get_array().get(arr))) {
+                return err;
+            }
+            out = flat_json::array();
+            for (auto element_result : arr) {
+                ondemand::value element;
+                flat_json j;
+                if ((err = std::move(element_result).get(element)) || (err = ToJSON(element, j))) {
+                    return err;
+                }
+                out.push_back(std::move(j));
+            }
+            return SUCCESS;
+        }
+        case ondemand::json_type::number: {
+            ondemand::number_type number_type;
+            if ((err = value.get_number_type().get(number_type))) {
+                return err;
+            }
+            if (number_type == ondemand::number_type::signed_integer) {
+                int64_t i;
+                if ((err = value.get_int64().get(i))) {
+                    return err;
+                }
+                // nlohmann parses non-negative integers as unsigned.
+                if (i >= 0) {
+                    out = static_cast<uint64_t>(i);
+                } else {
+                    out = i;
+                }
+            } else if (number_type == ondemand::number_type::unsigned_integer) {
+                uint64_t u;
+                if ((err = value.get_uint64().get(u))) {
+                    return err;
+                }
+                out = u;
+            } else {
+                // Floating point, or an integer too big for 64 bits (which nlohmann
+                // also parses as a double).
+                double d;
+                if ((err = value.get_double().get(d))) {
+                    return err;
+                }
+                out = d;
+            }
+            return SUCCESS;
+        }
+        case ondemand::json_type::string: {
+            std::string_view sv;
+            if ((err = value.get_string().get(sv))) {
+                return err;
+            }
+            out = string(sv);
+            return SUCCESS;
+        }
+        case ondemand::json_type::boolean: {
+            bool b;
+            if ((err = value.get_bool().get(b))) {
+                return err;
+            }
+            out = b;
+            return SUCCESS;
+        }
+        case ondemand::json_type::null: {
+            bool is_null;
+            if ((err = value.is_null().get(is_null))) {
+                return err;
+            }
+            if (!is_null) {
+                return INCORRECT_TYPE;
+            }
+            out = nullptr;
+            return SUCCESS;
+        }
+        default:
+            return INCORRECT_TYPE;
+    }
+}
+
+Result<flat_json> ParseJSONDocument(const string& s) {
+    padded_string padded(s);
+    ondemand::document doc;
+    ondemand::value root;
+    flat_json j;
+    auto err = Parser().iterate(padded).get(doc);
+    if (!err) {
+        err = doc.get_value().get(root);
+    }
+    if (!err) {
+        err = ToJSON(root, j);
+    }
+    if (!err && !doc.at_end()) {
+        err = TRAILING_CONTENT;
+    }
+    if (err) {
+        return ParseError(err, "document");
+    }
+
+    return std::move(j);
+}
+
+} // namespace simdjson_parser
+} // namespace psicash
+
+#endif // PSICASH_USE_SIMDJSON
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "response_parser.hpp"
+#include "base64.hpp"
+
+using namespace std;
+using namespace psicash;
+using json = nlohmann::json;
+
+class TestResponseParser : public ::testing::Test
+{
+  public:
+    TestResponseParser() = default;
+
+    // The parsers to test: nlohmann, and simdjson if it's built in.
+    static vector<JSONParser> Parsers() {
+        vector<JSONParser> parsers = {JSONParser::Nlohmann};
+        if (JSONParserAvailable(JSONParser::Simdjson)) {
+            parsers.push_back(JSONParser::Simdjson);
+        }
+        return parsers;
+    }
+};
+
+static const char* kRefreshStateBody = R"|({
+    "TokensValid": {"earner": true, "spender": false, "indicator": true},
+    "IsAccount": false,
+    "Balance": 12345,
+    "PurchasePrices": [
+        {"Class": "speed-boost", "Distinguisher": "1hr", "Price": 100},
+        {"Class": "speed-boost", "Distinguisher": "2hr", "Price": 200.0}
+    ]
+})|";
+
+static const char* kTransactionBody = R"|({
+    "TransactionID": "tx1",
+    "TransactionAmount": -100,
+    "Balance": 900,
+    "Authorization": "encoded-auth",
+    "TransactionResponse": {
+        "Type": "expiring-purchase",
+        "Values": {"Expires": "2019-01-14T17:22:23.168764129Z"}
+    }
+})|";
+
+static const char* kAuthorizationDecoded = R"|({
+    "Authorization": {
+        "ID": "0V3ExTviAtSqLfNwaiAyG4zZEBI8jHbzylWMyNEgRDg=",
+        "AccessType": "speed-boost-test",
+        "Expires": "2019-01-14T17:22:23.168764129Z"
+    },
+    "SigningKeyID": "QCYO5vrR/dhcD6z3aLBUMydnfRrdSQ/TVamHPXXy7tM=",
+    "Signature": "P/ckzyhUBhJNQCn32yn3UStjKzw1SN15oLrUaMOWiolqpNM0s5QR5DGTECOQsBMw87Pu75La58kILtHqmAW8CA=="
+})|";
+
+TEST_F(TestResponseParser, Unavailable)
+{
+    if (JSONParserAvailable(JSONParser::Simdjson)) {
+        ASSERT_EQ(DefaultJSONParser(), JSONParser::Simdjson);
+        return;
+    }
+
+    ASSERT_EQ(DefaultJSONParser(), JSONParser::Nlohmann);
+    auto res = ParseRefreshStateResponse(kRefreshStateBody, JSONParser::Simdjson);
+    ASSERT_FALSE(res);
+}
+
+TEST_F(TestResponseParser, RefreshState)
+{
+    for (auto parser : Parsers()) {
+        auto res = ParseRefreshStateResponse(kRefreshStateBody, parser);
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_EQ(res->tokens_valid, (map<string, bool>{{"earner", true}, {"spender", false}, {"indicator", true}}));
+        ASSERT_TRUE(res->is_account);
+        ASSERT_FALSE(*res->is_account);
+        ASSERT_EQ(*res->balance, 12345);
+        ASSERT_TRUE(res->purchase_prices);
+        ASSERT_EQ(*res->purchase_prices, (PurchasePrices{{"speed-boost", "1hr", 100}, {"speed-boost", "2hr", 200}}));
+
+        // Optional fields missing or of the wrong type
+        res = ParseRefreshStateResponse(R"|({"TokensValid":{},"IsAccount":null,"Balance":1.5,"PurchasePrices":{}})|", parser);
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_TRUE(res->tokens_valid.empty());
+        ASSERT_FALSE(res->is_account);
+        ASSERT_FALSE(res->balance);
+        ASSERT_FALSE(res->purchase_prices);
+
+        // Failures
+        for (const auto& bad : {"", "[]", "{\"Balance\":1}", "{\"TokensValid\":{\"earner\":1}}",
+                                "{\"TokensValid\":{},\"PurchasePrices\":[{\"Class\":\"c\",\"Price\":1}]}",
+                                "{\"TokensValid\":{", "{\"TokensValid\":{\"earner\":tru}}"}) {
+            res = ParseRefreshStateResponse(bad, parser);
+            ASSERT_FALSE(res) << bad;
+        }
+    }
+}
+
+TEST_F(TestResponseParser, NewTracker)
+{
+    for (auto parser : Parsers()) {
+        auto res = ParseNewTrackerResponse(R"|({"earner":"e","spender":"s","indicator":"ié"})|", parser);
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_EQ(*res, (AuthTokens{{"earner", "e"}, {"spender", "s"}, {"indicator", "i\xc3\xa9"}}));
+
+        res = ParseNewTrackerResponse("{}", parser);
+        ASSERT_TRUE(res);
+        ASSERT_TRUE(res->empty());
+
+        for (const auto& bad : {"", "[]", "\"e\"", "{\"earner\":1}", "{\"earner\":\"e\""}) {
+            res = ParseNewTrackerResponse(bad, parser);
+            ASSERT_FALSE(res) << bad;
+        }
+    }
+}
+
+TEST_F(TestResponseParser, Transaction)
+{
+    for (auto parser : Parsers()) {
+        auto res = ParseTransactionResponse(kTransactionBody, parser);
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_EQ(*res->balance, 900);
+        ASSERT_EQ(res->transaction_id, "tx1");
+        ASSERT_EQ(res->authorization, "encoded-auth");
+        ASSERT_EQ(res->type, "expiring-purchase");
+        ASSERT_EQ(res->expires, "2019-01-14T17:22:23.168764129Z");
+
+        // Everything is optional
+        res = ParseTransactionResponse(R"|({"Balance":"x","TransactionResponse":{"Values":null}})|", parser);
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_FALSE(res->balance);
+        ASSERT_TRUE(res->transaction_id.empty());
+        ASSERT_TRUE(res->authorization.empty());
+        ASSERT_TRUE(res->type.empty());
+        ASSERT_TRUE(res->expires.empty());
+
+        for (const auto& bad : {"", "[]", "{\"Balance\":"}) {
+            res = ParseTransactionResponse(bad, parser);
+            ASSERT_FALSE(res) << bad;
+        }
+    }
+}
+
+TEST_F(TestResponseParser, Authorization)
+{
+    datetime::DateTime want_expires;
+    ASSERT_TRUE(want_expires.FromISO8601("2019-01-14T17:22:23.168764129Z"));
+
+    for (auto parser : Parsers()) {
+        auto res = ParseAuthorization(kAuthorizationDecoded, parser);
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_EQ(res->id, "0V3ExTviAtSqLfNwaiAyG4zZEBI8jHbzylWMyNEgRDg=");
+        ASSERT_EQ(res->access_type, "speed-boost-test");
+        ASSERT_EQ(res->expires, want_expires);
+        ASSERT_TRUE(res->encoded.empty());
+
+        for (const auto& bad : {"", "{}", "{\"Authorization\":{\"ID\":\"a\"}}", "{\"Authorization\":1}"}) {
+            res = ParseAuthorization(bad, parser);
+            ASSERT_FALSE(res) << bad;
+        }
+    }
+}
+
+TEST_F(TestResponseParser, Document)
+{
+    auto doc = R"|({
+        "v": 1,
+        "balance": -12,
+        "big": 18446744073709551615,
+        "float": 1.25,
+        "nested": {"a": [1, "two", null, true, {"b": []}]},
+        "escaped": "tab\there \"quoted\" é"
+    })|";
+
+    auto want = flat_json::parse(doc);
+    for (auto parser : Parsers()) {
+        auto res = ParseJSONDocument(doc, parser);
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_EQ(*res, want);
+        // Same number representations, too
+        ASSERT_EQ(res->dump(), want.dump());
+
+        for (const auto& bad : {"", "{", "{\"a\":1} x", "{\"a\":[1,]}", "nul"}) {
+            res = ParseJSONDocument(bad, parser);
+            ASSERT_FALSE(res) << bad;
+        }
+    }
+}
+
+TEST_F(TestResponseParser, Differential)
+{
+    if (!JSONParserAvailable(JSONParser::Simdjson)) {
+        return;
+    }
+
+    // Variations on real responses. Both parsers must agree on all of them.
+    vector<string> bodies = {kRefreshStateBody, kTransactionBody, kAuthorizationDecoded, "{}",
+                             R"|({"TokensValid":{"a":true,"a":false}})|",
+                             R"|({"TokensValid":{},"Balance":-1,"IsAccount":true})|",
+                             R"|({"TransactionResponse":{"Type":1,"Values":{"Expires":2}}})|"};
+
+    for (const auto& body : bodies) {
+        auto n_rs = ParseRefreshStateResponse(body, JSONParser::Nlohmann);
+        auto s_rs = ParseRefreshStateResponse(body, JSONParser::Simdjson);
+        ASSERT_EQ((bool)n_rs, (bool)s_rs) << body;
+        if (n_rs) {
+            ASSERT_EQ(n_rs->tokens_valid, s_rs->tokens_valid) << body;
+            ASSERT_EQ(n_rs->is_account, s_rs->is_account) << body;
+            ASSERT_EQ(n_rs->balance, s_rs->balance) << body;
+            ASSERT_EQ(n_rs->purchase_prices, s_rs->purchase_prices) << body;
+        }
+
+        auto n_tx = ParseTransactionResponse(body, JSONParser::Nlohmann);
+        auto s_tx = ParseTransactionResponse(body, JSONParser::Simdjson);
+        ASSERT_EQ((bool)n_tx, (bool)s_tx) << body;
+        if (n_tx) {
+            ASSERT_EQ(n_tx->balance, s_tx->balance) << body;
+            ASSERT_EQ(n_tx->transaction_id, s_tx->transaction_id) << body;
+            ASSERT_EQ(n_tx->authorization, s_tx->authorization) << body;
+            ASSERT_EQ(n_tx->type, s_tx->type) << body;
+            ASSERT_EQ(n_tx->expires, s_tx->expires) << body;
+        }
+
+        auto n_doc = ParseJSONDocument(body, JSONParser::Nlohmann);
+        auto s_doc = ParseJSONDocument(body, JSONParser::Simdjson);
+        ASSERT_EQ((bool)n_doc, (bool)s_doc) << body;
+        if (n_doc) {
+            ASSERT_EQ(n_doc->dump(), s_doc->dump()) << body;
+        }
+    }
+}
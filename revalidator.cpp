@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "revalidator.hpp"
+
+using namespace std;
+
+namespace psicash {
+
+Revalidator::Revalidator()
+        : stop_(false), in_flight_(false), running_(false), started_(0) {
+}
+
+Revalidator::~Revalidator() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void Revalidator::Revalidate(const RefreshFn& refresh, const DoneFn& done) {
+    lock_guard<mutex> lock(mutex_);
+    if (stop_) {
+        return;
+    }
+    if (done) {
+        waiters_.push_back(done);
+    }
+    if (in_flight_) {
+        return;
+    }
+
+    in_flight_ = true;
+    refresh_ = refresh;
+    started_++;
+    if (!running_) {
+        // The previous thread (if any) has already finished with everything.
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        running_ = true;
+        thread_ = thread(&Revalidator::Run, this);
+    }
+}
+
+bool Revalidator::InFlight() const {
+    lock_guard<mutex> lock(mutex_);
+    return in_flight_;
+}
+
+uint64_t Revalidator::Started() const {
+    lock_guard<mutex> lock(mutex_);
+    return started_;
+}
+
+void Revalidator::Run() {
+    unique_lock<mutex> lock(mutex_);
+    // A revalidation asked for while results are being delivered runs on this thread too.
+    while (in_flight_) {
+        auto refresh = refresh_;
+        lock.unlock();
+        auto result = refresh();
+        lock.lock();
+
+        // Callers from here on start (or join) the next revalidation.
+        vector<DoneFn> waiters;
+        waiters.swap(waiters_);
+        in_flight_ = false;
+
+        lock.unlock();
+        for (const auto& done : waiters) {
+            done(result);
+        }
+        lock.lock();
+
+        if (stop_) {
+            break;
+        }
+    }
+    running_ = false;
+}
+
+} // namespace psicash
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_REVALIDATOR_H
+#define PSICASHLIB_REVALIDATOR_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "psicash.hpp"
+#include "error.hpp"
+
+namespace psicash {
+
+/// Runs revalidations -- refreshes of stored state that a caller has already been given
+/// a (possibly stale) copy of -- on a background thread, at most one at a time. A caller
+/// that asks for a revalidation while one is in flight joins it rather than starting
+/// another, and every caller's callback gets the result of the one they joined.
+/// Revalidator operations are threadsafe.
+class Revalidator {
+public:
+    using RefreshFn = std::function<error::Result<Status>()>;
+    using DoneFn = std::function<void(const error::Result<Status>&)>;
+
+    Revalidator();
+    /// Waits for any revalidation in progress (and its callbacks). No more are started.
+    ~Revalidator();
+
+    Revalidator(const Revalidator&) = delete;
+    Revalidator& operator=(const Revalidator&) = delete;
+
+    /// Calls `done` (if not null) on the background thread with the result of a
+    /// revalidation: the one in flight, if there is one, or else a new one that calls
+    /// `refresh`. `done` may call Revalidate.
+    void Revalidate(const RefreshFn& refresh, const DoneFn& done);
+
+    /// True if a revalidation is in flight (i.e., its result hasn't been delivered).
+    bool InFlight() const;
+
+    /// The number of revalidations started.
+    uint64_t Started() const;
+
+private:
+    void Run();
+
+    mutable std::mutex mutex_;
+    bool stop_;
+    // A revalidation has been asked for and its result not yet delivered.
+    bool in_flight_;
+    // The thread is running (refreshing or delivering results). While it is, a new
+    // revalidation is picked up by it rather than by a new thread.
+    bool running_;
+    RefreshFn refresh_;
+    std::vector<DoneFn> waiters_;
+    uint64_t started_;
+    std::thread thread_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_REVALIDATOR_H
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "test_helpers.hpp"
+#include "test_fake_server.hpp"
+#include "revalidator.hpp"
+#include "psicash.hpp"
+
+using namespace std;
+using namespace psicash;
+using namespace testing;
+
+class TestRevalidator : public ::testing::Test, public TempDir
+{
+  public:
+    TestRevalidator() : refreshes(0), done_count(0), open(false) {}
+
+    // A refresh that waits until the gate is opened.
+    Revalidator::RefreshFn GatedRefresh() {
+        return [this]() -> error::Result<Status> {
+            refreshes++;
+            unique_lock<mutex> lock(gate_mutex);
+            gate.wait(lock, [this] { return open; });
+            return Status::Success;
+        };
+    }
+
+    void Open() {
+        {
+            lock_guard<mutex> lock(gate_mutex);
+            open = true;
+        }
+        gate.notify_all();
+    }
+
+    Revalidator::DoneFn Done() {
+        return [this](const error::Result<Status>& result) {
+            ASSERT_TRUE(result);
+            ASSERT_EQ(*result, Status::Success);
+            done_count++;
+        };
+    }
+
+    void WaitForDone(int n) {
+        while (done_count < n) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+
+    atomic<int> refreshes;
+    atomic<int> done_count;
+    mutex gate_mutex;
+    condition_variable gate;
+    bool open;
+};
+
+TEST_F(TestRevalidator, JoinsInFlight)
+{
+    Revalidator revalidator;
+    ASSERT_FALSE(revalidator.InFlight());
+
+    revalidator.Revalidate(GatedRefresh(), Done());
+    revalidator.Revalidate(GatedRefresh(), Done());
+    revalidator.Revalidate(GatedRefresh(), nullptr);
+    revalidator.Revalidate(GatedRefresh(), Done());
+    ASSERT_TRUE(revalidator.InFlight());
+
+    Open();
+    WaitForDone(3);
+    ASSERT_EQ(refreshes, 1);
+    ASSERT_EQ(revalidator.Started(), 1);
+
+    // Once delivered, the next call starts another.
+    while (revalidator.InFlight()) {
+        this_thread::yield();
+    }
+    revalidator.Revalidate(GatedRefresh(), Done());
+    WaitForDone(4);
+    ASSERT_EQ(refreshes, 2);
+    ASSERT_EQ(revalidator.Started(), 2);
+}
+
+TEST_F(TestRevalidator, RevalidateFromCallback)
+{
+    Open();
+    Revalidator revalidator;
+    promise<void> second;
+    revalidator.Revalidate(GatedRefresh(), [&](const error::Result<Status>&) {
+        revalidator.Revalidate(GatedRefresh(), [&](const error::Result<Status>&) {
+            second.set_value();
+        });
+    });
+    ASSERT_EQ(second.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_EQ(refreshes, 2);
+    ASSERT_EQ(revalidator.Started(), 2);
+}
+
+TEST_F(TestRevalidator, DestructorWaits)
+{
+    thread opener;
+    {
+        Revalidator revalidator;
+        revalidator.Revalidate(GatedRefresh(), Done());
+        while (refreshes == 0) {
+            this_thread::yield();
+        }
+        opener = thread([this] {
+            this_thread::sleep_for(chrono::milliseconds(20));
+            Open();
+        });
+    }
+    auto done_at_destruction = done_count.load();
+    // Open may still be notifying; the fixture must outlive it.
+    opener.join();
+    ASSERT_EQ(done_at_destruction, 1);
+}
+
+TEST_F(TestRevalidator, PsiCashBalanceAndPrices)
+{
+    FakeServer::Options options;
+    options.initial_balance = 500;
+    FakeServer server(options);
+
+    PsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Test", GetTempDir().c_str(), nullptr));
+
+    // No requester: the stored (empty) value, and no revalidation.
+    auto balance = pc.BalanceWithRevalidation(chrono::hours(1), nullptr);
+    ASSERT_EQ(balance.value, 0);
+    ASSERT_FALSE(balance.age);
+    ASSERT_FALSE(balance.revalidating);
+
+    pc.SetHTTPRequestFn(server.Requester());
+
+    // Never refreshed, so revalidated; the fresh value comes through the callback.
+    promise<pair<error::Result<Status>, int64_t>> fresh_balance;
+    balance = pc.BalanceWithRevalidation(chrono::hours(1),
+            [&](const error::Result<Status>& result, const int64_t& value) {
+                fresh_balance.set_value({result, value});
+            });
+    ASSERT_EQ(balance.value, 0);
+    ASSERT_TRUE(balance.revalidating);
+    auto fresh_result = fresh_balance.get_future().get();
+    ASSERT_TRUE(fresh_result.first) << fresh_result.first.error();
+    ASSERT_EQ(*fresh_result.first, Status::Success);
+    ASSERT_EQ(fresh_result.second, 500);
+
+    // Fresh enough now.
+    balance = pc.BalanceWithRevalidation(chrono::hours(1), nullptr);
+    ASSERT_EQ(balance.value, 500);
+    ASSERT_TRUE(balance.age);
+    ASSERT_GE(balance.age->count(), 0);
+    ASSERT_LT(*balance.age, chrono::hours(1));
+    ASSERT_FALSE(balance.revalidating);
+
+    // Older than max_age.
+    this_thread::sleep_for(chrono::milliseconds(5));
+    promise<PurchasePrices> fresh_prices;
+    auto prices = pc.GetPurchasePricesWithRevalidation({"speed-boost"}, chrono::milliseconds(1),
+            [&](const error::Result<Status>&, const PurchasePrices& value) {
+                fresh_prices.set_value(value);
+            });
+    ASSERT_TRUE(prices.value.empty());
+    ASSERT_TRUE(prices.revalidating);
+    auto fresh = fresh_prices.get_future().get();
+    ASSERT_FALSE(fresh.empty());
+    ASSERT_EQ(pc.GetPurchasePrices(), fresh);
+
+    // A balance revalidation keeps the stored prices.
+    this_thread::sleep_for(chrono::milliseconds(5));
+    promise<void> revalidated;
+    balance = pc.BalanceWithRevalidation(chrono::milliseconds(1),
+            [&](const error::Result<Status>&, const int64_t&) { revalidated.set_value(); });
+    ASSERT_TRUE(balance.revalidating);
+    revalidated.get_future().wait();
+    ASSERT_EQ(pc.GetPurchasePrices(), fresh);
+}
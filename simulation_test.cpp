@@ -0,0 +1,142 @@
+#include <chrono>
+
+#include "gtest/gtest.h"
+#include "test_helpers.hpp"
+#include "test_simulation.hpp"
+#include "psicash.hpp"
+
+using namespace std;
+using namespace psicash;
+using namespace testing;
+
+// Runs the client state machine in virtual time (see test_simulation.hpp), so multi-day
+// sessions take no real time.
+class TestSimulation : public ::testing::Test, public TempDir
+{
+  public:
+    static datetime::DateTime Start() {
+        datetime::DateTime start;
+        start.FromISO8601("2019-01-01T00:00:00.000Z");
+        return start;
+    }
+};
+
+TEST_F(TestSimulation, VirtualClock)
+{
+    VirtualClock clock(Start());
+    clock.Install();
+
+    ASSERT_EQ(datetime::DateTime::Now(), Start());
+    datetime::SleepFor(chrono::hours(1));
+    ASSERT_EQ(datetime::DateTime::Now(), Start().Add(chrono::hours(1)));
+
+    vector<int> order;
+    clock.ScheduleAfter(chrono::minutes(20), [&] { order.push_back(2); });
+    clock.ScheduleAfter(chrono::minutes(10), [&] {
+        order.push_back(1);
+        // Scheduled by an event, and still within the run.
+        clock.ScheduleAfter(chrono::minutes(30), [&] { order.push_back(4); });
+    });
+    clock.ScheduleAfter(chrono::minutes(20), [&] { order.push_back(3); });
+    clock.ScheduleAfter(chrono::hours(2), [&] { order.push_back(5); });
+
+    ASSERT_EQ(clock.RunUntil(Start().Add(chrono::hours(2))), 4);
+    ASSERT_EQ(order, vector<int>({1, 2, 3, 4}));
+    ASSERT_EQ(clock.Now(), Start().Add(chrono::hours(2)));
+    ASSERT_EQ(clock.PendingEvents(), 1);
+
+    clock.Uninstall();
+    ASSERT_GT(datetime::DateTime::Now(), Start().Add(chrono::hours(24 * 365)));
+}
+
+TEST_F(TestSimulation, PurchaseExpiresInVirtualTime)
+{
+    VirtualClock clock(Start());
+    clock.Install();
+
+    FakeServer::Options options;
+    options.initial_balance = 1000;
+    options.clock_skew = chrono::minutes(5);
+    FakeServer server(options);
+    ScriptedTransport transport(server, 1);
+
+    PsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Simulation", GetTempDir().c_str(), transport.Requester()));
+    auto res = pc.RefreshState({"speed-boost"});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::Success);
+
+    auto purchase = pc.NewExpiringPurchase("speed-boost", "24hr", 100);
+    ASSERT_TRUE(purchase) << purchase.error();
+    ASSERT_EQ(purchase->status, Status::Success);
+    ASSERT_TRUE(pc.HasActivePurchase("speed-boost"));
+
+    clock.Advance(chrono::hours(23));
+    ASSERT_TRUE(pc.HasActivePurchase("speed-boost"));
+    clock.Advance(chrono::hours(1) + chrono::seconds(1));
+    ASSERT_FALSE(pc.HasActivePurchase("speed-boost"));
+    auto expired = pc.ExpirePurchases();
+    ASSERT_TRUE(expired);
+    ASSERT_EQ(expired->size(), 1);
+}
+
+TEST_F(TestSimulation, StormRetriesInVirtualTime)
+{
+    VirtualClock clock(Start());
+    clock.Install();
+
+    FakeServer server;
+    ScriptedTransport transport(server, 1);
+    transport.AddStorm(Start(), Start().Add(chrono::hours(1)), 503, 1.0);
+
+    PsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Simulation", GetTempDir().c_str(), transport.Requester()));
+    auto res = pc.RefreshState({"speed-boost"});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::ServerError);
+    ASSERT_EQ(transport.FaultCount(), 3);
+    // The retry waits passed in virtual time only.
+    ASSERT_EQ(clock.Now(), Start().Add(chrono::seconds(1 + 2)));
+
+    clock.Advance(chrono::hours(1));
+    res = pc.RefreshState({"speed-boost"});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::Success);
+}
+
+TEST_F(TestSimulation, Sessions)
+{
+    VirtualClock clock(Start());
+    clock.Install();
+
+    SimulationStats stats;
+    for (uint32_t seed = 1; seed <= 20; seed++) {
+        SimulationConfig config;
+        config.seed = seed;
+        config.days = 3;
+        auto failure = RunSimulatedSession(clock, config, GetTempDir(), stats);
+        ASSERT_EQ(failure, "") << "seed " << seed;
+    }
+
+    ASSERT_EQ(stats.sessions, 20);
+    ASSERT_GT(stats.purchases, 0);
+    ASSERT_GT(stats.expired, 0);
+    ASSERT_GT(stats.rewards, 0);
+    ASSERT_GT(stats.faults, 0);
+}
+
+TEST_F(TestSimulation, Deterministic)
+{
+    SimulationConfig config;
+    config.seed = 7;
+    config.days = 7;
+
+    SimulationStats stats[2];
+    for (auto& s : stats) {
+        VirtualClock clock(Start());
+        clock.Install();
+        ASSERT_EQ(RunSimulatedSession(clock, config, GetTempDir(), s), "");
+    }
+    ASSERT_TRUE(stats[0] == stats[1]);
+    ASSERT_GT(stats[0].ops, 0);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "strand.hpp"
+#include "flight_recorder.hpp"
+
+using namespace std;
+
+namespace psicash {
+
+Strand::Strand()
+        : next_ticket_(0), serving_(0), contended_(0) {
+}
+
+bool Strand::HeldByThisThread() const {
+    lock_guard<mutex> lock(mutex_);
+    return holder_ == this_thread::get_id();
+}
+
+uint64_t Strand::Turns() const {
+    lock_guard<mutex> lock(mutex_);
+    return next_ticket_;
+}
+
+uint64_t Strand::ContendedTurns() const {
+    lock_guard<mutex> lock(mutex_);
+    return contended_;
+}
+
+Strand::Turn::Turn(Strand& strand)
+        : strand_(strand), nested_(false) {
+    unique_lock<mutex> lock(strand_.mutex_);
+    if (strand_.holder_ == this_thread::get_id()) {
+        nested_ = true;
+        return;
+    }
+
+    auto ticket = strand_.next_ticket_++;
+    if (ticket != strand_.serving_) {
+        strand_.contended_++;
+        FlightRecorder::PhaseTimer wait_timer(FlightRecorder::Phase::kWait);
+        strand_.turn_done_.wait(lock, [this, ticket] { return strand_.serving_ == ticket; });
+    }
+    strand_.holder_ = this_thread::get_id();
+}
+
+Strand::Turn::~Turn() {
+    if (nested_) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(strand_.mutex_);
+        strand_.holder_ = thread::id();
+        strand_.serving_++;
+    }
+    // Every waiter checks whether it's next.
+    strand_.turn_done_.notify_all();
+}
+
+} // namespace psicash
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_STRAND_H
+#define PSICASHLIB_STRAND_H
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+
+namespace psicash {
+
+/// A logical queue of operations: each runs (on its caller's thread) only once all the
+/// operations that entered the strand before it have finished, so they run one at a
+/// time, in arrival order. PsiCash runs every operation that modifies its state on its
+/// strand, so that their read-modify-write cycles can't interleave; reads don't use it.
+/// Strand operations are threadsafe.
+class Strand {
+public:
+    Strand();
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    /// Holds the strand while in scope, waiting for its turn first. A thread that already
+    /// holds the strand can take another Turn (it doesn't wait).
+    /// Time spent waiting is attributed to the current FlightRecorder operation.
+    class Turn {
+    public:
+        explicit Turn(Strand& strand);
+        ~Turn();
+
+        Turn(const Turn&) = delete;
+        Turn& operator=(const Turn&) = delete;
+
+    private:
+        Strand& strand_;
+        bool nested_;
+    };
+
+    /// True if the calling thread holds the strand.
+    bool HeldByThisThread() const;
+
+    /// The number of turns taken (not counting nested ones), and how many of those had
+    /// to wait for another.
+    uint64_t Turns() const;
+    uint64_t ContendedTurns() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable turn_done_;
+    // Tickets are taken in arrival order; the holder of `serving_` has the strand.
+    uint64_t next_ticket_;
+    uint64_t serving_;
+    std::thread::id holder_;
+    uint64_t contended_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_STRAND_H
@@ -0,0 +1,188 @@
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "gtest/gtest.h"
+#include "test_helpers.hpp"
+#include "test_fake_server.hpp"
+#include "strand.hpp"
+#include "psicash.hpp"
+
+using namespace std;
+using namespace psicash;
+using namespace testing;
+
+class TestStrand : public ::testing::Test, public TempDir
+{
+  public:
+    // Waits until `n` turns have been requested of the strand.
+    static void WaitForTurns(const Strand& strand, uint64_t n) {
+        while (strand.Turns() < n) {
+            this_thread::yield();
+        }
+    }
+};
+
+// Exposes the strand of a PsiCash instance.
+class StrandPsiCash : public PsiCash {
+public:
+    const Strand& GetStrand() const { return *strand_; }
+};
+
+TEST_F(TestStrand, ArrivalOrder)
+{
+    Strand strand;
+    mutex order_mutex;
+    vector<int> order;
+
+    vector<thread> threads;
+    {
+        Strand::Turn first(strand);
+        for (int i = 0; i < 5; i++) {
+            threads.emplace_back([&, i] {
+                Strand::Turn turn(strand);
+                lock_guard<mutex> lock(order_mutex);
+                order.push_back(i);
+            });
+            // The next thread doesn't start until this one is queued.
+            WaitForTurns(strand, i + 2);
+        }
+        ASSERT_TRUE(order.empty());
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    ASSERT_EQ(order, vector<int>({0, 1, 2, 3, 4}));
+    ASSERT_EQ(strand.Turns(), 6);
+    ASSERT_EQ(strand.ContendedTurns(), 5);
+}
+
+TEST_F(TestStrand, Nested)
+{
+    Strand strand;
+    ASSERT_FALSE(strand.HeldByThisThread());
+    {
+        Strand::Turn outer(strand);
+        ASSERT_TRUE(strand.HeldByThisThread());
+        {
+            Strand::Turn inner(strand);
+            ASSERT_TRUE(strand.HeldByThisThread());
+        }
+        // Still held by the outer turn.
+        ASSERT_TRUE(strand.HeldByThisThread());
+
+        bool held_elsewhere = true;
+        thread([&] { held_elsewhere = strand.HeldByThisThread(); }).join();
+        ASSERT_FALSE(held_elsewhere);
+    }
+    ASSERT_FALSE(strand.HeldByThisThread());
+    ASSERT_EQ(strand.Turns(), 1);
+    ASSERT_EQ(strand.ContendedTurns(), 0);
+}
+
+TEST_F(TestStrand, Exclusive)
+{
+    Strand strand;
+    atomic<int> inside(0);
+    atomic<int> overlaps(0);
+    int unguarded = 0;
+
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 2000; i++) {
+                Strand::Turn turn(strand);
+                if (inside++ != 0) {
+                    overlaps++;
+                }
+                unguarded++;
+                inside--;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    ASSERT_EQ(overlaps, 0);
+    ASSERT_EQ(unguarded, 8000);
+    ASSERT_EQ(strand.Turns(), 8000);
+}
+
+TEST_F(TestStrand, PsiCashMutationsWithReads)
+{
+    FakeServer::Options options;
+    options.initial_balance = 1000000;
+    FakeServer server(options);
+
+    StrandPsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Test", GetTempDir().c_str(), server.Requester()));
+    auto res = pc.RefreshState({});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::Success);
+
+    const int kBuyers = 4, kPurchases = 10, kRefreshes = 20;
+    mutex bought_mutex;
+    set<string> bought;
+    atomic<bool> done(false);
+    atomic<int> bad_reads(0);
+
+    vector<thread> threads;
+    for (int b = 0; b < kBuyers; b++) {
+        threads.emplace_back([&, b] {
+            // Purchases of a class of its own, which expire almost immediately.
+            auto transaction_class = "class-" + to_string(b);
+            for (int i = 0; i < kPurchases; i++) {
+                auto purchase = pc.NewExpiringPurchase(transaction_class, "1ms", 100);
+                if (purchase && purchase->status == Status::Success) {
+                    lock_guard<mutex> lock(bought_mutex);
+                    bought.insert(purchase->purchase->id);
+                }
+                this_thread::sleep_for(chrono::milliseconds(2));
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        for (int i = 0; i < kRefreshes; i++) {
+            (void)pc.RefreshState({});
+        }
+    });
+    thread reader([&] {
+        // Reads see a consistent state while the mutations run.
+        while (!done) {
+            auto balance = pc.Balance();
+            auto purchases = pc.GetPurchases();
+            if (balance < 0 || balance > options.initial_balance ||
+                purchases.size() > kBuyers * kPurchases) {
+                bad_reads++;
+            }
+        }
+    });
+
+    for (auto& t : threads) {
+        t.join();
+    }
+    done = true;
+    reader.join();
+
+    ASSERT_EQ(bad_reads, 0);
+    ASSERT_GT(bought.size(), 0);
+
+    // No purchase was lost to an interleaved update.
+    set<string> stored;
+    for (const auto& p : pc.GetPurchases()) {
+        stored.insert(p.id);
+    }
+    ASSERT_EQ(stored, bought);
+
+    res = pc.RefreshState({});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(pc.Balance(), options.initial_balance - 100 * (int64_t)bought.size());
+
+    // Every mutation took one turn (nested calls don't add any).
+    ASSERT_EQ(pc.GetStrand().Turns(), 1 + kBuyers * kPurchases + kRefreshes + 1);
+}
@@ -0,0 +1,81 @@
+/*
+ * Compares utils::Stringer with its previous ostringstream-per-argument implementation,
+ * on argument mixes like the library's error messages.
+ *
+ * Usage: stringer_bench [--iterations=N]
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench_helpers.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// The previous utils::Stringer.
+template<typename T>
+static string OldStringer(const T& value) {
+    ostringstream oss;
+    oss << value;
+    return oss.str();
+}
+template<typename T, typename ... Args>
+static string OldStringer(const T& value, const Args& ... args) {
+    return OldStringer(value) + OldStringer(args...);
+}
+
+int main(int argc, char** argv) {
+    int iterations = 100000;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--iterations=") == 0) {
+            iterations = atoi(arg.c_str() + strlen("--iterations="));
+        }
+    }
+
+    const string what = "[json.exception.parse_error.101] parse error at line 1, column 1: syntax error";
+    const int64_t status = 500;
+    const string body = "{\"error\":\"internal server error\"}";
+    size_t failures = 0;
+
+    bench::OpStats stats;
+    for (int i = 0; i < iterations; i++) {
+        failures += !bench::Measure(stats, "short/old", [&] {
+            return OldStringer("not f.is_open; errno=", i).size() > 0;
+        });
+        failures += !bench::Measure(stats, "short/new", [&] {
+            return utils::Stringer("not f.is_open; errno=", i).size() > 0;
+        });
+        failures += !bench::Measure(stats, "error/old", [&] {
+            return OldStringer("json dump failed: ", what, "; id:", 101).size() > 0;
+        });
+        failures += !bench::Measure(stats, "error/new", [&] {
+            return utils::Stringer("json dump failed: ", what, "; id:", 101).size() > 0;
+        });
+        failures += !bench::Measure(stats, "request/old", [&] {
+            return OldStringer("1T reward request failed: ", status, "; ", body, "; attempt ", i, '/', iterations).size() > 0;
+        });
+        failures += !bench::Measure(stats, "request/new", [&] {
+            return utils::Stringer("1T reward request failed: ", status, "; ", body, "; attempt ", i, '/', iterations).size() > 0;
+        });
+    }
+
+    if (OldStringer("a", -12, 'b', what, 3000000000u) != utils::Stringer("a", -12, 'b', what, 3000000000u)) {
+        cerr << "implementations disagree" << endl;
+        return 1;
+    }
+
+    if (failures) {
+        cerr << failures << " failures" << endl;
+        return 1;
+    }
+
+    cout << "iterations: " << iterations << endl;
+    stats.Print(cout);
+
+    return 0;
+}
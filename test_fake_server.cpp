@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string>
+#include <sstream>
+#include <locale>
+#include "test_fake_server.hpp"
+#include "base64.hpp"
+#include "utils.hpp"
+#include "http_status_codes.h"
+#include "vendor/date/date.h"
+#include "vendor/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace psicash;
+
+static const char* kDistinguishers[] = {"1ms", "100ms", "1s", "10s", "1min", "1hr", "24hr", "7day"};
+
+// Parses a distinguisher like "10s" into a duration. Returns false if it's not one.
+static bool DistinguisherDuration(const string& distinguisher, datetime::Duration& d) {
+    size_t unit_pos = 0;
+    while (unit_pos < distinguisher.size() && isdigit((unsigned char)distinguisher[unit_pos])) {
+        unit_pos++;
+    }
+    if (unit_pos == 0 || unit_pos > 9) {
+        return false;
+    }
+
+    auto n = stoll(distinguisher.substr(0, unit_pos));
+    auto unit = distinguisher.substr(unit_pos);
+    static const map<string, int64_t> unit_millis = {
+            {"ms", 1}, {"s", 1000}, {"min", 60 * 1000}, {"hr", 60 * 60 * 1000},
+            {"day", 24 * 60 * 60 * 1000}};
+    auto it = unit_millis.find(unit);
+    if (it == unit_millis.end()) {
+        return false;
+    }
+
+    d = datetime::Duration(n * it->second);
+    return true;
+}
+
+static string QueryValue(const HTTPParams& params, const string& name) {
+    for (const auto& q : params.query) {
+        if (q.first == name) {
+            return q.second;
+        }
+    }
+    return "";
+}
+
+static HTTPResult MakeResult(int code, const string& body = "") {
+    HTTPResult result;
+    result.code = code;
+    result.body = body;
+    return result;
+}
+
+FakeServer::FakeServer()
+        : FakeServer(Options()) {
+}
+
+FakeServer::FakeServer(const Options& options)
+        : options_(options), rand_(options.seed ? options.seed : random_device()()), request_count_(0), next_id_(1) {
+}
+
+MakeHTTPRequestFn FakeServer::Requester() {
+    return [this](const HTTPParams& params) { return Handle(params); };
+}
+
+uint64_t FakeServer::RequestCount() const {
+    lock_guard<mutex> lock(mutex_);
+    return request_count_;
+}
+
+void FakeServer::SetServerErrorRate(double rate) {
+    lock_guard<mutex> lock(mutex_);
+    options_.server_error_rate = rate;
+}
+
+void FakeServer::SetClockSkew(const datetime::Duration& skew) {
+    lock_guard<mutex> lock(mutex_);
+    options_.clock_skew = skew;
+}
+
+HTTPResult FakeServer::Handle(const HTTPParams& params) {
+    if (options_.latency.count() > 0) {
+        datetime::SleepFor(options_.latency);
+    }
+
+    HTTPResult result;
+    datetime::DateTime server_now;
+    {
+        lock_guard<mutex> lock(mutex_);
+        request_count_++;
+        server_now = ServerNow();
+
+        if (uniform_real_distribution<double>(0, 1)(rand_) < options_.server_error_rate) {
+            result = MakeResult(kHTTPStatusInternalServerError);
+        } else if (params.method == "POST" && params.path == "/v1/tracker") {
+            result = NewTracker();
+        } else if (params.method == "GET" && params.path == "/v1/refresh-state") {
+            result = RefreshState(params);
+        } else if (params.method == "POST" && params.path == "/v1/transaction") {
+            result = Transaction(params);
+        } else {
+            result = MakeResult(kHTTPStatusNotFound);
+        }
+    }
+
+    // Like "Wed, 03 Oct 2018 18:41:43 GMT"
+    ostringstream date;
+    date.imbue(locale::classic());
+    date << date::format("%a, %d %b %Y %T GMT", date::floor<chrono::seconds>(
+            datetime::TimePoint(datetime::Duration(server_now.MillisSinceEpoch()))));
+    result.date = date.str();
+
+    return result;
+}
+
+HTTPResult FakeServer::NewTracker() {
+    auto user_id = next_id_++;
+    users_[user_id] = User{options_.initial_balance, {}};
+
+    json tokens;
+    for (const auto& type : {kEarnerTokenType, kSpenderTokenType, kIndicatorTokenType}) {
+        auto token = utils::Stringer(type, "-", user_id, "-", rand_());
+        tokens_[token] = user_id;
+        tokens[type] = token;
+    }
+
+    return MakeResult(kHTTPStatusOK, tokens.dump());
+}
+
+HTTPResult FakeServer::RefreshState(const HTTPParams& params) {
+    auto auth = params.headers.find("X-PsiCash-Auth");
+    bool all_same_user = true;
+    auto user = UserForTokens(auth == params.headers.end() ? "" : auth->second, all_same_user);
+    if (!all_same_user) {
+        return MakeResult(kHTTPStatusUnauthorized);
+    }
+
+    json j;
+    j["TokensValid"] = json::object();
+    if (auth != params.headers.end()) {
+        stringstream ss(auth->second);
+        string token;
+        while (getline(ss, token, ',')) {
+            j["TokensValid"][token] = tokens_.count(token) > 0;
+        }
+    }
+    j["IsAccount"] = false;
+
+    if (user) {
+        j["Balance"] = user->balance;
+
+        j["PurchasePrices"] = json::array();
+        for (const auto& q : params.query) {
+            if (q.first != "class") {
+                continue;
+            }
+            for (const auto& d : kDistinguishers) {
+                j["PurchasePrices"].push_back({{"Class", q.second},
+                                               {"Distinguisher", d},
+                                               {"Price", options_.price}});
+            }
+        }
+    }
+
+    return MakeResult(kHTTPStatusOK, j.dump());
+}
+
+HTTPResult FakeServer::Transaction(const HTTPParams& params) {
+    auto auth = params.headers.find("X-PsiCash-Auth");
+    bool all_same_user = true;
+    auto user = UserForTokens(auth == params.headers.end() ? "" : auth->second, all_same_user);
+    if (!all_same_user || !user) {
+        return MakeResult(kHTTPStatusUnauthorized);
+    }
+
+    auto transaction_class = QueryValue(params, "class");
+    auto distinguisher = QueryValue(params, "distinguisher");
+    auto expected_amount = QueryValue(params, "expectedAmount");
+
+    if (expected_amount.empty()) {
+        // Reward
+        user->balance += options_.reward;
+        return MakeResult(kHTTPStatusOK, json{{"Balance", user->balance}}.dump());
+    }
+
+    datetime::Duration lifetime;
+    if (!DistinguisherDuration(distinguisher, lifetime)) {
+        return MakeResult(kHTTPStatusNotFound);
+    }
+
+    if (-stoll(expected_amount) != options_.price) {
+        return MakeResult(kHTTPStatusConflict, json{{"Balance", user->balance}}.dump());
+    }
+
+    auto now = ServerNow();
+    auto existing = user->purchases.find(transaction_class);
+    if (existing != user->purchases.end() && existing->second > now) {
+        return MakeResult(kHTTPStatusTooManyRequests, json{{"Balance", user->balance}}.dump());
+    }
+
+    if (user->balance < options_.price) {
+        return MakeResult(kHTTPStatusPaymentRequired, json{{"Balance", user->balance}}.dump());
+    }
+
+    user->balance -= options_.price;
+    auto expiry = now.Add(lifetime);
+    user->purchases[transaction_class] = expiry;
+
+    auto transaction_id = utils::Stringer("tx", next_id_++);
+    json auth_json = {
+            {"Authorization", {{"ID", base64::B64Encode(transaction_id)},
+                               {"AccessType", transaction_class},
+                               {"Expires", expiry}}},
+            {"SigningKeyID", "fake"},
+            {"Signature", "fake"}};
+
+    json j = {
+            {"TransactionID", transaction_id},
+            {"Balance", user->balance},
+            {"Authorization", base64::B64Encode(auth_json.dump())},
+            {"TransactionResponse", {{"Type", "expiring-purchase"},
+                                     {"Values", {{"Expires", expiry}}}}}};
+
+    return MakeResult(kHTTPStatusOK, j.dump());
+}
+
+FakeServer::User* FakeServer::UserForTokens(const string& auth_header, bool& all_same_user) {
+    all_same_user = true;
+    User* user = nullptr;
+
+    stringstream ss(auth_header);
+    string token;
+    while (getline(ss, token, ',')) {
+        auto it = tokens_.find(token);
+        if (it == tokens_.end()) {
+            continue;
+        }
+        auto& u = users_.at(it->second);
+        if (user && user != &u) {
+            all_same_user = false;
+            return nullptr;
+        }
+        user = &u;
+    }
+
+    return user;
+}
+
+datetime::DateTime FakeServer::ServerNow() const {
+    return datetime::DateTime::Now().Add(options_.clock_skew);
+}
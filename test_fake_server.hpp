@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_TEST_FAKE_SERVER_H
+#define PSICASHLIB_TEST_FAKE_SERVER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <random>
+#include <cstdint>
+#include "psicash.hpp"
+#include "datetime.hpp"
+
+/// An in-process stand-in for the PsiCash API server, for use as (the target of) a
+/// MakeHTTPRequestFn. It implements enough of /tracker, /refresh-state and /transaction
+/// to drive the full client state machine without a network.
+///
+/// Every transaction class is priced at `price` for any distinguisher whose name is a
+/// duration ("1ms", "10s", "5min", "1hr", "7day"); that is also the purchase lifetime.
+/// A transaction without an expectedAmount is a reward of `reward`.
+/// FakeServer operations are threadsafe.
+class FakeServer {
+public:
+    struct Options {
+        // Simulated latency added to every request.
+        psicash::datetime::Duration latency{0};
+        // Fraction (0-1) of requests that get a 500 response.
+        double server_error_rate = 0;
+        // The server's clock is ahead of the client's by this much.
+        psicash::datetime::Duration clock_skew{0};
+        int64_t initial_balance = 0;
+        int64_t price = 100;
+        int64_t reward = 1000;
+        // Seeds error injection and token generation; 0 seeds randomly.
+        uint32_t seed = 0;
+    };
+
+    FakeServer();
+    explicit FakeServer(const Options& options);
+
+    /// Returns a requester suitable for PsiCash::Init or SetHTTPRequestFn. The
+    /// FakeServer must outlive any use of it.
+    psicash::MakeHTTPRequestFn Requester();
+
+    psicash::HTTPResult Handle(const psicash::HTTPParams& params);
+
+    /// The number of requests handled so far.
+    uint64_t RequestCount() const;
+
+    /// Changes the fraction of requests that get a 500 response.
+    void SetServerErrorRate(double rate);
+
+    /// Changes how far the server's clock is ahead of the client's.
+    void SetClockSkew(const psicash::datetime::Duration& skew);
+
+protected:
+    struct User {
+        int64_t balance;
+        // Purchase expiries by transaction class
+        std::map<std::string, psicash::datetime::DateTime> purchases;
+    };
+
+    psicash::HTTPResult NewTracker();
+    psicash::HTTPResult RefreshState(const psicash::HTTPParams& params);
+    psicash::HTTPResult Transaction(const psicash::HTTPParams& params);
+
+    // Returns the user that owns all of the given tokens, or null.
+    User* UserForTokens(const std::string& auth_header, bool& all_same_user);
+    psicash::datetime::DateTime ServerNow() const;
+
+private:
+    mutable std::mutex mutex_;
+    Options options_;
+    std::mt19937 rand_;
+    uint64_t request_count_;
+    uint64_t next_id_;
+    // token -> user ID
+    std::map<std::string, uint64_t> tokens_;
+    std::map<uint64_t, User> users_;
+};
+
+#endif // PSICASHLIB_TEST_FAKE_SERVER_H
@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <cstdio>
+#include <memory>
+#include <algorithm>
+#include "test_simulation.hpp"
+#include "psicash_tester.hpp"
+#include "utils.hpp"
+
+using namespace std;
+using namespace psicash;
+using testing::PsiCashTester;
+
+//
+// VirtualClock
+//
+
+VirtualClock::VirtualClock(const datetime::DateTime& start)
+        : now_(start), next_seq_(0), installed_(false) {
+}
+
+VirtualClock::~VirtualClock() {
+    Uninstall();
+}
+
+void VirtualClock::Install() {
+    datetime::SetTimeSource(this);
+    installed_ = true;
+}
+
+void VirtualClock::Uninstall() {
+    if (installed_) {
+        datetime::SetTimeSource(nullptr);
+        installed_ = false;
+    }
+}
+
+datetime::DateTime VirtualClock::Now() {
+    lock_guard<mutex> lock(mutex_);
+    return now_;
+}
+
+void VirtualClock::SleepFor(const datetime::Duration& d) {
+    Advance(d);
+}
+
+void VirtualClock::Advance(const datetime::Duration& d) {
+    lock_guard<mutex> lock(mutex_);
+    if (d.count() > 0) {
+        now_ = now_.Add(d);
+    }
+}
+
+void VirtualClock::Schedule(const datetime::DateTime& at, Event event) {
+    lock_guard<mutex> lock(mutex_);
+    events_.push({at.MillisSinceEpoch(), next_seq_++, std::move(event)});
+}
+
+void VirtualClock::ScheduleAfter(const datetime::Duration& d, Event event) {
+    Schedule(Now().Add(d), std::move(event));
+}
+
+size_t VirtualClock::RunUntil(const datetime::DateTime& until) {
+    auto until_millis = until.MillisSinceEpoch();
+    size_t run = 0;
+    while (true) {
+        Event event;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (events_.empty() || events_.top().at_millis > until_millis) {
+                if (now_ < until) {
+                    now_ = until;
+                }
+                return run;
+            }
+            auto at_millis = events_.top().at_millis;
+            if (now_.MillisSinceEpoch() < at_millis) {
+                now_ = now_.Add(datetime::Duration(at_millis - now_.MillisSinceEpoch()));
+            }
+            event = std::move(const_cast<Scheduled&>(events_.top()).event);
+            events_.pop();
+        }
+        // Unlocked, so the event can use the clock.
+        event();
+        run++;
+    }
+}
+
+size_t VirtualClock::PendingEvents() const {
+    lock_guard<mutex> lock(mutex_);
+    return events_.size();
+}
+
+void VirtualClock::ClearEvents() {
+    lock_guard<mutex> lock(mutex_);
+    events_ = decltype(events_)();
+}
+
+//
+// ScriptedTransport
+//
+
+ScriptedTransport::ScriptedTransport(FakeServer& server, uint32_t seed)
+        : server_(server), rand_(seed), request_count_(0), fault_count_(0) {
+}
+
+void ScriptedTransport::AddStorm(const datetime::DateTime& from, const datetime::DateTime& until,
+                                 int status, double rate) {
+    lock_guard<mutex> lock(mutex_);
+    storms_.push_back({from.MillisSinceEpoch(), until.MillisSinceEpoch(), status, rate});
+}
+
+bool ScriptedTransport::StormOverlaps(const datetime::DateTime& from,
+                                      const datetime::DateTime& until) const {
+    lock_guard<mutex> lock(mutex_);
+    auto from_millis = from.MillisSinceEpoch(), until_millis = until.MillisSinceEpoch();
+    for (const auto& storm : storms_) {
+        if (storm.from_millis <= until_millis && from_millis <= storm.until_millis) {
+            return true;
+        }
+    }
+    return false;
+}
+
+MakeHTTPRequestFn ScriptedTransport::Requester() {
+    return [this](const HTTPParams& params) { return Handle(params); };
+}
+
+HTTPResult ScriptedTransport::Handle(const HTTPParams& params) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        request_count_++;
+        auto now_millis = datetime::DateTime::Now().MillisSinceEpoch();
+        for (const auto& storm : storms_) {
+            if (now_millis < storm.from_millis || now_millis >= storm.until_millis) {
+                continue;
+            }
+            if (uniform_real_distribution<double>(0, 1)(rand_) < storm.rate) {
+                fault_count_++;
+                HTTPResult result;
+                result.code = storm.status;
+                if (storm.status < 0) {
+                    result.error = "simulated network failure";
+                }
+                return result;
+            }
+            break;
+        }
+    }
+    return server_.Handle(params);
+}
+
+uint64_t ScriptedTransport::RequestCount() const {
+    lock_guard<mutex> lock(mutex_);
+    return request_count_;
+}
+
+uint64_t ScriptedTransport::FaultCount() const {
+    lock_guard<mutex> lock(mutex_);
+    return fault_count_;
+}
+
+//
+// SimulationStats
+//
+
+void SimulationStats::Merge(const SimulationStats& other) {
+    sessions += other.sessions;
+    ops += other.ops;
+    requests += other.requests;
+    faults += other.faults;
+    failed_ops += other.failed_ops;
+    purchases += other.purchases;
+    rewards += other.rewards;
+    expired += other.expired;
+    restarts += other.restarts;
+    skew_changes += other.skew_changes;
+}
+
+bool SimulationStats::operator==(const SimulationStats& other) const {
+    return sessions == other.sessions && ops == other.ops && requests == other.requests &&
+           faults == other.faults && failed_ops == other.failed_ops &&
+           purchases == other.purchases && rewards == other.rewards &&
+           expired == other.expired && restarts == other.restarts &&
+           skew_changes == other.skew_changes;
+}
+
+//
+// RunSimulatedSession
+//
+
+static const char* kUserAgent = "Psiphon-PsiCash-Simulation";
+static const char* kTransactionClass = "speed-boost";
+static const char* kRewardClass = "giftcard";
+static const int64_t kPrice = 100;
+static const auto kExpiryTolerance = chrono::seconds(2);
+
+namespace {
+
+// The state of one session, and its scripted activity. Each method that runs an
+// operation checks the outcome and the client state afterwards, recording the first
+// violation in `failure`.
+class Session {
+public:
+    Session(VirtualClock& clock, const SimulationConfig& config, const string& datastore_dir,
+            SimulationStats& stats)
+            : clock_(clock), dir_(datastore_dir), stats_(stats), rand_(config.seed),
+              server_(ServerOptions(config.seed)), transport_(server_, config.seed + 1) {
+    }
+
+    string Run(int days) {
+        auto start = clock_.Now();
+        auto end = start.Add(chrono::hours(24 * days));
+
+        // The script: a few storms and skew changes per day.
+        for (int day = 0; day < days; day++) {
+            auto day_start = start.Add(chrono::hours(24 * day));
+            if (Chance(0.5)) {
+                auto from = day_start.Add(chrono::minutes(Uniform(0, 24 * 60 - 1)));
+                auto until = from.Add(chrono::minutes(Uniform(5, 90)));
+                static const int kStatuses[] = {500, 502, 503, HTTPResult::RECOVERABLE_ERROR};
+                transport_.AddStorm(from, until, kStatuses[Uniform(0, 3)], Uniform(50, 100) / 100.0);
+            }
+            if (Chance(0.3)) {
+                auto skew = chrono::seconds(Uniform(-15 * 60, 15 * 60));
+                clock_.Schedule(day_start.Add(chrono::minutes(Uniform(0, 24 * 60 - 1))), [this, skew] {
+                    server_.SetClockSkew(skew);
+                    stats_.skew_changes++;
+                });
+            }
+        }
+
+        // (Re)opening the datastore starts fresh.
+        (void)std::remove((dir_ + "/psicashdatastore").c_str());
+        StartClient();
+        clock_.Schedule(start, [this] { Foreground(); });
+
+        clock_.RunUntil(end);
+        clock_.ClearEvents();
+
+        if (failure_.empty()) {
+            Expire();
+        }
+
+        stats_.sessions++;
+        stats_.requests += transport_.RequestCount();
+        stats_.faults += transport_.FaultCount();
+        return failure_;
+    }
+
+private:
+    static FakeServer::Options ServerOptions(uint32_t seed) {
+        FakeServer::Options options;
+        options.seed = seed;
+        options.price = kPrice;
+        options.clock_skew = chrono::seconds(mt19937(seed)() % (30 * 60)) - chrono::minutes(15);
+        return options;
+    }
+
+    int Uniform(int lo, int hi) {
+        return uniform_int_distribution<int>(lo, hi)(rand_);
+    }
+
+    bool Chance(double p) {
+        return uniform_real_distribution<double>(0, 1)(rand_) < p;
+    }
+
+    void Fail(const string& what) {
+        if (failure_.empty()) {
+            failure_ = utils::Stringer(what, " at ", clock_.Now().ToISO8601());
+        }
+    }
+
+    // Counts the op and checks its error: critical errors are never acceptable, and
+    // noncritical ones only during a storm. Returns true if the op succeeded.
+    bool CheckOp(const char* name, const error::Error& err, const datetime::DateTime& started) {
+        stats_.ops++;
+        if (!err) {
+            return true;
+        }
+        if (!err.Critical() && transport_.StormOverlaps(started, clock_.Now())) {
+            stats_.failed_ops++;
+            return false;
+        }
+        Fail(utils::Stringer(name, " failed: ", err.ToString()));
+        return false;
+    }
+
+    // As above, for an op that returned a status.
+    bool CheckStatus(const char* name, Status status, const datetime::DateTime& started) {
+        if (status != Status::ServerError) {
+            return true;
+        }
+        if (transport_.StormOverlaps(started, clock_.Now())) {
+            stats_.failed_ops++;
+            return false;
+        }
+        Fail(utils::Stringer(name, " got ServerError outside of a storm"));
+        return false;
+    }
+
+    void CheckState() {
+        if (pc_->Balance() < 0) {
+            Fail("negative balance");
+        }
+
+        // The server allows one purchase of a class at a time, and the client won't buy
+        // while it has one active (except as it's expiring; see Buy).
+        auto active = pc_->CountPurchases(PurchaseExpiry::kActive);
+        size_t lasting = 0;
+        auto soon = clock_.Now().Add(kExpiryTolerance);
+        pc_->ForEachPurchase(PurchaseExpiry::kActive, [&](const Purchase& p) {
+            lasting += !p.local_time_expiry || soon < *p.local_time_expiry;
+            return true;
+        });
+        if (lasting > 1) {
+            Fail(utils::Stringer(lasting, " active purchases"));
+        }
+        if (pc_->HasActivePurchase(kTransactionClass) != (active > 0)) {
+            Fail("HasActivePurchase disagrees with CountPurchases");
+        }
+
+        size_t active_authorized = 0;
+        pc_->ForEachPurchase(PurchaseExpiry::kActive, [&](const Purchase& p) {
+            active_authorized += p.authorization.has_value();
+            return true;
+        });
+        auto bundle = pc_->GetActiveAuthorizationBundle();
+        if (bundle.encoded->size() != active_authorized) {
+            Fail(utils::Stringer("bundle has ", bundle.encoded->size(), " authorizations; want ",
+                                 active_authorized));
+        }
+
+        if (pc_->CountPurchases(PurchaseExpiry::kAny) !=
+            active + pc_->CountPurchases(PurchaseExpiry::kExpired)) {
+            Fail("purchase counts don't add up");
+        }
+    }
+
+    void StartClient() {
+        pc_.reset(new PsiCashTester());
+        auto started = clock_.Now();
+        CheckOp("Init", pc_->Init(kUserAgent, dir_.c_str(), transport_.Requester()), started);
+    }
+
+    // The app restarts, reloading its state from the datastore.
+    void Restart() {
+        auto balance = pc_->Balance();
+        auto purchases = pc_->GetPurchases();
+        auto tokens = pc_->ValidTokenTypes();
+
+        pc_.reset();
+        StartClient();
+        stats_.restarts++;
+
+        if (pc_->Balance() != balance || pc_->GetPurchases() != purchases ||
+            pc_->ValidTokenTypes() != tokens) {
+            Fail("state changed across restart");
+        }
+    }
+
+    void Refresh() {
+        auto started = clock_.Now();
+        auto result = pc_->RefreshState({kTransactionClass});
+        if (CheckOp("RefreshState", result ? error::nullerr : result.error(), started)) {
+            (void)CheckStatus("RefreshState", *result, started);
+        }
+    }
+
+    void Reward() {
+        if (pc_->ValidTokenTypes().empty()) {
+            return;
+        }
+        auto started = clock_.Now();
+        auto err = pc_->MakeRewardRequests(kRewardClass, "1", Uniform(1, 3));
+        if (CheckOp("MakeRewardRequests", err, started)) {
+            stats_.rewards++;
+        }
+    }
+
+    void Buy() {
+        static const char* kDistinguishers[] = {"10min", "1hr", "24hr"};
+        // The server only tells the client its time to the second, so the client's local
+        // expiries can be that much off; a purchase that's about to expire may already
+        // have expired on the server.
+        datetime::DateTime active_until;
+        pc_->ForEachPurchase(PurchaseExpiry::kActive, [&](const Purchase& p) {
+            if (p.local_time_expiry && active_until < *p.local_time_expiry) {
+                active_until = *p.local_time_expiry;
+            }
+            return true;
+        });
+        auto balance = pc_->Balance();
+
+        auto started = clock_.Now();
+        auto result = pc_->NewExpiringPurchase(kTransactionClass, kDistinguishers[Uniform(0, 2)], kPrice);
+        if (!CheckOp("NewExpiringPurchase", result ? error::nullerr : result.error(), started) ||
+            !CheckStatus("NewExpiringPurchase", result->status, started)) {
+            return;
+        }
+
+        switch (result->status) {
+            case Status::Success:
+                stats_.purchases++;
+                if (active_until > started.Add(kExpiryTolerance)) {
+                    Fail("purchased while a purchase was active");
+                }
+                if (!result->purchase || !pc_->HasActivePurchase(kTransactionClass)) {
+                    Fail("successful purchase isn't active");
+                }
+                break;
+            case Status::ExistingTransaction:
+                // The server may consider a purchase active a little longer than the client.
+                break;
+            case Status::InsufficientBalance:
+                // The client's balance can only be low (rewards aren't reflected until the
+                // next refresh), never high.
+                if (balance >= kPrice) {
+                    Fail(utils::Stringer("InsufficientBalance with balance ", balance));
+                }
+                break;
+            default:
+                Fail(utils::Stringer("NewExpiringPurchase unexpected status ", (int)result->status));
+        }
+    }
+
+    void Expire() {
+        auto started = clock_.Now();
+        auto result = pc_->ExpirePurchases();
+        if (!CheckOp("ExpirePurchases", result ? error::nullerr : result.error(), started)) {
+            return;
+        }
+        stats_.expired += result->size();
+        for (const auto& p : *result) {
+            if (!p.local_time_expiry || clock_.Now() < *p.local_time_expiry) {
+                Fail("ExpirePurchases removed an unexpired purchase");
+            }
+        }
+        if (pc_->CountPurchases(PurchaseExpiry::kExpired) != 0) {
+            Fail("expired purchases remain after ExpirePurchases");
+        }
+        CheckState();
+    }
+
+    // Like an app timer, expires the next purchase when it's due.
+    void ScheduleExpiry() {
+        auto next = pc_->NextExpiringPurchase();
+        if (next && next->local_time_expiry) {
+            clock_.Schedule(*next->local_time_expiry, [this] {
+                if (failure_.empty()) {
+                    Expire();
+                }
+            });
+        }
+    }
+
+    // The user opens the app.
+    void Foreground() {
+        if (!failure_.empty()) {
+            return;
+        }
+
+        if (Chance(0.05)) {
+            Restart();
+        }
+        Refresh();
+        CheckState();
+        if (Chance(0.4)) {
+            Reward();
+            CheckState();
+        }
+        if (Chance(0.6)) {
+            Buy();
+            CheckState();
+        }
+        ScheduleExpiry();
+
+        clock_.ScheduleAfter(chrono::minutes(Uniform(30, 8 * 60)), [this] { Foreground(); });
+    }
+
+    VirtualClock& clock_;
+    string dir_;
+    SimulationStats& stats_;
+    mt19937 rand_;
+    FakeServer server_;
+    ScriptedTransport transport_;
+    unique_ptr<PsiCashTester> pc_;
+    string failure_;
+};
+
+} // namespace
+
+string RunSimulatedSession(VirtualClock& clock, const SimulationConfig& config,
+                           const string& datastore_dir, SimulationStats& stats) {
+    Session session(clock, config, datastore_dir, stats);
+    return session.Run(config.days);
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_TEST_SIMULATION_H
+#define PSICASHLIB_TEST_SIMULATION_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <random>
+#include <functional>
+#include <cstdint>
+#include "psicash.hpp"
+#include "datetime.hpp"
+#include "test_fake_server.hpp"
+
+/// A virtual clock and event scheduler for deterministic simulation. While installed as
+/// the datetime::TimeSource, time only moves when the simulation moves it: SleepFor
+/// advances the clock immediately instead of waiting, and RunUntil runs scheduled events
+/// in time order, advancing the clock to each. Events run on the calling thread.
+class VirtualClock : public psicash::datetime::TimeSource {
+public:
+    using Event = std::function<void()>;
+
+    explicit VirtualClock(const psicash::datetime::DateTime& start);
+    /// Uninstalls the clock, if it's installed.
+    virtual ~VirtualClock();
+
+    /// Makes this the process-wide time source. Only one VirtualClock may be installed
+    /// at a time.
+    void Install();
+    void Uninstall();
+
+    psicash::datetime::DateTime Now() override;
+    void SleepFor(const psicash::datetime::Duration& d) override;
+    void Advance(const psicash::datetime::Duration& d);
+
+    /// Schedules `event` to run at `at`, or immediately (on the next RunUntil) if that's
+    /// already past.
+    void Schedule(const psicash::datetime::DateTime& at, Event event);
+    void ScheduleAfter(const psicash::datetime::Duration& d, Event event);
+
+    /// Runs the events scheduled up to `until` -- including those scheduled by the events
+    /// themselves -- in time order (ties in scheduling order), then moves the clock to
+    /// `until` (unless an event already moved it further). Returns the number of events run.
+    size_t RunUntil(const psicash::datetime::DateTime& until);
+
+    size_t PendingEvents() const;
+    void ClearEvents();
+
+private:
+    struct Scheduled {
+        int64_t at_millis;
+        uint64_t seq;
+        Event event;
+    };
+    struct Later {
+        bool operator()(const Scheduled& a, const Scheduled& b) const {
+            return a.at_millis != b.at_millis ? a.at_millis > b.at_millis : a.seq > b.seq;
+        }
+    };
+
+    mutable std::mutex mutex_;
+    psicash::datetime::DateTime now_;
+    uint64_t next_seq_;
+    std::priority_queue<Scheduled, std::vector<Scheduled>, Later> events_;
+    bool installed_;
+};
+
+/// A scripted fault layer in front of a FakeServer. Within the scheduled (virtual time)
+/// windows of a storm, requests fail with the storm's status at the storm's rate, without
+/// reaching the server. Fault decisions come from a seeded generator, so a script plays out
+/// the same way on every run.
+class ScriptedTransport {
+public:
+    ScriptedTransport(FakeServer& server, uint32_t seed);
+
+    /// A status less than zero (like kHTTPStatusRecoverableError) simulates a network failure.
+    void AddStorm(const psicash::datetime::DateTime& from, const psicash::datetime::DateTime& until,
+                  int status, double rate);
+
+    /// True if any storm overlaps [from, until].
+    bool StormOverlaps(const psicash::datetime::DateTime& from,
+                       const psicash::datetime::DateTime& until) const;
+
+    /// Returns a requester suitable for PsiCash::Init or SetHTTPRequestFn. The
+    /// ScriptedTransport must outlive any use of it.
+    psicash::MakeHTTPRequestFn Requester();
+
+    psicash::HTTPResult Handle(const psicash::HTTPParams& params);
+
+    uint64_t RequestCount() const;
+    uint64_t FaultCount() const;
+
+private:
+    struct Storm {
+        int64_t from_millis, until_millis;
+        int status;
+        double rate;
+    };
+
+    mutable std::mutex mutex_;
+    FakeServer& server_;
+    std::mt19937 rand_;
+    std::vector<Storm> storms_;
+    uint64_t request_count_;
+    uint64_t fault_count_;
+};
+
+struct SimulationConfig {
+    // Everything about a session -- the server's clock skew, storms, the client's
+    // activity -- derives from the seed.
+    uint32_t seed = 1;
+    int days = 3;
+};
+
+struct SimulationStats {
+    uint64_t sessions = 0;
+    uint64_t ops = 0; // PsiCash API calls
+    uint64_t requests = 0;
+    uint64_t faults = 0; // requests failed by storms
+    uint64_t failed_ops = 0; // ops that failed because of storms
+    uint64_t purchases = 0;
+    uint64_t rewards = 0;
+    uint64_t expired = 0;
+    uint64_t restarts = 0;
+    uint64_t skew_changes = 0;
+
+    void Merge(const SimulationStats& other);
+    bool operator==(const SimulationStats& other) const;
+};
+
+/// Runs one simulated session on `clock` (which must be installed): a client with its own
+/// FakeServer, ScriptedTransport and fresh datastore in datastore_dir, used for
+/// config.days of virtual time. The client periodically comes to the foreground to refresh,
+/// collect rewards and buy speed-boosts; purchases expire; the app restarts from its
+/// datastore; the server's clock skew changes; and 5xx storms come and go.
+/// State invariants are checked after every operation, and operations may only fail
+/// during a storm. Returns an empty string on success, or a description of the first
+/// invariant violated.
+std::string RunSimulatedSession(VirtualClock& clock, const SimulationConfig& config,
+                                const std::string& datastore_dir, SimulationStats& stats);
+
+#endif // PSICASHLIB_TEST_SIMULATION_H
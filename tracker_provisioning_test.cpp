@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "test_helpers.hpp"
+#include "test_fake_server.hpp"
+#include "revalidator.hpp"
+#include "psicash.hpp"
+
+using namespace std;
+using namespace psicash;
+using namespace testing;
+
+class TestTrackerProvisioning : public ::testing::Test, public TempDir
+{
+  public:
+    TestTrackerProvisioning() : trackers(0) {}
+
+    // Passes requests to the server, counting the tracker requests.
+    MakeHTTPRequestFn CountingRequester(FakeServer& server) {
+        auto requester = server.Requester();
+        return [this, requester](const HTTPParams& params) {
+            if (params.path.find("/tracker") != string::npos) {
+                trackers++;
+            }
+            return requester(params);
+        };
+    }
+
+    atomic<int> trackers;
+};
+
+// Exposes the tracker provisioner of a PsiCash instance.
+class ProvisioningPsiCash : public PsiCash {
+public:
+    uint64_t ProvisioningsStarted() const { return tracker_provisioner_->Started(); }
+
+    void WaitForProvisioning() const {
+        while (tracker_provisioner_->InFlight()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+};
+
+TEST_F(TestTrackerProvisioning, Disabled)
+{
+    FakeServer server;
+
+    ProvisioningPsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Test", GetTempDir().c_str(), CountingRequester(server)));
+    ASSERT_EQ(pc.ProvisioningsStarted(), 0);
+    ASSERT_EQ(server.RequestCount(), 0);
+
+    // The first refresh gets the tracker itself.
+    auto res = pc.RefreshState({});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::Success);
+    ASSERT_EQ(trackers, 1);
+    ASSERT_EQ(server.RequestCount(), 2);
+
+    // Not needed once there are tokens.
+    pc.SetTrackerProvisioning(true);
+    ASSERT_EQ(pc.ProvisioningsStarted(), 0);
+}
+
+TEST_F(TestTrackerProvisioning, WhenRequesterSet)
+{
+    FakeServer::Options options;
+    options.initial_balance = 100;
+    FakeServer server(options);
+
+    ProvisioningPsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Test", GetTempDir().c_str(), nullptr));
+    pc.SetTrackerProvisioning(true);
+    ASSERT_EQ(pc.ProvisioningsStarted(), 0);
+
+    pc.SetHTTPRequestFn(CountingRequester(server));
+    ASSERT_EQ(pc.ProvisioningsStarted(), 1);
+    pc.WaitForProvisioning();
+    ASSERT_EQ(trackers, 1);
+    ASSERT_EQ(pc.ValidTokenTypes().size(), 3);
+
+    // The first refresh needs just the one request.
+    auto res = pc.RefreshState({});
+    ASSERT_TRUE(res) << res.error();
+    ASSERT_EQ(*res, Status::Success);
+    ASSERT_EQ(server.RequestCount(), 2);
+    ASSERT_EQ(pc.Balance(), 100);
+
+    // Setting the requester again doesn't provision another.
+    pc.SetHTTPRequestFn(CountingRequester(server));
+    ASSERT_EQ(pc.ProvisioningsStarted(), 1);
+    ASSERT_EQ(trackers, 1);
+}
+
+TEST_F(TestTrackerProvisioning, ConcurrentRefreshesWait)
+{
+    FakeServer::Options options;
+    options.latency = chrono::milliseconds(20);
+    options.initial_balance = 100;
+    FakeServer server(options);
+
+    ProvisioningPsiCash pc;
+    ASSERT_FALSE(pc.Init("Psiphon-PsiCash-Test", GetTempDir().c_str(), CountingRequester(server)));
+    pc.SetTrackerProvisioning(true);
+    ASSERT_EQ(pc.ProvisioningsStarted(), 1);
+
+    const int kRefreshers = 3;
+    atomic<int> successes(0);
+    vector<thread> threads;
+    for (int i = 0; i < kRefreshers; i++) {
+        threads.emplace_back([&] {
+            auto res = pc.RefreshState({});
+            if (res && *res == Status::Success) {
+                successes++;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    pc.WaitForProvisioning();
+
+    ASSERT_EQ(successes, kRefreshers);
+    ASSERT_EQ(trackers, 1);
+    ASSERT_EQ(server.RequestCount(), 1 + kRefreshers);
+    ASSERT_EQ(pc.ValidTokenTypes().size(), 3);
+    ASSERT_EQ(pc.Balance(), 100);
+}
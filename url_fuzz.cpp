@@ -0,0 +1,29 @@
+/*
+ * Fuzz target for URL::Parse. std::regex matching is recursive in libstdc++, so long
+ * inputs can exhaust the stack or take superlinear time.
+ */
+
+#include "fuzz_helpers.hpp"
+#include "url.hpp"
+
+using namespace psicash;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz::Budget budget("url");
+    auto s = fuzz::AsString(data, size);
+
+    URL url;
+    if (url.Parse(s)) {
+        return 0;
+    }
+
+    // A parsed URL reparses to the same thing.
+    auto str = url.ToString();
+    URL reparsed;
+    fuzz::Check(!reparsed.Parse(str), "url", "ToString result doesn't parse");
+    fuzz::Check(reparsed.ToString() == str, "url", "ToString doesn't round-trip");
+
+    (void)URL::Encode(s, false);
+    (void)URL::Encode(s, true);
+    return 0;
+}
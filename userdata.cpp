@@ -20,6 +20,7 @@
 #include "userdata.hpp"
 #include "datastore.hpp"
 #include "psicash.hpp"
+#include "utils.hpp"
 #include "vendor/nlohmann/json.hpp"
 
 using json = nlohmann::json;
@@ -29,16 +30,124 @@ using namespace std;
 namespace psicash {
 
 // Datastore keys
-static constexpr const char* VERSION = "v"; // Preliminary version key; not yet used for anything
+static constexpr const char* VERSION = "v";
 static constexpr const char* SERVER_TIME_DIFF = "serverTimeDiff";
 static constexpr const char* AUTH_TOKENS = "authTokens";
 static constexpr const char* BALANCE = "balance";
 static constexpr const char* IS_ACCOUNT = "IsAccount";
 static constexpr const char* PURCHASE_PRICES = "purchasePrices";
+static constexpr const char* LAST_REFRESH = "lastRefresh";
 static constexpr const char* PURCHASES = "purchases";
 static constexpr const char* LAST_TRANSACTION_ID = "lastTransactionID";
+static constexpr const char* SLOW_OPERATIONS = "slowOperations";
 const char* REQUEST_METADATA = "requestMetadata"; // used in header
 
+// Datastore schema versions:
+//   1: Purchase and Authorization dates are ISO8601 strings; purchases include the
+//      derived localTimeExpiry.
+//   2: Those dates are int64 milliseconds since the epoch, and localTimeExpiry is not
+//      stored. Version 1 purchases are still readable (see from_json for DateTime).
+//   3: Authorizations are stored as their encoded form plus the ID and expiry (which
+//      are needed without decoding); the other fields are decoded when first read.
+static constexpr int kDatastoreVersion = 3;
+
+// The datastore form of a Purchase, which differs from its to_json form in the ways
+// described for schema versions 2 and 3.
+// Built as flat_json, the datastore's own type, so Set needn't convert it.
+static flat_json PurchaseToDatastore(const Purchase& p) {
+    flat_json j = {
+            {"id",            p.id},
+            {"class",         p.transaction_class},
+            {"distinguisher", p.distinguisher}};
+
+    if (p.authorization) {
+        j["authorization"] = {
+                {"ID",      p.authorization->id},
+                {"Expires", p.authorization->expires.MillisSinceEpoch()},
+                {"Encoded", p.authorization->encoded}};
+    } else {
+        j["authorization"] = nullptr;
+    }
+
+    if (p.server_time_expiry) {
+        j["serverTimeExpiry"] = p.server_time_expiry->MillisSinceEpoch();
+    } else {
+        j["serverTimeExpiry"] = nullptr;
+    }
+
+    return j;
+}
+
+// The datastore stores dates as milliseconds since the epoch; version 1 used ISO8601
+// strings, like the server does. Throws json exceptions.
+static datetime::DateTime DateTimeFromDatastore(const flat_json& j) {
+    if (j.is_number()) {
+        return datetime::DateTime(datetime::TimePoint(datetime::Duration(j.get<int64_t>())));
+    }
+    datetime::DateTime dt;
+    (void)dt.FromISO8601(j.get<string>()); // as from_json does
+    return dt;
+}
+
+// Reads the datastore form of a Purchase (of any schema version). Sets auth_pending if
+// the authorization still needs decoding. Throws json exceptions.
+static void PurchaseFromDatastore(const flat_json& j, Purchase& p, bool& auth_pending) {
+    p.id = j.at("id").get<string>();
+    p.transaction_class = j.at("class").get<string>();
+    p.distinguisher = j.at("distinguisher").get<string>();
+
+    const auto& server_time_expiry = j.at("serverTimeExpiry");
+    if (server_time_expiry.is_null()) {
+        p.server_time_expiry = nonstd::nullopt;
+    } else {
+        p.server_time_expiry = DateTimeFromDatastore(server_time_expiry);
+    }
+    // The derived local_time_expiry is filled in by the cache.
+    p.local_time_expiry = nonstd::nullopt;
+
+    auth_pending = false;
+    const auto& auth = j.at("authorization");
+    if (auth.is_null()) {
+        p.authorization = nonstd::nullopt;
+    } else if (auth.find("AccessType") != auth.end()) {
+        // Versions 1 and 2 stored the decoded fields.
+        Authorization a;
+        a.id = auth.at("ID").get<string>();
+        a.access_type = auth.at("AccessType").get<string>();
+        a.expires = DateTimeFromDatastore(auth.at("Expires"));
+        a.encoded = auth.at("Encoded").get<string>();
+        p.authorization = std::move(a);
+    } else {
+        Authorization a;
+        a.id = auth.at("ID").get<string>();
+        a.expires = DateTimeFromDatastore(auth.at("Expires"));
+        a.encoded = auth.at("Encoded").get<string>();
+        p.authorization = std::move(a);
+        auth_pending = true;
+    }
+}
+
+static flat_json PurchasesToDatastore(const Purchases& purchases) {
+    flat_json j = flat_json::array();
+    for (const auto& p : purchases) {
+        j.push_back(PurchaseToDatastore(p));
+    }
+    return j;
+}
+
+static flat_json PurchasePricesToDatastore(const PurchasePrices& prices) {
+    flat_json j = flat_json::array();
+    for (const auto& pp : prices) {
+        j.push_back({
+                {"class",         pp.transaction_class},
+                {"distinguisher", pp.distinguisher},
+                {"price",         pp.price}});
+    }
+    return j;
+}
+
+constexpr int64_t UserData::kNoExpiry;
+
 UserData::UserData() {
 }
 
@@ -51,16 +160,63 @@ error::Error UserData::Init(const char* file_store_root) {
         return PassError(err);
     }
 
-    err = datastore_.Set({{VERSION, 1}});
-    if (err) {
-        return PassError(err);
+    Purchases purchases;
+    vector<uint8_t> auth_pending;
+    uint64_t dropped = 0;
+    auto j_purchases = datastore_.Get<flat_json>(PURCHASES);
+    if (j_purchases && j_purchases->is_array()) {
+        purchases.reserve(j_purchases->size());
+        auth_pending.reserve(j_purchases->size());
+        for (const auto& jp : *j_purchases) {
+            Purchase p;
+            bool pending;
+            try {
+                PurchaseFromDatastore(jp, p, pending);
+            }
+            catch (json::exception&) {
+                // As with a damaged datastore record, lose only this purchase.
+                dropped++;
+                continue;
+            }
+            purchases.push_back(std::move(p));
+            auth_pending.push_back(pending);
+        }
+    }
+    CachePurchases(purchases, auth_pending);
+    dropped_purchases_ = dropped;
+
+    auto version = datastore_.Get<int>(VERSION);
+    if (version && *version >= kDatastoreVersion) {
+        if (dropped > 0) {
+            // Replace the damaged purchases with the intact ones.
+            return PassError(datastore_.Set({{PURCHASES, PurchasesToDatastore(purchases)}},
+                                            Datastore::kDurable));
+        }
+        return error::nullerr;
     }
 
-    return error::nullerr;
+    // New or older datastore. Rewriting the purchases converts them to the current
+    // form; do it and the version update in one write. (Pending authorizations are
+    // already in the current form, so this doesn't need to decode them.)
+    WritePauser pauser(*this);
+    if (j_purchases) {
+        (void)datastore_.Set({{PURCHASES, PurchasesToDatastore(purchases)}}, Datastore::kDurable);
+    }
+    (void)datastore_.Set({{VERSION, kDatastoreVersion}}, Datastore::kDurable);
+    return PassError(pauser.Unpause()); // write
 }
 
 void UserData::Clear() {
     datastore_.Clear();
+    CachePurchases(Purchases());
+}
+
+uint64_t UserData::DatastoreBytesWritten() const {
+    return datastore_.BytesWritten();
+}
+
+uint64_t UserData::DatastoreDroppedRecords() const {
+    return datastore_.DroppedRecords() + dropped_purchases_;
 }
 
 datetime::Duration UserData::GetServerTimeDiff() const {
@@ -74,7 +230,15 @@ datetime::Duration UserData::GetServerTimeDiff() const {
 error::Error UserData::SetServerTimeDiff(const datetime::DateTime& serverTimeNow) {
     auto localTimeNow = datetime::DateTime::Now();
     auto diff = serverTimeNow.Diff(localTimeNow);
-    return PassError(datastore_.Set({{SERVER_TIME_DIFF, datetime::DurationToInt64(diff)}}));
+
+    SYNCHRONIZE(purchases_mutex_);
+    // Updated with every request and cheap to relearn, so it needn't cost a write.
+    auto err = datastore_.Set({{SERVER_TIME_DIFF, datetime::DurationToInt64(diff)}},
+                              Datastore::kLazy);
+    UpdatePurchasesLocalTimeExpiry(purchases_);
+    // The diff moves the expiry threshold.
+    UpdateAuthBundle(MakeExpiryFilter(PurchaseExpiry::kActive, localTimeNow, true).threshold);
+    return PassError(err);
 }
 
 AuthTokens UserData::GetAuthTokens() const {
@@ -87,7 +251,8 @@ AuthTokens UserData::GetAuthTokens() const {
 
 error::Error UserData::SetAuthTokens(const AuthTokens& v, bool is_account) {
     return PassError(datastore_.Set({{AUTH_TOKENS, v},
-                                     {IS_ACCOUNT,  is_account}}));
+                                     {IS_ACCOUNT,  is_account}},
+                                    Datastore::kDurable));
 }
 
 error::Error UserData::CullAuthTokens(const std::map<std::string, bool>& valid_tokens) {
@@ -104,7 +269,12 @@ error::Error UserData::CullAuthTokens(const std::map<std::string, bool>& valid_t
         }
     }
 
-    return PassError(datastore_.Set({{AUTH_TOKENS, good_auth_tokens}}));
+    // Called on every refresh; usually nothing changes, and that needn't cost a write.
+    if (good_auth_tokens == all_auth_tokens) {
+        return error::nullerr;
+    }
+
+    return PassError(datastore_.Set({{AUTH_TOKENS, good_auth_tokens}}, Datastore::kDurable));
 }
 
 bool UserData::GetIsAccount() const {
@@ -116,7 +286,11 @@ bool UserData::GetIsAccount() const {
 }
 
 error::Error UserData::SetIsAccount(bool v) {
-    return PassError(datastore_.Set({{IS_ACCOUNT, v}}));
+    auto stored = datastore_.Get<bool>(IS_ACCOUNT);
+    if (stored && *stored == v) {
+        return error::nullerr;
+    }
+    return PassError(datastore_.Set({{IS_ACCOUNT, v}}, Datastore::kDurable));
 }
 
 int64_t UserData::GetBalance() const {
@@ -140,38 +314,231 @@ PurchasePrices UserData::GetPurchasePrices() const {
 }
 
 error::Error UserData::SetPurchasePrices(const PurchasePrices& v) {
-    return PassError(datastore_.Set({{PURCHASE_PRICES, v}}));
+    return PassError(datastore_.Set({{PURCHASE_PRICES, PurchasePricesToDatastore(v)}}));
 }
 
-Purchases UserData::GetPurchases() const {
-    auto v = datastore_.Get<Purchases>(PURCHASES);
+nonstd::optional<datetime::DateTime> UserData::GetLastRefresh() const {
+    auto v = datastore_.Get<flat_json>(LAST_REFRESH);
     if (!v) {
-        v = Purchases();
+        return nonstd::nullopt;
+    }
+    try {
+        // Earlier versions stored an ISO8601 string.
+        return DateTimeFromDatastore(*v);
+    }
+    catch (json::exception&) {
+        return nonstd::nullopt;
     }
+}
 
-    UpdatePurchasesLocalTimeExpiry(*v);
-    return *v;
+error::Error UserData::SetLastRefresh(const datetime::DateTime& v) {
+    return PassError(datastore_.Set({{LAST_REFRESH, v.MillisSinceEpoch()}}));
+}
+
+Purchases UserData::GetPurchases() const {
+    SYNCHRONIZE(purchases_mutex_);
+    for (size_t i = 0; i < purchases_.size(); i++) {
+        (void)DecodedPurchase(i);
+    }
+    return purchases_;
 }
 
 error::Error UserData::SetPurchases(const Purchases& v) {
-    return PassError(datastore_.Set({{PURCHASES, v}}));
+    auto j = PurchasesToDatastore(v);
+
+    // The in-memory datastore is updated even if the write fails, so the cache is too.
+    WritePauser pauser(*this);
+    (void)datastore_.Set({{PURCHASES, j}}, Datastore::kDurable);
+    CachePurchases(v);
+    return PassError(pauser.Unpause()); // write
+}
+
+UserData::ExpiryFilter UserData::MakeExpiryFilter(PurchaseExpiry expiry,
+                                                  const datetime::DateTime& local_now,
+                                                  bool authorized_only) const {
+    // A purchase is expired if its local expiry is before local_now. Local expiry is
+    // server expiry minus the server time diff, so that's equivalent to its server
+    // expiry being before local_now plus the diff.
+    ExpiryFilter f;
+    f.threshold = local_now.MillisSinceEpoch() + datetime::DurationToInt64(GetServerTimeDiff());
+    f.want_expired = (expiry == PurchaseExpiry::kExpired);
+    f.any_expiry = (expiry == PurchaseExpiry::kAny);
+    f.any_authorization = !authorized_only;
+    return f;
+}
+
+Purchases UserData::GetPurchases(PurchaseExpiry expiry, const datetime::DateTime& local_now,
+                                 bool authorized_only/*=false*/) const {
+    const auto filter = MakeExpiryFilter(expiry, local_now, authorized_only);
+
+    Purchases res;
+    SYNCHRONIZE_BLOCK(purchases_mutex_) {
+        const auto count = purchases_.size();
+        const int64_t* expiries = server_expiry_millis_.data();
+        const uint8_t* authorized = has_authorization_.data();
+
+        // Compute all the matches before touching any purchases.
+        vector<uint8_t> match(count);
+        size_t matches = 0;
+        for (size_t i = 0; i < count; i++) {
+            match[i] = filter.Match(expiries[i], authorized[i]);
+            matches += match[i];
+        }
+
+        res.reserve(matches);
+        for (size_t i = 0; i < count; i++) {
+            if (match[i]) {
+                res.push_back(DecodedPurchase(i));
+            }
+        }
+    }
+
+    return res;
+}
+
+void UserData::ForEachPurchase(PurchaseExpiry expiry, const datetime::DateTime& local_now,
+                               bool authorized_only, PurchaseVisitor visit) const {
+    const auto filter = MakeExpiryFilter(expiry, local_now, authorized_only);
+
+    SYNCHRONIZE(purchases_mutex_);
+    for (size_t i = 0; i < purchases_.size(); i++) {
+        if (filter.Match(server_expiry_millis_[i], has_authorization_[i]) && !visit(DecodedPurchase(i))) {
+            return;
+        }
+    }
+}
+
+size_t UserData::CountPurchases(PurchaseExpiry expiry, const datetime::DateTime& local_now,
+                                bool authorized_only/*=false*/) const {
+    const auto filter = MakeExpiryFilter(expiry, local_now, authorized_only);
+
+    SYNCHRONIZE(purchases_mutex_);
+    const auto count = purchases_.size();
+    const int64_t* expiries = server_expiry_millis_.data();
+    const uint8_t* authorized = has_authorization_.data();
+    size_t matches = 0;
+    for (size_t i = 0; i < count; i++) {
+        matches += filter.Match(expiries[i], authorized[i]);
+    }
+    return matches;
+}
+
+nonstd::optional<Purchase> UserData::GetNextExpiringPurchase() const {
+    SYNCHRONIZE(purchases_mutex_);
+
+    // The first of equally early purchases wins.
+    size_t next = 0;
+    int64_t next_expiry = kNoExpiry;
+    for (size_t i = 0; i < server_expiry_millis_.size(); i++) {
+        if (server_expiry_millis_[i] < next_expiry) {
+            next = i;
+            next_expiry = server_expiry_millis_[i];
+        }
+    }
+
+    if (next_expiry == kNoExpiry) {
+        return nonstd::nullopt;
+    }
+    return DecodedPurchase(next);
+}
+
+AuthorizationBundle UserData::GetActiveAuthorizationBundle(const datetime::DateTime& local_now) const {
+    const auto threshold = MakeExpiryFilter(PurchaseExpiry::kActive, local_now, true).threshold;
+
+    SYNCHRONIZE(purchases_mutex_);
+    if (auth_bundle_expiry_ < threshold) {
+        // Something in the bundle has expired.
+        UpdateAuthBundle(threshold);
+    }
+    return auth_bundle_;
+}
+
+void UserData::UpdateAuthBundle(int64_t threshold) const {
+    // This runs whenever purchases or the server time diff change, but the bundle rarely
+    // does; so first check, without allocating, whether it's unchanged.
+    // (The encoded authorization is always present, even if decoding is pending.)
+    const auto* current = auth_bundle_.encoded.get();
+    bool unchanged = (current != nullptr);
+    size_t count = 0;
+    int64_t earliest_expiry = kNoExpiry;
+    for (size_t i = 0; i < purchases_.size(); i++) {
+        if (has_authorization_[i] && server_expiry_millis_[i] >= threshold) {
+            unchanged = unchanged && count < current->size() &&
+                        (*current)[count] == purchases_[i].authorization->encoded;
+            count++;
+            earliest_expiry = std::min(earliest_expiry, server_expiry_millis_[i]);
+        }
+    }
+    auth_bundle_expiry_ = earliest_expiry;
+
+    if (unchanged && count == current->size()) {
+        return;
+    }
+
+    auto encoded = std::make_shared<std::vector<std::string>>();
+    encoded->reserve(count);
+    for (size_t i = 0; i < purchases_.size(); i++) {
+        if (has_authorization_[i] && server_expiry_millis_[i] >= threshold) {
+            encoded->push_back(purchases_[i].authorization->encoded);
+        }
+    }
+    auth_bundle_.version++;
+    auth_bundle_.encoded = std::move(encoded);
+}
+
+const Purchase& UserData::DecodedPurchase(size_t i) const {
+    auto& p = purchases_[i];
+    if (auth_pending_[i]) {
+        auth_pending_[i] = false;
+        auto decoded = DecodeAuthorization(p.authorization->encoded);
+        if (decoded) {
+            // Keep the stored ID and expiry, which the index was built from.
+            p.authorization->access_type = std::move(decoded->access_type);
+        }
+        // Otherwise the fields that were stored are all we have.
+    }
+    return p;
+}
+
+void UserData::CachePurchases(const Purchases& purchases,
+                              const vector<uint8_t>& auth_pending/*=vector<uint8_t>()*/) {
+    SYNCHRONIZE(purchases_mutex_);
+    purchases_ = purchases;
+    UpdatePurchasesLocalTimeExpiry(purchases_);
+
+    auth_pending_ = auth_pending;
+    auth_pending_.resize(purchases.size());
+
+    server_expiry_millis_.resize(purchases.size());
+    has_authorization_.resize(purchases.size());
+    for (size_t i = 0; i < purchases.size(); i++) {
+        const auto& p = purchases[i];
+        server_expiry_millis_[i] = p.server_time_expiry ? p.server_time_expiry->MillisSinceEpoch() : kNoExpiry;
+        has_authorization_[i] = p.authorization.has_value();
+    }
+
+    UpdateAuthBundle(MakeExpiryFilter(PurchaseExpiry::kActive, datetime::DateTime::Now(), true).threshold);
 }
 
 error::Error UserData::AddPurchase(const Purchase& v) {
-    auto purchases = GetPurchases();
+    // Pause to set Purchases and LastTransactionID in one write
+    WritePauser pauser(*this);
     // Prevent duplicate insertion
-    for (const auto& p : purchases) {
+    for (const auto& p : purchases_) {
         if (p.id == v.id) {
             return error::nullerr;
         }
     }
 
+    // Work from the cache, so that pending authorizations don't need to be decoded.
+    auto purchases = purchases_;
+    auto auth_pending = auth_pending_;
     purchases.push_back(v);
+    auth_pending.push_back(false);
 
-    // Pause to set Purchases and LastTransactionID in one write
-    WritePauser pauser(*this);
     // These don't write, so have no meaningful return
-    (void)SetPurchases(purchases);
+    (void)datastore_.Set({{PURCHASES, PurchasesToDatastore(purchases)}}, Datastore::kDurable);
+    CachePurchases(purchases, auth_pending);
     (void)SetLastTransactionID(v.id);
     return PassError(pauser.Unpause()); // write
 }
@@ -189,8 +556,11 @@ void UserData::UpdatePurchaseLocalTimeExpiry(Purchase& purchase) const {
 }
 
 void UserData::UpdatePurchasesLocalTimeExpiry(Purchases& purchases) const {
+    const auto server_time_diff = GetServerTimeDiff();
     for (auto& p : purchases) {
-        UpdatePurchaseLocalTimeExpiry(p);
+        if (p.server_time_expiry) {
+            p.local_time_expiry = p.server_time_expiry->Sub(server_time_diff);
+        }
     }
 }
 
@@ -203,7 +573,21 @@ TransactionID UserData::GetLastTransactionID() const {
 }
 
 error::Error UserData::SetLastTransactionID(const TransactionID& v) {
-    return PassError(datastore_.Set({{LAST_TRANSACTION_ID, v}}));
+    return PassError(datastore_.Set({{LAST_TRANSACTION_ID, v}}, Datastore::kDurable));
+}
+
+json UserData::GetSlowOperations() const {
+    auto j = datastore_.Get<json>(SLOW_OPERATIONS);
+    if (!j) {
+        return json::array();
+    }
+
+    return *j;
+}
+
+error::Error UserData::SetSlowOperations(const json& v) {
+    // The recorder's form is shared with the diagnostic info, so this one is converted.
+    return PassError(datastore_.Set({{SLOW_OPERATIONS, flat_json(v)}}, Datastore::kLazy));
 }
 
 json UserData::GetRequestMetadata() const {
@@ -21,6 +21,8 @@
 #define PSICASHLIB_USERDATA_H
 
 #include <cstdint>
+#include <mutex>
+#include <vector>
 #include "datastore.hpp"
 #include "psicash.hpp"
 #include "datetime.hpp"
@@ -48,15 +50,34 @@ public:
     /// Clears data and datastore file.
     void Clear();
 
+    /// Returns the total number of bytes written to the datastore file since Init.
+    uint64_t DatastoreBytesWritten() const;
+    /// Number of damaged datastore records (including individual purchases) dropped at Init.
+    uint64_t DatastoreDroppedRecords() const;
+
     /// Used to pause and result datastore file writing.
+    /// Until Unpause, the purchases and the datastore are also locked (see
+    /// Datastore::Lock), so other threads see the changes made while paused all at once,
+    /// when they're committed. The file is written after the locks are released.
+    /// Pausers may be nested.
     class WritePauser {
     public:
-        WritePauser(UserData& user_data) : user_data_(
-                user_data) { user_data_.datastore_.PauseWrites(); };
+        WritePauser(UserData& user_data) : user_data_(user_data),
+                purchases_lock_(SYNCHRONIZE_LOCK(user_data.purchases_mutex_)),
+                lock_(user_data.datastore_.Lock()) { user_data_.datastore_.PauseWrites(); };
         ~WritePauser() { (void)Unpause(); } // TODO: Should dtor nuke changes (implying error)? Maybe param to ctor to indicate?
-        error::Error Unpause() { return user_data_.datastore_.UnpauseWrites(); }
+        error::Error Unpause() {
+            if (!lock_) {
+                return error::nullerr;
+            }
+            purchases_lock_.unlock();
+            return user_data_.datastore_.UnpauseWrites(lock_);
+        }
     private:
         UserData& user_data_;
+        // The purchases lock is ordered before the datastore's.
+        utils::SynchronizeLock purchases_lock_;
+        utils::SynchronizeLock lock_;
     };
 
 public:
@@ -79,30 +100,110 @@ public:
     PurchasePrices GetPurchasePrices() const;
     error::Error SetPurchasePrices(const PurchasePrices& v);
 
+    /// The local time of the last successful refresh-state request, if there has been one.
+    nonstd::optional<datetime::DateTime> GetLastRefresh() const;
+    error::Error SetLastRefresh(const datetime::DateTime& v);
+
     Purchases GetPurchases() const;
     error::Error SetPurchases(const Purchases& v);
     error::Error AddPurchase(const Purchase& v);
 
+    using PurchaseExpiry = psicash::PurchaseExpiry;
+    /// Returns the purchases (in stored order) whose local expiry state, compared to
+    /// local_now, matches `expiry`. If authorized_only is true, purchases without an
+    /// authorization are excluded. Purchases without an expiry are never expired.
+    Purchases GetPurchases(PurchaseExpiry expiry, const datetime::DateTime& local_now,
+                           bool authorized_only=false) const;
+    /// Calls `visit` with each purchase that GetPurchases would return, in stored order
+    /// and without copying, until it returns false. Purchases are locked during the visit,
+    /// so it must not modify them.
+    void ForEachPurchase(PurchaseExpiry expiry, const datetime::DateTime& local_now,
+                         bool authorized_only, PurchaseVisitor visit) const;
+    /// Returns the number of purchases that GetPurchases would return, without copying any.
+    size_t CountPurchases(PurchaseExpiry expiry, const datetime::DateTime& local_now,
+                          bool authorized_only=false) const;
+    /// Returns the encoded authorizations of the purchases that are active at local_now.
+    /// The bundle is rebuilt only when purchases change or one of its authorizations'
+    /// purchases expires; its version only changes if its contents do.
+    AuthorizationBundle GetActiveAuthorizationBundle(const datetime::DateTime& local_now) const;
+    /// Returns the purchase with the earliest expiry, if any purchase has one.
+    nonstd::optional<Purchase> GetNextExpiringPurchase() const;
+
     TransactionID GetLastTransactionID() const;
     error::Error SetLastTransactionID(const TransactionID& v);
 
+    /// The slow-operation recorder's entries (see FlightRecorder::ToJSON). They're
+    /// written lazily, with the next write of anything else.
+    nlohmann::json GetSlowOperations() const;
+    error::Error SetSlowOperations(const nlohmann::json& v);
+
     nlohmann::json GetRequestMetadata() const;
     template<typename T>
     error::Error SetRequestMetadataItem(const std::string& key, const T& val) {
         if (key.empty()) {
             return error::MakeCriticalError("Metadata key cannot be empty");
         }
-        auto j = GetRequestMetadata();
+        auto stored = datastore_.Get<flat_json>(REQUEST_METADATA);
+        auto j = stored ? *stored : flat_json::object();
         j[key] = val;
-        return datastore_.Set({{REQUEST_METADATA, j}});
+        return datastore_.Set({{REQUEST_METADATA, std::move(j)}});
     }
 
 protected:
     /// Modifies the purchases in the argument.
     void UpdatePurchasesLocalTimeExpiry(Purchases& purchases) const;
 
+    /// Replaces the purchase cache and index. Does not touch the datastore.
+    /// auth_pending, if not empty, flags (per purchase) authorizations that have only
+    /// their ID, expiry and encoded form filled in, to be decoded when first read.
+    void CachePurchases(const Purchases& purchases,
+                        const std::vector<uint8_t>& auth_pending = std::vector<uint8_t>());
+
+    /// Rebuilds auth_bundle_ for the given expiry threshold (as in ExpiryFilter).
+    /// Must be called with purchases_mutex_ held.
+    void UpdateAuthBundle(int64_t threshold) const;
+
+    /// Returns cached purchase i, first decoding its authorization if that's pending.
+    /// Must be called with purchases_mutex_ held.
+    const Purchase& DecodedPurchase(size_t i) const;
+
+    // Decides whether the index entry for a purchase matches a GetPurchases query.
+    struct ExpiryFilter {
+        int64_t threshold;
+        uint8_t want_expired, any_expiry, any_authorization;
+
+        uint8_t Match(int64_t server_expiry_millis, uint8_t has_authorization) const {
+            uint8_t expired = server_expiry_millis < threshold;
+            return ((expired == want_expired) | any_expiry) & (has_authorization | any_authorization);
+        }
+    };
+    ExpiryFilter MakeExpiryFilter(PurchaseExpiry expiry, const datetime::DateTime& local_now,
+                                  bool authorized_only) const;
+
 private:
     Datastore datastore_;
+    // Purchases that couldn't be read at Init, and so were dropped.
+    uint64_t dropped_purchases_ = 0;
+
+    // The stored purchases, kept in memory so they aren't deserialized from the
+    // datastore JSON on every read. Alongside is an index of the fields used for expiry
+    // scans, in structure-of-arrays form so the scans are simple loops over contiguous
+    // values (that the compiler can vectorize). Entry i of each refers to purchases_[i].
+    // Expiries are server time; a purchase without one has kNoExpiry. The cached
+    // purchases' local_time_expiry is kept current with the server time diff.
+    // Authorizations loaded from the datastore are decoded lazily (see DecodedPurchase),
+    // so purchases_ and auth_pending_ change in const reads.
+    static constexpr int64_t kNoExpiry = INT64_MAX;
+    mutable std::recursive_mutex purchases_mutex_;
+    mutable Purchases purchases_;
+    mutable std::vector<uint8_t> auth_pending_;
+    std::vector<int64_t> server_expiry_millis_;
+    std::vector<uint8_t> has_authorization_;
+
+    // The active authorizations bundle, and the earliest (server) expiry of the purchases
+    // in it, after which it must be rebuilt.
+    mutable AuthorizationBundle auth_bundle_;
+    mutable int64_t auth_bundle_expiry_ = kNoExpiry;
 };
 
 } // namespace psicash
@@ -1,6 +1,9 @@
+#include <fstream>
+#include <iterator>
 #include "gtest/gtest.h"
 #include "test_helpers.hpp"
 #include "userdata.hpp"
+#include "base64.hpp"
 #include "vendor/nlohmann/json.hpp"
 using json = nlohmann::json;
 
@@ -192,6 +195,13 @@ TEST_F(TestUserData, AuthTokens)
     ASSERT_FALSE(err);
     got_tokens = ud.GetAuthTokens();
     ASSERT_EQ(want, got_tokens);
+
+    // Culling nothing doesn't write
+    auto bytes_written = ud.DatastoreBytesWritten();
+    err = ud.CullAuthTokens(valid_tokens);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetAuthTokens(), want);
+    ASSERT_EQ(ud.DatastoreBytesWritten(), bytes_written);
 }
 
 TEST_F(TestUserData, IsAccount)
@@ -210,6 +220,12 @@ TEST_F(TestUserData, IsAccount)
     ASSERT_FALSE(err);
     auto got = ud.GetIsAccount();
     ASSERT_EQ(got, want);
+
+    // Setting the same value doesn't write
+    auto bytes_written = ud.DatastoreBytesWritten();
+    err = ud.SetIsAccount(want);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.DatastoreBytesWritten(), bytes_written);
 }
 
 TEST_F(TestUserData, Balance)
@@ -288,6 +304,237 @@ TEST_F(TestUserData, Purchases)
     ASSERT_NEAR(got[2].local_time_expiry->MillisSinceEpoch(), local_now.MillisSinceEpoch(), 5);
 }
 
+TEST_F(TestUserData, PurchasesDatastoreFormat)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_file = temp_dir + "/psicashdatastore";
+
+    // A version 1 datastore, with ISO8601 dates and a stored localTimeExpiry.
+    auto v1 = R"|({
+        "v": 1,
+        "purchases": [
+            {
+                "id": "id1", "class": "tc1", "distinguisher": "d1",
+                "serverTimeExpiry": "2019-01-14T21:46:30.717Z",
+                "localTimeExpiry": "2019-01-14T21:46:30.717Z",
+                "authorization": {
+                    "ID": "authid", "AccessType": "speed-boost",
+                    "Expires": "2019-01-14T21:46:30.717Z", "Encoded": "encoded"
+                }
+            },
+            {
+                "id": "id2", "class": "tc2", "distinguisher": "d2",
+                "serverTimeExpiry": null, "localTimeExpiry": null, "authorization": null
+            }
+        ]
+    })|";
+    {
+        ofstream f(ds_file, ios::trunc | ios::binary);
+        f << v1;
+    }
+
+    datetime::DateTime dt;
+    ASSERT_TRUE(dt.FromISO8601("2019-01-14T21:46:30.717Z"));
+    Purchases want = {
+        {"id1", "tc1", "d1", dt, nullopt, Authorization{"authid", "speed-boost", dt, "encoded"}},
+        {"id2", "tc2", "d2", nullopt, nullopt, nullopt}};
+
+    {
+        UserData ud;
+        auto err = ud.Init(temp_dir.c_str());
+        ASSERT_FALSE(err);
+
+        auto got = ud.GetPurchases();
+        ASSERT_EQ(got, want);
+        ASSERT_TRUE(got[0].authorization);
+        ASSERT_EQ(got[0].authorization->expires, dt);
+        ASSERT_TRUE(got[0].local_time_expiry);
+    }
+
+    // Init migrated the file to the current version.
+    // The file is a header line and then checksummed records; reassemble them.
+    ifstream f(ds_file, ios::binary);
+    json j = json::object();
+    string line;
+    ASSERT_TRUE(getline(f, line));
+    while (getline(f, line)) {
+        auto rec = json::parse(line.substr(9));
+        auto key = rec["k"].get<string>();
+        if (rec.count("e")) {
+            j[key].push_back(rec["e"]);
+        } else {
+            j[key] = rec["v"];
+        }
+    }
+    ASSERT_EQ(j["v"].get<int>(), 3);
+    auto j_purchase = j["purchases"][0];
+    ASSERT_EQ(j_purchase["serverTimeExpiry"].get<int64_t>(), dt.MillisSinceEpoch());
+    ASSERT_EQ(j_purchase["authorization"]["Expires"].get<int64_t>(), dt.MillisSinceEpoch());
+    ASSERT_EQ(j_purchase["authorization"].count("AccessType"), 0);
+    ASSERT_EQ(j_purchase.count("localTimeExpiry"), 0);
+
+    // And it reads back the same.
+    UserData ud;
+    auto err = ud.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    auto got = ud.GetPurchases();
+    ASSERT_EQ(got, want);
+    ASSERT_EQ(got[0].authorization->expires, dt);
+}
+
+TEST_F(TestUserData, PurchasesDatastoreFormatV2)
+{
+    auto temp_dir = GetTempDir();
+
+    // Version 2 stored dates as epoch milliseconds, alongside the decoded authorization.
+    datetime::DateTime dt;
+    ASSERT_TRUE(dt.FromISO8601("2019-01-14T21:46:30.717Z"));
+    auto millis = to_string(dt.MillisSinceEpoch());
+    auto v2 = R"|({
+        "v": 2,
+        "purchases": [
+            {
+                "id": "id1", "class": "tc1", "distinguisher": "d1",
+                "serverTimeExpiry": )|" + millis + R"|(,
+                "authorization": {
+                    "ID": "authid", "AccessType": "speed-boost",
+                    "Expires": )|" + millis + R"|(, "Encoded": "encoded"
+                }
+            }
+        ]
+    })|";
+    {
+        ofstream f(temp_dir + "/psicashdatastore", ios::trunc | ios::binary);
+        f << v2;
+    }
+
+    UserData ud;
+    auto err = ud.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    auto got = ud.GetPurchases();
+    ASSERT_EQ(got.size(), 1);
+    ASSERT_EQ(got[0].server_time_expiry, dt);
+    ASSERT_TRUE(got[0].authorization);
+    ASSERT_EQ(got[0].authorization->access_type, "speed-boost");
+    ASSERT_EQ(got[0].authorization->expires, dt);
+}
+
+TEST_F(TestUserData, PurchasesDamagedEntry)
+{
+    auto temp_dir = GetTempDir();
+
+    // The middle purchase is unreadable.
+    auto v1 = R"|({
+        "v": 1,
+        "purchases": [
+            {
+                "id": "id1", "class": "tc1", "distinguisher": "d1",
+                "serverTimeExpiry": null, "localTimeExpiry": null, "authorization": null
+            },
+            {
+                "id": 12345, "class": "tc2", "distinguisher": "d2",
+                "serverTimeExpiry": null, "localTimeExpiry": null, "authorization": null
+            },
+            {
+                "id": "id3", "class": "tc3", "distinguisher": "d3",
+                "serverTimeExpiry": null, "localTimeExpiry": null, "authorization": null
+            }
+        ]
+    })|";
+    {
+        ofstream f(temp_dir + "/psicashdatastore", ios::trunc | ios::binary);
+        f << v1;
+    }
+
+    Purchases want = {
+        {"id1", "tc1", "d1", nullopt, nullopt, nullopt},
+        {"id3", "tc3", "d3", nullopt, nullopt, nullopt}};
+
+    {
+        UserData ud;
+        auto err = ud.Init(temp_dir.c_str());
+        ASSERT_FALSE(err);
+        ASSERT_EQ(ud.GetPurchases(), want);
+        ASSERT_EQ(ud.DatastoreDroppedRecords(), 1);
+    }
+
+    // Only the damaged purchase was lost from the file.
+    UserData ud;
+    auto err = ud.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetPurchases(), want);
+    ASSERT_EQ(ud.DatastoreDroppedRecords(), 0);
+}
+
+TEST_F(TestUserData, PurchasesByExpiry)
+{
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str());
+    ASSERT_FALSE(err);
+
+    auto local_now = datetime::DateTime::Now();
+    ASSERT_EQ(ud.GetPurchases(UserData::PurchaseExpiry::kAny, local_now).size(), 0);
+    ASSERT_FALSE(ud.GetNextExpiringPurchase());
+
+    // The server is an hour ahead of us.
+    auto server_time_diff = datetime::Duration(60*60*1000);
+    err = ud.SetServerTimeDiff(local_now.Add(server_time_diff));
+    ASSERT_FALSE(err);
+
+    auto past = local_now.Sub(datetime::Duration(1000)).Add(server_time_diff);
+    auto future = local_now.Add(datetime::Duration(1000)).Add(server_time_diff);
+    auto later = future.Add(datetime::Duration(1000));
+    Authorization auth{"authid", "speed-boost", later, "encoded"};
+    Purchases all = {
+        {"expired-auth", "tc", "d", past, nullopt, auth},
+        {"active", "tc", "d", later, nullopt, nullopt},
+        {"no-expiry", "tc", "d", nullopt, nullopt, nullopt},
+        {"expired", "tc", "d", past, nullopt, nullopt},
+        {"active-auth", "tc", "d", future, nullopt, auth},
+        {"also-active-auth", "tc", "d", future, nullopt, auth}};
+    err = ud.SetPurchases(all);
+    ASSERT_FALSE(err);
+
+    auto ids = [](const Purchases& purchases) {
+        vector<string> res;
+        for (const auto& p : purchases) {
+            res.push_back(p.id);
+        }
+        return res;
+    };
+
+    // Allowing for the server time diff, the expiries are about a second either side of now.
+    auto got = ud.GetPurchases(UserData::PurchaseExpiry::kAny, local_now);
+    ASSERT_EQ(ids(got), ids(all));
+    got = ud.GetPurchases(UserData::PurchaseExpiry::kActive, local_now);
+    ASSERT_EQ(ids(got), (vector<string>{"active", "no-expiry", "active-auth", "also-active-auth"}));
+    ASSERT_TRUE(got[0].local_time_expiry);
+    ASSERT_EQ(*got[0].local_time_expiry, later.Sub(ud.GetServerTimeDiff()));
+    got = ud.GetPurchases(UserData::PurchaseExpiry::kExpired, local_now);
+    ASSERT_EQ(ids(got), (vector<string>{"expired-auth", "expired"}));
+
+    got = ud.GetPurchases(UserData::PurchaseExpiry::kAny, local_now, true);
+    ASSERT_EQ(ids(got), (vector<string>{"expired-auth", "active-auth", "also-active-auth"}));
+    got = ud.GetPurchases(UserData::PurchaseExpiry::kActive, local_now, true);
+    ASSERT_EQ(ids(got), (vector<string>{"active-auth", "also-active-auth"}));
+
+    // The first of the earliest.
+    auto next = ud.GetNextExpiringPurchase();
+    ASSERT_TRUE(next);
+    ASSERT_EQ(next->id, "expired-auth");
+    ASSERT_EQ(*next->local_time_expiry, past.Sub(ud.GetServerTimeDiff()));
+
+    // Changes are reflected.
+    err = ud.SetPurchases({all[1], all[2]});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetNextExpiringPurchase()->id, "active");
+    ASSERT_EQ(ud.GetPurchases(UserData::PurchaseExpiry::kExpired, local_now).size(), 0);
+
+    ud.Clear();
+    ASSERT_EQ(ud.GetPurchases(UserData::PurchaseExpiry::kAny, local_now).size(), 0);
+    ASSERT_FALSE(ud.GetNextExpiringPurchase());
+}
+
 TEST_F(TestUserData, AddPurchase)
 {
     UserData ud;
@@ -341,6 +588,43 @@ TEST_F(TestUserData, LastTransactionID)
     ASSERT_EQ(got, want);
 }
 
+TEST_F(TestUserData, LastRefresh)
+{
+    auto temp_dir = GetTempDir();
+    datetime::DateTime dt;
+    ASSERT_TRUE(dt.FromISO8601("2019-01-14T21:46:30.717Z"));
+
+    // Earlier versions stored it as an ISO8601 string.
+    {
+        ofstream f(temp_dir + "/psicashdatastore", ios::trunc | ios::binary);
+        f << R"|({"v": 3, "lastRefresh": "2019-01-14T21:46:30.717Z"})|";
+    }
+    {
+        UserData ud;
+        auto err = ud.Init(temp_dir.c_str());
+        ASSERT_FALSE(err);
+        auto got = ud.GetLastRefresh();
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, dt);
+
+        // Set then get
+        auto want = dt.Add(chrono::hours(1));
+        err = ud.SetLastRefresh(want);
+        ASSERT_FALSE(err);
+        got = ud.GetLastRefresh();
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, want);
+    }
+
+    // Now it's stored as epoch milliseconds.
+    Datastore ds;
+    auto err = ds.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    auto stored = ds.Get<int64_t>("lastRefresh");
+    ASSERT_TRUE(stored);
+    ASSERT_EQ(*stored, dt.Add(chrono::hours(1)).MillisSinceEpoch());
+}
+
 TEST_F(TestUserData, Metadata)
 {
     UserData ud;
@@ -379,3 +663,178 @@ TEST_F(TestUserData, Metadata)
     v = ud.GetRequestMetadata();
     ASSERT_TRUE(v["k"].is_null());
 }
+
+TEST_F(TestUserData, ForEachPurchase)
+{
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str());
+    ASSERT_FALSE(err);
+
+    auto local_now = datetime::DateTime::Now();
+    auto past = local_now.Sub(datetime::Duration(1000));
+    auto future = local_now.Add(datetime::Duration(1000));
+    Authorization auth{"authid", "speed-boost", future, "encoded"};
+    Purchases all = {
+        {"expired-auth", "tc1", "d", past, nullopt, auth},
+        {"active", "tc2", "d", future, nullopt, nullopt},
+        {"no-expiry", "tc3", "d", nullopt, nullopt, nullopt},
+        {"active-auth", "tc4", "d", future, nullopt, auth}};
+    err = ud.SetPurchases(all);
+    ASSERT_FALSE(err);
+
+    // Visiting and counting agree with GetPurchases.
+    for (auto expiry : {PurchaseExpiry::kAny, PurchaseExpiry::kActive, PurchaseExpiry::kExpired}) {
+        for (auto authorized_only : {false, true}) {
+            vector<string> want, got;
+            for (const auto& p : ud.GetPurchases(expiry, local_now, authorized_only)) {
+                want.push_back(p.id);
+            }
+            ud.ForEachPurchase(expiry, local_now, authorized_only, [&got](const Purchase& p) {
+                got.push_back(p.id);
+                return true;
+            });
+            ASSERT_EQ(got, want);
+            ASSERT_EQ(ud.CountPurchases(expiry, local_now, authorized_only), want.size());
+        }
+    }
+
+    // Returning false stops the visit.
+    int visited = 0;
+    ud.ForEachPurchase(PurchaseExpiry::kAny, local_now, false, [&visited](const Purchase&) {
+        return ++visited < 2;
+    });
+    ASSERT_EQ(visited, 2);
+
+    // Visited purchases have a current local_time_expiry.
+    auto server_time_diff = datetime::Duration(60*60*1000);
+    err = ud.SetServerTimeDiff(local_now.Add(server_time_diff));
+    ASSERT_FALSE(err);
+    ud.ForEachPurchase(PurchaseExpiry::kAny, local_now, false, [&ud](const Purchase& p) {
+        if (p.server_time_expiry) {
+            EXPECT_TRUE(p.local_time_expiry);
+            EXPECT_EQ(*p.local_time_expiry, p.server_time_expiry->Sub(ud.GetServerTimeDiff()));
+        } else {
+            EXPECT_FALSE(p.local_time_expiry);
+        }
+        return true;
+    });
+    // And with the server an hour ahead, everything with an expiry is now expired.
+    ASSERT_EQ(ud.CountPurchases(PurchaseExpiry::kActive, local_now), 1);
+}
+
+TEST_F(TestUserData, AuthorizationDecodedLazily)
+{
+    auto temp_dir = GetTempDir();
+
+    datetime::DateTime expires;
+    ASSERT_TRUE(expires.FromISO8601("2019-01-14T21:46:30.717Z"));
+    auto encoded = base64::B64Encode(json({
+        {"Authorization", {{"ID", "authid"},
+                           {"AccessType", "speed-boost"},
+                           {"Expires", "2019-01-14T21:46:30.717Z"}}},
+        {"Signature", "sig"},
+        {"SigningKeyID", "keyid"}}).dump());
+    auto auth = DecodeAuthorization(encoded);
+    ASSERT_TRUE(auth);
+    Purchases want = {{"id1", "tc1", "d1", expires, nullopt, *auth},
+                      {"id2", "tc2", "d2", nullopt, nullopt, nullopt}};
+
+    {
+        UserData ud;
+        auto err = ud.Init(temp_dir.c_str());
+        ASSERT_FALSE(err);
+        err = ud.SetPurchases(want);
+        ASSERT_FALSE(err);
+    }
+
+    // Only the encoded form has the access type.
+    ifstream f(temp_dir + "/psicashdatastore", ios::binary);
+    string contents((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    ASSERT_EQ(contents.find("AccessType"), string::npos);
+
+    UserData ud;
+    auto err = ud.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+
+    // Whichever way it's read, the authorization is fully decoded.
+    auto next = ud.GetNextExpiringPurchase();
+    ASSERT_TRUE(next);
+    ASSERT_EQ(next->authorization->access_type, "speed-boost");
+    ASSERT_EQ(next->authorization->id, "authid");
+    ASSERT_EQ(next->authorization->expires, expires);
+
+    auto got = ud.GetPurchases();
+    ASSERT_EQ(got, want);
+    ASSERT_EQ(got[0].authorization->access_type, "speed-boost");
+
+    // Adding a purchase keeps the others.
+    err = ud.AddPurchase({"id3", "tc3", "d3", nullopt, nullopt, nullopt});
+    ASSERT_FALSE(err);
+    UserData ud2;
+    err = ud2.Init(temp_dir.c_str());
+    ASSERT_FALSE(err);
+    auto added = ud2.GetPurchases();
+    ASSERT_EQ(added.size(), 3);
+    ASSERT_EQ(added[0].authorization->access_type, "speed-boost");
+}
+
+TEST_F(TestUserData, ActiveAuthorizationBundle)
+{
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str());
+    ASSERT_FALSE(err);
+
+    auto local_now = datetime::DateTime::Now();
+    auto bundle = ud.GetActiveAuthorizationBundle(local_now);
+    ASSERT_TRUE(bundle.encoded);
+    ASSERT_EQ(bundle.encoded->size(), 0);
+    auto version = bundle.version;
+
+    auto soon = local_now.Add(datetime::Duration(1000));
+    auto later = local_now.Add(datetime::Duration(60*1000));
+    auto past = local_now.Sub(datetime::Duration(1000));
+    Purchases purchases = {
+        {"id1", "tc", "d", soon, nullopt, Authorization{"a1", "speed-boost", soon, "encoded1"}},
+        {"id2", "tc", "d", past, nullopt, Authorization{"a2", "speed-boost", past, "encoded2"}},
+        {"id3", "tc", "d", later, nullopt, nullopt},
+        {"id4", "tc", "d", later, nullopt, Authorization{"a4", "speed-boost", later, "encoded4"}}};
+    err = ud.SetPurchases(purchases);
+    ASSERT_FALSE(err);
+
+    bundle = ud.GetActiveAuthorizationBundle(local_now);
+    ASSERT_GT(bundle.version, version);
+    ASSERT_EQ(*bundle.encoded, (vector<string>{"encoded1", "encoded4"}));
+    version = bundle.version;
+
+    // Unchanged: same version, same bundle.
+    err = ud.SetPurchases(purchases);
+    ASSERT_FALSE(err);
+    auto again = ud.GetActiveAuthorizationBundle(local_now);
+    ASSERT_EQ(again.version, version);
+    ASSERT_EQ(again.encoded, bundle.encoded);
+
+    // Adding a purchase with an authorization changes it.
+    err = ud.AddPurchase({"id5", "tc", "d", later, nullopt, Authorization{"a5", "speed-boost", later, "encoded5"}});
+    ASSERT_FALSE(err);
+    bundle = ud.GetActiveAuthorizationBundle(local_now);
+    ASSERT_GT(bundle.version, version);
+    ASSERT_EQ(*bundle.encoded, (vector<string>{"encoded1", "encoded4", "encoded5"}));
+    version = bundle.version;
+
+    // Time passing expires one.
+    bundle = ud.GetActiveAuthorizationBundle(soon.Add(datetime::Duration(1)));
+    ASSERT_GT(bundle.version, version);
+    ASSERT_EQ(*bundle.encoded, (vector<string>{"encoded4", "encoded5"}));
+    version = bundle.version;
+
+    // Removing one changes it; removing one without an authorization doesn't.
+    err = ud.SetPurchases({purchases[0], purchases[1], purchases[2]});
+    ASSERT_FALSE(err);
+    bundle = ud.GetActiveAuthorizationBundle(local_now);
+    ASSERT_GT(bundle.version, version);
+    ASSERT_EQ(*bundle.encoded, (vector<string>{"encoded1"}));
+    version = bundle.version;
+    err = ud.SetPurchases({purchases[0], purchases[1]});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetActiveAuthorizationBundle(local_now).version, version);
+}
@@ -22,21 +22,95 @@
 
 #include <string>
 #include <sstream>
+#include <locale>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+#ifdef PSICASH_LOCK_PROFILING
+#include "lock_profiler.hpp"
+#endif
 
 
 namespace utils {
 
-// From https://stackoverflow.com/a/25386444/729729
-// Can be used like `s = Stringer("lucky ", 42, '!');
-template<typename T>
-std::string Stringer(const T& value) {
-    std::ostringstream oss;
-    oss << value;
-    return oss.str();
-}
+namespace detail {
+
+/// One argument to Stringer, formatted. Strings are borrowed rather than copied,
+/// integers are formatted into an internal buffer, and anything else is streamed (with
+/// the classic locale). Only for use within a single Stringer expression.
+class StringerPiece {
+public:
+    StringerPiece(const std::string& s) : data_(s.data()), size_(s.size()) {}
+    // A null string formats as empty.
+    StringerPiece(const char* s) : data_(s ? s : ""), size_(s ? std::strlen(s) : 0) {}
+    StringerPiece(char c) : data_(nullptr), size_(1), start_(sizeof(buf_) - 1) { buf_[start_] = c; }
+    StringerPiece(signed char c) : StringerPiece(static_cast<char>(c)) {}
+    StringerPiece(unsigned char c) : StringerPiece(static_cast<char>(c)) {}
+    StringerPiece(bool b) : StringerPiece(b ? '1' : '0') {}
+
+    template<typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    StringerPiece(T v) : data_(nullptr) {
+        // Formats from the end of the buffer. The magnitude is computed unsigned so that
+        // the most negative value works.
+        using U = typename std::make_unsigned<T>::type;
+        bool negative = v < 0;
+        U u = negative ? static_cast<U>(0 - static_cast<U>(v)) : static_cast<U>(v);
+        start_ = sizeof(buf_);
+        do {
+            buf_[--start_] = static_cast<char>('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (negative) {
+            buf_[--start_] = '-';
+        }
+        size_ = sizeof(buf_) - start_;
+    }
+
+    template<typename T, typename std::enable_if<!std::is_integral<T>::value, int>::type = 0>
+    StringerPiece(const T& v) {
+        std::ostringstream oss;
+        oss.imbue(std::locale::classic());
+        oss << v;
+        owned_ = oss.str();
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+
+    // data_ may point into this object.
+    StringerPiece(const StringerPiece&) = delete;
+    StringerPiece& operator=(const StringerPiece&) = delete;
+
+    const char* data() const { return data_ ? data_ : buf_ + start_; }
+    size_t size() const { return size_; }
+
+private:
+    const char* data_; // nullptr means the value is in buf_
+    size_t size_;
+    char buf_[24]; // big enough for any 64-bit integer and its sign
+    size_t start_;
+    std::string owned_;
+};
+
+} // namespace detail
+
+/// Concatenates the string forms of its arguments, which are as for operator<< (in the
+/// classic locale). Can be used like `s = Stringer("lucky ", 42, '!');`
+/// All of the arguments are formatted first, so the result is allocated only once.
 template<typename T, typename ... Args>
 std::string Stringer(const T& value, const Args& ... args) {
-    return Stringer(value) + Stringer(args...);
+    const detail::StringerPiece pieces[] = {{value}, {args}...};
+
+    size_t size = 0;
+    for (const auto& p : pieces) {
+        size += p.size();
+    }
+
+    std::string res;
+    res.reserve(size);
+    for (const auto& p : pieces) {
+        res.append(p.data(), p.size());
+    }
+    return res;
 }
 
 // From https://stackoverflow.com/a/43894724/729729
@@ -44,9 +118,29 @@ std::string Stringer(const T& value, const Args& ... args) {
 /// SYNCHRONIZE_BLOCK(mutex_) {
 ///     ...do stuff
 /// }
+/// SYNCHRONIZE(mutex_) synchronizes the current scope using the given mutex.
+/// SYNCHRONIZE_LOCK(mutex_) returns a lock (a utils::SynchronizeLock), for holding
+/// beyond the current scope.
+/// With PSICASH_LOCK_PROFILING, acquisitions are profiled by call site ("file:line").
+/// See lock_profiler.hpp.
+#define SYNCHRONIZE_STRINGIFY_(x) #x
+#define SYNCHRONIZE_STRINGIFY(x) SYNCHRONIZE_STRINGIFY_(x)
+#define SYNCHRONIZE_SITE __FILE__ ":" SYNCHRONIZE_STRINGIFY(__LINE__)
+#ifdef PSICASH_LOCK_PROFILING
+#define SYNCHRONIZE_BLOCK(m) for(psicash::lock_profiler::Lock lk(m, SYNCHRONIZE_SITE); lk; lk.unlock())
+#define SYNCHRONIZE(m) psicash::lock_profiler::Lock synchronize_lock(m, SYNCHRONIZE_SITE)
+#define SYNCHRONIZE_LOCK(m) psicash::lock_profiler::Lock(m, SYNCHRONIZE_SITE)
+#else
 #define SYNCHRONIZE_BLOCK(m) for(std::unique_lock<std::recursive_mutex> lk(m); lk; lk.unlock())
-/// Synchronize the current scope using the given mutex.
 #define SYNCHRONIZE(m) std::unique_lock<std::recursive_mutex> synchronize_lock(m)
+#define SYNCHRONIZE_LOCK(m) std::unique_lock<std::recursive_mutex>(m)
+#endif
+
+#ifdef PSICASH_LOCK_PROFILING
+using SynchronizeLock = psicash::lock_profiler::Lock;
+#else
+using SynchronizeLock = std::unique_lock<std::recursive_mutex>;
+#endif
 
 }
 
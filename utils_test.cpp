@@ -16,3 +16,42 @@ TEST(TestStringer, MultiValue) {
   auto s = Stringer("one", 2, "three", 4, '5', '!');
   ASSERT_EQ(s, "one2three45!");
 }
+
+TEST(TestStringer, Integers) {
+  ASSERT_EQ(Stringer(0), "0");
+  ASSERT_EQ(Stringer(-1), "-1");
+  ASSERT_EQ(Stringer(INT64_MIN), "-9223372036854775808");
+  ASSERT_EQ(Stringer(INT64_MAX), "9223372036854775807");
+  ASSERT_EQ(Stringer(UINT64_MAX), "18446744073709551615");
+  ASSERT_EQ(Stringer((short)-123, (unsigned short)456, 789UL), "-123456789");
+  ASSERT_EQ(Stringer(true, false), "10");
+}
+
+TEST(TestStringer, Characters) {
+  ASSERT_EQ(Stringer('a', (signed char)'b', (unsigned char)'c'), "abc");
+}
+
+TEST(TestStringer, Strings) {
+  string s = "string";
+  const char* cs = "c-string";
+  char mutable_cs[] = "mutable";
+  ASSERT_EQ(Stringer(s, "/", cs, "/", mutable_cs, "/", string()), "string/c-string/mutable/");
+  ASSERT_EQ(Stringer(""), "");
+}
+
+TEST(TestStringer, NullString) {
+  ASSERT_EQ(Stringer("x", (const char*)nullptr, "y"), "xy");
+  ASSERT_EQ(Stringer((const char*)nullptr), "");
+}
+
+struct Streamable {
+  int v;
+};
+
+ostream& operator<<(ostream& os, const Streamable& s) {
+  return os << "Streamable(" << s.v << ")";
+}
+
+TEST(TestStringer, Streamed) {
+  ASSERT_EQ(Stringer(1.5, " ", Streamable{42}), "1.5 Streamable(42)");
+}